@@ -0,0 +1,133 @@
+#include "imdiskrequest.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+// Create and remove cycles through CRequestArena, CCreateRequest and
+// CRequestString against a simulated driver, counting heap allocations.
+// Each cycle builds the create request with the section name and a file
+// name of some extra characters, the format command line, and a query reply
+// buffer, as ImDiskCliCreateDevice and ImDiskCliRemoveDevice do. After one
+// warm-up cycle per name length a cycle must take nothing from the heap,
+// otherwise the test fails.
+//
+// malloc is counted through glibc's __libc_malloc, so the test runs on Linux.
+
+extern "C" void *__libc_malloc(size_t size);
+
+static bool counting = false;
+static quint64 allocations = 0;
+
+void *malloc(size_t size)
+{
+    if(counting)
+        ++allocations;
+    return __libc_malloc(size);
+}
+
+static const int defaultCycles = 10000;
+static const size_t extraLengths[] = { 0, 100, 5000, 12000 };       // past MAX_PATH and the inline buffers
+static const WCHAR sectionPrefix[] = L"\\BaseNamedObjects\\Global\\";
+static const WCHAR proxyName[] = L"qt-imdisk-R";
+static const WCHAR formatCommand[] = L"C:\\Windows\\System32\\format.com R: /FS:NTFS /Q /Y ";
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-alloctest [--cycles <n>]\n");
+}
+
+// IOCTL_IMDISK_CREATE_DEVICE, checks the size the caller passes
+static bool simulateCreate(PIMDISK_CREATE_DATA data, DWORD size)
+{
+    static ULONG deviceNumber = 0;
+
+    if(size != sizeof(IMDISK_CREATE_DATA) + data->FileNameLength)
+        return false;
+
+    data->DeviceNumber = deviceNumber++;
+    return true;
+}
+
+static bool cycle(CRequestArena &arena, LPCWSTR extra, size_t extraLength)
+{
+    size_t prefixLength = wcslen(sectionPrefix);
+    size_t nameLength = wcslen(proxyName);
+
+    arena.reset();
+
+    CCreateRequest create(arena);
+    if(!create.appendFileName(sectionPrefix, prefixLength) ||
+       !create.appendFileName(proxyName, nameLength) ||
+       !create.appendFileName(extra, extraLength))
+        return false;
+
+    if(!simulateCreate(create.data(), create.size()) ||
+       create.size() != sizeof(IMDISK_CREATE_DATA) + (prefixLength + nameLength + extraLength) * sizeof(WCHAR) ||
+       memcmp(create.data()->FileName, sectionPrefix, prefixLength * sizeof(WCHAR)) != 0)
+        return false;
+
+    CRequestString command(arena);
+    if(!command.append(formatCommand) || !command.append(extra, extraLength) ||
+       command.length() != wcslen(command.data()))
+        return false;
+
+    arena.reset();
+
+    // IOCTL_IMDISK_QUERY_DEVICE reply of the remove
+    CCreateRequest query(arena);
+    return query.capacity() >= sizeof(IMDISK_CREATE_DATA) + (MAX_PATH << 2);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    int cycles = defaultCycles;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        bool ok = i + 1 < args.size();
+
+        if(args[i] == "--cycles" && ok)
+            cycles = args[++i].toInt(&ok);
+        else
+            ok = false;
+
+        if(!ok || cycles <= 0)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    CRequestArena arena;
+    bool passed = true;
+
+    for(size_t extraLength : extraLengths)
+    {
+        LPWSTR extra = new WCHAR[extraLength + 1];
+        wmemset(extra, L'x', extraLength);
+        extra[extraLength] = 0;
+
+        bool ok = cycle(arena, extra, extraLength);
+
+        allocations = 0;
+        counting = true;
+        for(int i = 0; ok && i < cycles; ++i)
+            ok = cycle(arena, extra, extraLength);
+        counting = false;
+
+        delete[] extra;
+
+        printf("%5zu extra characters: %llu allocations in %d cycles%s\n", extraLength,
+               allocations, cycles, !ok ? ", request check failed" : allocations ? ", FAILED" : "");
+        passed = passed && ok && !allocations;
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+#ifndef CBLOCKGEOMETRY_H
+#define CBLOCKGEOMETRY_H
+
+#include <QtGlobal>
+
+Q_DECL_CONSTEXPR inline int blockShift(quint32 size)
+{
+    return size > 1 ? 1 + blockShift(size / 2) : 0;
+}
+
+// Splits disk offsets into store pages. With the sector and page sizes known
+// at compile time this is shifts and masks, and with sectors as large as pages
+// an aligned request never touches part of a page, so the partial page paths
+// compile away. Callers check isAligned() before relying on the sector size.
+template<quint32 SectorSize, quint32 PageSize>
+class CBlockGeometry
+{
+public:
+    Q_STATIC_ASSERT((SectorSize & (SectorSize - 1)) == 0 && (PageSize & (PageSize - 1)) == 0);
+    Q_STATIC_ASSERT(SectorSize <= PageSize);
+
+    CBlockGeometry(quint32 sectorSize, quint32 pageSize)
+    {
+        Q_UNUSED(sectorSize);
+        Q_UNUSED(pageSize);
+    }
+
+    inline bool isAligned(quint64 offset, quint64 length) const
+    {
+        return ((offset | length) & (SectorSize - 1)) == 0;
+    }
+
+    inline quint64 page(quint64 offset) const
+    {
+        return offset >> pageShift;
+    }
+
+    inline quint64 inPage(quint64 offset) const
+    {
+        return wholePages ? 0 : offset & (PageSize - 1);
+    }
+
+    // Bytes of length that fall into the page, from inPage on
+    inline quint64 chunk(quint64 inPage, quint64 length) const
+    {
+        return wholePages ? PageSize : qMin(length, PageSize - inPage);
+    }
+
+    static const bool wholePages = SectorSize == PageSize;
+    static const int pageShift = blockShift(PageSize);
+};
+
+// The same interface with the sizes chosen at run time: a division and a
+// branch per page. Kept as the generic path the specializations are measured against.
+class CRuntimeGeometry
+{
+public:
+    CRuntimeGeometry(quint32 sectorSize, quint32 pageSize) : _sectorSize(sectorSize), _pageSize(pageSize) {}
+
+    inline bool isAligned(quint64 offset, quint64 length) const
+    {
+        return offset % _sectorSize == 0 && length % _sectorSize == 0;
+    }
+
+    inline quint64 page(quint64 offset) const
+    {
+        return offset / _pageSize;
+    }
+
+    inline quint64 inPage(quint64 offset) const
+    {
+        return offset % _pageSize;
+    }
+
+    inline quint64 chunk(quint64 inPage, quint64 length) const
+    {
+        return qMin(length, _pageSize - inPage);
+    }
+
+private:
+    quint64 _sectorSize;
+    quint64 _pageSize;
+};
+
+#endif // CBLOCKGEOMETRY_H
@@ -0,0 +1,575 @@
+#include "blockkernels.h"
+
+#include <string.h>
+
+#if defined(Q_PROCESSOR_X86)
+#include <immintrin.h>
+#if defined(Q_CC_MSVC)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#define BLOCKKERNELS_X86
+// AVX-512 intrinsics need VS2017 15.3
+#if !defined(Q_CC_MSVC) || _MSC_VER >= 1911
+#define BLOCKKERNELS_AVX512
+#endif
+#endif
+
+// GCC and Clang build the SIMD kernels for their level only, MSVC needs no flag
+#if defined(Q_CC_GNU) || defined(Q_CC_CLANG)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+const size_t CBlockKernels::streamThreshold = 64*1024;              // a whole page, rarely read back right away
+
+// Stripes of eight 64-bit lanes: every lane adds its input and the product of
+// the input's halves keyed by a secret, a scramble every 16 stripes folds the
+// high bits down. Multiplies are 32x32->64 so every SIMD level does the same math.
+static const size_t stripeSize = 64;
+static const size_t stripesPerScramble = 16;
+static const quint32 hashPrime32 = 0x9e3779b1u;
+static const quint64 hashPrime64 = 0x9e3779b97f4a7c15ull;
+static const quint64 hashPrime64b = 0xc2b2ae3d27d4eb4full;
+
+alignas(64) static const quint64 hashSecret[8] =
+{
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+    0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull
+};
+
+static inline quint64 load64(const quint8 *p)
+{
+    // Lanes are little endian, as on every CPU the SIMD levels exist for
+    quint64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline quint64 mix64(quint64 value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+static inline void hashInit(quint64 *acc, quint64 seed)
+{
+    for(int j = 0; j < 8; ++j)
+        acc[j] = hashSecret[7 - j] ^ seed;
+}
+
+static inline void scalarStripe(quint64 *acc, const quint8 *p)
+{
+    for(int j = 0; j < 8; ++j)
+    {
+        quint64 in = load64(p + 8 * j);
+        quint64 keyed = in ^ hashSecret[j];
+        acc[j] += in + (keyed & 0xffffffffull) * (keyed >> 32);
+    }
+}
+
+static inline void scalarScramble(quint64 *acc)
+{
+    for(int j = 0; j < 8; ++j)
+    {
+        quint64 value = acc[j] ^ (acc[j] >> 47) ^ hashSecret[j];
+        acc[j] = value * hashPrime32;
+    }
+}
+
+// Shared by all levels: the partial last stripe, zero padded, and the merge of the lanes
+static quint64 hashFinish(quint64 *acc, const quint8 *tail, size_t tailLength, size_t length, quint64 seed)
+{
+    if(tailLength)
+    {
+        quint8 last[stripeSize];
+        memset(last, 0, sizeof(last));
+        memcpy(last, tail, tailLength);
+        scalarStripe(acc, last);
+    }
+
+    quint64 hash = quint64(length) * hashPrime64 ^ seed;
+    for(int j = 0; j < 8; ++j)
+        hash = (hash ^ mix64(acc[j])) * hashPrime64b;
+
+    return mix64(hash);
+}
+
+static bool isZeroScalar(const void *data, size_t length)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    size_t i = 0;
+
+    for(; i + 32 <= length; i += 32)
+        if(load64(p + i) | load64(p + i + 8) | load64(p + i + 16) | load64(p + i + 24))
+            return false;
+
+    for(; i < length; ++i)
+        if(p[i])
+            return false;
+
+    return true;
+}
+
+static void copyScalar(void *destination, const void *source, size_t length)
+{
+    memcpy(destination, source, length);
+}
+
+static quint64 hashScalar(const void *data, size_t length, quint64 seed)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    quint64 acc[8];
+    hashInit(acc, seed);
+
+    size_t stripes = length / stripeSize;
+    for(size_t s = 0; s < stripes; ++s, p += stripeSize)
+    {
+        scalarStripe(acc, p);
+        if((s + 1) % stripesPerScramble == 0)
+            scalarScramble(acc);
+    }
+
+    return hashFinish(acc, p, length % stripeSize, length, seed);
+}
+
+#ifdef BLOCKKERNELS_X86
+
+static void cpuid(int leaf, int subleaf, quint32 *regs)
+{
+#if defined(Q_CC_MSVC)
+    int values[4];
+    __cpuidex(values, leaf, subleaf);
+    for(int i = 0; i < 4; ++i)
+        regs[i] = quint32(values[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on a context switch
+static quint64 xgetbv()
+{
+#if defined(Q_CC_MSVC)
+    return _xgetbv(0);
+#else
+    quint32 low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return quint64(high) << 32 | low;
+#endif
+}
+
+KERNEL_TARGET("sse2")
+static inline __m128i sse2Accumulate(__m128i acc, const quint8 *p, __m128i secret)
+{
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i keyed = _mm_xor_si128(in, secret);
+    __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+    return _mm_add_epi64(acc, _mm_add_epi64(in, product));
+}
+
+KERNEL_TARGET("sse2")
+static inline __m128i sse2Scramble(__m128i acc, __m128i secret, __m128i prime)
+{
+    __m128i value = _mm_xor_si128(_mm_xor_si128(acc, _mm_srli_epi64(acc, 47)), secret);
+    __m128i low = _mm_mul_epu32(value, prime);
+    __m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+    return _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+}
+
+KERNEL_TARGET("sse2")
+static bool isZeroSse2(const void *data, size_t length)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    size_t i = 0;
+
+    for(; i + 64 <= length; i += 64)
+    {
+        const __m128i *v = reinterpret_cast<const __m128i *>(p + i);
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+
+    return isZeroScalar(p + i, length - i);
+}
+
+KERNEL_TARGET("sse2")
+static void copySse2(void *destination, const void *source, size_t length)
+{
+    if(length < CBlockKernels::streamThreshold)
+    {
+        memcpy(destination, source, length);
+        return;
+    }
+
+    quint8 *d = static_cast<quint8 *>(destination);
+    const quint8 *s = static_cast<const quint8 *>(source);
+
+    size_t head = (16 - (quintptr(d) & 15)) & 15;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    length -= head;
+
+    for(; length >= 64; d += 64, s += 64, length -= 64)
+    {
+        const __m128i *from = reinterpret_cast<const __m128i *>(s);
+        __m128i *to = reinterpret_cast<__m128i *>(d);
+        __m128i v0 = _mm_loadu_si128(from);
+        __m128i v1 = _mm_loadu_si128(from + 1);
+        __m128i v2 = _mm_loadu_si128(from + 2);
+        __m128i v3 = _mm_loadu_si128(from + 3);
+        _mm_stream_si128(to, v0);
+        _mm_stream_si128(to + 1, v1);
+        _mm_stream_si128(to + 2, v2);
+        _mm_stream_si128(to + 3, v3);
+    }
+
+    // Streaming stores are weakly ordered, publish them before the store lock is released
+    _mm_sfence();
+    memcpy(d, s, length);
+}
+
+KERNEL_TARGET("sse2")
+static quint64 hashSse2(const void *data, size_t length, quint64 seed)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    alignas(16) quint64 acc[8];
+    hashInit(acc, seed);
+
+    __m128i a[4];
+    __m128i secret[4];
+    for(int j = 0; j < 4; ++j)
+    {
+        a[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(acc + 2 * j));
+        secret[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(hashSecret + 2 * j));
+    }
+    __m128i prime = _mm_set1_epi32(int(hashPrime32));
+
+    size_t stripes = length / stripeSize;
+    for(size_t s = 0; s < stripes; ++s, p += stripeSize)
+    {
+        for(int j = 0; j < 4; ++j)
+            a[j] = sse2Accumulate(a[j], p + 16 * j, secret[j]);
+
+        if((s + 1) % stripesPerScramble == 0)
+            for(int j = 0; j < 4; ++j)
+                a[j] = sse2Scramble(a[j], secret[j], prime);
+    }
+
+    for(int j = 0; j < 4; ++j)
+        _mm_store_si128(reinterpret_cast<__m128i *>(acc + 2 * j), a[j]);
+
+    return hashFinish(acc, p, length % stripeSize, length, seed);
+}
+
+KERNEL_TARGET("avx2")
+static inline __m256i avx2Accumulate(__m256i acc, const quint8 *p, __m256i secret)
+{
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i keyed = _mm256_xor_si256(in, secret);
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+    return _mm256_add_epi64(acc, _mm256_add_epi64(in, product));
+}
+
+KERNEL_TARGET("avx2")
+static inline __m256i avx2Scramble(__m256i acc, __m256i secret, __m256i prime)
+{
+    __m256i value = _mm256_xor_si256(_mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47)), secret);
+    __m256i low = _mm256_mul_epu32(value, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+    return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+KERNEL_TARGET("avx2")
+static bool isZeroAvx2(const void *data, size_t length)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    size_t i = 0;
+
+    for(; i + 128 <= length; i += 128)
+    {
+        const __m256i *v = reinterpret_cast<const __m256i *>(p + i);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+                                      _mm256_or_si256(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3)));
+        if(!_mm256_testz_si256(any, any))
+            return false;
+    }
+
+    return isZeroScalar(p + i, length - i);
+}
+
+KERNEL_TARGET("avx2")
+static void copyAvx2(void *destination, const void *source, size_t length)
+{
+    if(length < CBlockKernels::streamThreshold)
+    {
+        memcpy(destination, source, length);
+        return;
+    }
+
+    quint8 *d = static_cast<quint8 *>(destination);
+    const quint8 *s = static_cast<const quint8 *>(source);
+
+    size_t head = (32 - (quintptr(d) & 31)) & 31;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    length -= head;
+
+    for(; length >= 128; d += 128, s += 128, length -= 128)
+    {
+        const __m256i *from = reinterpret_cast<const __m256i *>(s);
+        __m256i *to = reinterpret_cast<__m256i *>(d);
+        __m256i v0 = _mm256_loadu_si256(from);
+        __m256i v1 = _mm256_loadu_si256(from + 1);
+        __m256i v2 = _mm256_loadu_si256(from + 2);
+        __m256i v3 = _mm256_loadu_si256(from + 3);
+        _mm256_stream_si256(to, v0);
+        _mm256_stream_si256(to + 1, v1);
+        _mm256_stream_si256(to + 2, v2);
+        _mm256_stream_si256(to + 3, v3);
+    }
+
+    _mm_sfence();
+    memcpy(d, s, length);
+}
+
+KERNEL_TARGET("avx2")
+static quint64 hashAvx2(const void *data, size_t length, quint64 seed)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    alignas(32) quint64 acc[8];
+    hashInit(acc, seed);
+
+    __m256i a0 = _mm256_load_si256(reinterpret_cast<const __m256i *>(acc));
+    __m256i a1 = _mm256_load_si256(reinterpret_cast<const __m256i *>(acc + 4));
+    __m256i secret0 = _mm256_load_si256(reinterpret_cast<const __m256i *>(hashSecret));
+    __m256i secret1 = _mm256_load_si256(reinterpret_cast<const __m256i *>(hashSecret + 4));
+    __m256i prime = _mm256_set1_epi32(int(hashPrime32));
+
+    size_t stripes = length / stripeSize;
+    for(size_t s = 0; s < stripes; ++s, p += stripeSize)
+    {
+        a0 = avx2Accumulate(a0, p, secret0);
+        a1 = avx2Accumulate(a1, p + 32, secret1);
+
+        if((s + 1) % stripesPerScramble == 0)
+        {
+            a0 = avx2Scramble(a0, secret0, prime);
+            a1 = avx2Scramble(a1, secret1, prime);
+        }
+    }
+
+    _mm256_store_si256(reinterpret_cast<__m256i *>(acc), a0);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(acc + 4), a1);
+
+    return hashFinish(acc, p, length % stripeSize, length, seed);
+}
+
+#ifdef BLOCKKERNELS_AVX512
+
+KERNEL_TARGET("avx512f")
+static bool isZeroAvx512(const void *data, size_t length)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    size_t i = 0;
+
+    for(; i + 256 <= length; i += 256)
+    {
+        const quint8 *v = p + i;
+        __m512i any = _mm512_or_si512(_mm512_or_si512(_mm512_loadu_si512(v), _mm512_loadu_si512(v + 64)),
+                                      _mm512_or_si512(_mm512_loadu_si512(v + 128), _mm512_loadu_si512(v + 192)));
+        if(_mm512_test_epi64_mask(any, any))
+            return false;
+    }
+
+    return isZeroScalar(p + i, length - i);
+}
+
+KERNEL_TARGET("avx512f")
+static void copyAvx512(void *destination, const void *source, size_t length)
+{
+    if(length < CBlockKernels::streamThreshold)
+    {
+        memcpy(destination, source, length);
+        return;
+    }
+
+    quint8 *d = static_cast<quint8 *>(destination);
+    const quint8 *s = static_cast<const quint8 *>(source);
+
+    size_t head = (64 - (quintptr(d) & 63)) & 63;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    length -= head;
+
+    for(; length >= 256; d += 256, s += 256, length -= 256)
+    {
+        __m512i v0 = _mm512_loadu_si512(s);
+        __m512i v1 = _mm512_loadu_si512(s + 64);
+        __m512i v2 = _mm512_loadu_si512(s + 128);
+        __m512i v3 = _mm512_loadu_si512(s + 192);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d), v0);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 64), v1);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 128), v2);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 192), v3);
+    }
+
+    _mm_sfence();
+    memcpy(d, s, length);
+}
+
+KERNEL_TARGET("avx512f")
+static quint64 hashAvx512(const void *data, size_t length, quint64 seed)
+{
+    const quint8 *p = static_cast<const quint8 *>(data);
+    alignas(64) quint64 acc[8];
+    hashInit(acc, seed);
+
+    __m512i a = _mm512_load_si512(acc);
+    __m512i secret = _mm512_load_si512(hashSecret);
+    __m512i prime = _mm512_set1_epi32(int(hashPrime32));
+
+    size_t stripes = length / stripeSize;
+    for(size_t s = 0; s < stripes; ++s, p += stripeSize)
+    {
+        __m512i in = _mm512_loadu_si512(p);
+        __m512i keyed = _mm512_xor_si512(in, secret);
+        __m512i product = _mm512_mul_epu32(keyed, _mm512_srli_epi64(keyed, 32));
+        a = _mm512_add_epi64(a, _mm512_add_epi64(in, product));
+
+        if((s + 1) % stripesPerScramble == 0)
+        {
+            __m512i value = _mm512_xor_si512(_mm512_xor_si512(a, _mm512_srli_epi64(a, 47)), secret);
+            __m512i low = _mm512_mul_epu32(value, prime);
+            __m512i high = _mm512_mul_epu32(_mm512_srli_epi64(value, 32), prime);
+            a = _mm512_add_epi64(low, _mm512_slli_epi64(high, 32));
+        }
+    }
+
+    _mm512_store_si512(acc, a);
+
+    return hashFinish(acc, p, length % stripeSize, length, seed);
+}
+
+#endif // BLOCKKERNELS_AVX512
+
+#endif // BLOCKKERNELS_X86
+
+CBlockKernels::Level CBlockKernels::_level = CBlockKernels::detect();
+CBlockKernels::Table CBlockKernels::_active = CBlockKernels::table(CBlockKernels::_level);
+
+CBlockKernels::Level CBlockKernels::detect()
+{
+#ifdef BLOCKKERNELS_X86
+    quint32 regs[4];
+    cpuid(0, 0, regs);
+    quint32 maxLeaf = regs[0];
+
+    cpuid(1, 0, regs);
+    bool sse2 = regs[3] & (1u << 26);
+    bool osxsave = regs[2] & (1u << 27);
+    bool avx = regs[2] & (1u << 28);
+
+    if(!sse2)
+        return Scalar;
+
+    // The OS must save the YMM (and for AVX-512 the ZMM and mask) registers
+    quint64 xcr0 = osxsave && avx ? xgetbv() : 0;
+    if((xcr0 & 0x06) != 0x06 || maxLeaf < 7)
+        return Sse2;
+
+    cpuid(7, 0, regs);
+
+#ifdef BLOCKKERNELS_AVX512
+    if((regs[1] & (1u << 16)) && (xcr0 & 0xe6) == 0xe6)
+        return Avx512;
+#endif
+
+    return regs[1] & (1u << 5) ? Avx2 : Sse2;
+#else
+    return Scalar;
+#endif
+}
+
+CBlockKernels::Table CBlockKernels::table(Level level)
+{
+    switch(level)
+    {
+#ifdef BLOCKKERNELS_X86
+    case Sse2:
+    {
+        Table kernels = { isZeroSse2, copySse2, hashSse2 };
+        return kernels;
+    }
+
+    case Avx2:
+    {
+        Table kernels = { isZeroAvx2, copyAvx2, hashAvx2 };
+        return kernels;
+    }
+
+#ifdef BLOCKKERNELS_AVX512
+    case Avx512:
+    {
+        Table kernels = { isZeroAvx512, copyAvx512, hashAvx512 };
+        return kernels;
+    }
+#endif
+#endif
+
+    default:
+    {
+        Table kernels = { isZeroScalar, copyScalar, hashScalar };
+        return kernels;
+    }
+    }
+}
+
+CBlockKernels::Level CBlockKernels::level()
+{
+    return _level;
+}
+
+bool CBlockKernels::isSupported(Level level)
+{
+#ifndef BLOCKKERNELS_AVX512
+    if(level == Avx512)
+        return false;
+#endif
+
+    return level >= Scalar && level <= detect();
+}
+
+bool CBlockKernels::setLevel(Level level)
+{
+    if(!isSupported(level))
+        return false;
+
+    _level = level;
+    _active = table(level);
+    return true;
+}
+
+const char *CBlockKernels::name(Level level)
+{
+    static const char *names[LevelCount] =
+    {
+        "scalar",
+        "sse2",
+        "avx2",
+        "avx512"
+    };
+
+    return names[level];
+}
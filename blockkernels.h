@@ -0,0 +1,63 @@
+#ifndef CBLOCKKERNELS_H
+#define CBLOCKKERNELS_H
+
+#include <QtGlobal>
+
+#include <stddef.h>
+
+// Block scanning kernels for the write path: zero detection, copies that
+// bypass the cache for large spans and a 64-bit block hash. Scalar, SSE2,
+// AVX2 and AVX-512 versions are built, the best one the CPU and OS support
+// is picked at startup. All levels return the same hash for the same data.
+class CBlockKernels
+{
+public:
+    enum Level
+    {
+        Scalar,
+        Sse2,
+        Avx2,
+        Avx512,
+        LevelCount
+    };
+
+    static inline bool isZero(const void *data, size_t length)
+    {
+        return _active.isZero(data, length);
+    }
+
+    // Spans of streamThreshold and more are written with non-temporal stores
+    static inline void copy(void *destination, const void *source, size_t length)
+    {
+        _active.copy(destination, source, length);
+    }
+
+    static inline quint64 hash(const void *data, size_t length, quint64 seed = 0)
+    {
+        return _active.hash(data, length, seed);
+    }
+
+    static Level level();
+    static bool isSupported(Level level);
+    // For benchmarks, switch only while no other thread uses the kernels
+    static bool setLevel(Level level);
+    static const char *name(Level level);
+
+    static const size_t streamThreshold;
+
+private:
+    struct Table
+    {
+        bool (*isZero)(const void *data, size_t length);
+        void (*copy)(void *destination, const void *source, size_t length);
+        quint64 (*hash)(const void *data, size_t length, quint64 seed);
+    };
+
+    static Level detect();
+    static Table table(Level level);
+
+    static Level _level;
+    static Table _active;
+};
+
+#endif // CBLOCKKERNELS_H
@@ -0,0 +1,146 @@
+#include "daemon.h"
+#include "ramdisk.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QProcess>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QThread>
+
+#include <stdio.h>
+
+static const int daemonStartTimeout = 5000;                     // ms until a spawned daemon must answer
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-cli [--timing] mount [image] | unmount | status | resize <size> | snapshot |\n"
+                    "                     export <image> | clone <letter> | unclone <letter> | stop | daemon\n");
+}
+
+// Milliseconds since the process was created, so loading the Qt DLLs counts, -1 if unknown
+static double sinceProcessCreation()
+{
+    FILETIME creation, exited, kernel, user, now;
+    if(!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user))
+        return -1;
+
+    GetSystemTimePreciseAsFileTime(&now);
+
+    ULARGE_INTEGER from, to;
+    from.LowPart = creation.dwLowDateTime;
+    from.HighPart = creation.dwHighDateTime;
+    to.LowPart = now.dwLowDateTime;
+    to.HighPart = now.dwHighDateTime;
+    return to.QuadPart > from.QuadPart ? (to.QuadPart - from.QuadPart) / 1e4 : 0;   // 100 ns units
+}
+
+// Runs on its own thread, pending driver and service waits give up first
+static BOOL WINAPI onConsoleCtrl(DWORD type)
+{
+    Q_UNUSED(type);
+
+    CReadiness::cancelAll();
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+    return TRUE;
+}
+
+// The disk lives in the daemon, start one in the background when it is not running
+static bool sendOrSpawn(const QString &command, int &code, QString &message, bool *spawned)
+{
+    *spawned = false;
+
+    if(CDaemon::send(command, code, message, 100))
+        return true;
+
+    if(!QProcess::startDetached(QCoreApplication::applicationFilePath(), QStringList() << "daemon"))
+        return false;
+
+    *spawned = true;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while(timer.elapsed() < daemonStartTimeout)
+    {
+        if(CDaemon::send(command, code, message, 100))
+            return true;
+        QThread::msleep(20);
+    }
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    QElapsedTimer startup;
+    startup.start();
+
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    // Cold start: process creation and QCoreApplication up to the command, then the daemon round trip
+    bool timing = args.size() > 1 && args.at(1) == "--timing";
+    if(timing)
+        args.removeAt(1);
+
+    if(args.size() != 2 && args.size() != 3)
+    {
+        usage();
+        return IMDISK_CLI_ERROR_BAD_SYNTAX;
+    }
+
+    QString command = args.at(1);
+
+    if(command == "daemon")
+    {
+        CDaemon daemon;
+        if(!daemon.listen())
+            return IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE;
+
+        QObject::connect(&daemon, &CDaemon::stopRequested, &a, &QCoreApplication::quit, Qt::QueuedConnection);
+        SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+        return a.exec();
+    }
+
+    // Only mount and export take an image path, resize takes a size like 8G, clone a drive letter
+    bool takesPath = command == "mount" || command == "export";
+    bool needsArgument = command == "export" || command == "resize" || command == "clone" || command == "unclone";
+
+    if((command != "mount" && command != "unmount" && command != "status" && command != "resize" &&
+        command != "snapshot" && command != "export" && command != "clone" && command != "unclone" &&
+        command != "stop") ||
+       (args.size() == 3 && !takesPath && !needsArgument) || (args.size() == 2 && needsArgument))
+    {
+        usage();
+        return IMDISK_CLI_ERROR_BAD_SYNTAX;
+    }
+
+    // The daemon has its own working directory
+    QString line = command;
+    if(args.size() == 3)
+        line += " " + (takesPath ? QFileInfo(args.at(2)).absoluteFilePath() : args.at(2));
+
+    int code = IMDISK_CLI_SUCCESS;
+    QString message;
+    bool spawned = false;
+
+    double started = sinceProcessCreation();
+    qint64 ready = startup.nsecsElapsed();
+
+    bool sent = command == "mount" ? sendOrSpawn(line, code, message, &spawned)
+                                   : CDaemon::send(line, code, message, 100);
+
+    if(timing)
+        fprintf(stderr, "Started in %.2f ms (%.2f ms in main), daemon%s answered in %.2f ms\n", started,
+                ready / 1e6, spawned ? " spawned and" : "", (startup.nsecsElapsed() - ready) / 1e6);
+
+    if(!sent)
+    {
+        fprintf(stderr, "Daemon not running\n");
+        return command == "stop" ? IMDISK_CLI_SUCCESS : IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    fprintf(code == IMDISK_CLI_SUCCESS ? stdout : stderr, "%s\n", message.toLocal8Bit().constData());
+    return code;
+}
@@ -0,0 +1,139 @@
+#include "compactor.h"
+#include "ramstore.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QByteArray>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+const quint64 CCompactor::sliceBudget = 2000000;                   // ns of compaction per slice
+const int CCompactor::sliceGap = 8;                                // ms between slices, 20% of a core at most
+const int CCompactor::idleInterval = 10000;                        // ms between checks of a dense pool
+
+CCompactor::CCompactor(CRamStore *store, QObject *parent) :
+    QThread(parent), _store(store), _current(), _last(), _compacting(false), _stopping(false)
+{
+    qDebug() << Q_FUNC_INFO;
+}
+
+CCompactor::~CCompactor()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    stop();
+}
+
+void CCompactor::stop()
+{
+    {
+        QMutexLocker locker(&_mutex);
+        _stopping = true;
+        _wake.wakeAll();
+    }
+    wait();
+}
+
+bool CCompactor::isCompacting() const
+{
+    QMutexLocker locker(&_mutex);
+    return _compacting;
+}
+
+CCompactor::Report CCompactor::lastReport() const
+{
+    QMutexLocker locker(&_mutex);
+    return _last;
+}
+
+quint64 CCompactor::residentBytes()
+{
+#ifdef Q_OS_WIN
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return quint64(counters.WorkingSetSize);
+#else
+    // "size resident shared text lib data dt" in pages
+    QFile statm("/proc/self/statm");
+    if(!statm.open(QIODevice::ReadOnly))
+        return 0;
+
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    if(fields.size() < 2)
+        return 0;
+
+    return fields[1].toULongLong() * quint64(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// False once stopping
+bool CCompactor::pause(int ms)
+{
+    QMutexLocker locker(&_mutex);
+
+    if(!_stopping)
+        _wake.wait(&_mutex, ulong(ms));
+    return !_stopping;
+}
+
+void CCompactor::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    QElapsedTimer cycle;
+    quint64 sweepMoved = 0;
+
+    while(pause(_compacting ? sliceGap : idleInterval))
+    {
+        // Taken ahead of every check, the cycle only starts when pages move
+        quint64 rss = _compacting ? 0 : residentBytes();
+        quint64 latency = _store->writeLatency();
+
+        bool sweepEnded;
+        quint64 moved = _store->compact(sliceBudget, &sweepEnded);
+        sweepMoved += moved;
+
+        QMutexLocker locker(&_mutex);
+
+        if(moved && !_compacting)
+        {
+            Report report = { 0, rss, 0, latency, 0, 0 };
+            _current = report;
+            _compacting = true;
+            cycle.start();
+        }
+
+        if(_compacting)
+        {
+            _current.movedPages += moved;
+            _current.latencyPeak = qMax(_current.latencyPeak, _store->writeLatency());
+        }
+
+        if(!sweepEnded)
+            continue;
+
+        // A whole sweep without a move, the pool is as dense as it gets
+        if(_compacting && sweepMoved == 0)
+        {
+            _current.rssAfter = residentBytes();
+            _current.duration = quint64(cycle.elapsed());
+            _last = _current;
+            _compacting = false;
+
+            qDebug() << "Compaction moved" << _last.movedPages << "pages in" << _last.duration << "ms, RSS"
+                     << _last.rssBefore / 1048576 << "->" << _last.rssAfter / 1048576 << "Mb, write latency"
+                     << _last.latencyBefore << "->" << _last.latencyPeak << "ns at most";
+        }
+
+        sweepMoved = 0;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef CCOMPACTOR_H
+#define CCOMPACTOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+
+class CRamStore;
+
+// Background defragmentation of a store after create/delete churn.
+// Runs CRamStore::compact() in slices of at most sliceBudget, sliceGap apart,
+// while sweeps still move pages, and checks again every idleInterval once a
+// sweep finds the pool dense. Each cycle is reported with the process RSS
+// before and after it and the smoothed foreground write latency before it
+// and at its worst while it ran.
+class CCompactor : public QThread
+{
+    Q_OBJECT
+public:
+    struct Report
+    {
+        quint64 movedPages;
+        quint64 rssBefore;
+        quint64 rssAfter;
+        quint64 latencyBefore;              // ns, CRamStore::writeLatency()
+        quint64 latencyPeak;
+        quint64 duration;                   // ms
+    };
+
+    explicit CCompactor(CRamStore *store, QObject *parent = 0);
+    ~CCompactor();
+
+    void stop();
+
+    bool isCompacting() const;
+    // Last finished cycle, all zero before the first
+    Report lastReport() const;
+
+    // Resident memory of this process in bytes
+    static quint64 residentBytes();
+
+    static const quint64 sliceBudget;
+    static const int sliceGap;
+    static const int idleInterval;
+
+protected:
+    void run() override;
+
+private:
+    bool pause(int ms);
+
+    CRamStore *_store;
+    Report _current;
+    Report _last;
+    bool _compacting;
+
+    mutable QMutex _mutex;
+    QWaitCondition _wake;
+    bool _stopping;
+};
+
+#endif // CCOMPACTOR_H
@@ -0,0 +1,195 @@
+#include "ramstore.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QFile>
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Kills a process while it writes into a shared CRamStore and reattaches to
+// the store from the parent, as a restarted qt-imdisk does. The child
+// creates the store, clones it, then writes one page after the other with a
+// pattern of its index and a round number, and counts finished pages in an
+// attribute. The parent waits a little, sends SIGKILL and checks that every
+// counted page reads back its pattern, the clone writes did not reach the
+// store, the untouched tail reads as zeros, and the reattached store takes
+// new writes. Runs several rounds, each killing at a different moment.
+// With --spill the child also moves every spillInterval-th page to a spill
+// file in the directory given, and those pages must read back as well.
+// fork and SIGKILL, so Linux only.
+
+static const quint64 defaultSize = 256ull << 20;                    // 4096 pages
+static const int defaultRounds = 5;
+static const int progressAttribute = 0;                             // pages written, before the kill
+static const int roundAttribute = 1;
+static const quint64 cloneMarker = 0xC1C1C1C1C1C1C1C1ull;
+static const quint64 spillInterval = 4;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-crashtest [--size <bytes>] [--rounds <n>] [--spill <directory>]\n");
+}
+
+static void fillPage(quint64 *words, quint64 page, quint64 round)
+{
+    for(quint64 i = 0; i < CRamStore::pageSize / sizeof(quint64); ++i)
+        words[i] = (page << 32) ^ (round << 16) ^ i;
+}
+
+// Never returns, killed by the parent; writes wrap around the disk
+static void writer(const QString &name, quint64 size, quint64 round, const QString &spill, int ready)
+{
+    CRamStore *store = CRamStore::createShared(name, size);
+    if(!store || (!spill.isEmpty() && !store->setSpillFile(spill)))
+        _exit(1);
+
+    CRamStore *clone = store->clone();
+    QVector<quint64> words(int(CRamStore::pageSize / sizeof(quint64)));
+
+    // Last page stays a hole
+    quint64 pages = store->pageCount() - 1;
+    store->attributes()[roundAttribute] = round;
+
+    for(quint64 written = 0; ; ++written)
+    {
+        quint64 page = written % pages;
+
+        fillPage(words.data(), page, round);
+        if(!store->write(page * CRamStore::pageSize, words.data(), CRamStore::pageSize))
+            _exit(1);
+
+        words.fill(cloneMarker);
+        clone->write(page * CRamStore::pageSize, words.data(), CRamStore::pageSize);
+
+        store->attributes()[progressAttribute] = written + 1;
+
+        if(!spill.isEmpty() && written % spillInterval == 0)
+            store->evict(CRamStore::Spill, 1);
+
+        if(written == 0 && write(ready, "", 1) != 1)
+            _exit(1);
+    }
+}
+
+static bool verify(const QString &name, quint64 size, quint64 round)
+{
+    CRamStore *store = CRamStore::attachShared(name);
+    if(!store)
+    {
+        printf("round %llu: reattach failed\n", round);
+        return false;
+    }
+
+    bool ok = store->size() == size && store->attributes()[roundAttribute] == round;
+    quint64 written = store->attributes()[progressAttribute];
+    quint64 pages = store->pageCount() - 1;
+    QVector<quint64> words(int(CRamStore::pageSize / sizeof(quint64)));
+    QVector<quint64> expected(words.size());
+
+    // Every round writes a page the same, so one rewritten at the kill reads back alike
+    for(quint64 page = 0; ok && page < qMin(written, pages); ++page)
+    {
+        fillPage(expected.data(), page, round);
+        ok = store->read(page * CRamStore::pageSize, words.data(), CRamStore::pageSize) &&
+             memcmp(words.data(), expected.data(), CRamStore::pageSize) == 0;
+        if(!ok)
+            printf("round %llu: page %llu does not read back\n", round, page);
+    }
+
+    expected.fill(0);
+    ok = ok && store->read(pages * CRamStore::pageSize, words.data(), CRamStore::pageSize) &&
+         memcmp(words.data(), expected.data(), CRamStore::pageSize) == 0;
+
+    // Writable after the reattach
+    words.fill(round);
+    ok = ok && store->write(0, words.data(), CRamStore::pageSize) &&
+         store->read(0, expected.data(), CRamStore::pageSize) &&
+         memcmp(words.data(), expected.data(), CRamStore::pageSize) == 0;
+
+    printf("round %llu: %llu pages written before the kill, %llu committed, %llu spilled after reattach, %s\n",
+           round, written, store->committedPages(), store->evictionStats().spilledPages, ok ? "ok" : "FAILED");
+
+    delete store;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    quint64 size = defaultSize;
+    int rounds = defaultRounds;
+    QString directory;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        bool ok = i + 1 < args.size();
+
+        if(args[i] == "--size" && ok)
+            size = args[++i].toULongLong(&ok);
+        else if(args[i] == "--rounds" && ok)
+            rounds = args[++i].toInt(&ok);
+        else if(args[i] == "--spill" && ok)
+            directory = args[++i];
+        else
+            ok = false;
+
+        if(!ok || size < 2 * CRamStore::pageSize || size % CRamStore::pageSize || rounds <= 0)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    QString name = QString("qt-imdisk-crashtest-%1").arg(QCoreApplication::applicationPid());
+    QString spill = directory.isEmpty() ? QString() : QString("%1/%2.spill").arg(directory).arg(name);
+    bool passed = true;
+
+    for(int round = 1; round <= rounds; ++round)
+    {
+        CRamStore::removeShared(name);
+
+        int ready[2];
+        if(pipe(ready) != 0)
+            return 1;
+
+        pid_t child = fork();
+        if(child < 0)
+            return 1;
+        if(child == 0)
+        {
+            close(ready[0]);
+            writer(name, size, quint64(round), spill, ready[1]);
+        }
+        close(ready[1]);
+
+        // Killed at a different point of the disk every round
+        char byte;
+        bool started = read(ready[0], &byte, 1) == 1;
+        close(ready[0]);
+        if(started)
+            usleep(useconds_t(round * 20000));
+
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+
+        if(!started)
+        {
+            printf("round %d: writer failed to start\n", round);
+            passed = false;
+            break;
+        }
+
+        passed = verify(name, size, quint64(round)) && passed;
+    }
+
+    CRamStore::removeShared(name);
+    if(!spill.isEmpty())
+        QFile::remove(spill);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,323 @@
+#include "daemon.h"
+#include "ramdisk.h"
+
+#include <QDebug>
+
+const QString CDaemon::serverName = "qt-imdisk-R-daemon";
+
+// Bytes with an optional K, M, G or T suffix (powers of 1024), 0 when malformed
+static quint64 parseSize(const QString &text)
+{
+    QString digits = text.trimmed().toUpper();
+    int shift = 0;
+
+    if(digits.endsWith('K'))
+        shift = 10;
+    else if(digits.endsWith('M'))
+        shift = 20;
+    else if(digits.endsWith('G'))
+        shift = 30;
+    else if(digits.endsWith('T'))
+        shift = 40;
+
+    if(shift)
+        digits.chop(1);
+
+    bool ok = false;
+    quint64 value = digits.toULongLong(&ok);
+    if(!ok || value > (~0ull >> shift))
+        return 0;
+
+    return value << shift;
+}
+
+// "S", "s:" or "S:\" as "S:", empty when it is no drive letter
+static QString parseLetter(const QString &text)
+{
+    QString letter = text.trimmed().toUpper();
+    if(letter.endsWith('\\'))
+        letter.chop(1);
+    if(letter.endsWith(':'))
+        letter.chop(1);
+
+    if(letter.size() != 1 || letter[0] < 'A' || letter[0] > 'Z')
+        return QString();
+
+    return letter + ':';
+}
+
+// What failed, with the reason the disk recorded for its last device request
+static QString failure(const QString &what, const CRamDisk *disk)
+{
+    QString reason = disk->lastError();
+    return reason.isEmpty() ? what : what + ": " + reason;
+}
+
+CDaemon::CDaemon(QObject *parent) : QObject(parent)
+{
+    qDebug() << Q_FUNC_INFO;
+
+    connect(&_server, &QLocalServer::newConnection, this, &CDaemon::onNewConnection);
+}
+
+CDaemon::~CDaemon()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    _server.close();
+    CRamDisk::destroyInstance();
+}
+
+bool CDaemon::listen()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    // Only one daemon may own the disk
+    QLocalSocket probe;
+    probe.connectToServer(serverName);
+    if(probe.waitForConnected(100))
+    {
+        qDebug() << "Daemon already running";
+        return false;
+    }
+
+    // Stale socket of a daemon that died
+    QLocalServer::removeServer(serverName);
+
+    return _server.listen(serverName);
+}
+
+void CDaemon::onNewConnection()
+{
+    while(QLocalSocket *socket = _server.nextPendingConnection())
+    {
+        connect(socket, &QLocalSocket::readyRead, this, &CDaemon::onReadyRead);
+        connect(socket, &QLocalSocket::disconnected, socket, &QLocalSocket::deleteLater);
+    }
+}
+
+void CDaemon::onReadyRead()
+{
+    QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender());
+    if(!socket || !socket->canReadLine())
+        return;
+
+    QString command = QString::fromUtf8(socket->readLine().trimmed());
+    QString message;
+    bool stopping = command == "stop";
+
+    // Stops after a successful unmount or with nothing mounted, keeps serving the disk otherwise
+    int code = execute(stopping ? "unmount" : command, message);
+    if(stopping)
+    {
+        if(code == IMDISK_CLI_ERROR_DEVICE_NOT_FOUND && !CRamDisk::getInstance()->wasMounted())
+            code = IMDISK_CLI_SUCCESS;
+
+        if(code == IMDISK_CLI_SUCCESS)
+            message = "Daemon stopped";
+        else
+            stopping = false;
+    }
+
+    socket->write(QString("%1 %2\n").arg(code).arg(message).toUtf8());
+    socket->flush();
+    socket->disconnectFromServer();
+
+    if(stopping)
+        emit stopRequested();
+}
+
+int CDaemon::execute(const QString &line, QString &message)
+{
+    CRamDisk *disk = CRamDisk::getInstance();
+
+    // "<command> [argument]", the argument may contain spaces
+    QString command = line.section(' ', 0, 0);
+    QString argument = line.section(' ', 1);
+
+    // Driver and shared store are looked at on first use only
+    static bool initialized = false;
+    if(!initialized)
+    {
+        disk->init();
+        initialized = true;
+    }
+
+    if(command == "mount")
+    {
+        if(disk->wasMounted())
+        {
+            message = disk->letter() + " already mounted";
+
+            // An image asks for a new disk, the mounted one is not replaced
+            if(!argument.isEmpty())
+            {
+                message += ", unmount it before mounting " + argument;
+                return IMDISK_CLI_ERROR_CREATE_DEVICE;
+            }
+            return IMDISK_CLI_SUCCESS;
+        }
+
+        int code = disk->mount(argument);
+        message = code == IMDISK_CLI_SUCCESS ? disk->letter() + " mounted" : failure("Mount failed", disk);
+        return code;
+    }
+
+    if(command == "unmount")
+    {
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        int code = disk->unmount();
+        message = code == IMDISK_CLI_SUCCESS ? disk->letter() + " unmounted" : failure("Unmount failed", disk);
+        return code;
+    }
+
+    if(command == "status")
+    {
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        message = QString("%1 mounted, %2 bytes, %3 committed")
+                .arg(disk->letter()).arg(disk->size()).arg(disk->committedBytes());
+
+        if(const CPreloader *preloader = disk->preloader())
+        {
+            if(preloader->failedExtents() != 0)
+                message += QString(", seed incomplete, %1 extents failed to load").arg(preloader->failedExtents());
+            else if(preloader->isComplete())
+                message += QString(", seed loaded in %1 ms").arg(preloader->timeToLoaded());
+            else
+                message += QString(", seed %1% loaded").arg(qRound(preloader->progress() * 100));
+        }
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    if(command == "resize")
+    {
+        quint64 bytes = parseSize(argument);
+        if(!bytes)
+        {
+            message = "Missing or malformed size";
+            return IMDISK_CLI_ERROR_BAD_SYNTAX;
+        }
+
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        int code = disk->resize(bytes);
+        message = code == IMDISK_CLI_SUCCESS ? QString("%1 resized to %2 bytes").arg(disk->letter()).arg(bytes)
+                                             : failure(QString("Resize to %1 bytes failed").arg(bytes), disk);
+        return code;
+    }
+
+    if(command == "snapshot")
+    {
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        // Only a seed that failed to load stops it
+        if(!disk->snapshot())
+        {
+            message = "Snapshot failed, the seed image did not load completely";
+            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
+        }
+
+        message = "Snapshot taken";
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    if(command == "export")
+    {
+        if(argument.isEmpty())
+        {
+            message = "Missing image path";
+            return IMDISK_CLI_ERROR_BAD_SYNTAX;
+        }
+
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        if(!disk->exportImage(argument))
+        {
+            message = "Export to " + argument + " failed";
+            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
+        }
+
+        message = "Exported to " + argument;
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    if(command == "clone" || command == "unclone")
+    {
+        QString letter = parseLetter(argument);
+        if(letter.isEmpty())
+        {
+            message = "Missing or malformed drive letter";
+            return IMDISK_CLI_ERROR_BAD_SYNTAX;
+        }
+
+        if(!disk->wasMounted())
+        {
+            message = disk->letter() + " not mounted";
+            return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+        }
+
+        if(command == "unclone")
+        {
+            int code = disk->unmountClone(letter);
+            message = code == IMDISK_CLI_SUCCESS ? letter + " unmounted"
+                    : code == IMDISK_CLI_ERROR_DEVICE_NOT_FOUND ? "No clone at " + letter
+                    : failure("Unmount of " + letter + " failed", disk);
+            return code;
+        }
+
+        if(!disk->mountClone(letter))
+        {
+            message = failure("Clone at " + letter + " failed", disk);
+            return IMDISK_CLI_ERROR_CREATE_DEVICE;
+        }
+
+        message = "Clone mounted at " + letter;
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    message = QString("Unknown command: %1").arg(line);
+    return IMDISK_CLI_ERROR_BAD_SYNTAX;
+}
+
+bool CDaemon::send(const QString &command, int &code, QString &message, int connectTimeout)
+{
+    QLocalSocket socket;
+    socket.connectToServer(serverName);
+    if(!socket.waitForConnected(connectTimeout))
+        return false;
+
+    socket.write((command + "\n").toUtf8());
+    socket.waitForBytesWritten();
+
+    // Mounting formats the disk, no upper bound on the reply
+    while(!socket.canReadLine())
+        if(!socket.waitForReadyRead(-1))
+            return false;
+
+    QString reply = QString::fromUtf8(socket.readLine().trimmed());
+    code = reply.section(' ', 0, 0).toInt();
+    message = reply.section(' ', 1);
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef CDAEMON_H
+#define CDAEMON_H
+
+#include <QObject>
+#include <QString>
+#include <QLocalServer>
+#include <QLocalSocket>
+
+// Headless owner of the RAM disk.
+// Keeps CRamDisk and its proxy alive between CLI invocations and answers one
+// command line per local socket connection with "<exit code> <message>".
+// The driver is only touched when the first command arrives.
+class CDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CDaemon(QObject *parent = 0);
+    ~CDaemon();
+
+    bool listen();
+
+    // Runs a command line against the disk of this process, returns an IMDISK_CLI_* value
+    static int execute(const QString &line, QString &message);
+
+    // Client side, false when no daemon is listening
+    static bool send(const QString &command, int &code, QString &message, int connectTimeout);
+
+    static const QString serverName;
+
+signals:
+    void stopRequested();
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+
+private:
+    QLocalServer _server;
+};
+
+#endif // CDAEMON_H
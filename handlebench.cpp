@@ -0,0 +1,202 @@
+#include "latency.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+
+#include <stdio.h>
+
+// Mount and unmount cycles against a simulated ImDisk driver, with and
+// without the handle cache of CRamDisk. Every open and IOCTL spins for a
+// fixed time, like a kernel round trip. The call sequences follow
+// ImDiskCliCreateDevice and ImDiskCliRemoveDevice; format and the
+// notifications cost the same either way and are left out.
+//
+//   uncached create  open control device, query version, create, close
+//   uncached remove  open device (access fallbacks), query version, query device,
+//                    lock, dismount, eject, close
+//   cached create    check control handle, create, open device for the cache
+//   cached remove    check device handle, lock, dismount, eject, close
+//
+// A check is the IOCTL_IMDISK_QUERY_VERSION a cached handle gets before reuse.
+//
+// --denied makes the first access levels of every device open fail, as for
+// a user without write access. The cache only keeps read/write handles, so
+// then removals take the uncached path again.
+
+static const int defaultCycles = 10000;
+static const quint64 defaultOpenNs = 40000;                         // CreateFile of a device object
+static const quint64 defaultIoctlNs = 8000;                         // DeviceIoControl round trip
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-handlebench [--cycles <n>] [--open-ns <ns>] [--ioctl-ns <ns>] [--denied 0|1|2]\n");
+}
+
+class CSimulatedDriver
+{
+public:
+    CSimulatedDriver(quint64 openNs, quint64 ioctlNs, int denied) :
+        _openNs(openNs), _ioctlNs(ioctlNs), _denied(denied), _opens(0), _ioctls(0) {}
+
+    // access 0 is GENERIC_READ | GENERIC_WRITE, 1 GENERIC_READ, 2 FILE_READ_ATTRIBUTES
+    bool openDevice(int access)
+    {
+        spin(_openNs);
+        ++_opens;
+        return access >= _denied;
+    }
+
+    bool openControl()
+    {
+        spin(_openNs);
+        ++_opens;
+        return true;
+    }
+
+    void ioctl()
+    {
+        spin(_ioctlNs);
+        ++_ioctls;
+    }
+
+    void close() {}
+
+    quint64 opens() const { return _opens; }
+    quint64 ioctls() const { return _ioctls; }
+
+private:
+    static void spin(quint64 ns)
+    {
+        quint64 until = CLatency::now() + ns;
+        while(CLatency::now() < until)
+            ;
+    }
+
+    quint64 _openNs;
+    quint64 _ioctlNs;
+    int _denied;
+    quint64 _opens;
+    quint64 _ioctls;
+};
+
+static void openWithFallbacks(CSimulatedDriver &driver)
+{
+    for(int access = 0; access < 3; ++access)
+        if(driver.openDevice(access))
+            return;
+}
+
+static void removeOpened(CSimulatedDriver &driver)
+{
+    driver.ioctl();                     // FSCTL_LOCK_VOLUME
+    driver.ioctl();                     // FSCTL_DISMOUNT_VOLUME
+    driver.ioctl();                     // IOCTL_STORAGE_EJECT_MEDIA
+    driver.close();
+}
+
+static void uncachedCycle(CSimulatedDriver &driver)
+{
+    driver.openControl();
+    driver.ioctl();                     // IOCTL_IMDISK_QUERY_VERSION
+    driver.ioctl();                     // IOCTL_IMDISK_CREATE_DEVICE
+    driver.close();
+
+    openWithFallbacks(driver);
+    driver.ioctl();                     // IOCTL_IMDISK_QUERY_VERSION
+    driver.ioctl();                     // IOCTL_IMDISK_QUERY_DEVICE
+    removeOpened(driver);
+}
+
+static void cachedCycle(CSimulatedDriver &driver, bool *controlOpen)
+{
+    if(!*controlOpen)
+    {
+        driver.openControl();
+        *controlOpen = true;
+    }
+
+    driver.ioctl();                     // IOCTL_IMDISK_QUERY_VERSION, check or first open
+    driver.ioctl();
+    bool cached = driver.openDevice(0);
+
+    if(cached)
+        driver.ioctl();                 // IOCTL_IMDISK_QUERY_VERSION, check
+    else
+    {
+        openWithFallbacks(driver);
+        driver.ioctl();
+        driver.ioctl();
+    }
+    removeOpened(driver);
+}
+
+struct Result
+{
+    double usPerCycle;
+    double opensPerCycle;
+    double ioctlsPerCycle;
+};
+
+template<typename Cycle>
+static Result run(int cycles, quint64 openNs, quint64 ioctlNs, int denied, Cycle cycle)
+{
+    CSimulatedDriver driver(openNs, ioctlNs, denied);
+
+    quint64 start = CLatency::now();
+    for(int i = 0; i < cycles; ++i)
+        cycle(driver);
+    quint64 elapsed = CLatency::now() - start;
+
+    Result result = { elapsed / 1e3 / cycles, double(driver.opens()) / cycles, double(driver.ioctls()) / cycles };
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    int cycles = defaultCycles;
+    quint64 openNs = defaultOpenNs;
+    quint64 ioctlNs = defaultIoctlNs;
+    int denied = 0;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        bool ok = i + 1 < args.size();
+
+        if(args[i] == "--cycles" && ok)
+            cycles = args[++i].toInt(&ok);
+        else if(args[i] == "--open-ns" && ok)
+            openNs = args[++i].toULongLong(&ok);
+        else if(args[i] == "--ioctl-ns" && ok)
+            ioctlNs = args[++i].toULongLong(&ok);
+        else if(args[i] == "--denied" && ok)
+            denied = args[++i].toInt(&ok);
+        else
+            ok = false;
+
+        if(!ok || cycles <= 0 || denied < 0 || denied > 2)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    bool controlOpen = false;
+
+    Result uncached = run(cycles, openNs, ioctlNs, denied, uncachedCycle);
+    Result cached = run(cycles, openNs, ioctlNs, denied, [&](CSimulatedDriver &driver) {
+        cachedCycle(driver, &controlOpen);
+    });
+
+    printf("%d cycles, open %llu ns, ioctl %llu ns, %d denied access levels\n",
+           cycles, openNs, ioctlNs, denied);
+    printf("%-9s %12s %10s %10s\n", "", "per cycle", "opens", "ioctls");
+    printf("%-9s %9.1f us %10.2f %10.2f\n", "uncached", uncached.usPerCycle, uncached.opensPerCycle, uncached.ioctlsPerCycle);
+    printf("%-9s %9.1f us %10.2f %10.2f\n", "cached", cached.usPerCycle, cached.opensPerCycle, cached.ioctlsPerCycle);
+    printf("saved     %9.1f us %9.0f %%\n", uncached.usPerCycle - cached.usPerCycle,
+           uncached.usPerCycle > 0 ? 100.0 * (1.0 - cached.usPerCycle / uncached.usPerCycle) : 0.0);
+
+    return 0;
+}
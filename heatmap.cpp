@@ -0,0 +1,218 @@
+#include "heatmap.h"
+#include "ramstore.h"
+#include "latency.h"
+
+#include <algorithm>
+
+const int CHeatmap::extentPages = 16;                               // 1Mb extents with 64Kb pages
+const int CHeatmap::maxSampledPages = 8192;
+const int CHeatmap::distanceBuckets = 256;                          // miss ratio curve resolution
+
+static const int treeSize = 4 * CHeatmap::maxSampledPages;          // positions before compaction
+
+CHeatmap::CHeatmap(quint64 pageCount, quint64 maxPageCount) : _pageCount(pageCount),
+    _extents(int((qMax(pageCount, maxPageCount) + extentPages - 1) / extentPages)),
+    _tree(treeSize + 1, 0), _position(0), _distances(distanceBuckets + 1, 0), _accesses(0), _samplingTime(0)
+{
+    setRate();
+}
+
+// Fixed rate for the disk size, chosen so the expected sample stays under the cap
+void CHeatmap::setRate()
+{
+    _rate = qMin(1.0, double(maxSampledPages) / double(qMax<quint64>(_pageCount.load(), 1)));
+    _threshold.store(quint32(qMin(_rate * 4294967296.0, 4294967295.0)));
+}
+
+void CHeatmap::resize(quint64 pageCount)
+{
+    pageCount = qMin<quint64>(pageCount, quint64(_extents.size()) * extentPages);
+
+    QMutexLocker locker(&_mutex);
+
+    if(pageCount == _pageCount.load())
+        return;
+
+    // Heat past the end is dropped, a later grow starts cold there
+    _pageCount.store(pageCount);
+    for(int i = int((pageCount + extentPages - 1) / extentPages); i < _extents.size(); ++i)
+        _extents[i].store(0);
+
+    // Scaled reuse distances only compare at one rate
+    _lastAccess.clear();
+    _tree.fill(0);
+    _position = 0;
+    _distances.fill(0);
+    _accesses = 0;
+    setRate();
+}
+
+// Murmur3 finalizer, spreads neighbouring pages over the whole range
+quint32 CHeatmap::pageHash(quint64 page)
+{
+    page ^= page >> 33;
+    page *= 0xff51afd7ed558ccdull;
+    page ^= page >> 33;
+    page *= 0xc4ceb9fe1a85ec53ull;
+    page ^= page >> 33;
+    return quint32(page);
+}
+
+void CHeatmap::record(quint64 offset, quint64 length)
+{
+    if(length == 0)
+        return;
+
+    quint64 pageCount = _pageCount.load();
+    quint64 first = offset / CRamStore::pageSize;
+    quint64 last = qMin((offset + length - 1) / CRamStore::pageSize, pageCount - 1);
+
+    if(first >= pageCount)
+        return;
+
+    for(quint64 extent = first / extentPages; extent <= last / extentPages; ++extent)
+        _extents[int(extent)].fetchAndAddRelaxed(1);
+
+    for(quint64 page = first; page <= last; ++page)
+        if(pageHash(page) < _threshold.load())
+            sample(page);
+}
+
+void CHeatmap::sample(quint64 page)
+{
+    quint64 start = CLatency::now();
+    QMutexLocker locker(&_mutex);
+
+    if(_position == treeSize)
+        compact();
+
+    // Distinct sampled pages touched since the last access, scaled to the whole disk
+    QHash<quint64, int>::iterator it = _lastAccess.find(page);
+    int bucket = distanceBuckets;
+
+    if(it != _lastAccess.end())
+    {
+        int distance = treeSum(_position) - treeSum(it.value() + 1);
+        quint64 scaled = quint64(distance / _rate);
+        bucket = int(qMin<quint64>(scaled * distanceBuckets / qMax<quint64>(_pageCount.load(), 1), distanceBuckets - 1));
+
+        treeAdd(it.value() + 1, -1);
+        it.value() = _position;
+    }
+    else
+        _lastAccess.insert(page, _position);
+
+    treeAdd(_position + 1, 1);
+    ++_position;
+
+    ++_distances[bucket];
+    ++_accesses;
+    _samplingTime += CLatency::now() - start;
+}
+
+// Renumbers the live positions from zero once the tree is full
+void CHeatmap::compact()
+{
+    QVector<QPair<int, quint64> > live;
+    live.reserve(_lastAccess.size());
+
+    for(QHash<quint64, int>::const_iterator it = _lastAccess.constBegin(); it != _lastAccess.constEnd(); ++it)
+        live.append(qMakePair(it.value(), it.key()));
+
+    std::sort(live.begin(), live.end());
+
+    _tree.fill(0);
+    for(int i = 0; i < live.size(); ++i)
+    {
+        _lastAccess[live[i].second] = i;
+        treeAdd(i + 1, 1);
+    }
+
+    _position = live.size();
+}
+
+void CHeatmap::treeAdd(int position, int delta)
+{
+    for(; position <= treeSize; position += position & -position)
+        _tree[position] += delta;
+}
+
+// Sum over positions 1..position
+int CHeatmap::treeSum(int position) const
+{
+    int sum = 0;
+
+    for(; position > 0; position -= position & -position)
+        sum += _tree[position];
+
+    return sum;
+}
+
+void CHeatmap::decay()
+{
+    for(int i = 0; i < _extents.size(); ++i)
+        _extents[i].store(_extents[i].load() >> 1);
+
+    QMutexLocker locker(&_mutex);
+
+    _accesses = 0;
+    for(int i = 0; i < _distances.size(); ++i)
+    {
+        _distances[i] >>= 1;
+        _accesses += _distances[i];
+    }
+}
+
+int CHeatmap::extentCount() const
+{
+    return int((_pageCount.load() + extentPages - 1) / extentPages);
+}
+
+quint32 CHeatmap::extentHeat(int extent) const
+{
+    return _extents[extent].load();
+}
+
+double CHeatmap::missRatio(quint64 pages) const
+{
+    QMutexLocker locker(&_mutex);
+
+    if(_accesses == 0)
+        return 0.0;
+
+    // An access hits when its reuse distance is below the cache size, cold accesses always miss
+    int hitBuckets = int(qMin<quint64>(pages * distanceBuckets / qMax<quint64>(_pageCount.load(), 1), distanceBuckets));
+    quint64 misses = 0;
+
+    for(int i = hitBuckets; i <= distanceBuckets; ++i)
+        misses += _distances[i];
+
+    return double(misses) / double(_accesses);
+}
+
+quint64 CHeatmap::workingSetPages(double slack) const
+{
+    quint64 pageCount = _pageCount.load();
+    double floor = missRatio(pageCount);
+
+    for(int i = 0; i <= distanceBuckets; ++i)
+    {
+        quint64 pages = pageCount * quint64(i) / distanceBuckets;
+        if(missRatio(pages) <= floor + slack)
+            return pages;
+    }
+
+    return pageCount;
+}
+
+quint64 CHeatmap::sampledAccesses() const
+{
+    QMutexLocker locker(&_mutex);
+    return _accesses;
+}
+
+quint64 CHeatmap::samplingCost() const
+{
+    QMutexLocker locker(&_mutex);
+    return _accesses ? _samplingTime / qMax<quint64>(_accesses, 1) : 0;
+}
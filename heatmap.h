@@ -0,0 +1,72 @@
+#ifndef CHEATMAP_H
+#define CHEATMAP_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QAtomicInteger>
+
+// Access statistics of a CRamStore, fed by the proxy.
+// Per extent counters (extentPages pages each) are halved by decay(), so they
+// show recent heat. The working set is estimated with SHARDS: pages whose
+// hash falls under a fixed threshold are sampled and their reuse distances
+// collected into a histogram. That histogram gives a miss ratio curve, which
+// is scaled back to the whole disk. The sample is capped at maxSampledPages
+// pages, which bounds both memory and the cost of a sampled access.
+// Sized to the disk, extents up to maxPageCount are allocated up front so
+// resize() can rebuild it in place while the proxy records into it.
+class CHeatmap
+{
+public:
+    explicit CHeatmap(quint64 pageCount, quint64 maxPageCount = 0);
+
+    // Called for every foreground read and write
+    void record(quint64 offset, quint64 length);
+    void decay();
+    // New disk size, drops the heat past it and restarts the sample at the matching rate
+    void resize(quint64 pageCount);
+
+    int extentCount() const;
+    quint32 extentHeat(int extent) const;
+
+    // Fraction of accesses that would miss a cache of the given size
+    double missRatio(quint64 pages) const;
+    // Smallest cache, in pages, whose miss ratio is within slack of an unbounded
+    // cache; cold misses are paid by any cache and do not grow the working set
+    quint64 workingSetPages(double slack) const;
+
+    quint64 sampledAccesses() const;
+    // Mean time spent per sampled access, in nanoseconds
+    quint64 samplingCost() const;
+
+    static const int extentPages;
+    static const int maxSampledPages;
+    static const int distanceBuckets;
+
+private:
+    Q_DISABLE_COPY(CHeatmap)
+
+    static quint32 pageHash(quint64 page);
+    void setRate();
+    void sample(quint64 page);
+    void compact();
+    void treeAdd(int position, int delta);
+    int treeSum(int position) const;
+
+    QAtomicInteger<quint64> _pageCount;
+    QVector<QAtomicInteger<quint32> > _extents;   // for maxPageCount, extentCount() in use
+
+    // SHARDS state, guarded by _mutex
+    mutable QMutex _mutex;
+    QAtomicInteger<quint32> _threshold;     // page sampled when its hash is below this
+    double _rate;
+    QHash<quint64, int> _lastAccess;        // sampled page -> position of its last access
+    QVector<int> _tree;                     // Fenwick tree over positions, 1 = latest access of a page
+    int _position;
+    QVector<quint64> _distances;            // scaled reuse distance histogram, last bucket = cold
+    quint64 _accesses;
+    quint64 _samplingTime;
+};
+
+#endif // CHEATMAP_H
@@ -0,0 +1,56 @@
+#include "heatmapview.h"
+#include "heatmap.h"
+
+#include <QPainter>
+#include <QtMath>
+
+const int CHeatmapView::cellSize = 4;                           // px per cell side
+
+CHeatmapView::CHeatmapView(QWidget *parent) : QWidget(parent)
+{
+}
+
+void CHeatmapView::setHeatmap(const CHeatmap *heatmap)
+{
+    _heat.resize(heatmap ? heatmap->extentCount() : 0);
+
+    for(int i = 0; i < _heat.size(); ++i)
+        _heat[i] = heatmap->extentHeat(i);
+
+    update();
+}
+
+void CHeatmapView::paintEvent(QPaintEvent *event)
+{
+    Q_UNUSED(event);
+
+    QPainter painter(this);
+    painter.fillRect(rect(), Qt::black);
+
+    int columns = width() / cellSize;
+    int cells = columns * (height() / cellSize);
+    if(_heat.isEmpty() || cells == 0)
+        return;
+
+    int extentsPerCell = (_heat.size() + cells - 1) / cells;
+
+    quint32 hottest = 0;
+    for(int i = 0; i < _heat.size(); ++i)
+        hottest = qMax(hottest, _heat[i]);
+
+    // Log scale, a few very hot extents would leave everything else dark otherwise
+    double scale = hottest ? 1.0 / qLn(1.0 + hottest) : 0.0;
+
+    for(int cell = 0; cell * extentsPerCell < _heat.size(); ++cell)
+    {
+        quint32 heat = 0;
+        for(int i = cell * extentsPerCell; i < qMin((cell + 1) * extentsPerCell, _heat.size()); ++i)
+            heat = qMax(heat, _heat[i]);
+
+        QColor color(48, 48, 48);
+        if(heat)
+            color = QColor::fromHsv(int(240 - 240 * qLn(1.0 + heat) * scale), 255, 255);
+
+        painter.fillRect((cell % columns) * cellSize, (cell / columns) * cellSize, cellSize - 1, cellSize - 1, color);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef CHEATMAPVIEW_H
+#define CHEATMAPVIEW_H
+
+#include <QWidget>
+#include <QVector>
+
+class CHeatmap;
+
+// Paints the access heat of the disk, left to right and top to bottom from
+// offset zero. Each cell covers one or more extents and shows the hottest.
+class CHeatmapView : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit CHeatmapView(QWidget *parent = nullptr);
+
+    // Takes a copy of the counters, nullptr clears the view
+    void setHeatmap(const CHeatmap *heatmap);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+private:
+    static const int cellSize;
+
+    QVector<quint32> _heat;
+};
+
+#endif // CHEATMAPVIEW_H
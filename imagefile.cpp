@@ -0,0 +1,628 @@
+#include "imagefile.h"
+#include "ramstore.h"
+#include "blockkernels.h"
+
+#include <QFile>
+#include <QThread>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QUuid>
+#include <QtEndian>
+#include <QDebug>
+
+#include <functional>
+#include <algorithm>
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+const quint64 CImageFile::chunkSize = 4ull*1024*1024;               // 4Mb per read or write
+const quint32 CImageFile::vhdBlockSize = 2*1024*1024;               // 2Mb, what Windows creates
+
+static const quint64 vhdSector = 512;
+static const quint32 vhdFixed = 2;
+static const quint32 vhdDynamic = 3;
+static const quint64 vhdNoOffset = ~0ull;
+static const quint32 vhdUnallocated = ~0u;
+static const qint64 vhdEpoch = 946684800;                           // 2000-01-01 UTC, VHD timestamps count from here
+
+#pragma pack(push, 1)
+// VHD footer, also copied to the start of a dynamic image; big-endian
+struct VhdFooter
+{
+    char cookie[8];                         // "conectix"
+    quint32 features;
+    quint32 version;
+    quint64 dataOffset;                     // dynamic header, vhdNoOffset for a fixed image
+    quint32 timestamp;
+    char creatorApp[4];
+    quint32 creatorVersion;
+    quint32 creatorOs;
+    quint64 originalSize;
+    quint64 currentSize;
+    quint32 geometry;
+    quint32 diskType;
+    quint32 checksum;
+    quint8 uuid[16];
+    quint8 savedState;
+    quint8 reserved[427];
+};
+
+// Dynamic disk header; big-endian
+struct VhdHeader
+{
+    char cookie[8];                         // "cxsparse"
+    quint64 dataOffset;
+    quint64 tableOffset;
+    quint32 headerVersion;
+    quint32 maxTableEntries;
+    quint32 blockSize;
+    quint32 checksum;
+    quint8 parentUuid[16];
+    quint32 parentTimestamp;
+    quint32 reserved;
+    quint16 parentName[256];
+    quint8 parentLocators[8 * 24];
+    quint8 reserved2[256];
+};
+#pragma pack(pop)
+
+// One's complement of the byte sum with the checksum field cleared
+template<typename T>
+static quint32 vhdChecksum(const T &structure)
+{
+    T copy = structure;
+    copy.checksum = 0;
+
+    const quint8 *bytes = reinterpret_cast<const quint8 *>(&copy);
+    quint32 sum = 0;
+
+    for(size_t i = 0; i < sizeof(copy); ++i)
+        sum += bytes[i];
+
+    return ~sum;
+}
+
+// CHS geometry as the VHD specification computes it
+static quint32 vhdGeometry(quint64 size)
+{
+    quint64 totalSectors = qMin<quint64>(size / vhdSector, 65535ull * 16 * 255);
+    quint64 sectorsPerTrack, heads, cylinderTimesHeads;
+
+    if(totalSectors >= 65535ull * 16 * 63)
+    {
+        sectorsPerTrack = 255;
+        heads = 16;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+    }
+    else
+    {
+        sectorsPerTrack = 17;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        heads = qMax<quint64>((cylinderTimesHeads + 1023) / 1024, 4);
+
+        if(cylinderTimesHeads >= heads * 1024 || heads > 16)
+        {
+            sectorsPerTrack = 31;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+
+        if(cylinderTimesHeads >= heads * 1024)
+        {
+            sectorsPerTrack = 63;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+    }
+
+    return quint32(cylinderTimesHeads / heads) << 16 | quint32(heads) << 8 | quint32(sectorsPerTrack);
+}
+
+static VhdFooter vhdFooter(quint64 size, quint32 type)
+{
+    VhdFooter footer;
+    memset(&footer, 0, sizeof(footer));
+
+    memcpy(footer.cookie, "conectix", 8);
+    footer.features = qToBigEndian(quint32(2));
+    footer.version = qToBigEndian(quint32(0x00010000));
+    footer.dataOffset = qToBigEndian(type == vhdDynamic ? vhdSector : vhdNoOffset);
+    footer.timestamp = qToBigEndian(quint32(QDateTime::currentMSecsSinceEpoch() / 1000 - vhdEpoch));
+    memcpy(footer.creatorApp, "qtim", 4);
+    footer.creatorVersion = qToBigEndian(quint32(0x00010000));
+    footer.creatorOs = qToBigEndian(quint32(0x5769326B));          // "Wi2k"
+    footer.originalSize = qToBigEndian(size);
+    footer.currentSize = qToBigEndian(size);
+    footer.geometry = qToBigEndian(vhdGeometry(size));
+    footer.diskType = qToBigEndian(type);
+
+    QByteArray uuid = QUuid::createUuid().toRfc4122();
+    memcpy(footer.uuid, uuid.constData(), sizeof(footer.uuid));
+
+    footer.checksum = qToBigEndian(vhdChecksum(footer));
+    return footer;
+}
+
+// Calls write(offset, data, length) for every run of non-zero pages, data starts at disk offset
+template<typename Write>
+static bool forEachRun(quint64 offset, const char *data, quint64 length, Write write)
+{
+    quint64 run = 0;
+    quint64 runLength = 0;
+
+    for(quint64 done = 0; done < length; )
+    {
+        quint64 piece = qMin(CRamStore::pageSize - (offset + done) % CRamStore::pageSize, length - done);
+
+        if(!CBlockKernels::isZero(data + done, size_t(piece)))
+        {
+            if(runLength == 0)
+                run = done;
+            runLength += piece;
+        }
+        else if(runLength)
+        {
+            if(!write(offset + run, data + run, runLength))
+                return false;
+            runLength = 0;
+        }
+
+        done += piece;
+    }
+
+    return runLength == 0 || write(offset + run, data + run, runLength);
+}
+
+// Sectors a dynamic VHD block does not mark as present read as zeros
+static void clearAbsentSectors(const quint8 *bitmap, char *data, quint64 length)
+{
+    for(quint64 sector = 0; sector * vhdSector < length; ++sector)
+        if(!(bitmap[sector / 8] & (0x80 >> (sector % 8))))
+            memset(data + sector * vhdSector, 0, size_t(qMin(vhdSector, length - sector * vhdSector)));
+}
+
+// Ranges of the file that hold data, the whole file when the file system cannot tell
+static QVector<QPair<quint64, quint64> > allocatedRanges(QFile &file, quint64 length)
+{
+    QVector<QPair<quint64, quint64> > ranges;
+
+#ifdef Q_OS_WIN
+    HANDLE handle = HANDLE(_get_osfhandle(file.handle()));
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER found[64];
+
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = LONGLONG(length);
+
+    for(;;)
+    {
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                                  found, sizeof(found), &returned, NULL);
+        if(!ok && GetLastError() != ERROR_MORE_DATA)
+        {
+            ranges.clear();
+            ranges.append(qMakePair(quint64(0), length));
+            break;
+        }
+
+        int count = int(returned / sizeof(found[0]));
+        for(int i = 0; i < count; ++i)
+            ranges.append(qMakePair(quint64(found[i].FileOffset.QuadPart), quint64(found[i].Length.QuadPart)));
+
+        if(ok || count == 0)
+            break;
+
+        query.FileOffset.QuadPart = found[count - 1].FileOffset.QuadPart + found[count - 1].Length.QuadPart;
+        query.Length.QuadPart = LONGLONG(length) - query.FileOffset.QuadPart;
+    }
+#else
+    int fd = file.handle();
+    off_t offset = 0;
+
+    while(quint64(offset) < length)
+    {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if(data < 0)
+        {
+            // ENXIO: only a hole is left
+            if(errno != ENXIO)
+            {
+                ranges.clear();
+                ranges.append(qMakePair(quint64(0), length));
+            }
+            break;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if(hole < 0)
+            hole = off_t(length);
+
+        ranges.append(qMakePair(quint64(data), qMin(quint64(hole), length) - quint64(data)));
+        offset = hole;
+    }
+#endif
+
+    return ranges;
+}
+
+// The caller and a worker thread take turns on two buffers in index order,
+// so one side does file I/O while the other copies. After a failure both
+// sides skip their remaining steps.
+class CStreamWorker : public QThread
+{
+public:
+    typedef std::function<bool(int index, QByteArray &buffer)> Step;
+
+    CStreamWorker(int count, int bufferSize, bool workerFirst, const Step &work) :
+        _count(count), _work(work), _toWorker(workerFirst ? 2 : 0), _toCaller(workerFirst ? 0 : 2), _failed(0)
+    {
+        _buffers[0].resize(bufferSize);
+        _buffers[1].resize(bufferSize);
+    }
+
+    bool process(const Step &step)
+    {
+        start();
+
+        for(int i = 0; i < _count; ++i)
+        {
+            _toCaller.acquire();
+            if(!_failed.load() && !step(i, _buffers[i % 2]))
+                _failed.store(1);
+            _toWorker.release();
+        }
+
+        wait();
+        return !_failed.load();
+    }
+
+protected:
+    void run() override
+    {
+        for(int i = 0; i < _count; ++i)
+        {
+            _toWorker.acquire();
+            if(!_failed.load() && !_work(i, _buffers[i % 2]))
+                _failed.store(1);
+            _toCaller.release();
+        }
+    }
+
+private:
+    int _count;
+    Step _work;
+    QByteArray _buffers[2];
+    QSemaphore _toWorker;
+    QSemaphore _toCaller;
+    QAtomicInt _failed;
+};
+
+CImageFile::Format CImageFile::formatFor(const QString &path)
+{
+    return path.endsWith(".vhd", Qt::CaseInsensitive) ? DynamicVhd : Raw;
+}
+
+// Splits a range at chunk boundaries, so reads stay large and aligned
+void CImageFile::appendChunks(QVector<Extent> &extents, quint64 offset, quint64 length)
+{
+    while(length)
+    {
+        quint64 piece = qMin(chunkSize - offset % chunkSize, length);
+        Extent extent = { offset, offset, piece, 0 };
+        extents.append(extent);
+
+        offset += piece;
+        length -= piece;
+    }
+}
+
+bool CImageFile::mapImage(QFile &file, QVector<Extent> &extents, quint64 *size)
+{
+    extents.clear();
+
+    quint64 fileSize = quint64(file.size());
+    quint64 dataSize = fileSize;
+    bool dynamic = false;
+
+    VhdFooter footer;
+    if(fileSize >= sizeof(footer) && file.seek(qint64(fileSize - sizeof(footer))) &&
+       file.read(reinterpret_cast<char *>(&footer), sizeof(footer)) == qint64(sizeof(footer)) &&
+       memcmp(footer.cookie, "conectix", 8) == 0)
+    {
+        quint32 type = qFromBigEndian(footer.diskType);
+
+        if(vhdChecksum(footer) != qFromBigEndian(footer.checksum) || (type != vhdFixed && type != vhdDynamic))
+        {
+            qDebug() << "Unsupported or damaged VHD" << file.fileName() << "type" << type;
+            return false;
+        }
+
+        dataSize = qMin(qFromBigEndian(footer.currentSize), fileSize - sizeof(footer));
+        dynamic = type == vhdDynamic;
+    }
+
+    if(dynamic)
+    {
+        dataSize = qFromBigEndian(footer.currentSize);
+
+        VhdHeader header;
+        if(!file.seek(qint64(qFromBigEndian(footer.dataOffset))) ||
+           file.read(reinterpret_cast<char *>(&header), sizeof(header)) != qint64(sizeof(header)) ||
+           memcmp(header.cookie, "cxsparse", 8) != 0 || vhdChecksum(header) != qFromBigEndian(header.checksum))
+        {
+            qDebug() << "Damaged VHD header" << file.fileName();
+            return false;
+        }
+
+        quint32 blockSize = qFromBigEndian(header.blockSize);
+        quint32 entries = qFromBigEndian(header.maxTableEntries);
+        quint32 bitmapSize = quint32((blockSize / vhdSector / 8 + vhdSector - 1) / vhdSector * vhdSector);
+
+        QVector<quint32> table;
+        table.resize(int(entries));
+        qint64 tableBytes = qint64(entries) * sizeof(quint32);
+
+        if(blockSize == 0 || blockSize % vhdSector || !file.seek(qint64(qFromBigEndian(header.tableOffset))) ||
+           file.read(reinterpret_cast<char *>(table.data()), tableBytes) != tableBytes)
+        {
+            qDebug() << "Damaged VHD block table" << file.fileName();
+            return false;
+        }
+
+        for(quint32 i = 0; i < entries && quint64(i) * blockSize < dataSize; ++i)
+        {
+            quint32 sector = qFromBigEndian(table[int(i)]);
+            if(sector == vhdUnallocated)
+                continue;
+
+            quint64 offset = quint64(i) * blockSize;
+            Extent extent = { sector * vhdSector, offset, qMin<quint64>(blockSize, dataSize - offset), bitmapSize };
+            extents.append(extent);
+        }
+
+        // Blocks in file order, so the image is read front to back
+        std::sort(extents.begin(), extents.end(), [](const Extent &a, const Extent &b) {
+            return a.fileOffset < b.fileOffset;
+        });
+    }
+    else
+    {
+        // Page aligned, ranges of a file system with smaller clusters may touch the same page
+        QVector<QPair<quint64, quint64> > ranges = allocatedRanges(file, dataSize);
+        quint64 end = 0;
+
+        for(int i = 0; i < ranges.size(); ++i)
+        {
+            quint64 first = qMax(ranges[i].first / CRamStore::pageSize * CRamStore::pageSize, end);
+            quint64 last = qMin((ranges[i].first + ranges[i].second + CRamStore::pageSize - 1) /
+                                CRamStore::pageSize * CRamStore::pageSize, dataSize);
+            if(last <= first)
+                continue;
+
+            appendChunks(extents, first, last - first);
+            end = last;
+        }
+    }
+
+    if(size)
+        *size = dataSize;
+    return true;
+}
+
+bool CImageFile::readExtent(QFile &file, const Extent &extent, QByteArray &buffer)
+{
+    qint64 length = qint64(extent.bitmapSize + extent.length);
+    if(buffer.size() < length)
+        buffer.resize(int(length));
+
+    return file.seek(qint64(extent.fileOffset)) && file.read(buffer.data(), length) == length;
+}
+
+bool CImageFile::storeExtent(CRamStore *store, const Extent &extent, QByteArray &buffer, quint64 *stored)
+{
+    char *data = buffer.data() + extent.bitmapSize;
+
+    if(extent.bitmapSize)
+        clearAbsentSectors(reinterpret_cast<const quint8 *>(buffer.constData()), data, extent.length);
+
+    return forEachRun(extent.diskOffset, data, extent.length, [&](quint64 offset, const char *run, quint64 length) {
+        if(stored)
+            *stored += length;
+        return store->write(offset, run, length);
+    });
+}
+
+bool CImageFile::importImage(CRamStore *store, const QString &path, quint64 *loaded)
+{
+    qDebug() << Q_FUNC_INFO << path;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot open image" << path;
+        return false;
+    }
+
+    QVector<Extent> extents;
+    quint64 dataSize = 0;
+
+    if(!mapImage(file, extents, &dataSize))
+        return false;
+
+    if(dataSize > store->size())
+    {
+        qDebug() << "Image" << path << "is larger than the disk";
+        return false;
+    }
+
+    quint64 largest = 0;
+    for(int i = 0; i < extents.size(); ++i)
+        largest = qMax(largest, extents[i].bitmapSize + extents[i].length);
+
+    quint64 stored = 0;
+
+    CStreamWorker reader(extents.size(), int(largest), true, [&](int i, QByteArray &buffer) {
+        return readExtent(file, extents[i], buffer);
+    });
+
+    bool ok = reader.process([&](int i, QByteArray &buffer) {
+        return storeExtent(store, extents[i], buffer, &stored);
+    });
+
+    if(loaded)
+        *loaded = stored;
+
+    qDebug() << "Image" << path << (ok ? "loaded" : "failed") << "in" << timer.elapsed() << "ms," << stored << "bytes";
+    return ok;
+}
+
+bool CImageFile::exportImage(CRamStore *store, const QString &path, Format format)
+{
+    qDebug() << Q_FUNC_INFO << path << format;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    quint64 size = store->size();
+    if(format != Raw && size % vhdSector)
+    {
+        qDebug() << "Disk size is not a whole number of sectors";
+        return false;
+    }
+
+    QFile file(path);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot create image" << path;
+        return false;
+    }
+
+    // Only committed pages are looked at, everything else is a hole already
+    QVector<Extent> extents;
+    quint64 pageCount = store->pageCount();
+
+    if(format == DynamicVhd)
+    {
+        quint64 pagesPerBlock = vhdBlockSize / CRamStore::pageSize;
+
+        for(quint64 block = 0; block * vhdBlockSize < size; ++block)
+            for(quint64 page = block * pagesPerBlock; page < qMin((block + 1) * pagesPerBlock, pageCount); ++page)
+                if(store->isPageCommitted(page))
+                {
+                    Extent extent = { 0, block * vhdBlockSize, qMin<quint64>(vhdBlockSize, size - block * vhdBlockSize), 0 };
+                    extents.append(extent);
+                    break;
+                }
+    }
+    else
+    {
+        for(quint64 page = 0; page < pageCount; )
+        {
+            if(!store->isPageCommitted(page))
+            {
+                ++page;
+                continue;
+            }
+
+            quint64 first = page;
+            while(page < pageCount && store->isPageCommitted(page))
+                ++page;
+
+            quint64 offset = first * CRamStore::pageSize;
+            appendChunks(extents, offset, qMin(page * CRamStore::pageSize, size) - offset);
+        }
+
+#ifdef Q_OS_WIN
+        DWORD returned = 0;
+        DeviceIoControl(HANDLE(_get_osfhandle(file.handle())), FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+#endif
+        if(!file.resize(qint64(size)))
+            return false;
+    }
+
+    // Dynamic layout: footer copy, header, block table, then blocks as they are written
+    quint32 entries = quint32((size + vhdBlockSize - 1) / vhdBlockSize);
+    quint64 tableOffset = vhdSector + sizeof(VhdHeader);
+    quint64 tableBytes = (quint64(entries) * sizeof(quint32) + vhdSector - 1) / vhdSector * vhdSector;
+    quint64 nextBlock = tableOffset + tableBytes;
+
+    QVector<quint32> table(int(tableBytes / sizeof(quint32)), vhdUnallocated);
+    QByteArray bitmap(int(vhdBlockSize / vhdSector / 8), char(0xff));
+
+    CStreamWorker writer(extents.size(), int(qMax<quint64>(chunkSize, vhdBlockSize)), false, [&](int i, QByteArray &buffer) {
+        const Extent &extent = extents[i];
+
+        if(format != DynamicVhd)
+            return forEachRun(extent.diskOffset, buffer.constData(), extent.length, [&](quint64 offset, const char *run, quint64 length) {
+                return file.seek(qint64(offset)) && file.write(run, qint64(length)) == qint64(length);
+            });
+
+        if(CBlockKernels::isZero(buffer.constData(), size_t(extent.length)))
+            return true;
+
+        table[int(extent.diskOffset / vhdBlockSize)] = qToBigEndian(quint32(nextBlock / vhdSector));
+
+        bool ok = file.seek(qint64(nextBlock)) && file.write(bitmap) == bitmap.size() &&
+                file.write(buffer.constData(), vhdBlockSize) == qint64(vhdBlockSize);
+        nextBlock += quint64(bitmap.size()) + vhdBlockSize;
+        return ok;
+    });
+
+    bool ok = writer.process([&](int i, QByteArray &buffer) {
+        const Extent &extent = extents[i];
+
+        // The last block of a dynamic image is written whole
+        if(format == DynamicVhd && extent.length < vhdBlockSize)
+            memset(buffer.data() + extent.length, 0, size_t(vhdBlockSize - extent.length));
+
+        return store->read(extent.diskOffset, buffer.data(), extent.length);
+    });
+
+    if(ok && format == FixedVhd)
+    {
+        VhdFooter footer = vhdFooter(size, vhdFixed);
+        ok = file.seek(qint64(size)) && file.write(reinterpret_cast<const char *>(&footer), sizeof(footer)) == qint64(sizeof(footer));
+    }
+
+    if(ok && format == DynamicVhd)
+    {
+        VhdFooter footer = vhdFooter(size, vhdDynamic);
+
+        VhdHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.cookie, "cxsparse", 8);
+        header.dataOffset = qToBigEndian(vhdNoOffset);
+        header.tableOffset = qToBigEndian(tableOffset);
+        header.headerVersion = qToBigEndian(quint32(0x00010000));
+        header.maxTableEntries = qToBigEndian(entries);
+        header.blockSize = qToBigEndian(vhdBlockSize);
+        header.checksum = qToBigEndian(vhdChecksum(header));
+
+        qint64 tableLength = qint64(tableBytes);
+        ok = file.seek(0) && file.write(reinterpret_cast<const char *>(&footer), sizeof(footer)) == qint64(sizeof(footer)) &&
+                file.write(reinterpret_cast<const char *>(&header), sizeof(header)) == qint64(sizeof(header)) &&
+                file.write(reinterpret_cast<const char *>(table.constData()), tableLength) == tableLength &&
+                file.seek(qint64(nextBlock)) &&
+                file.write(reinterpret_cast<const char *>(&footer), sizeof(footer)) == qint64(sizeof(footer));
+    }
+
+    file.close();
+
+    qDebug() << "Image" << path << (ok ? "written" : "failed") << "in" << timer.elapsed() << "ms";
+    return ok;
+}
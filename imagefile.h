@@ -0,0 +1,57 @@
+#ifndef CIMAGEFILE_H
+#define CIMAGEFILE_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QVector>
+
+class QFile;
+class QByteArray;
+class CRamStore;
+
+// Streams disk images into and out of a CRamStore.
+// Raw images and fixed or dynamic VHDs are imported. Only what the image
+// actually holds is read: allocated ranges of a sparse file, present blocks
+// of a dynamic VHD. Zero pages are not stored. Reads and writes are large and
+// aligned, a worker thread does the file I/O on one buffer while the caller
+// copies the other from or to the store.
+class CImageFile
+{
+public:
+    enum Format
+    {
+        Raw,
+        FixedVhd,
+        DynamicVhd
+    };
+
+    // A piece of the image moved through one buffer
+    struct Extent
+    {
+        quint64 fileOffset;
+        quint64 diskOffset;
+        quint64 length;
+        quint32 bitmapSize;                 // dynamic VHD sector bitmap read in front of the data
+    };
+
+    // Pages the image does not cover are left as they are. loaded receives the non-zero bytes stored.
+    static bool importImage(CRamStore *store, const QString &path, quint64 *loaded = nullptr);
+    // Zero pages become holes in a raw image and absent blocks in a dynamic VHD
+    static bool exportImage(CRamStore *store, const QString &path, Format format);
+    // DynamicVhd for *.vhd, Raw otherwise
+    static Format formatFor(const QString &path);
+
+    // Building blocks of an import, for callers that schedule the extents themselves.
+    // mapImage lists the data extents in file order and the disk size the image covers.
+    static bool mapImage(QFile &file, QVector<Extent> &extents, quint64 *size);
+    static bool readExtent(QFile &file, const Extent &extent, QByteArray &buffer);
+    static bool storeExtent(CRamStore *store, const Extent &extent, QByteArray &buffer, quint64 *stored = nullptr);
+
+    static const quint64 chunkSize;
+    static const quint32 vhdBlockSize;
+
+private:
+    static void appendChunks(QVector<Extent> &extents, quint64 offset, quint64 length);
+};
+
+#endif // CIMAGEFILE_H
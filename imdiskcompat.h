@@ -0,0 +1,45 @@
+#ifndef IMDISKCOMPAT_H
+#define IMDISKCOMPAT_H
+
+#include <wchar.h>
+
+// The Windows types and the IMDISK_CREATE_DATA layout the request builders
+// use, for building them without the Windows and ImDisk headers. WCHAR is
+// the native wchar_t so wide literals fit, 4 bytes on Linux.
+
+typedef wchar_t WCHAR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef unsigned int DWORD;
+typedef unsigned int ULONG;
+typedef unsigned short USHORT;
+typedef long long LONGLONG;
+
+#define MAX_PATH 260
+
+typedef union
+{
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct
+{
+    LARGE_INTEGER Cylinders;
+    int MediaType;
+    DWORD TracksPerCylinder;
+    DWORD SectorsPerTrack;
+    DWORD BytesPerSector;
+} DISK_GEOMETRY;
+
+typedef struct
+{
+    ULONG DeviceNumber;
+    DISK_GEOMETRY DiskGeometry;
+    LARGE_INTEGER ImageOffset;
+    ULONG Flags;
+    WCHAR DriveLetter;
+    USHORT FileNameLength;
+    WCHAR FileName[1];
+} IMDISK_CREATE_DATA, *PIMDISK_CREATE_DATA;
+
+#endif // IMDISKCOMPAT_H
@@ -0,0 +1,279 @@
+#include "imdiskproxy.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "tracer.h"
+#include "heatmap.h"
+#include "preloader.h"
+
+#include <errno.h>
+
+const DWORD CImDiskProxy::bufferSize = 2*1024*1024;                   // 2Mb, max transfer per request
+
+CImDiskProxy::CImDiskProxy(CRamStore *store, const QString &objectName, QObject *parent) :
+    QThread(parent), _store(store), _preloader(nullptr), _objectName(objectName),
+    _section(NULL), _serverMutex(NULL), _requestEvent(NULL), _responseEvent(NULL), _stopEvent(NULL),
+    _view(NULL), _buffer(NULL)
+{
+    qDebug() << Q_FUNC_INFO;
+}
+
+CImDiskProxy::~CImDiskProxy()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    stop();
+    closeObjects();
+}
+
+bool CImDiskProxy::listen()
+{
+    qDebug() << Q_FUNC_INFO << _objectName;
+
+    // Names must match the \BaseNamedObjects\Global\ prefix used by ImDiskCliCreateDevice
+    QString name = QString("Global\\%1").arg(_objectName);
+
+    _section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_COMMIT,
+                                 0, IMDPROXY_HEADER_SIZE + bufferSize,
+                                 (LPCWSTR)name.utf16());
+    if (_section == NULL)
+    {
+        qDebug() << "CreateFileMapping failed:" << GetLastError();
+        closeObjects();
+        return false;
+    }
+
+    _view = (PUCHAR)MapViewOfFile(_section, FILE_MAP_WRITE, 0, 0, 0);
+    if (_view == NULL)
+    {
+        qDebug() << "MapViewOfFile failed:" << GetLastError();
+        closeObjects();
+        return false;
+    }
+    _buffer = _view + IMDPROXY_HEADER_SIZE;
+
+    // An abandoned mutex means the previous server crashed, the device is taken over
+    _serverMutex = CreateMutex(NULL, FALSE, (LPCWSTR)(name + "_Server").utf16());
+    DWORD wait = _serverMutex != NULL ? WaitForSingleObject(_serverMutex, 0) : WAIT_FAILED;
+    if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED)
+    {
+        qDebug() << "Proxy object already served:" << name;
+        closeObjects();
+        return false;
+    }
+
+    _requestEvent = CreateEvent(NULL, FALSE, FALSE, (LPCWSTR)(name + "_Request").utf16());
+    _responseEvent = CreateEvent(NULL, FALSE, FALSE, (LPCWSTR)(name + "_Response").utf16());
+    _stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (_requestEvent == NULL || _responseEvent == NULL || _stopEvent == NULL)
+    {
+        qDebug() << "CreateEvent failed:" << GetLastError();
+        closeObjects();
+        return false;
+    }
+
+    return true;
+}
+
+QString CImDiskProxy::name() const
+{
+    return _objectName;
+}
+
+void CImDiskProxy::stop()
+{
+    if (_stopEvent != NULL)
+        SetEvent(_stopEvent);
+
+    wait();
+}
+
+void CImDiskProxy::setPreloader(CPreloader *preloader)
+{
+    _preloader = preloader;
+}
+
+void CImDiskProxy::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    HANDLE objects[] = { _stopEvent, _requestEvent };
+
+    for (;;)
+    {
+        if (WaitForMultipleObjects(2, objects, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+            break;
+
+        // Our share of the driver round trip, from request signaled to response signaled
+        quint64 start = CLatency::now();
+        bool ok;
+
+        switch (((PIMDPROXY_READ_REQ)_view)->request_code)
+        {
+        case IMDPROXY_REQ_INFO:
+            ok = serveInfo();
+            break;
+
+        case IMDPROXY_REQ_READ:
+            ok = serveRead();
+            break;
+
+        case IMDPROXY_REQ_WRITE:
+            ok = serveWrite();
+            break;
+
+#ifdef IMDPROXY_FLAG_SUPPORTS_UNMAP
+        case IMDPROXY_REQ_UNMAP:
+            ok = serveRanges(false);
+            break;
+
+        case IMDPROXY_REQ_ZERO:
+            ok = serveRanges(true);
+            break;
+#endif
+
+        case IMDPROXY_REQ_CLOSE:
+            qDebug() << "Driver closed proxy connection";
+            return;
+
+        default:
+            qDebug() << "Unknown proxy request:" << ((PIMDPROXY_READ_REQ)_view)->request_code;
+            ok = false;
+        }
+
+        if (!ok)
+            break;
+
+        SetEvent(_responseEvent);
+        CLatency::record(CLatency::RoundTrip, CLatency::now() - start);
+    }
+}
+
+bool CImDiskProxy::serveInfo()
+{
+    IMDPROXY_INFO_RESP resp = { 0 };
+
+    resp.file_size = _store->size();
+    resp.req_alignment = _store->sectorSize();
+#ifdef IMDPROXY_FLAG_SUPPORTS_UNMAP
+    resp.flags = IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ZERO;
+#endif
+
+    memcpy(_view, &resp, sizeof(resp));
+    return true;
+}
+
+bool CImDiskProxy::serveRead()
+{
+    IMDPROXY_READ_REQ req = *(PIMDPROXY_READ_REQ)_view;
+    IMDPROXY_READ_RESP resp = { 0 };
+
+    quint64 start = CLatency::now();
+
+    // Seed data that failed to load is not served as zeros
+    if (req.length > bufferSize || (_preloader && !_preloader->fetch(req.offset, req.length)) ||
+        !_store->read(req.offset, _buffer, req.length))
+        resp.errorno = EIO;
+    else
+        resp.length = req.length;
+
+    CLatency::record(CLatency::Read, CLatency::now() - start);
+
+    CTracer::record(CTracer::ReadOp, req.offset, req.length);
+    CTelemetry::add(CTelemetry::Reads, 1);
+    CTelemetry::add(CTelemetry::BytesRead, resp.length);
+
+    if (CHeatmap *heatmap = _store->heatmap())
+        heatmap->record(req.offset, resp.length);
+
+    memcpy(_view, &resp, sizeof(resp));
+    return true;
+}
+
+bool CImDiskProxy::serveWrite()
+{
+    IMDPROXY_WRITE_REQ req = *(PIMDPROXY_WRITE_REQ)_view;
+    IMDPROXY_WRITE_RESP resp = { 0 };
+
+    quint64 start = CLatency::now();
+
+    if (req.length > bufferSize || (_preloader && !_preloader->fetch(req.offset, req.length)) ||
+        !_store->write(req.offset, _buffer, req.length))
+        resp.errorno = EIO;
+    else
+        resp.length = req.length;
+
+    CLatency::record(CLatency::Write, CLatency::now() - start);
+
+    CTracer::record(CTracer::WriteOp, req.offset, req.length);
+    CTelemetry::add(CTelemetry::Writes, 1);
+    CTelemetry::add(CTelemetry::BytesWritten, resp.length);
+
+    if (CHeatmap *heatmap = _store->heatmap())
+        heatmap->record(req.offset, resp.length);
+
+    memcpy(_view, &resp, sizeof(resp));
+    return true;
+}
+
+// UNMAP and ZERO carry a DEVICE_DATA_SET_RANGE array in the data buffer.
+// Both end up as discards, a discarded range reads back as zeros.
+bool CImDiskProxy::serveRanges(bool zero)
+{
+    Q_UNUSED(zero);
+
+#ifdef IMDPROXY_FLAG_SUPPORTS_UNMAP
+    IMDPROXY_UNMAP_REQ req = *(PIMDPROXY_UNMAP_REQ)_view;
+    IMDPROXY_UNMAP_RESP resp = { 0 };
+
+    quint64 start = CLatency::now();
+
+    if (req.length > bufferSize)
+        resp.errorno = EIO;
+    else
+    {
+        PDEVICE_DATA_SET_RANGE range = (PDEVICE_DATA_SET_RANGE)_buffer;
+        ULONGLONG count = req.length / sizeof(DEVICE_DATA_SET_RANGE);
+
+        for (ULONGLONG i = 0; i < count; ++i)
+        {
+            CTracer::record(CTracer::DiscardOp, range[i].StartingOffset, range[i].LengthInBytes);
+
+            if ((_preloader && !_preloader->fetch(range[i].StartingOffset, range[i].LengthInBytes)) ||
+                !_store->discard(range[i].StartingOffset, range[i].LengthInBytes))
+                resp.errorno = EIO;
+            else
+                CTelemetry::add(CTelemetry::BytesDiscarded, range[i].LengthInBytes);
+        }
+
+        CTelemetry::add(CTelemetry::Discards, 1);
+    }
+
+    CLatency::record(CLatency::Discard, CLatency::now() - start);
+
+    memcpy(_view, &resp, sizeof(resp));
+#endif
+    return true;
+}
+
+void CImDiskProxy::closeObjects()
+{
+    if (_view != NULL)
+        UnmapViewOfFile(_view);
+    if (_serverMutex != NULL)
+    {
+        ReleaseMutex(_serverMutex);
+        CloseHandle(_serverMutex);
+    }
+    if (_requestEvent != NULL)
+        CloseHandle(_requestEvent);
+    if (_responseEvent != NULL)
+        CloseHandle(_responseEvent);
+    if (_stopEvent != NULL)
+        CloseHandle(_stopEvent);
+    if (_section != NULL)
+        CloseHandle(_section);
+
+    _view = _buffer = NULL;
+    _section = _serverMutex = _requestEvent = _responseEvent = _stopEvent = NULL;
+}
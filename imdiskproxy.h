@@ -0,0 +1,60 @@
+#ifndef CIMDISKPROXY_H
+#define CIMDISKPROXY_H
+
+#include <QThread>
+#include <QString>
+#include <QDebug>
+
+#include <windows.h>
+#include <winioctl.h>
+
+// ImDisk includes
+#include <imdproxy.h>
+
+#include "ramstore.h"
+
+class CPreloader;
+
+// Serves a CRamStore to the ImDisk driver over the shared memory proxy
+// protocol (IMDISK_TYPE_PROXY | IMDISK_PROXY_TYPE_SHM).
+class CImDiskProxy : public QThread
+{
+    Q_OBJECT
+public:
+    CImDiskProxy(CRamStore *store, const QString &objectName, QObject *parent = 0);
+    ~CImDiskProxy();
+
+    // Creates the section and events, must succeed before the device is created
+    bool listen();
+    void stop();
+    // Requests wait for the seed data they touch, set before start()
+    void setPreloader(CPreloader *preloader);
+
+    QString name() const;
+
+    static const DWORD bufferSize;
+
+protected:
+    void run() override;
+
+private:
+    bool serveInfo();
+    bool serveRead();
+    bool serveWrite();
+    bool serveRanges(bool zero);
+    void closeObjects();
+
+    CRamStore *_store;
+    CPreloader *_preloader;
+    QString _objectName;
+
+    HANDLE _section;
+    HANDLE _serverMutex;
+    HANDLE _requestEvent;
+    HANDLE _responseEvent;
+    HANDLE _stopEvent;
+    PUCHAR _view;
+    PUCHAR _buffer;
+};
+
+#endif // CIMDISKPROXY_H
@@ -0,0 +1,140 @@
+#include "imdiskrequest.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+static const size_t arenaGranularity = 4096;                       // bytes the arena grows by at least
+
+CRequestArena::CRequestArena() :
+    _block(nullptr), _capacity(0), _used(0), _requested(0), _overflow(nullptr)
+{
+}
+
+CRequestArena::~CRequestArena()
+{
+    reset();
+    free(_block);
+}
+
+void CRequestArena::reset()
+{
+    bool overflowed = _overflow != nullptr;
+
+    while(_overflow)
+    {
+        Overflow *next = _overflow->next;
+        free(_overflow);
+        _overflow = next;
+    }
+
+    // One block that fits the whole last request, the next one alike stays in it
+    if(overflowed)
+    {
+        free(_block);
+        _capacity = (_requested + arenaGranularity - 1) & ~(arenaGranularity - 1);
+        _block = static_cast<char *>(malloc(_capacity));
+        if(!_block)
+            _capacity = 0;
+    }
+
+    _used = 0;
+    _requested = 0;
+}
+
+void *CRequestArena::alloc(size_t bytes)
+{
+    bytes = (bytes + 7) & ~size_t(7);
+    _requested += bytes;
+
+    if(_capacity - _used >= bytes)
+    {
+        void *block = _block + _used;
+        _used += bytes;
+        return block;
+    }
+
+    Overflow *overflow = static_cast<Overflow *>(malloc(sizeof(Overflow) + bytes));
+    if(!overflow)
+        return nullptr;
+
+    overflow->next = _overflow;
+    overflow->size = bytes;
+    _overflow = overflow;
+    return overflow + 1;
+}
+
+CRequestString::CRequestString(CRequestArena &arena) :
+    _arena(arena), _data(_inline), _length(0), _capacity(MAX_PATH)
+{
+    _inline[0] = 0;
+}
+
+bool CRequestString::reserve(size_t length)
+{
+    if(length < _capacity)
+        return true;
+
+    size_t capacity = qMax(length + 1, _capacity * 2);
+    LPWSTR data = static_cast<LPWSTR>(_arena.alloc(capacity * sizeof(WCHAR)));
+    if(!data)
+        return false;
+
+    // The old block stays in the arena until the request ends
+    memcpy(data, _data, (_length + 1) * sizeof(WCHAR));
+    _data = data;
+    _capacity = capacity;
+    return true;
+}
+
+bool CRequestString::append(LPCWSTR text)
+{
+    return append(text, wcslen(text));
+}
+
+bool CRequestString::append(LPCWSTR text, size_t length)
+{
+    if(!reserve(_length + length))
+        return false;
+
+    memcpy(_data + _length, text, length * sizeof(WCHAR));
+    _length += length;
+    _data[_length] = 0;
+    return true;
+}
+
+CCreateRequest::CCreateRequest(CRequestArena &arena) :
+    _arena(arena), _data(&_inline.header), _capacity(sizeof(_inline))
+{
+    memset(&_inline, 0, sizeof(_inline));
+}
+
+DWORD CCreateRequest::size() const
+{
+    return DWORD(sizeof(IMDISK_CREATE_DATA) + _data->FileNameLength);
+}
+
+bool CCreateRequest::appendFileName(LPCWSTR text, size_t length)
+{
+    // FileNameLength counts bytes in a USHORT
+    size_t nameSize = _data->FileNameLength + length * sizeof(WCHAR);
+    if(nameSize > 0xFFFF)
+        return false;
+
+    if(sizeof(IMDISK_CREATE_DATA) + nameSize > _capacity)
+    {
+        size_t capacity = qMax(sizeof(IMDISK_CREATE_DATA) + nameSize, _capacity * 2);
+        PIMDISK_CREATE_DATA data = static_cast<PIMDISK_CREATE_DATA>(_arena.alloc(capacity));
+        if(!data)
+            return false;
+
+        memset(data, 0, capacity);
+        memcpy(data, _data, size());
+        _data = data;
+        _capacity = capacity;
+    }
+
+    memcpy(reinterpret_cast<char *>(_data->FileName) + _data->FileNameLength, text, length * sizeof(WCHAR));
+    _data->FileNameLength = USHORT(nameSize);
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef CIMDISKREQUEST_H
+#define CIMDISKREQUEST_H
+
+#include <QtGlobal>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+
+// ImDisk includes
+#include <ntumapi.h>
+#include <imdisk.h>
+#else
+// The allocation test builds the request builders on Linux
+#include "imdiskcompat.h"
+#endif
+
+// Scratch memory of one create, remove or format request.
+// Builders keep their data in fixed inline buffers and only take blocks from
+// the arena when it does not fit. reset() at the start of each request drops
+// all blocks at once; when the last request needed more than the arena held,
+// it is grown to that size there, so a steady stream of similar requests
+// takes nothing from the heap.
+class CRequestArena
+{
+public:
+    CRequestArena();
+    ~CRequestArena();
+
+    void reset();
+    // 8 byte aligned, nullptr when the heap is exhausted
+    void *alloc(size_t bytes);
+
+private:
+    Q_DISABLE_COPY(CRequestArena)
+
+    // Taken while the block was too small, freed on reset
+    struct Overflow
+    {
+        Overflow *next;
+        size_t size;
+    };
+
+    char *_block;
+    size_t _capacity;
+    size_t _used;
+    size_t _requested;                  // by this request, the size reset() grows to
+    Overflow *_overflow;
+};
+
+// Zero terminated wide string, MAX_PATH characters inline
+class CRequestString
+{
+public:
+    explicit CRequestString(CRequestArena &arena);
+
+    // Room for length characters and the terminator, false when out of memory
+    bool reserve(size_t length);
+    bool append(LPCWSTR text);
+    bool append(LPCWSTR text, size_t length);
+
+    LPWSTR data() { return _data; }
+    size_t length() const { return _length; }
+    // Characters that fit, without the terminator
+    size_t capacity() const { return _capacity - 1; }
+
+private:
+    Q_DISABLE_COPY(CRequestString)
+
+    CRequestArena &_arena;
+    LPWSTR _data;
+    size_t _length;
+    size_t _capacity;
+    WCHAR _inline[MAX_PATH];
+};
+
+// IMDISK_CREATE_DATA followed by its file name, zeroed on construction.
+// The inline buffer holds the longest name a device query returns.
+class CCreateRequest
+{
+public:
+    explicit CCreateRequest(CRequestArena &arena);
+
+    // Appends to FileName and FileNameLength, false when out of memory or past 32k characters
+    bool appendFileName(LPCWSTR text, size_t length);
+
+    PIMDISK_CREATE_DATA data() { return _data; }
+    // Header and file name, the size of a create request
+    DWORD size() const;
+    // Header and room for a file name, the size of a query reply
+    DWORD capacity() const { return DWORD(_capacity); }
+
+private:
+    Q_DISABLE_COPY(CCreateRequest)
+
+    CRequestArena &_arena;
+    PIMDISK_CREATE_DATA _data;
+    size_t _capacity;
+    union
+    {
+        IMDISK_CREATE_DATA header;
+        char bytes[sizeof(IMDISK_CREATE_DATA) + (MAX_PATH << 2)];
+    } _inline;
+};
+
+#endif // CIMDISKREQUEST_H
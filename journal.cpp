@@ -0,0 +1,550 @@
+#include "journal.h"
+#include "ramstore.h"
+#include "latency.h"
+#include "blockkernels.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+const quint64 CJournal::maxPending = 64ull*1024*1024;                // 64Mb, writers wait above this
+const quint64 CJournal::checkpointThreshold = 1024ull*1024*1024;     // 1Gb of records per checkpoint
+
+static const quint32 recordMagic = 0x324e524a;                       // "JRN2", block kernel hash
+static const quint32 legacyRecordMagic = 0x4c4e524a;                 // "JRNL", FNV-1a hash
+static const quint32 checkpointMagic = 0x54504b43;                   // "CKPT"
+
+static const char stagedSuffix[] = ".staged";
+static const char promoteSuffix[] = ".promote";                      // present while staged segments are renamed
+
+// Leads the checkpoint file, followed by (page index, page data) pairs
+struct CheckpointHeader
+{
+    quint32 magic;
+    quint32 reserved;
+    quint64 size;
+    quint64 pageSize;
+    quint64 sequence;
+};
+
+CJournal::CJournal(const QString &path, int commitInterval, QObject *parent) :
+    QThread(parent), _path(path), _commitInterval(commitInterval), _store(nullptr),
+    _segmentNumber(0), _segmentBytes(0), _sequence(0), _committedSequence(0), _stopping(false), _snapshotting(false),
+    _staged(false), _promote(false), _promoted(false)
+{
+    qDebug() << Q_FUNC_INFO << path << commitInterval;
+}
+
+CJournal::~CJournal()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    close();
+}
+
+quint64 CJournal::sequence() const
+{
+    return _sequence;
+}
+
+quint64 CJournal::committedSequence() const
+{
+    return _committedSequence.load();
+}
+
+QStringList CJournal::segments(bool staged) const
+{
+    QFileInfo info(_path);
+    QString pattern = info.fileName() + ".*.seg" + (staged ? stagedSuffix : "");
+    QStringList names = info.dir().entryList(QStringList() << pattern,
+                                             QDir::Files, QDir::Name);
+
+    for(int i = 0; i < names.size(); ++i)
+        names[i] = info.dir().filePath(names[i]);
+
+    return names;
+}
+
+quint64 CJournal::segmentNumber(const QString &fileName)
+{
+    QString suffix = QFileInfo(fileName).completeSuffix();
+    if(suffix.endsWith(stagedSuffix))
+        suffix.chop(int(sizeof(stagedSuffix)) - 1);
+
+    return suffix.section('.', -2, -2).toULongLong();
+}
+
+// Staged segments of a mount that never got its device are dropped, an
+// interrupted promotion is completed
+void CJournal::recover()
+{
+    QFile marker(_path + promoteSuffix);
+    bool promoting = marker.exists();
+
+    QStringList names = segments(true);
+    for(int i = 0; i < names.size(); ++i)
+    {
+        QString name = names[i];
+        name.chop(int(sizeof(stagedSuffix)) - 1);
+
+        if(!promoting)
+            QFile::remove(names[i]);
+        else if(!QFile::rename(names[i], name))
+            return;
+    }
+
+    marker.remove();
+}
+
+bool CJournal::replay(CRamStore *store)
+{
+    qDebug() << Q_FUNC_INFO;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if(!load(store))
+        return false;
+
+    qDebug() << "Journal replayed up to" << _sequence << "in" << timer.elapsed() << "ms";
+    return true;
+}
+
+// Without a store only the sequence and segment numbers are recovered
+bool CJournal::load(CRamStore *store)
+{
+    recover();
+
+    quint64 after = 0;
+    QFile file(_path + ".ckpt");
+
+    if(file.open(QIODevice::ReadOnly))
+    {
+        CheckpointHeader header;
+
+        // A disk resized while mounted comes back with its last size, if the store can hold it
+        if(file.read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header) ||
+           header.magic != checkpointMagic || header.pageSize != CRamStore::pageSize ||
+           (store && header.size != store->size() && !store->resize(header.size, true)))
+        {
+            qDebug() << "Checkpoint does not match the store, ignored";
+            return false;
+        }
+
+        QByteArray page(int(CRamStore::pageSize), Qt::Uninitialized);
+        quint64 index;
+
+        while(store && file.read(reinterpret_cast<char *>(&index), sizeof(index)) == sizeof(index))
+        {
+            if(file.read(page.data(), page.size()) != page.size())
+                break;
+
+            store->write(index * CRamStore::pageSize, page.constData(), CRamStore::pageSize);
+        }
+
+        after = header.sequence;
+    }
+
+    _sequence = after;
+
+    // A torn tail is cut off before new segments follow it, so the next replay
+    // goes on past it into them
+    QStringList names = segments();
+    for(int i = 0; i < names.size(); ++i)
+    {
+        qint64 good;
+        if(!replaySegment(names[i], store, after, &good) && (good < 0 || !truncateSegment(names[i], good)))
+        {
+            qDebug() << "Cannot cut the torn tail of" << names[i];
+            return false;
+        }
+    }
+
+    if(!names.isEmpty())
+        _segmentNumber = segmentNumber(names.last());
+
+    return true;
+}
+
+// Stops at the first torn or corrupt record, everything after it was never
+// committed; good is the size of the records before it, -1 when the segment
+// cannot be read. Without a store the
+// records are still read and hashed, a torn one takes no sequence number.
+bool CJournal::replaySegment(const QString &fileName, CRamStore *store, quint64 after, qint64 *good)
+{
+    *good = -1;
+
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+    *good = 0;
+
+    QByteArray data;
+    RecordHeader header;
+
+    while(file.read(reinterpret_cast<char *>(&header), sizeof(header)) == sizeof(header))
+    {
+        if(header.magic != recordMagic && header.magic != legacyRecordMagic)
+            return false;
+
+        if(header.type == WriteRecord)
+        {
+            if(header.length > maxPending)
+                return false;
+
+            data.resize(int(header.length));
+            if(file.read(data.data(), data.size()) != data.size())
+                return false;
+        }
+        else
+            data.clear();
+
+        if(recordHash(header, data.constData(), quint64(data.size())) != header.hash)
+            return false;
+
+        if(store && header.sequence > after)
+        {
+            if(header.type == WriteRecord)
+                store->write(header.offset, data.constData(), header.length);
+            else if(header.type == ResizeRecord)
+                store->resize(header.offset, true);
+            else
+                store->discard(header.offset, header.length);
+        }
+
+        _sequence = qMax(_sequence, header.sequence);
+        *good = file.pos();
+    }
+
+    // A partial header at the end
+    return file.pos() == file.size();
+}
+
+bool CJournal::truncateSegment(const QString &fileName, qint64 size)
+{
+    QFile file(fileName);
+    return file.open(QIODevice::ReadWrite) && file.resize(size) && syncFile(file);
+}
+
+bool CJournal::open(CRamStore *store, bool staged)
+{
+    qDebug() << Q_FUNC_INFO << staged;
+
+    QDir().mkpath(QFileInfo(_path).absolutePath());
+
+    _store = store;
+    _stopping = false;
+    _staged = staged;
+    _promote = false;
+
+    // Not replayed, e.g. reattached store: continue after the existing records
+    if(_segmentNumber == 0 && !load(nullptr))
+        return false;
+    _committedSequence.store(_sequence);
+
+    if(!openSegment())
+        return false;
+
+    start();
+    return true;
+}
+
+void CJournal::close()
+{
+    if(!isRunning())
+        return;
+
+    {
+        QMutexLocker locker(&_mutex);
+        _stopping = true;
+        _pendingChanged.wakeAll();
+    }
+
+    wait();
+    _segment.close();
+}
+
+bool CJournal::openSegment()
+{
+    _segment.close();
+    _segment.setFileName(QString("%1.%2.seg%3").arg(_path).arg(++_segmentNumber, 8, 10, QChar('0'))
+                         .arg(_staged ? stagedSuffix : ""));
+    _segmentBytes = 0;
+
+    if(!_segment.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        qDebug() << "Cannot open journal segment" << _segment.fileName();
+        return false;
+    }
+
+    return true;
+}
+
+bool CJournal::promote()
+{
+    QMutexLocker locker(&_mutex);
+    _promote = true;
+    _pendingChanged.wakeAll();
+
+    while(_promote)
+        _committed.wait(&_mutex);
+
+    return _promoted;
+}
+
+// After the commit that holds the last staged record. The marker makes the
+// renames all or nothing across a crash, recover() completes them.
+bool CJournal::promoteSegments()
+{
+    QFile marker(_path + promoteSuffix);
+    if(!marker.open(QIODevice::WriteOnly) || !syncFile(marker))
+        return false;
+    marker.close();
+
+    _segment.close();
+
+    QStringList names = segments(true);
+    bool ok = true;
+
+    for(int i = 0; i < names.size() && ok; ++i)
+    {
+        QString name = names[i];
+        name.chop(int(sizeof(stagedSuffix)) - 1);
+        ok = QFile::rename(names[i], name);
+    }
+
+    if(ok)
+    {
+        _staged = false;
+        marker.remove();
+    }
+
+    return openSegment() && ok;
+}
+
+void CJournal::append(quint64 offset, const void *data, quint64 length)
+{
+    appendRecord(WriteRecord, offset, data, length);
+}
+
+void CJournal::appendDiscard(quint64 offset, quint64 length)
+{
+    appendRecord(DiscardRecord, offset, nullptr, length);
+}
+
+// The new size travels in the offset field
+void CJournal::appendResize(quint64 size)
+{
+    appendRecord(ResizeRecord, size, nullptr, 0);
+}
+
+void CJournal::appendRecord(quint32 type, quint64 offset, const void *data, quint64 length)
+{
+    quint64 dataLength = type == WriteRecord ? length : 0;
+
+    QMutexLocker locker(&_mutex);
+
+    while(quint64(_pending.size()) > maxPending && !_stopping && !_snapshotting)
+        _committed.wait(&_mutex);
+
+    RecordHeader header;
+    header.magic = recordMagic;
+    header.type = type;
+    header.sequence = ++_sequence;
+    header.offset = offset;
+    header.length = length;
+    header.hash = recordHash(header, data, dataLength);
+
+    _pending.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    if(dataLength)
+        _pending.append(static_cast<const char *>(data), int(dataLength));
+}
+
+void CJournal::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    QByteArray batch;
+
+    for(;;)
+    {
+        bool stopping;
+        bool promote;
+        quint64 sequence;
+
+        {
+            QMutexLocker locker(&_mutex);
+
+            if(!_stopping && !_promote)
+                _pendingChanged.wait(&_mutex, ulong(_commitInterval));
+
+            // Swap buffers, writers keep appending while the batch is written
+            batch.swap(_pending);
+            sequence = _sequence;
+            stopping = _stopping;
+            promote = _promote;
+            _committed.wakeAll();
+        }
+
+        if(commit(batch))
+            _committedSequence.store(sequence);
+        else
+            qDebug() << "Journal commit failed";
+
+        // The batch held the last staged record
+        if(promote)
+        {
+            bool promoted = !_staged || promoteSegments();
+            if(!promoted)
+                qDebug() << "Journal promotion failed";
+
+            QMutexLocker locker(&_mutex);
+            _promoted = promoted;
+            _promote = false;
+            _committed.wakeAll();
+        }
+
+        // A staged generation is not checkpointed, the checkpoint belongs to the old one
+        if(!_staged && (stopping || _segmentBytes > checkpointThreshold))
+            checkpoint();
+
+        if(stopping)
+            break;
+    }
+}
+
+// One write and one fsync for everything appended since the last commit
+bool CJournal::commit(QByteArray &batch)
+{
+    if(batch.isEmpty())
+        return true;
+
+    quint64 start = CLatency::now();
+    bool ok = _segment.write(batch) == batch.size() && _segment.flush() && syncFile(_segment);
+    CLatency::record(CLatency::Flush, CLatency::now() - start);
+
+    _segmentBytes += quint64(batch.size());
+    batch.clear();
+    return ok;
+}
+
+bool CJournal::checkpoint()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Records from here on go to a fresh segment, older segments are covered by the snapshot
+    quint64 lastCovered = _segmentNumber;
+    if(!openSegment())
+        return false;
+
+    // Writers blocked on a full buffer hold the store lock the snapshot needs
+    {
+        QMutexLocker locker(&_mutex);
+        _snapshotting = true;
+        _committed.wakeAll();
+    }
+
+    quint64 sequence = 0;
+    CRamStore *frozen = _store->snapshot(&sequence);
+
+    {
+        QMutexLocker locker(&_mutex);
+        _snapshotting = false;
+    }
+
+    QSaveFile file(_path + ".ckpt");
+    if(!file.open(QIODevice::WriteOnly))
+    {
+        delete frozen;
+        return false;
+    }
+
+    CheckpointHeader header = { checkpointMagic, 0, frozen->size(), CRamStore::pageSize, sequence };
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    QByteArray page(int(CRamStore::pageSize), Qt::Uninitialized);
+    QByteArray batch;
+    QElapsedTimer sinceCommit;
+    sinceCommit.start();
+
+    for(quint64 index = 0; index < frozen->pageCount(); ++index)
+    {
+        if(!frozen->isPageCommitted(index))
+            continue;
+
+        frozen->read(index * CRamStore::pageSize, page.data(), CRamStore::pageSize);
+        file.write(reinterpret_cast<const char *>(&index), sizeof(index));
+        file.write(page);
+
+        // Keep group commits going while a large checkpoint is written
+        if(sinceCommit.elapsed() >= _commitInterval)
+        {
+            {
+                QMutexLocker locker(&_mutex);
+                batch.swap(_pending);
+                _committed.wakeAll();
+            }
+            commit(batch);
+            sinceCommit.restart();
+        }
+    }
+
+    delete frozen;
+
+    if(!file.commit())
+    {
+        qDebug() << "Checkpoint write failed";
+        return false;
+    }
+
+    QStringList names = segments();
+    for(int i = 0; i < names.size(); ++i)
+        if(segmentNumber(names[i]) <= lastCovered)
+            QFile::remove(names[i]);
+
+    qDebug() << "Checkpoint at" << sequence << "took" << timer.elapsed() << "ms";
+    return true;
+}
+
+// Over the header fields and the payload. Segments written before the
+// block kernels used FNV-1a, a byte at a time, and are still replayed.
+quint64 CJournal::recordHash(const RecordHeader &header, const void *data, quint64 length)
+{
+    const quint64 fields[] = { header.type, header.sequence, header.offset, header.length };
+
+    if(header.magic != legacyRecordMagic)
+        return CBlockKernels::hash(data, size_t(length), CBlockKernels::hash(fields, sizeof(fields)));
+
+    quint64 hash = 14695981039346656037ull;
+
+    const quint8 *p = reinterpret_cast<const quint8 *>(fields);
+    for(size_t i = 0; i < sizeof(fields); ++i)
+        hash = (hash ^ p[i]) * 1099511628211ull;
+
+    p = static_cast<const quint8 *>(data);
+    for(quint64 i = 0; i < length; ++i)
+        hash = (hash ^ p[i]) * 1099511628211ull;
+
+    return hash;
+}
+
+bool CJournal::syncFile(QFile &file)
+{
+#ifdef Q_OS_WIN
+    return FlushFileBuffers(HANDLE(_get_osfhandle(file.handle()))) != FALSE;
+#else
+    return fdatasync(file.handle()) == 0;
+#endif
+}
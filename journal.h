@@ -0,0 +1,107 @@
+#ifndef CJOURNAL_H
+#define CJOURNAL_H
+
+#include <QThread>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInteger>
+
+class CRamStore;
+
+// Write-ahead journal for durable RAM disks.
+// Store writes are appended to a memory buffer and committed to the current
+// segment file by a background thread, one fsync per commit interval (group
+// commit). A checkpoint saves the committed pages of a store snapshot and
+// drops the segments it covers. replay() rebuilds a store from both.
+// A staged journal writes a new generation into .seg.staged segments that
+// replay() ignores until promote() renames them, so the old generation stays
+// in effect until then.
+class CJournal : public QThread
+{
+    Q_OBJECT
+public:
+    CJournal(const QString &path, int commitInterval, QObject *parent = 0);
+    ~CJournal();
+
+    // Loads the last checkpoint and all newer records into an empty store
+    bool replay(CRamStore *store);
+
+    // Starts a new segment and the commit thread, the store's writes are recorded from now on
+    bool open(CRamStore *store, bool staged = false);
+    // The staged records become part of the journal, done by the commit thread
+    bool promote();
+    // Commits what is pending, writes a final checkpoint and stops the thread
+    void close();
+
+    // Called by the store under its write lock, so sequence order is store order
+    void append(quint64 offset, const void *data, quint64 length);
+    void appendDiscard(quint64 offset, quint64 length);
+    void appendResize(quint64 size);
+    quint64 sequence() const;
+    // Last record known to be on disk
+    quint64 committedSequence() const;
+
+    static const quint64 maxPending;
+    static const quint64 checkpointThreshold;
+
+protected:
+    void run() override;
+
+private:
+    enum RecordType
+    {
+        WriteRecord = 1,
+        DiscardRecord = 2,
+        ResizeRecord = 3
+    };
+
+    struct RecordHeader
+    {
+        quint32 magic;
+        quint32 type;
+        quint64 sequence;
+        quint64 offset;
+        quint64 length;
+        quint64 hash;
+    };
+
+    void appendRecord(quint32 type, quint64 offset, const void *data, quint64 length);
+    bool commit(QByteArray &batch);
+    bool checkpoint();
+    bool openSegment();
+    bool promoteSegments();
+    void recover();
+    bool load(CRamStore *store);
+    bool replaySegment(const QString &fileName, CRamStore *store, quint64 after, qint64 *good);
+    static bool truncateSegment(const QString &fileName, qint64 size);
+    QStringList segments(bool staged = false) const;
+    static quint64 segmentNumber(const QString &fileName);
+    static quint64 recordHash(const RecordHeader &header, const void *data, quint64 length);
+    static bool syncFile(QFile &file);
+
+    QString _path;
+    int _commitInterval;
+    CRamStore *_store;
+
+    QFile _segment;
+    quint64 _segmentNumber;
+    quint64 _segmentBytes;
+    quint64 _sequence;
+    QAtomicInteger<quint64> _committedSequence;
+
+    QByteArray _pending;
+    QMutex _mutex;
+    QWaitCondition _pendingChanged;
+    QWaitCondition _committed;
+    bool _stopping;
+    bool _snapshotting;
+    bool _staged;
+    bool _promote;
+    bool _promoted;
+};
+
+#endif // CJOURNAL_H
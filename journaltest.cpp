@@ -0,0 +1,178 @@
+#include "journal.h"
+#include "ramstore.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QThread>
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Power loss twice in a row against CJournal, as mount and unmount use it.
+// A child writes pages through a journaled store, waits until they are
+// committed and is killed, so no checkpoint is written. The parent then
+// tears the last record of the segment, a second child replays the journal,
+// writes more pages into a new segment and is killed as well. A final replay
+// must hold the pages of both children, except the torn one.
+// fork and SIGKILL, so Linux only.
+
+static const quint64 diskSize = 64ull << 20;                        // 1024 pages
+static const int pagesPerRun = 32;
+static const int commitInterval = 10;                               // ms
+static const qint64 tearBytes = 100;                                // cut off the last record
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-journaltest [<directory>]\n");
+}
+
+static void fillPage(quint64 *words, quint64 page, quint64 run)
+{
+    for(quint64 i = 0; i < CRamStore::pageSize / sizeof(quint64); ++i)
+        words[i] = (page << 32) ^ (run << 16) ^ i ^ 1;
+}
+
+// Replays, writes pagesPerRun pages from first on, waits for the commit, signals ready
+static void writer(const QString &path, quint64 first, quint64 run, int ready)
+{
+    CRamStore store(diskSize);
+    CJournal *journal = new CJournal(path, commitInterval);
+
+    journal->replay(&store);
+    if(!journal->open(&store))
+        _exit(1);
+    store.setJournal(journal);
+
+    QVector<quint64> words(int(CRamStore::pageSize / sizeof(quint64)));
+
+    for(quint64 page = first; page < first + pagesPerRun; ++page)
+    {
+        fillPage(words.data(), page, run);
+        if(!store.write(page * CRamStore::pageSize, words.data(), CRamStore::pageSize))
+            _exit(1);
+    }
+
+    while(journal->committedSequence() < journal->sequence())
+        QThread::usleep(1000);
+
+    if(write(ready, "", 1) != 1)
+        _exit(1);
+
+    // Killed here, the journal is never closed
+    for(;;)
+        pause();
+}
+
+static bool crash(const QString &path, quint64 first, quint64 run)
+{
+    int ready[2];
+    if(pipe(ready) != 0)
+        return false;
+
+    pid_t child = fork();
+    if(child < 0)
+        return false;
+    if(child == 0)
+    {
+        close(ready[0]);
+        writer(path, first, run, ready[1]);
+    }
+    close(ready[1]);
+
+    char byte;
+    bool committed = read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    return committed;
+}
+
+static QStringList segments(const QString &path)
+{
+    QFileInfo info(path);
+    QStringList names = info.dir().entryList(QStringList() << info.fileName() + ".*.seg", QDir::Files, QDir::Name);
+
+    for(int i = 0; i < names.size(); ++i)
+        names[i] = info.dir().filePath(names[i]);
+    return names;
+}
+
+static void removeJournal(const QString &path)
+{
+    QFileInfo info(path);
+    QStringList names = info.dir().entryList(QStringList() << info.fileName() + ".*", QDir::Files);
+
+    for(int i = 0; i < names.size(); ++i)
+        QFile::remove(info.dir().filePath(names[i]));
+}
+
+static bool check(CRamStore &store, quint64 page, quint64 run, bool present)
+{
+    QVector<quint64> words(int(CRamStore::pageSize / sizeof(quint64)));
+    QVector<quint64> expected(words.size(), 0);
+
+    if(present)
+        fillPage(expected.data(), page, run);
+
+    bool ok = store.read(page * CRamStore::pageSize, words.data(), CRamStore::pageSize) &&
+              memcmp(words.data(), expected.data(), CRamStore::pageSize) == 0;
+    if(!ok)
+        printf("page %llu of run %llu %s\n", page, run, present ? "lost" : "not torn off");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    if(args.size() > 2)
+    {
+        usage();
+        return 1;
+    }
+
+    QString directory = args.size() == 2 ? args[1] : QDir::tempPath();
+    QString path = QString("%1/qt-imdisk-journaltest-%2.journal").arg(directory).arg(a.applicationPid());
+    removeJournal(path);
+
+    bool ok = crash(path, 0, 1);
+
+    // Power lost in the middle of the last record
+    QStringList names = segments(path);
+    if(ok && !names.isEmpty())
+    {
+        QFile segment(names.last());
+        ok = segment.open(QIODevice::ReadWrite) && segment.size() > tearBytes && segment.resize(segment.size() - tearBytes);
+    }
+    else
+        ok = false;
+
+    ok = ok && crash(path, pagesPerRun, 2);
+
+    if(ok)
+    {
+        CRamStore store(diskSize);
+        CJournal journal(path, commitInterval);
+        ok = journal.replay(&store);
+
+        for(quint64 page = 0; ok && page < pagesPerRun; ++page)
+            ok = check(store, page, 1, page + 1 < pagesPerRun);
+        for(quint64 page = pagesPerRun; ok && page < 2 * pagesPerRun; ++page)
+            ok = check(store, page, 2, true);
+
+        printf("%d segments, replayed up to record %llu\n", segments(path).size(), journal.sequence());
+    }
+
+    removeJournal(path);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
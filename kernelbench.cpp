@@ -0,0 +1,325 @@
+#include "blockkernels.h"
+#include "latency.h"
+#include "ramstore.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+
+#include <stdio.h>
+#include <string.h>
+
+// Microbenchmarks of the block kernels at every level the CPU supports,
+// on page and sector sized blocks. Before timing, every level is checked to
+// agree with the scalar kernels on the same inputs. Then store requests are
+// timed with each sector geometry, specialized and through the generic path,
+// and batches of 4Kb segments one call per segment against one readv/writev.
+
+static const int pageBytes = 64*1024;
+static const int sectorBytes = 4*1024;
+static const int spanBytes = 64*1024*1024;                          // copy targets, larger than the caches
+static const quint64 bytesPerRun = 1024ull*1024*1024;
+
+static const quint64 storeBytes = 8ull*1024*1024;                    // cache resident, so the split math shows
+static const int storeRequests = 1 << 20;
+static const int vectoredSegments = 1 << 18;                        // 4Kb segments per readv/writev timing
+static const int maxBatch = 128;
+
+static volatile quint64 sink;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-kernelbench [--level scalar|sse2|avx2|avx512]\n");
+}
+
+static void fillRandom(QByteArray &buffer, quint64 seed)
+{
+    for(int i = 0; i < buffer.size(); ++i)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        buffer[i] = char(seed >> 56);
+    }
+}
+
+// Same answers as the scalar kernels, for lengths around every vector width and stripe
+static bool verify(CBlockKernels::Level level)
+{
+    QByteArray data(pageBytes + 308, Qt::Uninitialized);
+    fillRandom(data, 1);
+
+    QByteArray zeros(pageBytes + 300, char(0));
+
+    QVector<int> lengths;
+    for(int length = 0; length <= 300; ++length)
+        lengths.append(length);
+    lengths << 1023 << 1024 << 1025 << sectorBytes << pageBytes - 1 << pageBytes << pageBytes + 300;
+
+    for(int i = 0; i < lengths.size(); ++i)
+    {
+        int length = lengths[i];
+        const char *block = data.constData() + (i & 7);
+
+        CBlockKernels::setLevel(CBlockKernels::Scalar);
+        quint64 expected = CBlockKernels::hash(block, size_t(length), quint64(i));
+
+        CBlockKernels::setLevel(level);
+        if(CBlockKernels::hash(block, size_t(length), quint64(i)) != expected)
+            return false;
+
+        if(!CBlockKernels::isZero(zeros.constData(), size_t(length)))
+            return false;
+
+        // One non-zero byte anywhere must be found
+        if(length)
+        {
+            zeros[length - 1] = 1;
+            bool found = !CBlockKernels::isZero(zeros.constData(), size_t(length));
+            zeros[length - 1] = 0;
+            if(!found)
+                return false;
+        }
+
+        QByteArray copy(length + 64, char(0));
+        CBlockKernels::copy(copy.data() + (i & 63), data.constData(), size_t(length));
+        if(memcmp(copy.constData() + (i & 63), data.constData(), size_t(length)) != 0)
+            return false;
+    }
+
+    // Streaming copies of spans that start unaligned
+    QByteArray span(4 * pageBytes, Qt::Uninitialized);
+    fillRandom(span, 2);
+    QByteArray target(4 * pageBytes + 64, char(0));
+    CBlockKernels::copy(target.data() + 3, span.constData(), size_t(span.size()));
+
+    return memcmp(target.constData() + 3, span.constData(), size_t(span.size())) == 0;
+}
+
+template<typename Kernel>
+static double gigabytesPerSecond(int blockBytes, Kernel kernel)
+{
+    quint64 blocks = bytesPerRun / quint64(blockBytes);
+
+    quint64 start = CLatency::now();
+    for(quint64 i = 0; i < blocks; ++i)
+        kernel(i);
+    double seconds = (CLatency::now() - start) / 1e9;
+
+    return seconds > 0 ? bytesPerRun / 1e9 / seconds : 0.0;
+}
+
+// Nanoseconds per request for random aligned writes, then reads, of a filled store
+static void timeStore(CRamStore &store, const QVector<quint64> &offsets, QByteArray &buffer, double *write, double *read)
+{
+    quint64 start = CLatency::now();
+    for(int i = 0; i < offsets.size(); ++i)
+        store.write(offsets[i], buffer.constData(), quint64(buffer.size()));
+    *write = double(CLatency::now() - start) / offsets.size();
+
+    start = CLatency::now();
+    for(int i = 0; i < offsets.size(); ++i)
+        store.read(offsets[i], buffer.data(), quint64(buffer.size()));
+    *read = double(CLatency::now() - start) / offsets.size();
+}
+
+static void benchStore()
+{
+    CRamStore store(storeBytes);
+
+    QByteArray page(int(CRamStore::pageSize), Qt::Uninitialized);
+    fillRandom(page, 4);
+    for(quint64 offset = 0; offset < storeBytes; offset += CRamStore::pageSize)
+        store.write(offset, page.constData(), CRamStore::pageSize);
+
+    const quint32 sectors[] = { 512, 4096, quint32(CRamStore::pageSize) };
+
+    printf("\n%-8s %8s %16s %16s %16s %16s\n", "sector", "request", "generic write", "write", "generic read", "read");
+
+    for(int i = 0; i < 3; ++i)
+    {
+        // Requests of a cluster at least, as NTFS issues them
+        int request = int(qMax<quint32>(sectors[i], 4096));
+        QByteArray buffer(request, Qt::Uninitialized);
+        fillRandom(buffer, 5);
+
+        QVector<quint64> offsets;
+        quint64 seed = 6;
+        for(int j = 0; j < storeRequests; ++j)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            offsets.append((seed >> 16) % (storeBytes / quint64(request)) * quint64(request));
+        }
+
+        double genericWrite, genericRead, write, read;
+
+        store.setSectorSize(sectors[i], false);
+        timeStore(store, offsets, buffer, &genericWrite, &genericRead);
+
+        store.setSectorSize(sectors[i]);
+        timeStore(store, offsets, buffer, &write, &read);
+
+        printf("%-8u %8d %13.1f ns %13.1f ns %13.1f ns %13.1f ns\n",
+               sectors[i], request, genericWrite, write, genericRead, read);
+    }
+}
+
+// Nanoseconds per segment. Adjacent batches are contiguous on the disk and in
+// memory, so readv/writev merge them; scattered ones only share the call.
+static void benchVectored()
+{
+    const int segmentBytes = 4096;
+
+    CRamStore store(storeBytes);
+    store.setSectorSize(segmentBytes);
+
+    QByteArray page(int(CRamStore::pageSize), Qt::Uninitialized);
+    fillRandom(page, 7);
+    for(quint64 offset = 0; offset < storeBytes; offset += CRamStore::pageSize)
+        store.write(offset, page.constData(), CRamStore::pageSize);
+
+    QByteArray memory(maxBatch * segmentBytes, Qt::Uninitialized);
+    fillRandom(memory, 8);
+
+    const int batches[] = { 1, 8, 32, maxBatch };
+    const char *layouts[] = { "adjacent", "scattered" };
+
+    printf("\n%-10s %6s %16s %16s %16s %16s\n", "layout", "batch", "write", "writev", "read", "readv");
+
+    for(int layout = 0; layout < 2; ++layout)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            int batch = batches[i];
+            QVector<CRamStore::Segment> segments(vectoredSegments);
+            quint64 seed = 9;
+            quint64 base = 0;
+
+            for(int j = 0; j < vectoredSegments; ++j)
+            {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+
+                int k = j % batch;
+                if(layout == 1)
+                    segments[j].offset = (seed >> 16) % (storeBytes / segmentBytes) * segmentBytes;
+                else
+                {
+                    if(k == 0)
+                        base = (seed >> 16) % (storeBytes / segmentBytes / quint64(batch)) * quint64(batch) * segmentBytes;
+                    segments[j].offset = base + quint64(k) * segmentBytes;
+                }
+                segments[j].length = segmentBytes;
+                segments[j].buffer = memory.data() + k * segmentBytes;
+            }
+
+            double times[4];
+
+            quint64 start = CLatency::now();
+            for(int j = 0; j < vectoredSegments; ++j)
+                store.write(segments[j].offset, segments[j].buffer, segments[j].length);
+            times[0] = double(CLatency::now() - start) / vectoredSegments;
+
+            start = CLatency::now();
+            for(int j = 0; j < vectoredSegments; j += batch)
+                store.writev(segments.constData() + j, batch);
+            times[1] = double(CLatency::now() - start) / vectoredSegments;
+
+            start = CLatency::now();
+            for(int j = 0; j < vectoredSegments; ++j)
+                store.read(segments[j].offset, segments[j].buffer, segments[j].length);
+            times[2] = double(CLatency::now() - start) / vectoredSegments;
+
+            start = CLatency::now();
+            for(int j = 0; j < vectoredSegments; j += batch)
+                store.readv(segments.constData() + j, batch);
+            times[3] = double(CLatency::now() - start) / vectoredSegments;
+
+            printf("%-10s %6d %13.1f ns %13.1f ns %13.1f ns %13.1f ns\n",
+                   layouts[layout], batch, times[0], times[1], times[2], times[3]);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    int only = -1;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        if(args[i] == "--level" && i + 1 < args.size())
+        {
+            QString value = args[++i];
+            for(int level = 0; level < CBlockKernels::LevelCount; ++level)
+                if(value == CBlockKernels::name(CBlockKernels::Level(level)))
+                    only = level;
+
+            if(only < 0)
+            {
+                usage();
+                return 1;
+            }
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    CBlockKernels::Level detected = CBlockKernels::level();
+    printf("detected %s\n", CBlockKernels::name(detected));
+
+    QByteArray zeros(pageBytes, char(0));
+    QByteArray data(pageBytes, Qt::Uninitialized);
+    fillRandom(data, 3);
+    QByteArray span(spanBytes, char(0));
+
+    int failed = 0;
+
+    printf("%-8s %12s %12s %12s %12s %12s %12s\n", "level", "zero 64K", "zero 4K", "copy 64K", "copy 4K", "hash 64K", "hash 4K");
+
+    for(int level = 0; level < CBlockKernels::LevelCount; ++level)
+    {
+        CBlockKernels::Level current = CBlockKernels::Level(level);
+        if((only >= 0 && level != only) || !CBlockKernels::isSupported(current))
+            continue;
+
+        if(!verify(current))
+        {
+            printf("%-8s does not match the scalar kernels\n", CBlockKernels::name(current));
+            ++failed;
+            continue;
+        }
+
+        CBlockKernels::setLevel(current);
+
+        // Copies walk a span larger than the caches, like writes spread over the disk
+        double results[6] =
+        {
+            gigabytesPerSecond(pageBytes, [&](quint64) { sink = sink + CBlockKernels::isZero(zeros.constData(), pageBytes); }),
+            gigabytesPerSecond(sectorBytes, [&](quint64) { sink = sink + CBlockKernels::isZero(zeros.constData(), sectorBytes); }),
+            gigabytesPerSecond(pageBytes, [&](quint64 i) {
+                CBlockKernels::copy(span.data() + (i * pageBytes) % spanBytes, data.constData(), pageBytes);
+            }),
+            gigabytesPerSecond(sectorBytes, [&](quint64 i) {
+                CBlockKernels::copy(span.data() + (i * sectorBytes) % spanBytes, data.constData(), sectorBytes);
+            }),
+            gigabytesPerSecond(pageBytes, [&](quint64 i) { sink = sink + CBlockKernels::hash(data.constData(), pageBytes, i); }),
+            gigabytesPerSecond(sectorBytes, [&](quint64 i) { sink = sink + CBlockKernels::hash(data.constData(), sectorBytes, i); })
+        };
+
+        printf("%-8s", CBlockKernels::name(current));
+        for(int i = 0; i < 6; ++i)
+            printf(" %9.2f GB/s", results[i]);
+        printf("\n");
+    }
+
+    CBlockKernels::setLevel(detected);
+
+    benchStore();
+    benchVectored();
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,130 @@
+#include "latency.h"
+
+thread_local CLatency::Slot *CLatency::_local = nullptr;
+QMutex CLatency::_lock;
+QVector<CLatency::Slot *> CLatency::_slots;
+QVector<CLatency::Slot *> CLatency::_free;
+CLatency::Slot CLatency::_retired;
+
+CLatency::LocalSlot::LocalSlot()
+{
+    QMutexLocker locker(&_lock);
+
+    if(!_free.isEmpty())
+    {
+        slot = _free.takeLast();
+        return;
+    }
+
+    slot = new Slot;
+    _slots.append(slot);
+}
+
+// Folded into the retired histograms, a reused slot starts empty
+CLatency::LocalSlot::~LocalSlot()
+{
+    QMutexLocker locker(&_lock);
+
+    for(int op = 0; op < OperationCount; ++op)
+    {
+        for(int i = 0; i < bucketCount; ++i)
+            _retired.buckets[op][i].store(_retired.buckets[op][i].load() +
+                                          slot->buckets[op][i].fetchAndStoreRelaxed(0));
+
+        _retired.max[op].store(qMax(_retired.max[op].load(), slot->max[op].fetchAndStoreRelaxed(0)));
+        _retired.sum[op].store(_retired.sum[op].load() + slot->sum[op].fetchAndStoreRelaxed(0));
+    }
+
+    _free.append(slot);
+}
+
+CLatency::Slot *CLatency::attach()
+{
+    static thread_local LocalSlot local;
+    _local = local.slot;
+    return local.slot;
+}
+
+QElapsedTimer &CLatency::timer()
+{
+    static QElapsedTimer timer = []() {
+        QElapsedTimer started;
+        started.start();
+        return started;
+    }();
+
+    return timer;
+}
+
+// Highest value that falls into the bucket
+quint64 CLatency::bucketLimit(int index)
+{
+    if(index < (2 << subBits))
+        return quint64(index);
+
+    int shift = (index >> subBits) - 1;
+    quint64 mantissa = quint64(index & ((1 << subBits) - 1)) + (1u << subBits);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+CLatency::Summary CLatency::summary(Operation operation)
+{
+    QVector<quint64> merged(bucketCount);
+    Summary result = { 0, 0, 0, 0, 0, 0 };
+
+    {
+        QMutexLocker locker(&_lock);
+
+        for(int i = 0; i < bucketCount; ++i)
+            merged[i] = _retired.buckets[operation][i].load();
+        result.max = _retired.max[operation].load();
+        result.sum = _retired.sum[operation].load();
+
+        for(int s = 0; s < _slots.size(); ++s)
+        {
+            for(int i = 0; i < bucketCount; ++i)
+                merged[i] += _slots[s]->buckets[operation][i].load();
+            result.max = qMax(result.max, _slots[s]->max[operation].load());
+            result.sum += _slots[s]->sum[operation].load();
+        }
+    }
+
+    for(int i = 0; i < bucketCount; ++i)
+        result.count += merged[i];
+
+    if(result.count == 0)
+        return result;
+
+    // Ranks rounded up, so p999 of fewer than 1000 samples is the largest one
+    const quint64 ranks[] = { (result.count * 500 + 999) / 1000,
+                              (result.count * 990 + 999) / 1000,
+                              (result.count * 999 + 999) / 1000 };
+    quint64 *values[] = { &result.p50, &result.p99, &result.p999 };
+
+    quint64 seen = 0;
+    int next = 0;
+
+    for(int i = 0; i < bucketCount && next < 3; ++i)
+    {
+        seen += merged[i];
+
+        while(next < 3 && seen >= ranks[next])
+            *values[next++] = qMin(bucketLimit(i), result.max);
+    }
+
+    return result;
+}
+
+const char *CLatency::name(Operation operation)
+{
+    static const char *names[OperationCount] =
+    {
+        "read",
+        "write",
+        "flush",
+        "discard",
+        "round_trip"
+    };
+
+    return names[operation];
+}
@@ -0,0 +1,105 @@
+#ifndef CLATENCY_H
+#define CLATENCY_H
+
+#include <QtGlobal>
+#include <QtAlgorithms>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QVector>
+
+// Per operation latency histograms with HDR style log-linear buckets:
+// exact below 64ns, then 32 buckets per power of two (about 3% resolution).
+// Like CTelemetry every thread records into its own slot without locking,
+// summary() merges all slots on demand.
+class CLatency
+{
+public:
+    enum Operation
+    {
+        Read,
+        Write,
+        Flush,
+        Discard,
+        RoundTrip,
+        OperationCount
+    };
+
+    struct Summary
+    {
+        quint64 count;
+        quint64 p50;
+        quint64 p99;
+        quint64 p999;
+        quint64 max;
+        quint64 sum;                    // of all recorded values, for a mean
+    };
+
+    // Monotonic nanoseconds, pair with record()
+    static inline quint64 now()
+    {
+        return quint64(timer().nsecsElapsed());
+    }
+
+    static inline void record(Operation operation, quint64 nanoseconds)
+    {
+        Slot *slot = local();
+
+        QAtomicInteger<quint64> &count = slot->buckets[operation][bucket(nanoseconds)];
+        count.store(count.load() + 1);
+
+        if(nanoseconds > slot->max[operation].load())
+            slot->max[operation].store(nanoseconds);
+
+        slot->sum[operation].store(slot->sum[operation].load() + nanoseconds);
+    }
+
+    static Summary summary(Operation operation);
+    static const char *name(Operation operation);
+
+    static const int subBits = 5;
+    static const int bucketCount = (65 - subBits) << subBits;
+
+private:
+    struct alignas(64) Slot
+    {
+        QAtomicInteger<quint64> buckets[OperationCount][bucketCount];
+        QAtomicInteger<quint64> max[OperationCount];
+        QAtomicInteger<quint64> sum[OperationCount];
+    };
+
+    struct LocalSlot
+    {
+        Slot *slot;
+        LocalSlot();
+        ~LocalSlot();
+    };
+
+    static inline int bucket(quint64 value)
+    {
+        if(value < (2u << subBits))
+            return int(value);
+
+        int shift = 63 - qCountLeadingZeroBits(value) - subBits;
+        return (shift << subBits) + int(value >> shift);
+    }
+
+    static quint64 bucketLimit(int index);
+
+    static inline Slot *local()
+    {
+        Slot *slot = _local;
+        return slot ? slot : attach();
+    }
+
+    static Slot *attach();
+    static QElapsedTimer &timer();
+
+    static thread_local Slot *_local;
+    static QMutex _lock;
+    static QVector<Slot *> _slots;
+    static QVector<Slot *> _free;
+    static Slot _retired;
+};
+
+#endif // CLATENCY_H
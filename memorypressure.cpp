@@ -0,0 +1,300 @@
+#include "memorypressure.h"
+#include "ramstore.h"
+
+#include <QFile>
+#include <QList>
+#include <QByteArray>
+#include <QDebug>
+
+#ifndef Q_OS_WIN
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+const double CMemoryPressure::thresholds[LevelCount] = { 0.0, 5.0, 15.0, 40.0 };   // % of time stalled
+const int CMemoryPressure::sampleInterval = 1000;                   // ms between samples
+const int CMemoryPressure::relaxTicks = 10;                        // calm samples per level down
+const quint64 CMemoryPressure::evictBatch = 256;                   // pages per sample, 16Mb
+const quint64 CMemoryPressure::restoreBatch = 64;                  // pages per calm sample, 4Mb
+
+#ifndef Q_OS_WIN
+// PSI trigger: wake on 150ms of stalls within a second, the High threshold
+static const char psiTrigger[] = "some 150000 1000000";
+
+// cgroup v2 accounts the pressure of the cgroup we run in, a container limit included
+static QString pressureFile()
+{
+    QFile cgroup("/proc/self/cgroup");
+
+    if(cgroup.open(QIODevice::ReadOnly))
+    {
+        QList<QByteArray> lines = cgroup.readAll().split('\n');
+
+        for(int i = 0; i < lines.size(); ++i)
+        {
+            if(!lines[i].startsWith("0::"))
+                continue;
+
+            QString path = "/sys/fs/cgroup" + QString::fromLocal8Bit(lines[i].mid(3)) + "/memory.pressure";
+            if(QFile::exists(path))
+                return path;
+        }
+    }
+
+    return "/proc/pressure/memory";
+}
+#endif
+
+CMemoryPressure::CMemoryPressure(CRamStore *store, const QString &pressurePath, QObject *parent) :
+    QThread(parent), _store(store), _pressurePath(pressurePath), _level(None), _pressure(0), _calmTicks(0), _stopping(0)
+#ifdef Q_OS_WIN
+  , _lowMemory(NULL), _wake(NULL)
+#else
+  , _trigger(-1), _wake(-1)
+#endif
+{
+    qDebug() << Q_FUNC_INFO << pressurePath;
+}
+
+CMemoryPressure::~CMemoryPressure()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    stop();
+
+#ifdef Q_OS_WIN
+    if(_lowMemory)
+        CloseHandle(_lowMemory);
+    if(_wake)
+        CloseHandle(_wake);
+#else
+    if(_trigger >= 0)
+        close(_trigger);
+    if(_wake >= 0)
+        close(_wake);
+#endif
+}
+
+// Starts the thread, false when the host reports no memory pressure at all
+bool CMemoryPressure::open()
+{
+#ifdef Q_OS_WIN
+    _lowMemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    _wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(!_wake)
+        return false;
+#else
+    if(_pressurePath.isEmpty())
+        _pressurePath = pressureFile();
+
+    if(!QFile::exists(_pressurePath))
+    {
+        qDebug() << "No pressure stall information at" << _pressurePath;
+        return false;
+    }
+
+    _wake = eventfd(0, EFD_NONBLOCK);
+    if(_wake < 0)
+        return false;
+
+    // Needs CAP_SYS_RESOURCE on older kernels, sampling alone works without it
+    _trigger = ::open(QFile::encodeName(_pressurePath).constData(), O_RDWR | O_NONBLOCK);
+    if(_trigger >= 0 && write(_trigger, psiTrigger, strlen(psiTrigger) + 1) < 0)
+    {
+        close(_trigger);
+        _trigger = -1;
+    }
+#endif
+
+    _stopping.store(0);
+    start(QThread::LowPriority);
+    return true;
+}
+
+void CMemoryPressure::stop()
+{
+    if(!isRunning())
+        return;
+
+    _stopping.store(1);
+
+#ifdef Q_OS_WIN
+    SetEvent(_wake);
+#else
+    quint64 one = 1;
+    if(write(_wake, &one, sizeof(one)) < 0)
+        qDebug() << "Cannot wake the pressure monitor";
+#endif
+
+    wait();
+}
+
+CMemoryPressure::Level CMemoryPressure::level() const
+{
+    return Level(_level.load());
+}
+
+double CMemoryPressure::pressure() const
+{
+    return _pressure.load() / 100.0;
+}
+
+const char *CMemoryPressure::name(Level level)
+{
+    static const char *names[LevelCount] = { "none", "moderate", "high", "critical" };
+    return names[level];
+}
+
+void CMemoryPressure::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    while(!_stopping.load())
+    {
+        bool triggered = waitForEvent();
+        if(_stopping.load())
+            break;
+
+        tick(triggered);
+    }
+}
+
+// True when a pressure event woke us before the sample interval was over
+bool CMemoryPressure::waitForEvent()
+{
+#ifdef Q_OS_WIN
+    // The notification stays signaled while memory is low, at Critical it would only spin
+    HANDLE handles[2] = { _wake, _lowMemory };
+    DWORD count = _lowMemory && level() < Critical ? 2 : 1;
+
+    return WaitForMultipleObjects(count, handles, FALSE, DWORD(sampleInterval)) == WAIT_OBJECT_0 + 1;
+#else
+    struct pollfd fds[2] = { { _wake, POLLIN, 0 }, { _trigger, POLLPRI, 0 } };
+
+    int ready = poll(fds, _trigger >= 0 ? 2 : 1, sampleInterval);
+    if(ready <= 0)
+        return false;
+
+    if(fds[0].revents & POLLIN)
+    {
+        quint64 count;
+        if(read(_wake, &count, sizeof(count)) < 0)
+            return false;
+    }
+
+    return _trigger >= 0 && (fds[1].revents & POLLPRI);
+#endif
+}
+
+// Percent of time tasks stalled on memory, averaged over 10 s
+double CMemoryPressure::sample()
+{
+#ifdef Q_OS_WIN
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if(!GlobalMemoryStatusEx(&status))
+        return 0.0;
+
+    // Load above 80% onto the PSI scale: 82% is Moderate, 86% High, 96% Critical
+    double pressure = qMax(0.0, (double(status.dwMemoryLoad) - 80.0) * 2.5);
+
+    BOOL low = FALSE;
+    if(_lowMemory && QueryMemoryResourceNotification(_lowMemory, &low) && low)
+        pressure = qMax(pressure, thresholds[Critical]);
+
+    return pressure;
+#else
+    // "some avg10=1.23 avg60=0.50 avg300=0.10 total=12345"
+    QFile file(_pressurePath);
+    if(!file.open(QIODevice::ReadOnly))
+        return 0.0;
+
+    QList<QByteArray> lines = file.readAll().split('\n');
+
+    for(int i = 0; i < lines.size(); ++i)
+    {
+        if(!lines[i].startsWith("some "))
+            continue;
+
+        int start = lines[i].indexOf("avg10=");
+        if(start < 0)
+            break;
+
+        start += 6;
+        int end = lines[i].indexOf(' ', start);
+        return lines[i].mid(start, end < 0 ? -1 : end - start).toDouble();
+    }
+
+    return 0.0;
+#endif
+}
+
+CMemoryPressure::Level CMemoryPressure::nextLevel(Level current, double pressure, int *calmTicks)
+{
+    for(int level = Critical; level > current; --level)
+    {
+        if(pressure >= thresholds[level])
+        {
+            *calmTicks = 0;
+            return Level(level);
+        }
+    }
+
+    // Calm samples are counted at None too, they pace the restore
+    if(pressure < thresholds[qMax(int(current), int(Moderate))] / 2)
+        ++*calmTicks;
+    else
+        *calmTicks = 0;
+
+    if(current != None && *calmTicks >= relaxTicks)
+    {
+        *calmTicks = 0;
+        return Level(current - 1);
+    }
+
+    return current;
+}
+
+void CMemoryPressure::tick(bool triggered)
+{
+    double pressure = sample();
+
+    // The trigger fires on a second of stalls, long before the 10 s average shows them
+    if(triggered)
+        pressure = qMax(pressure, thresholds[High]);
+
+    Level current = level();
+    Level next = nextLevel(current, pressure, &_calmTicks);
+
+    _pressure.store(int(pressure * 100));
+    _level.store(int(next));
+
+    if(next != current)
+        qDebug() << "Memory pressure" << name(current) << "->" << name(next) << pressure;
+
+    // Without a spill file, spilling falls back to compression
+    switch(next)
+    {
+    case Critical:
+        _store->evict(CRamStore::DropClean, ~0ull);
+        if(!_store->evict(CRamStore::Spill, 4 * evictBatch))
+            _store->evict(CRamStore::Compress, 4 * evictBatch);
+        break;
+
+    case High:
+        if(!_store->evict(CRamStore::Spill, evictBatch))
+            _store->evict(CRamStore::Compress, evictBatch);
+        break;
+
+    case Moderate:
+        _store->evict(CRamStore::Compress, evictBatch);
+        break;
+
+    default:
+        if(_calmTicks >= relaxTicks)
+            _store->restoreEvicted(restoreBatch);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef CMEMORYPRESSURE_H
+#define CMEMORYPRESSURE_H
+
+#include <QThread>
+#include <QString>
+#include <QAtomicInt>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+class CRamStore;
+
+// Makes the store give memory back while the host is short of it.
+// Linux reads PSI, the cgroup's memory.pressure or else /proc/pressure/memory,
+// and a PSI trigger wakes it as soon as tasks stall. Windows maps the memory
+// load onto the same scale and wakes on the low memory notification.
+// Each level adds a more expensive action: Moderate compresses cold pages,
+// High spills them to a file, Critical also drops every clean page. Levels
+// rise at once and fall one at a time after relaxTicks calm samples, then
+// evicted pages are brought back a batch per sample.
+class CMemoryPressure : public QThread
+{
+    Q_OBJECT
+public:
+    enum Level
+    {
+        None,
+        Moderate,
+        High,
+        Critical,
+        LevelCount
+    };
+
+    // pressurePath overrides the PSI file, for tests
+    CMemoryPressure(CRamStore *store, const QString &pressurePath = QString(), QObject *parent = 0);
+    ~CMemoryPressure();
+
+    bool open();
+    void stop();
+
+    Level level() const;
+    // Share of time tasks stalled on memory over the last 10 s, in percent
+    double pressure() const;
+
+    // One sample and the store action for the resulting level, run() loops over it
+    void tick(bool triggered = false);
+
+    // Level hysteresis: calmTicks counts samples below half the threshold of the current level
+    static Level nextLevel(Level current, double pressure, int *calmTicks);
+    static const char *name(Level level);
+
+    static const double thresholds[LevelCount];
+    static const int sampleInterval;
+    static const int relaxTicks;
+    static const quint64 evictBatch;
+    static const quint64 restoreBatch;
+
+protected:
+    void run() override;
+
+private:
+    double sample();
+    bool waitForEvent();
+
+    CRamStore *_store;
+    QString _pressurePath;
+    QAtomicInt _level;
+    QAtomicInt _pressure;                   // hundredths of a percent
+    int _calmTicks;
+    QAtomicInt _stopping;
+#ifdef Q_OS_WIN
+    HANDLE _lowMemory;
+    HANDLE _wake;
+#else
+    int _trigger;
+    int _wake;
+#endif
+};
+
+#endif // CMEMORYPRESSURE_H
@@ -0,0 +1,491 @@
+#include "latency.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <QDir>
+#include <QThread>
+
+#include <algorithm>
+#include <string>
+
+#include <stdio.h>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Small file and metadata workload against any mounted path: every thread
+// builds its own directory tree, then creates, stats, renames (into the next
+// leaf directory) and deletes its files, one phase at a time for all threads.
+// Calls go straight to the OS so the numbers compare file systems, not Qt.
+// The result is one JSON object on stdout.
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-metabench <directory> [--threads <n>] [--files <n>] [--fanout <n>] [--depth <n>]\n"
+                    "                           [--size <bytes>|<min>-<max>] [--fsync none|file|dir]\n");
+}
+
+enum Phase
+{
+    Mkdir,
+    Create,
+    Stat,
+    Rename,
+    Delete,
+    Rmdir,
+    PhaseCount
+};
+
+static const char *phaseNames[PhaseCount] = { "mkdir", "create", "stat", "rename", "delete", "rmdir" };
+
+enum SyncPolicy
+{
+    SyncNone,
+    SyncFile,                               // file data before close
+    SyncDir                                 // also the directory after every entry change, no-op on Windows
+};
+
+static const char *syncNames[] = { "none", "file", "dir" };
+
+struct Options
+{
+    int threads;
+    int files;
+    int fanout;
+    int depth;
+    int minSize;
+    int maxSize;
+    SyncPolicy sync;
+};
+
+#ifdef Q_OS_WIN
+typedef std::wstring NativePath;
+
+static NativePath nativePath(const QString &path)
+{
+    return QDir::toNativeSeparators(path).toStdWString();
+}
+
+static bool makeDir(const NativePath &path)
+{
+    return CreateDirectoryW(path.c_str(), NULL) != FALSE;
+}
+
+static bool removeDir(const NativePath &path)
+{
+    return RemoveDirectoryW(path.c_str()) != FALSE;
+}
+
+static bool createFile(const NativePath &path, const char *data, int size, bool sync)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD written = 0;
+    bool ok = size == 0 || (WriteFile(file, data, DWORD(size), &written, NULL) && written == DWORD(size));
+    if(ok && sync)
+        ok = FlushFileBuffers(file) != FALSE;
+
+    return CloseHandle(file) && ok;
+}
+
+static bool statFile(const NativePath &path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    return GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data) != FALSE;
+}
+
+static bool renameFile(const NativePath &from, const NativePath &to)
+{
+    return MoveFileExW(from.c_str(), to.c_str(), 0) != FALSE;
+}
+
+static bool removeFile(const NativePath &path)
+{
+    return DeleteFileW(path.c_str()) != FALSE;
+}
+
+static bool syncDir(const NativePath &path)
+{
+    Q_UNUSED(path);
+    return true;
+}
+#else
+typedef QByteArray NativePath;
+
+static NativePath nativePath(const QString &path)
+{
+    return QFile::encodeName(path);
+}
+
+static bool makeDir(const NativePath &path)
+{
+    return mkdir(path.constData(), 0755) == 0;
+}
+
+static bool removeDir(const NativePath &path)
+{
+    return rmdir(path.constData()) == 0;
+}
+
+static bool createFile(const NativePath &path, const char *data, int size, bool sync)
+{
+    int fd = open(path.constData(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+        return false;
+
+    bool ok = size == 0 || write(fd, data, size_t(size)) == ssize_t(size);
+    if(ok && sync)
+        ok = fsync(fd) == 0;
+
+    return close(fd) == 0 && ok;
+}
+
+static bool statFile(const NativePath &path)
+{
+    struct stat info;
+    return stat(path.constData(), &info) == 0;
+}
+
+static bool renameFile(const NativePath &from, const NativePath &to)
+{
+    return rename(from.constData(), to.constData()) == 0;
+}
+
+static bool removeFile(const NativePath &path)
+{
+    return unlink(path.constData()) == 0;
+}
+
+static bool syncDir(const NativePath &path)
+{
+    int fd = open(path.constData(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+#endif
+
+// One thread's share of the workload, paths are built before anything is timed
+class CBenchThread : public QThread
+{
+public:
+    CBenchThread(const Options &options, const QString &root, int index) : _options(options), _phase(Mkdir)
+    {
+        QString top = QString("%1/t%2").arg(root).arg(index);
+        QStringList parents;
+        QStringList level;
+        level.append(top);
+
+        // Breadth first, so a directory is created after its parent
+        for(int depth = 0; depth < options.depth; ++depth)
+        {
+            QStringList next;
+            for(int i = 0; i < level.size(); ++i)
+                for(int j = 0; j < options.fanout; ++j)
+                    next.append(QString("%1/d%2").arg(level[i]).arg(j));
+            parents += level;
+            level = next;
+        }
+
+        QStringList dirs = parents + level;
+        for(int i = 0; i < dirs.size(); ++i)
+            _dirs.append(nativePath(dirs[i]));
+
+        int count = options.files / options.threads + (index < options.files % options.threads ? 1 : 0);
+        quint32 seed = 0x9e3779b9u * quint32(index + 1);
+
+        for(int i = 0; i < count; ++i)
+        {
+            int leaf = i % level.size();
+            int target = (i + 1) % level.size();
+
+            _leafOf.append(parents.size() + leaf);
+            _targetOf.append(parents.size() + target);
+            _created.append(nativePath(QString("%1/f%2").arg(level[leaf]).arg(i)));
+            _renamed.append(nativePath(QString("%1/r%2").arg(level[target]).arg(i)));
+
+            // xorshift, the same sizes every run
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            _sizes.append(options.minSize + int(seed % quint32(options.maxSize - options.minSize + 1)));
+        }
+
+        _data = QByteArray(options.maxSize, char(0x5a));
+    }
+
+    void runPhase(Phase phase)
+    {
+        _phase = phase;
+        _samples.clear();
+        _samples.reserve(operations());
+        _errors = 0;
+        start();
+    }
+
+    const QVector<quint64> &samples() const
+    {
+        return _samples;
+    }
+
+    int errors() const
+    {
+        return _errors;
+    }
+
+protected:
+    void run() override
+    {
+        for(int i = 0; i < operations(); ++i)
+        {
+            quint64 start = CLatency::now();
+
+            if(!operation(i))
+                ++_errors;
+
+            _samples.append(CLatency::now() - start);
+        }
+    }
+
+private:
+    int operations() const
+    {
+        return _phase == Mkdir || _phase == Rmdir ? _dirs.size() : _created.size();
+    }
+
+    bool operation(int i)
+    {
+        switch(_phase)
+        {
+        case Mkdir:
+            return makeDir(_dirs[i]) && syncParent(i);
+
+        case Create:
+            return createFile(_created[i], _data.constData(), _sizes[i], _options.sync != SyncNone) && sync(_leafOf[i]);
+
+        case Stat:
+            return statFile(_created[i]);
+
+        case Rename:
+            return renameFile(_created[i], _renamed[i]) && sync(_leafOf[i]) && sync(_targetOf[i]);
+
+        case Delete:
+            return removeFile(_renamed[i]) && sync(_targetOf[i]);
+
+        case Rmdir:
+        {
+            // Children first
+            int dir = _dirs.size() - 1 - i;
+            return removeDir(_dirs[dir]) && syncParent(dir);
+        }
+
+        default:
+            return false;
+        }
+    }
+
+    inline bool sync(int dir)
+    {
+        return _options.sync != SyncDir || syncDir(_dirs[dir]);
+    }
+
+    // The top directory's parent is shared by all threads, main syncs it once after mkdir and rmdir
+    inline bool syncParent(int dir)
+    {
+        return dir == 0 || sync((dir - 1) / _options.fanout);
+    }
+
+    Options _options;
+    Phase _phase;
+    QVector<NativePath> _dirs;              // parents before children, each level breadth first
+    QVector<NativePath> _created;
+    QVector<NativePath> _renamed;
+    QVector<int> _leafOf;                   // indexes into _dirs
+    QVector<int> _targetOf;
+    QVector<int> _sizes;
+    QByteArray _data;
+
+    QVector<quint64> _samples;
+    int _errors;
+};
+
+static bool parseCount(const QString &value, int minimum, int *result)
+{
+    bool ok = false;
+    int number = value.toInt(&ok);
+    if(!ok || number < minimum)
+        return false;
+
+    *result = number;
+    return true;
+}
+
+static QByteArray jsonString(const QString &value)
+{
+    QByteArray escaped = "\"";
+    QByteArray utf8 = value.toUtf8();
+
+    for(int i = 0; i < utf8.size(); ++i)
+    {
+        char c = utf8[i];
+        if(c == '"' || c == '\\')
+            escaped += '\\';
+        if(uchar(c) < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", uchar(c));
+            escaped += code;
+        }
+        else
+            escaped += c;
+    }
+
+    return escaped + "\"";
+}
+
+static quint64 percentile(const QVector<quint64> &sorted, double fraction)
+{
+    if(sorted.isEmpty())
+        return 0;
+
+    int index = int(fraction * sorted.size());
+    return sorted[qMin(index, sorted.size() - 1)];
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    QString directory;
+    Options options;
+    options.threads = 4;
+    options.files = 100000;
+    options.fanout = 16;
+    options.depth = 2;
+    options.minSize = 0;
+    options.maxSize = 4096;
+    options.sync = SyncNone;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        bool ok = true;
+
+        if(args[i] == "--threads" && i + 1 < args.size())
+            ok = parseCount(args[++i], 1, &options.threads);
+        else if(args[i] == "--files" && i + 1 < args.size())
+            ok = parseCount(args[++i], 1, &options.files);
+        else if(args[i] == "--fanout" && i + 1 < args.size())
+            ok = parseCount(args[++i], 1, &options.fanout);
+        else if(args[i] == "--depth" && i + 1 < args.size())
+            ok = parseCount(args[++i], 0, &options.depth);
+        else if(args[i] == "--size" && i + 1 < args.size())
+        {
+            QString value = args[++i];
+            ok = parseCount(value.section('-', 0, 0), 0, &options.minSize) &&
+                 parseCount(value.section('-', -1), options.minSize, &options.maxSize);
+        }
+        else if(args[i] == "--fsync" && i + 1 < args.size())
+        {
+            QString value = args[++i];
+            if(value == "none")
+                options.sync = SyncNone;
+            else if(value == "file")
+                options.sync = SyncFile;
+            else if(value == "dir")
+                options.sync = SyncDir;
+            else
+                ok = false;
+        }
+        else if(directory.isEmpty())
+            directory = args[i];
+        else
+            ok = false;
+
+        if(!ok)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if(directory.isEmpty())
+    {
+        usage();
+        return 1;
+    }
+
+    QString root = QString("%1/qt-imdisk-metabench-%2").arg(QDir(directory).absolutePath()).arg(a.applicationPid());
+    if(!makeDir(nativePath(root)))
+    {
+        fprintf(stderr, "Cannot create %s\n", root.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QVector<CBenchThread *> threads;
+    for(int i = 0; i < options.threads; ++i)
+        threads.append(new CBenchThread(options, root, i));
+
+    printf("{\n  \"path\": %s,\n  \"threads\": %d,\n  \"files\": %d,\n  \"fanout\": %d,\n  \"depth\": %d,\n"
+           "  \"size_min\": %d,\n  \"size_max\": %d,\n  \"fsync\": \"%s\",\n  \"phases\": [\n",
+           jsonString(directory).constData(), options.threads, options.files, options.fanout, options.depth,
+           options.minSize, options.maxSize, syncNames[options.sync]);
+
+    int failed = 0;
+
+    // All threads run the same phase, the rate is its operations over the wall time
+    for(int phase = 0; phase < PhaseCount; ++phase)
+    {
+        quint64 start = CLatency::now();
+
+        for(int i = 0; i < threads.size(); ++i)
+            threads[i]->runPhase(Phase(phase));
+        for(int i = 0; i < threads.size(); ++i)
+            threads[i]->wait();
+
+        // Entries of all top directories, in the phase time but no operation's sample
+        bool rootSynced = options.sync != SyncDir || (phase != Mkdir && phase != Rmdir) || syncDir(nativePath(root));
+
+        double seconds = (CLatency::now() - start) / 1e9;
+
+        QVector<quint64> samples;
+        int errors = rootSynced ? 0 : 1;
+        for(int i = 0; i < threads.size(); ++i)
+        {
+            samples += threads[i]->samples();
+            errors += threads[i]->errors();
+        }
+
+        std::sort(samples.begin(), samples.end());
+        failed += errors;
+
+        printf("    {\"op\": \"%s\", \"count\": %d, \"errors\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+               "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+               phaseNames[phase], samples.size(), errors, seconds, seconds > 0 ? samples.size() / seconds : 0.0,
+               percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+               percentile(samples, 0.999), samples.isEmpty() ? 0ull : samples.last(),
+               phase + 1 < PhaseCount ? "," : "");
+    }
+
+    printf("  ]\n}\n");
+
+    qDeleteAll(threads);
+
+    if(!removeDir(nativePath(root)))
+        fprintf(stderr, "Cannot remove %s\n", root.toLocal8Bit().constData());
+
+    return failed ? 2 : 0;
+}
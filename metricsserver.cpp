@@ -0,0 +1,166 @@
+#include "metricsserver.h"
+#include "ramdisk.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "heatmap.h"
+
+#include <QHostAddress>
+#include <QDebug>
+
+static const char metricPrefix[] = "qt_imdisk_";
+
+CMetricsServer::CMetricsServer(CRamDisk *disk, QObject *parent) : QObject(parent), _disk(disk)
+{
+    qDebug() << Q_FUNC_INFO;
+
+    connect(&_server, &QTcpServer::newConnection, this, &CMetricsServer::onNewConnection);
+}
+
+CMetricsServer::~CMetricsServer()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    _server.close();
+}
+
+bool CMetricsServer::listen(quint16 port)
+{
+    qDebug() << Q_FUNC_INFO << port;
+
+    return _server.listen(QHostAddress::LocalHost, port);
+}
+
+void CMetricsServer::onNewConnection()
+{
+    while(QTcpSocket *socket = _server.nextPendingConnection())
+    {
+        connect(socket, &QTcpSocket::readyRead, this, &CMetricsServer::onReadyRead);
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    }
+}
+
+void CMetricsServer::onReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if(!socket)
+        return;
+
+    // Wait for the end of the request headers, the request itself is not looked at
+    if(!socket->peek(socket->bytesAvailable()).contains("\r\n\r\n"))
+        return;
+
+    socket->readAll();
+
+    QByteArray body = render();
+    QByteArray response = "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                          "Connection: close\r\n\r\n" + body;
+
+    socket->write(response);
+    socket->disconnectFromHost();
+}
+
+QByteArray CMetricsServer::render() const
+{
+    QByteArray text;
+
+    for(int i = 0; i < CTelemetry::CounterCount; ++i)
+    {
+        CTelemetry::Counter counter = CTelemetry::Counter(i);
+        QByteArray name = metricPrefix + QByteArray(CTelemetry::name(counter));
+
+        text += "# TYPE " + name + " counter\n";
+        text += name + " " + QByteArray::number(CTelemetry::total(counter)) + "\n";
+    }
+
+    text += "# TYPE qt_imdisk_mounted gauge\n";
+    text += "qt_imdisk_mounted " + QByteArray::number(_disk->wasMounted() ? 1 : 0) + "\n";
+    text += "# TYPE qt_imdisk_size_bytes gauge\n";
+    text += "qt_imdisk_size_bytes " + QByteArray::number(_disk->size()) + "\n";
+    text += "# TYPE qt_imdisk_committed_bytes gauge\n";
+    text += "qt_imdisk_committed_bytes " + QByteArray::number(_disk->committedBytes()) + "\n";
+    text += "# TYPE qt_imdisk_resident_bytes gauge\n";
+    text += "qt_imdisk_resident_bytes " + QByteArray::number(_disk->residentBytes()) + "\n";
+    text += "# TYPE qt_imdisk_dedup_ratio gauge\n";
+    text += "qt_imdisk_dedup_ratio " + QByteArray::number(_disk->dedupRatio(), 'f', 3) + "\n";
+
+    // Working set from the SHARDS sample, with what the sampling costs per sampled access
+    const CHeatmap *heatmap = _disk->heatmap();
+    text += "# TYPE qt_imdisk_working_set_bytes gauge\n";
+    text += "qt_imdisk_working_set_bytes " + QByteArray::number(_disk->workingSetBytes()) + "\n";
+    text += "# TYPE qt_imdisk_heatmap_sampled_accesses gauge\n";
+    text += "qt_imdisk_heatmap_sampled_accesses " + QByteArray::number(heatmap ? heatmap->sampledAccesses() : 0) + "\n";
+    text += "# TYPE qt_imdisk_heatmap_sample_cost_seconds gauge\n";
+    text += "qt_imdisk_heatmap_sample_cost_seconds " +
+            QByteArray::number(heatmap ? heatmap->samplingCost() / 1e9 : 0.0, 'g', 6) + "\n";
+
+    // Seed image fill, times are -1 until they happened
+    if(const CPreloader *preloader = _disk->preloader())
+    {
+        text += "# TYPE qt_imdisk_seed_progress_ratio gauge\n";
+        text += "qt_imdisk_seed_progress_ratio " + QByteArray::number(preloader->progress(), 'f', 3) + "\n";
+        text += "# TYPE qt_imdisk_seed_first_io_seconds gauge\n";
+        text += "qt_imdisk_seed_first_io_seconds " + QByteArray::number(preloader->timeToFirstIo() / 1e3, 'g', 6) + "\n";
+        text += "# TYPE qt_imdisk_seed_loaded_seconds gauge\n";
+        text += "qt_imdisk_seed_loaded_seconds " + QByteArray::number(preloader->timeToLoaded() / 1e3, 'g', 6) + "\n";
+        text += "# TYPE qt_imdisk_seed_demand_loads_total counter\n";
+        text += "qt_imdisk_seed_demand_loads_total " + QByteArray::number(preloader->demandLoads()) + "\n";
+        text += "# TYPE qt_imdisk_seed_failed_extents gauge\n";
+        text += "qt_imdisk_seed_failed_extents " + QByteArray::number(preloader->failedExtents()) + "\n";
+    }
+
+    // Pressure relief, the ratio is logical over compressed bytes
+    const CMemoryPressure *pressure = _disk->memoryPressure();
+    CRamStore::EvictionStats eviction = _disk->evictionStats();
+    text += "# TYPE qt_imdisk_memory_pressure_level gauge\n";
+    text += "qt_imdisk_memory_pressure_level " + QByteArray::number(pressure ? int(pressure->level()) : 0) + "\n";
+    text += "# TYPE qt_imdisk_memory_pressure_percent gauge\n";
+    text += "qt_imdisk_memory_pressure_percent " + QByteArray::number(pressure ? pressure->pressure() : 0.0, 'f', 2) + "\n";
+    text += "# TYPE qt_imdisk_compressed_bytes gauge\n";
+    text += "qt_imdisk_compressed_bytes " + QByteArray::number(eviction.compressedBytes) + "\n";
+    text += "# TYPE qt_imdisk_compression_ratio gauge\n";
+    text += "qt_imdisk_compression_ratio " + QByteArray::number(eviction.compressedBytes ?
+            double(eviction.compressedPages * CRamStore::pageSize) / eviction.compressedBytes : 1.0, 'f', 3) + "\n";
+    text += "# TYPE qt_imdisk_spilled_bytes gauge\n";
+    text += "qt_imdisk_spilled_bytes " + QByteArray::number(eviction.spilledPages * CRamStore::pageSize) + "\n";
+    text += "# TYPE qt_imdisk_clean_cached_bytes gauge\n";
+    text += "qt_imdisk_clean_cached_bytes " + QByteArray::number(eviction.cleanPages * CRamStore::pageSize) + "\n";
+    text += "# TYPE qt_imdisk_lost_bytes gauge\n";
+    text += "qt_imdisk_lost_bytes " + QByteArray::number(eviction.lostPages * CRamStore::pageSize) + "\n";
+
+    // Last finished compaction cycle, zeros until one finished
+    CCompactor::Report compaction = {};
+    if(const CCompactor *compactor = _disk->compactor())
+        compaction = compactor->lastReport();
+    text += "# TYPE qt_imdisk_compaction_rss_before_bytes gauge\n";
+    text += "qt_imdisk_compaction_rss_before_bytes " + QByteArray::number(compaction.rssBefore) + "\n";
+    text += "# TYPE qt_imdisk_compaction_rss_after_bytes gauge\n";
+    text += "qt_imdisk_compaction_rss_after_bytes " + QByteArray::number(compaction.rssAfter) + "\n";
+    text += "# TYPE qt_imdisk_compaction_write_latency_before_seconds gauge\n";
+    text += "qt_imdisk_compaction_write_latency_before_seconds " +
+            QByteArray::number(compaction.latencyBefore / 1e9, 'g', 6) + "\n";
+    text += "# TYPE qt_imdisk_compaction_write_latency_peak_seconds gauge\n";
+    text += "qt_imdisk_compaction_write_latency_peak_seconds " +
+            QByteArray::number(compaction.latencyPeak / 1e9, 'g', 6) + "\n";
+
+    // Latency percentiles as a summary, in seconds
+    text += "# TYPE qt_imdisk_latency_seconds summary\n";
+
+    for(int i = 0; i < CLatency::OperationCount; ++i)
+    {
+        CLatency::Summary summary = _disk->latency(CLatency::Operation(i));
+        QByteArray label = QByteArray("qt_imdisk_latency_seconds{op=\"") + CLatency::name(CLatency::Operation(i));
+
+        text += label + "\",quantile=\"0.5\"} " + QByteArray::number(summary.p50 / 1e9, 'g', 6) + "\n";
+        text += label + "\",quantile=\"0.99\"} " + QByteArray::number(summary.p99 / 1e9, 'g', 6) + "\n";
+        text += label + "\",quantile=\"0.999\"} " + QByteArray::number(summary.p999 / 1e9, 'g', 6) + "\n";
+        text += label + "\",quantile=\"1\"} " + QByteArray::number(summary.max / 1e9, 'g', 6) + "\n";
+        text += QByteArray("qt_imdisk_latency_seconds_sum{op=\"") + CLatency::name(CLatency::Operation(i)) +
+                "\"} " + QByteArray::number(summary.sum / 1e9, 'g', 9) + "\n";
+        text += QByteArray("qt_imdisk_latency_seconds_count{op=\"") + CLatency::name(CLatency::Operation(i)) +
+                "\"} " + QByteArray::number(summary.count) + "\n";
+    }
+
+    return text;
+}
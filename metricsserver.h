@@ -0,0 +1,33 @@
+#ifndef CMETRICSSERVER_H
+#define CMETRICSSERVER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+class CRamDisk;
+
+// Serves the I/O counters and memory gauges in Prometheus text format.
+// Bound to the loopback interface only, any request path gets the metrics.
+class CMetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CMetricsServer(CRamDisk *disk, QObject *parent = 0);
+    ~CMetricsServer();
+
+    bool listen(quint16 port);
+
+    QByteArray render() const;
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+
+private:
+    CRamDisk *_disk;
+    QTcpServer _server;
+};
+
+#endif // CMETRICSSERVER_H
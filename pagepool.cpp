@@ -0,0 +1,400 @@
+#include "pagepool.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include <QtAlgorithms>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+const quint32 CPagePool::framesPerSlab = 64;
+
+static const quint32 regionMagic = 0x4b534452;                      // "RDSK"
+static const quint32 regionVersion = 2;
+
+static quint64 alignUp(quint64 value, quint64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+CPagePool::CPagePool(quint64 frameSize, quint32 maxFrames) :
+    _frameSize(frameSize), _maxFrames(maxFrames), _nextFrame(1), _usedFrames(0),
+    _region(nullptr), _header(nullptr)
+{
+    Slab empty = { nullptr, nullptr, 0 };
+    _slabs.fill(empty, int((maxFrames + framesPerSlab - 1) / framesPerSlab));
+    _freeSlabs.fill(0, (_slabs.size() + 63) / 64);
+}
+
+CPagePool::~CPagePool()
+{
+    if(_region)
+    {
+        delete _region;
+        return;
+    }
+
+    for(int i = 0; i < _slabs.size(); ++i)
+    {
+        if(_slabs[i].data)
+            unmapSlab(quint32(i));
+        delete[] _slabs[i].refs;
+    }
+}
+
+// Header | refcounts | root page table | evicted table | frames, each part frame aligned
+quint64 CPagePool::layout(quint64 frameSize, quint32 maxFrames, quint32 rootPages, quint64 *refsOffset,
+                          quint64 *rootOffset, quint64 *evictedOffset, quint64 *framesOffset)
+{
+    quint32 slabFrames = (maxFrames + framesPerSlab - 1) / framesPerSlab * framesPerSlab;
+
+    *refsOffset = alignUp(sizeof(Header), frameSize);
+    *rootOffset = *refsOffset + alignUp(quint64(slabFrames) * sizeof(QAtomicInt), frameSize);
+    *evictedOffset = *rootOffset + alignUp(quint64(rootPages) * sizeof(quint32), frameSize);
+    *framesOffset = *evictedOffset + alignUp(quint64(rootPages) * sizeof(quint32), frameSize);
+
+    return *framesOffset + quint64(slabFrames) * frameSize;
+}
+
+CPagePool *CPagePool::createShared(const QString &name, quint64 frameSize, quint32 maxFrames, quint32 rootPages)
+{
+    quint64 refsOffset, rootOffset, evictedOffset, framesOffset;
+    quint64 size = layout(frameSize, maxFrames, rootPages, &refsOffset, &rootOffset, &evictedOffset, &framesOffset);
+
+    CSharedRegion *region = new CSharedRegion;
+    if(!region->create(name, size))
+    {
+        qDebug() << "Cannot create shared region" << name;
+        delete region;
+        return nullptr;
+    }
+
+    CPagePool *pool = new CPagePool(frameSize, maxFrames);
+    pool->_region = region;
+    pool->_header = reinterpret_cast<Header *>(region->data());
+    pool->_header->frameSize = frameSize;
+    pool->_header->maxFrames = maxFrames;
+    pool->_header->nextFrame = 1;
+    pool->_header->rootPages = rootPages;
+    pool->setupRegion();
+
+    // Publish last, a region without magic is never attached
+    pool->_header->version = regionVersion;
+    pool->_header->magic = regionMagic;
+    return pool;
+}
+
+CPagePool *CPagePool::attachShared(const QString &name)
+{
+    CSharedRegion *region = new CSharedRegion;
+    if(!region->open(name))
+    {
+        delete region;
+        return nullptr;
+    }
+
+    const Header *header = reinterpret_cast<const Header *>(region->data());
+    quint64 refsOffset, rootOffset, evictedOffset, framesOffset;
+
+    if(region->size() < sizeof(Header) ||
+       header->magic != regionMagic || header->version != regionVersion ||
+       layout(header->frameSize, header->maxFrames, header->rootPages,
+              &refsOffset, &rootOffset, &evictedOffset, &framesOffset) != region->size())
+    {
+        qDebug() << "Shared region" << name << "has no valid store header";
+        delete region;
+        return nullptr;
+    }
+
+    CPagePool *pool = new CPagePool(header->frameSize, header->maxFrames);
+    pool->_region = region;
+    pool->_header = const_cast<Header *>(header);
+    pool->_nextFrame = header->nextFrame;
+    pool->setupRegion();
+    pool->recount();
+    return pool;
+}
+
+// Slabs of a shared pool are fixed windows into the region, all frames start out free
+void CPagePool::setupRegion()
+{
+    quint64 refsOffset, rootOffset, evictedOffset, framesOffset;
+    layout(_frameSize, _maxFrames, _header->rootPages, &refsOffset, &rootOffset, &evictedOffset, &framesOffset);
+
+    for(int i = 0; i < _slabs.size(); ++i)
+    {
+        _slabs[i].data = _region->data() + framesOffset + quint64(i) * framesPerSlab * _frameSize;
+        _slabs[i].refs = reinterpret_cast<QAtomicInt *>(_region->data() + refsOffset) + i * framesPerSlab;
+        _slabs[i].free = slabFrames(quint32(i));
+        _freeSlabs[i / 64] |= 1ull << (i % 64);
+    }
+}
+
+// Refcounts held by clones of a previous process are gone, only the root table counts
+void CPagePool::recount()
+{
+    for(quint32 frame = 1; frame < _nextFrame; ++frame)
+    {
+        quint32 index = frame - 1;
+        _slabs[int(index / framesPerSlab)].refs[index % framesPerSlab].store(0);
+    }
+
+    const quint32 *root = rootTable();
+    for(quint32 i = 0; i < _header->rootPages; ++i)
+        if(root[i] && root[i] < _nextFrame)
+            ref(root[i]);
+
+    _usedFrames.store(0);
+
+    for(quint32 frame = 1; frame < _nextFrame; ++frame)
+    {
+        quint32 index = frame - 1;
+        Slab &slab = _slabs[int(index / framesPerSlab)];
+
+        if(!slab.refs[index % framesPerSlab].load())
+            continue;
+
+        _usedFrames.ref();
+        slab.free &= ~(1ull << (index % framesPerSlab));
+        if(!slab.free)
+            _freeSlabs[int(index / framesPerSlab / 64)] &= ~(1ull << (index / framesPerSlab % 64));
+    }
+}
+
+quint64 CPagePool::frameSize() const
+{
+    return _frameSize;
+}
+
+quint32 CPagePool::maxFrames() const
+{
+    return _maxFrames;
+}
+
+quint32 CPagePool::usedFrames() const
+{
+    return quint32(_usedFrames.load());
+}
+
+quint32 *CPagePool::rootTable() const
+{
+    if(!_region)
+        return nullptr;
+
+    quint64 refsOffset, rootOffset, evictedOffset, framesOffset;
+    layout(_frameSize, _maxFrames, _header->rootPages, &refsOffset, &rootOffset, &evictedOffset, &framesOffset);
+    return reinterpret_cast<quint32 *>(_region->data() + rootOffset);
+}
+
+quint32 CPagePool::rootPages() const
+{
+    return _header ? _header->rootPages : 0;
+}
+
+quint64 *CPagePool::attributes() const
+{
+    return _header ? _header->attributes : nullptr;
+}
+
+quint32 *CPagePool::evictedTable() const
+{
+    if(!_region)
+        return nullptr;
+
+    quint64 refsOffset, rootOffset, evictedOffset, framesOffset;
+    layout(_frameSize, _maxFrames, _header->rootPages, &refsOffset, &rootOffset, &evictedOffset, &framesOffset);
+    return reinterpret_cast<quint32 *>(_region->data() + evictedOffset);
+}
+
+QString CPagePool::spillPath() const
+{
+    if(!_header)
+        return QString();
+
+    const ushort *path = _header->spillPath;
+    return QString::fromUtf16(path, int(std::find(path, path + maxSpillPath, 0) - path));
+}
+
+bool CPagePool::setSpillPath(const QString &path)
+{
+    if(!_header || path.size() >= maxSpillPath)
+        return false;
+
+    memcpy(_header->spillPath, path.utf16(), size_t(path.size()) * sizeof(ushort));
+    _header->spillPath[path.size()] = 0;
+    return true;
+}
+
+quint32 CPagePool::alloc(bool zeroed)
+{
+    quint32 frame;
+
+    {
+        QMutexLocker locker(&_mutex);
+
+        frame = takeFreeFrame();
+
+        // Every mapped frame is taken, a private pool maps its lowest unmapped slab
+        if(!frame)
+        {
+            int slab = 0;
+            while(slab < _slabs.size() && _slabs[slab].data)
+                ++slab;
+
+            if(slab == _slabs.size() || !mapSlab(quint32(slab)))
+                return 0;
+
+            frame = takeFreeFrame();
+        }
+
+        // High-water mark, a shared pool recounts the frames below it on attach
+        if(frame >= _nextFrame)
+        {
+            _nextFrame = frame + 1;
+            if(_header)
+                _header->nextFrame = _nextFrame;
+        }
+    }
+
+    quint32 index = frame - 1;
+    _slabs[int(index / framesPerSlab)].refs[index % framesPerSlab].store(1);
+    if(zeroed)
+        memset(data(frame), 0, _frameSize);
+    _usedFrames.ref();
+    return frame;
+}
+
+void CPagePool::ref(quint32 frame)
+{
+    quint32 index = frame - 1;
+    _slabs[int(index / framesPerSlab)].refs[index % framesPerSlab].ref();
+}
+
+void CPagePool::unref(quint32 frame)
+{
+    quint32 index = frame - 1;
+
+    if(_slabs[int(index / framesPerSlab)].refs[index % framesPerSlab].deref())
+        return;
+
+    _usedFrames.deref();
+
+    // Hand the memory back, a shared region would otherwise keep it forever
+    if(_region)
+        _region->release(data(frame) - _region->data(), _frameSize);
+
+    QMutexLocker locker(&_mutex);
+    putFreeFrame(frame);
+}
+
+bool CPagePool::isShared(quint32 frame) const
+{
+    quint32 index = frame - 1;
+    return _slabs[int(index / framesPerSlab)].refs[index % framesPerSlab].load() > 1;
+}
+
+quint8 *CPagePool::data(quint32 frame) const
+{
+    quint32 index = frame - 1;
+    return _slabs[int(index / framesPerSlab)].data + (index % framesPerSlab) * _frameSize;
+}
+
+// Slab memory is reserved and committed lazily by the OS, a fresh slab costs no RSS
+bool CPagePool::mapSlab(quint32 slab)
+{
+    quint64 bytes = _frameSize * framesPerSlab;
+
+#ifdef Q_OS_WIN
+    void *data = VirtualAlloc(NULL, SIZE_T(bytes), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if(data == NULL)
+        return false;
+#else
+    void *data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(data == MAP_FAILED)
+        return false;
+#endif
+
+    // Refcounts outlive a release, the slab may be mapped again
+    if(!_slabs[int(slab)].refs)
+        _slabs[int(slab)].refs = new QAtomicInt[framesPerSlab];
+    _slabs[int(slab)].data = static_cast<quint8 *>(data);
+    _slabs[int(slab)].free = slabFrames(slab);
+    _freeSlabs[int(slab / 64)] |= 1ull << (slab % 64);
+    return true;
+}
+
+void CPagePool::unmapSlab(quint32 slab)
+{
+#ifdef Q_OS_WIN
+    VirtualFree(_slabs[int(slab)].data, 0, MEM_RELEASE);
+#else
+    munmap(_slabs[int(slab)].data, _frameSize * framesPerSlab);
+#endif
+
+    _slabs[int(slab)].data = nullptr;
+    _slabs[int(slab)].free = 0;
+    _freeSlabs[int(slab / 64)] &= ~(1ull << (slab % 64));
+}
+
+quint32 CPagePool::releaseEmptySlabs()
+{
+    if(_region)
+        return 0;
+
+    QMutexLocker locker(&_mutex);
+    quint32 released = 0;
+
+    for(int i = 0; i < _slabs.size(); ++i)
+    {
+        if(!_slabs[i].data || _slabs[i].free != slabFrames(quint32(i)))
+            continue;
+
+        unmapSlab(quint32(i));
+        ++released;
+    }
+
+    return released;
+}
+
+// Frames of the slab that exist, the last slab may be cut short by maxFrames
+quint64 CPagePool::slabFrames(quint32 slab) const
+{
+    quint32 count = qMin(framesPerSlab, _maxFrames - slab * framesPerSlab);
+    return count == 64 ? ~0ull : (1ull << count) - 1;
+}
+
+// Lowest free frame of the lowest slab that has one, 0 if none
+quint32 CPagePool::takeFreeFrame()
+{
+    for(int word = 0; word < _freeSlabs.size(); ++word)
+    {
+        if(!_freeSlabs[word])
+            continue;
+
+        quint32 slab = quint32(word) * 64 + qCountTrailingZeroBits(_freeSlabs[word]);
+        quint64 &free = _slabs[int(slab)].free;
+        quint32 bit = qCountTrailingZeroBits(free);
+
+        free &= free - 1;
+        if(!free)
+            _freeSlabs[word] &= ~(1ull << (slab % 64));
+
+        return slab * framesPerSlab + bit + 1;
+    }
+
+    return 0;
+}
+
+void CPagePool::putFreeFrame(quint32 frame)
+{
+    quint32 index = frame - 1;
+    quint32 slab = index / framesPerSlab;
+
+    _slabs[int(slab)].free |= 1ull << (index % framesPerSlab);
+    _freeSlabs[int(slab / 64)] |= 1ull << (slab % 64);
+}
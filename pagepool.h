@@ -0,0 +1,105 @@
+#ifndef CPAGEPOOL_H
+#define CPAGEPOOL_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QVector>
+#include <QMutex>
+#include <QAtomicInt>
+
+#include "sharedregion.h"
+
+// Refcounted page frames shared by a store and its clones/snapshots.
+// Frames are carved out of slabs that are mapped on demand; frame 0 means "no frame".
+// The lowest free frame is handed out first, which keeps the pool packed at the
+// bottom and leaves slabs high up empty for releaseEmptySlabs().
+// A shared pool keeps frames, refcounts, the root page table and where the
+// store put pages it evicted in a named region, so the store can be
+// reattached after the process restarts.
+class CPagePool
+{
+public:
+    CPagePool(quint64 frameSize, quint32 maxFrames);
+    ~CPagePool();
+
+    static CPagePool *createShared(const QString &name, quint64 frameSize, quint32 maxFrames, quint32 rootPages);
+    static CPagePool *attachShared(const QString &name);
+
+    quint64 frameSize() const;
+    quint32 maxFrames() const;
+    quint32 usedFrames() const;
+
+    // Returns a frame holding one reference, 0 when the pool is exhausted.
+    // Without zeroed the caller overwrites the whole frame.
+    quint32 alloc(bool zeroed = true);
+    void ref(quint32 frame);
+    void unref(quint32 frame);
+    bool isShared(quint32 frame) const;
+
+    quint8 *data(quint32 frame) const;
+
+    // Unmaps slabs of a private pool that have no frame in use, returns how many.
+    // A shared pool gives each frame back in unref() already.
+    quint32 releaseEmptySlabs();
+
+    // Shared pools only, nullptr otherwise
+    quint32 *rootTable() const;
+    quint32 rootPages() const;
+    quint64 *attributes() const;
+    // One word per root page for the store, zero in a new region
+    quint32 *evictedTable() const;
+    // Empty without a shared pool, false when the path does not fit
+    QString spillPath() const;
+    bool setSpillPath(const QString &path);
+
+    static const quint32 framesPerSlab;
+    static const int attributeCount = 8;
+    static const int maxSpillPath = 1024;
+
+private:
+    Q_DISABLE_COPY(CPagePool)
+
+    struct Slab
+    {
+        quint8 *data;
+        QAtomicInt *refs;
+        quint64 free;                       // one bit per frame, framesPerSlab is 64
+    };
+
+    // Lives at offset 0 of the shared region
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        quint64 frameSize;
+        quint32 maxFrames;
+        quint32 nextFrame;
+        quint32 rootPages;
+        quint32 reserved;
+        quint64 attributes[attributeCount];
+        ushort spillPath[maxSpillPath];     // zero terminated
+    };
+
+    static quint64 layout(quint64 frameSize, quint32 maxFrames, quint32 rootPages, quint64 *refsOffset,
+                          quint64 *rootOffset, quint64 *evictedOffset, quint64 *framesOffset);
+    void setupRegion();
+    void recount();
+    bool mapSlab(quint32 slab);
+    void unmapSlab(quint32 slab);
+    quint64 slabFrames(quint32 slab) const;
+    quint32 takeFreeFrame();
+    void putFreeFrame(quint32 frame);
+
+    quint64 _frameSize;
+    quint32 _maxFrames;
+    quint32 _nextFrame;
+    QAtomicInt _usedFrames;
+    QVector<Slab> _slabs;
+    QVector<quint64> _freeSlabs;            // one bit per slab with a free frame
+    QMutex _mutex;
+
+    CSharedRegion *_region;
+    Header *_header;
+};
+
+#endif // CPAGEPOOL_H
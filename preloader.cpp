@@ -0,0 +1,228 @@
+#include "preloader.h"
+#include "ramstore.h"
+
+#include <QThread>
+#include <QDebug>
+
+#include <algorithm>
+
+const int CPreloader::readerThreads = 4;                            // overlap reads, more mostly adds seeks
+
+class CPreloadThread : public QThread
+{
+public:
+    explicit CPreloadThread(CPreloader *preloader) : _preloader(preloader) {}
+
+protected:
+    void run() override
+    {
+        _preloader->work();
+    }
+
+private:
+    CPreloader *_preloader;
+};
+
+CPreloader::CPreloader(CRamStore *store, const QString &path) : _store(store), _path(path),
+    _next(0), _loaded(0), _failed(0), _complete(0), _stopping(0), _demandLoads(0), _firstIo(-1), _loadedAt(-1), _demandFile(path)
+{
+    qDebug() << Q_FUNC_INFO << path;
+}
+
+CPreloader::~CPreloader()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    _stopping.store(1);
+
+    for(int i = 0; i < _threads.size(); ++i)
+    {
+        _threads[i]->wait();
+        delete _threads[i];
+    }
+}
+
+bool CPreloader::open()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    _timer.start();
+
+    if(!_demandFile.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot open seed image" << _path;
+        return false;
+    }
+
+    quint64 size = 0;
+    if(!CImageFile::mapImage(_demandFile, _extents, &size))
+        return false;
+
+    if(size > _store->size())
+    {
+        qDebug() << "Seed image" << _path << "is larger than the disk";
+        return false;
+    }
+
+    _state.resize(_extents.size());
+    _byDisk.resize(_extents.size());
+    for(int i = 0; i < _byDisk.size(); ++i)
+        _byDisk[i] = i;
+
+    std::sort(_byDisk.begin(), _byDisk.end(), [this](int a, int b) {
+        return _extents[a].diskOffset < _extents[b].diskOffset;
+    });
+
+    if(_extents.isEmpty())
+    {
+        _loadedAt.store(0);
+        _complete.storeRelease(1);
+    }
+
+    return true;
+}
+
+void CPreloader::start()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    if(_complete.load())
+        return;
+
+    for(int i = 0; i < readerThreads; ++i)
+    {
+        CPreloadThread *thread = new CPreloadThread(this);
+        _threads.append(thread);
+        thread->start();
+    }
+
+    qDebug() << "Seeding from" << _path << "with" << readerThreads << "readers," << _extents.size() << "extents";
+}
+
+// Reader thread, claims extents in file order
+void CPreloader::work()
+{
+    QFile file(_path);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot open seed image" << _path;
+        return;
+    }
+
+    QByteArray buffer;
+
+    while(!_stopping.load())
+    {
+        int extent = _next.fetchAndAddRelaxed(1);
+        if(extent >= _extents.size())
+            break;
+
+        if(_state[extent].testAndSetAcquire(Pending, Loading))
+            load(file, buffer, extent);
+    }
+}
+
+void CPreloader::load(QFile &file, QByteArray &buffer, int extent)
+{
+    const CImageFile::Extent &piece = _extents[extent];
+
+    // Waiters must not hang on a failed extent, they fail instead
+    bool ok = CImageFile::readExtent(file, piece, buffer) && CImageFile::storeExtent(_store, piece, buffer);
+    if(!ok)
+    {
+        _failed.fetchAndAddOrdered(1);
+        qDebug() << "Seed image extent at" << piece.diskOffset << "failed to load";
+    }
+
+    {
+        QMutexLocker locker(&_mutex);
+        _state[extent].storeRelease(ok ? Loaded : Failed);
+        _extentLoaded.wakeAll();
+    }
+
+    if(_loaded.fetchAndAddOrdered(1) + 1 == _extents.size())
+    {
+        _loadedAt.store(_timer.elapsed());
+
+        if(_failed.load() != 0)
+        {
+            qDebug() << "Seed image incomplete," << _failed.load() << "extents failed to load";
+            return;
+        }
+
+        _complete.storeRelease(1);
+        qDebug() << "Seed image loaded in" << _loadedAt.load() << "ms," << _demandLoads.load() << "extents on demand";
+    }
+}
+
+bool CPreloader::fetchMissing(quint64 offset, quint64 length)
+{
+    bool ok = true;
+
+    if(_firstIo.load() < 0 && _firstIo.testAndSetRelaxed(-1, _timer.elapsed()))
+        qDebug() << "First I/O" << _firstIo.load() << "ms after mount";
+
+    // First extent that ends past offset, extents do not overlap on the disk
+    QVector<int>::const_iterator it = std::partition_point(_byDisk.constBegin(), _byDisk.constEnd(), [&](int extent) {
+        return _extents[extent].diskOffset + _extents[extent].length <= offset;
+    });
+
+    for(; it != _byDisk.constEnd() && _extents[*it].diskOffset < offset + length; ++it)
+    {
+        int extent = *it;
+
+        // Ahead of the readers' queue
+        if(_state[extent].testAndSetAcquire(Pending, Loading))
+        {
+            QMutexLocker locker(&_demandMutex);
+            _demandLoads.fetchAndAddRelaxed(1);
+            load(_demandFile, _demandBuffer, extent);
+        }
+        else if(_state[extent].loadAcquire() == Loading)
+        {
+            QMutexLocker locker(&_mutex);
+            while(_state[extent].loadAcquire() == Loading)
+                _extentLoaded.wait(&_mutex);
+        }
+
+        if(_state[extent].loadAcquire() == Failed)
+            ok = false;
+    }
+
+    return ok;
+}
+
+bool CPreloader::isComplete() const
+{
+    return _complete.loadAcquire() != 0;
+}
+
+bool CPreloader::isFinished() const
+{
+    return _loaded.loadAcquire() == _extents.size();
+}
+
+int CPreloader::failedExtents() const
+{
+    return _failed.load();
+}
+
+double CPreloader::progress() const
+{
+    return _extents.isEmpty() ? 1.0 : double(_loaded.load()) / double(_extents.size());
+}
+
+qint64 CPreloader::timeToFirstIo() const
+{
+    return _firstIo.load();
+}
+
+qint64 CPreloader::timeToLoaded() const
+{
+    return _loadedAt.load();
+}
+
+quint64 CPreloader::demandLoads() const
+{
+    return _demandLoads.load();
+}
@@ -0,0 +1,98 @@
+#ifndef CPRELOADER_H
+#define CPRELOADER_H
+
+#include <QString>
+#include <QVector>
+#include <QFile>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+
+#include "imagefile.h"
+
+class CRamStore;
+class QThread;
+
+// Fills a freshly created store from a seed image in the background.
+// A pool of reader threads loads the image extents in file order. The disk
+// is usable meanwhile: fetch() is called before every foreground request and
+// loads the extents the request touches first, or waits for a reader that
+// already has them, so nothing reads around or is overwritten by the seed.
+// An extent that fails to load stays failed, requests touching it fail and
+// the seed never completes.
+class CPreloader
+{
+public:
+    CPreloader(CRamStore *store, const QString &path);
+    ~CPreloader();
+
+    // Maps the image, false when it cannot be read or does not fit the store
+    bool open();
+    // Starts the readers, the store's journal and dirty tracking should be set up by now
+    void start();
+
+    // False when the range touches an extent that failed to load
+    inline bool fetch(quint64 offset, quint64 length)
+    {
+        return _complete.load() || fetchMissing(offset, length);
+    }
+
+    // Every extent loaded
+    bool isComplete() const;
+    // Every extent loaded or failed
+    bool isFinished() const;
+    int failedExtents() const;
+    double progress() const;
+    // Milliseconds since open(), -1 until it happened
+    qint64 timeToFirstIo() const;
+    qint64 timeToLoaded() const;
+    quint64 demandLoads() const;
+
+    static const int readerThreads;
+
+private:
+    Q_DISABLE_COPY(CPreloader)
+
+    enum State
+    {
+        Pending = 0,
+        Loading = 1,
+        Loaded = 2,
+        Failed = 3
+    };
+
+    friend class CPreloadThread;
+
+    bool fetchMissing(quint64 offset, quint64 length);
+    void work();
+    void load(QFile &file, QByteArray &buffer, int extent);
+
+    CRamStore *_store;
+    QString _path;
+    QVector<CImageFile::Extent> _extents;   // file order, the readers' queue
+    QVector<int> _byDisk;                   // extent indexes ordered by disk offset
+    QVector<QAtomicInt> _state;
+    QVector<QThread *> _threads;
+
+    QAtomicInt _next;
+    QAtomicInt _loaded;                     // or failed
+    QAtomicInt _failed;
+    QAtomicInt _complete;
+    QAtomicInt _stopping;
+    QAtomicInteger<quint64> _demandLoads;
+    QAtomicInteger<qint64> _firstIo;
+    QAtomicInteger<qint64> _loadedAt;
+    QElapsedTimer _timer;
+
+    // Extents loaded by the foreground, one request thread at a time
+    QMutex _demandMutex;
+    QFile _demandFile;
+    QByteArray _demandBuffer;
+
+    QMutex _mutex;
+    QWaitCondition _extentLoaded;
+};
+
+#endif // CPRELOADER_H
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Heap allocations of the ImDisk request builders
+# over create/remove cycles, builds on Linux
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-alloctest
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    alloctest.cpp \
+    imdiskrequest.cpp
+
+HEADERS += \
+    imdiskrequest.h \
+    imdiskcompat.h
@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Headless console build, no widget stack
+#
+#-------------------------------------------------
+
+QT       = core network
+
+TARGET = qt-imdisk-cli
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+include(qt-imdisk.pri)
+
+# GetSystemTimePreciseAsFileTime for --timing
+DEFINES += _WIN32_WINNT=0x0602 WINVER=0x0602
+
+SOURCES += \
+    climain.cpp \
+    daemon.cpp
+
+HEADERS += \
+    daemon.h
@@ -0,0 +1,39 @@
+#-------------------------------------------------
+#
+# Kills a writer of a shared store and reattaches
+# to it, uses fork and SIGKILL so Linux only
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-crashtest
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+LIBS += -lrt
+
+SOURCES += \
+    crashtest.cpp \
+    latency.cpp \
+    telemetry.cpp \
+    ramstore.cpp \
+    pagepool.cpp \
+    sharedregion.cpp \
+    journal.cpp \
+    heatmap.cpp \
+    spillfile.cpp \
+    blockkernels.cpp
+
+HEADERS += \
+    latency.h \
+    telemetry.h \
+    ramstore.h \
+    pagepool.h \
+    sharedregion.h \
+    journal.h \
+    heatmap.h \
+    spillfile.h \
+    blockkernels.h \
+    blockgeometry.h
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Mount/unmount cycles against a simulated driver,
+# with and without the device handle cache
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-handlebench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    handlebench.cpp \
+    latency.cpp
+
+HEADERS += \
+    latency.h
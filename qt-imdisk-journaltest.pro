@@ -0,0 +1,39 @@
+#-------------------------------------------------
+#
+# Two power losses in a row against the journal,
+# uses fork and SIGKILL so Linux only
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-journaltest
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+LIBS += -lrt
+
+SOURCES += \
+    journaltest.cpp \
+    journal.cpp \
+    latency.cpp \
+    telemetry.cpp \
+    ramstore.cpp \
+    pagepool.cpp \
+    sharedregion.cpp \
+    heatmap.cpp \
+    spillfile.cpp \
+    blockkernels.cpp
+
+HEADERS += \
+    journal.h \
+    latency.h \
+    telemetry.h \
+    ramstore.h \
+    pagepool.h \
+    sharedregion.h \
+    heatmap.h \
+    spillfile.h \
+    blockkernels.h \
+    blockgeometry.h
@@ -0,0 +1,39 @@
+#-------------------------------------------------
+#
+# Block kernel and store geometry microbenchmarks,
+# one row per SIMD level the CPU supports
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-kernelbench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+unix:LIBS += -lrt
+
+SOURCES += \
+    kernelbench.cpp \
+    blockkernels.cpp \
+    latency.cpp \
+    telemetry.cpp \
+    ramstore.cpp \
+    pagepool.cpp \
+    sharedregion.cpp \
+    journal.cpp \
+    heatmap.cpp \
+    spillfile.cpp
+
+HEADERS += \
+    blockkernels.h \
+    blockgeometry.h \
+    latency.h \
+    telemetry.h \
+    ramstore.h \
+    pagepool.h \
+    sharedregion.h \
+    journal.h \
+    heatmap.h \
+    spillfile.h
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Small file and metadata benchmark for a mounted
+# disk, also runs on Linux against tmpfs or any
+# local directory
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-metabench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    metabench.cpp \
+    latency.cpp
+
+HEADERS += \
+    latency.h
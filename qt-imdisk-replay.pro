@@ -0,0 +1,44 @@
+#-------------------------------------------------
+#
+# Trace replay tool, builds without ImDisk so it
+# also runs on Linux benchmark hosts
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = qt-imdisk-replay
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+unix:LIBS += -lrt
+win32:LIBS += psapi.lib
+
+SOURCES += \
+    replay.cpp \
+    tracer.cpp \
+    latency.cpp \
+    telemetry.cpp \
+    ramstore.cpp \
+    pagepool.cpp \
+    sharedregion.cpp \
+    journal.cpp \
+    heatmap.cpp \
+    spillfile.cpp \
+    compactor.cpp \
+    blockkernels.cpp
+
+HEADERS += \
+    tracer.h \
+    latency.h \
+    telemetry.h \
+    ramstore.h \
+    pagepool.h \
+    sharedregion.h \
+    journal.h \
+    heatmap.h \
+    spillfile.h \
+    compactor.h \
+    blockkernels.h \
+    blockgeometry.h
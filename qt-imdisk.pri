@@ -0,0 +1,57 @@
+# Disk core shared by the GUI and the headless CLI
+
+QT += network
+
+IMDISK_SDK = "../imdisk_source"
+
+INCLUDEPATH += $$IMDISK_SDK/inc
+
+win32:CONFIG(release, debug|release):LIBS += "$$IMDISK_SDK/Release/imdisk.lib"
+win32:CONFIG(debug, debug|release):LIBS += "$$IMDISK_SDK/Debug/imdisk.lib"
+
+win32:LIBS += user32.lib advapi32.lib ntdll.lib psapi.lib
+
+SOURCES += \
+    $$PWD/ramdisk.cpp \
+    $$PWD/ramstore.cpp \
+    $$PWD/pagepool.cpp \
+    $$PWD/sharedregion.cpp \
+    $$PWD/journal.cpp \
+    $$PWD/writeback.cpp \
+    $$PWD/imdiskproxy.cpp \
+    $$PWD/readiness.cpp \
+    $$PWD/telemetry.cpp \
+    $$PWD/metricsserver.cpp \
+    $$PWD/latency.cpp \
+    $$PWD/tracer.cpp \
+    $$PWD/heatmap.cpp \
+    $$PWD/imagefile.cpp \
+    $$PWD/preloader.cpp \
+    $$PWD/blockkernels.cpp \
+    $$PWD/spillfile.cpp \
+    $$PWD/memorypressure.cpp \
+    $$PWD/compactor.cpp \
+    $$PWD/imdiskrequest.cpp
+
+HEADERS += \
+    $$PWD/ramdisk.h \
+    $$PWD/ramstore.h \
+    $$PWD/pagepool.h \
+    $$PWD/sharedregion.h \
+    $$PWD/journal.h \
+    $$PWD/writeback.h \
+    $$PWD/imdiskproxy.h \
+    $$PWD/readiness.h \
+    $$PWD/telemetry.h \
+    $$PWD/metricsserver.h \
+    $$PWD/latency.h \
+    $$PWD/tracer.h \
+    $$PWD/heatmap.h \
+    $$PWD/imagefile.h \
+    $$PWD/preloader.h \
+    $$PWD/blockkernels.h \
+    $$PWD/blockgeometry.h \
+    $$PWD/spillfile.h \
+    $$PWD/memorypressure.h \
+    $$PWD/compactor.h \
+    $$PWD/imdiskrequest.h
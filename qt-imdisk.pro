@@ -9,24 +9,16 @@ QT       += core gui widgets testlib
 TARGET = qt-imdisk
 TEMPLATE = app
 
-IMDISK_SDK = "../imdisk_source"
-
-INCLUDEPATH += $$IMDISK_SDK/inc
-
-win32:CONFIG(release, debug|release):LIBS += "$$IMDISK_SDK/Release/imdisk.lib"
-win32:CONFIG(debug, debug|release):LIBS += "$$IMDISK_SDK/Debug/imdisk.lib"
-
-win32:LIBS += user32.lib ntdll.lib
+include(qt-imdisk.pri)
 
 SOURCES += \
         main.cpp \
         widget.cpp \
-    ramdisk.cpp
+        heatmapview.cpp
 
 HEADERS += \
         widget.h \
-    ramdisk.h
+        heatmapview.h
 
 FORMS += \
         widget.ui
-
@@ -1,18 +1,41 @@
 #include "ramdisk.h"
-#include <QMessageBox>
+#include <QCoreApplication>
+#include <QFile>
+#include <QDir>
+#include <QStandardPaths>
 
 const QString CRamDisk::driveLetter = "R:";
 const QString CRamDisk::driveFileSystem = "/fs:ntfs";
+const QString CRamDisk::driveProxyName = "qt-imdisk-R";
+const QString CRamDisk::driveStoreName = "qt-imdisk-R-store";
+const bool CRamDisk::driveDurable = false;                       // journal writes, disk survives power loss
+const int CRamDisk::journalCommitInterval = 100;                 // ms between journal fsyncs
+const QString CRamDisk::driveBackingImage = "";                  // e.g. "D:/ramdisk.img", empty = no write-back
+const DWORD CRamDisk::readyTimeout = 10000;                      // ms for the driver or helper service to come up
+const QString CRamDisk::driveTracePath = "";                     // block I/O trace of the disk, empty = off
+const quint16 CRamDisk::metricsPort = 9477;                      // Prometheus endpoint on 127.0.0.1, 0 = off
+const int CRamDisk::heatDecayInterval = 10000;                   // ms between halvings of the access heat
+const int CRamDisk::seedWatchInterval = 1000;                    // ms between checks of a loading seed
+const double CRamDisk::workingSetSlack = 0.05;                   // extra miss ratio tolerated by the working set
+const bool CRamDisk::relieveMemoryPressure = true;               // compress and spill cold pages when the host runs short
+const bool CRamDisk::driveCompaction = true;                     // move pages into dense slabs in block order
 const quint64 CRamDisk::driveSize = 7ull*1024*1024*1024;         // 1Gb * 10^9 = bytes
+const quint64 CRamDisk::driveMaxSize = 28ull*1024*1024*1024;     // online growth limit, reserves address space only
+const DWORD CRamDisk::driveSectorSize = 512;                     // bytes per sector: 512, 4096 or 65536
 
 CRamDisk *CRamDisk::_instance = nullptr;
 
 // Wrapper for ImDisk
-CRamDisk::CRamDisk(QObject *parent) : QObject(parent), _wasMounted(false) //-V730
+CRamDisk::CRamDisk(QObject *parent) : QObject(parent), _wasMounted(false), _store(nullptr), _proxy(nullptr),
+    _journal(nullptr), _writeBack(nullptr), _snapshot(nullptr), _metrics(nullptr), _preloader(nullptr),
+    _pressure(nullptr), _compactor(nullptr), _seedSequence(0), _seedPasses(0) //-V730
 {
     qDebug() << Q_FUNC_INFO;
 
 	_deviceNumber = 0;
+    _driver = INVALID_HANDLE_VALUE;
+    _owner = NULL;
+    ZeroMemory(&_lastError, sizeof(CliError));
 }
 
 void CRamDisk::init()
@@ -25,6 +48,199 @@ void CRamDisk::init()
     ZeroMemory(&_diskGeometry, sizeof(DISK_GEOMETRY));
 
     _diskGeometry.Cylinders.QuadPart = driveSize;
+    _diskGeometry.BytesPerSector = driveSectorSize;
+
+    qDebug() << "Block kernels:" << CBlockKernels::name(CBlockKernels::level());
+
+    if(QCoreApplication::instance())
+        QCoreApplication::instance()->installNativeEventFilter(this);
+
+    connect(&_heatDecay, &QTimer::timeout, this, &CRamDisk::decayHeat, Qt::UniqueConnection);
+    _heatDecay.start(heatDecayInterval);
+    connect(&_seedWatch, &QTimer::timeout, this, &CRamDisk::watchSeed, Qt::UniqueConnection);
+
+    if(metricsPort && !_metrics)
+    {
+        _metrics = new CMetricsServer(this, this);
+        if(!_metrics->listen(metricsPort))
+            qDebug() << "Metrics endpoint unavailable on port" << metricsPort;
+    }
+
+    if(reattach())
+        qDebug() << "Reattached to device" << _deviceNumber;
+}
+
+// Picks up the store of a previous instance that exited without unmounting
+bool CRamDisk::reattach()
+{
+    // A live instance (the GUI next to the daemon, a second daemon) keeps the
+    // disk, its region, journal and image are not touched
+    if(!takeOwnership())
+    {
+        qDebug() << "Store owned by another instance";
+        return false;
+    }
+
+    _store = CRamStore::attachShared(driveStoreName);
+    if(!_store)
+    {
+        releaseOwnership();
+        return false;
+    }
+
+    // A seed still loading cannot be resumed, writes made meanwhile would be overwritten
+    if(!_store->attributes()[MountedAttribute] || _store->attributes()[SeedAttribute])
+    {
+        if(_store->attributes()[SeedAttribute])
+            qDebug() << "Store holds an incomplete seed";
+
+        CRamStore::removeShared(driveStoreName);
+        releaseStore();
+        return false;
+    }
+
+    // Spilled pages came back with the spill file, pages held compressed died with
+    // the previous process: the rest of the disk is served, reads of those fail
+    CRamStore::EvictionStats eviction = _store->evictionStats();
+    if(eviction.spilledPages || eviction.lostPages)
+        qDebug() << "Store kept" << eviction.spilledPages << "spilled pages, lost" << eviction.lostPages << "compressed pages";
+
+    _store->setSectorSize(_diskGeometry.BytesPerSector);
+    _diskGeometry.Cylinders.QuadPart = _store->size();
+
+    if(!driveBackingImage.isEmpty())
+        openWriteBack(false);
+
+    if(driveDurable)
+        openJournal(false);
+
+    _store->setHeatmap(true);
+    _proxy = new CImDiskProxy(_store, driveProxyName);
+    if(!_proxy->listen())
+    {
+        releaseStore();
+        return false;
+    }
+    _proxy->start();
+
+    if(!driveTracePath.isEmpty())
+        CTracer::begin(driveTracePath);
+
+    startBackgroundWork();
+
+    _deviceNumber = DWORD(_store->attributes()[DeviceNumberAttribute]);
+    _wasMounted = true;
+    return true;
+}
+
+// Returns true when the journal restored earlier contents into the store
+bool CRamDisk::openJournal(bool replay, bool staged)
+{
+    QString path = QString("%1/%2.journal")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation))
+            .arg(driveProxyName);
+
+    _journal = new CJournal(path, journalCommitInterval);
+
+    bool restored = replay && _journal->replay(_store) && _journal->sequence() != 0;
+
+    if(!_journal->open(_store, staged))
+    {
+        delete _journal;
+        _journal = nullptr;
+        return restored;
+    }
+
+    _store->setJournal(_journal);
+    return restored;
+}
+
+// Returns true when the backing image restored earlier contents into the store
+bool CRamDisk::openWriteBack(bool restore, bool staged)
+{
+    _writeBack = new CWriteBack(_store, driveBackingImage);
+
+    if(!_writeBack->open(restore, staged))
+    {
+        delete _writeBack;
+        _writeBack = nullptr;
+        return false;
+    }
+
+    return _writeBack->isRestored();
+}
+
+// Present from device creation until the journal and image hold the whole seed
+QString CRamDisk::seedMarkerPath() const
+{
+    return QString("%1/%2.seed")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation))
+            .arg(driveProxyName);
+}
+
+// Copies of the disk must not miss seed data that is still loading
+bool CRamDisk::ensureSeeded()
+{
+    return !_preloader || _preloader->fetch(0, _store->size());
+}
+
+void CRamDisk::watchSeed()
+{
+    // A failed seed never completes, its marker keeps refusing a restore
+    if(!_preloader || !_preloader->isComplete())
+    {
+        if(!_preloader || _preloader->isFinished())
+            _seedWatch.stop();
+        return;
+    }
+
+    if(_store->attributes()[SeedAttribute])
+    {
+        _store->attributes()[SeedAttribute] = 0;
+        _seedSequence = _journal ? _journal->sequence() : 0;
+        _seedPasses = _writeBack ? _writeBack->passes() : 0;
+        return;
+    }
+
+    // The pass running when the seed completed may have started before it
+    if((_journal && _journal->committedSequence() < _seedSequence) ||
+       (_writeBack && _writeBack->passes() < _seedPasses + 2))
+        return;
+
+    QFile::remove(seedMarkerPath());
+    _seedWatch.stop();
+}
+
+// Threads that only tend the memory of a served store
+void CRamDisk::startBackgroundWork()
+{
+    if(relieveMemoryPressure)
+        openMemoryPressure();
+
+    if(driveCompaction)
+    {
+        _compactor = new CCompactor(_store);
+        _compactor->start(QThread::LowPriority);
+    }
+}
+
+void CRamDisk::openMemoryPressure()
+{
+    QString path = QString("%1/%2.spill")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation))
+            .arg(driveProxyName);
+
+    // Without a spill file the store can still compress
+    if(!_store->setSpillFile(path))
+        qDebug() << "No spill file at" << path;
+
+    _pressure = new CMemoryPressure(_store);
+    if(!_pressure->open())
+    {
+        qDebug() << "Memory pressure unavailable";
+        delete _pressure;
+        _pressure = nullptr;
+    }
 }
 
 CRamDisk *CRamDisk::getInstance()
@@ -48,85 +264,616 @@ void CRamDisk::destroyInstance()
 CRamDisk::~CRamDisk()
 {
     qDebug() << Q_FUNC_INFO;
+
+    for(QMap<QString, Clone>::iterator it = _clones.begin(); it != _clones.end(); ++it)
+        releaseClone(it.value());
+
+    delete _snapshot;
+    releaseStore();
+
+    if(QCoreApplication::instance())
+        QCoreApplication::instance()->removeNativeEventFilter(this);
+
+    ImDiskCliInvalidateDevices(~0u);
+    ImDiskCliCloseDriver();
+}
+
+INT CRamDisk::mount(const QString &image)
+{
+    qDebug() << Q_FUNC_INFO << image;
+
+    QString format = QString("%1 /q /y").arg(driveFileSystem);
+    bool persistent = driveDurable || !driveBackingImage.isEmpty();
+
+    // The journal and image hold part of a seed, restoring them would serve holes
+    QFile marker(seedMarkerPath());
+    if(image.isEmpty() && persistent && marker.open(QIODevice::ReadOnly))
+    {
+        QString seed = QString::fromUtf8(marker.readAll());
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, 0,
+                             L"Seed image of the last mount did not finish loading, mount it again",
+                             (LPCWSTR)seed.utf16());
+    }
+
+    if(!takeOwnership())
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, 0,
+                             L"The disk is served by another instance");
+
+    // Disk memory lives in a named region, the driver reaches it through the proxy
+    _store = CRamStore::createShared(driveStoreName, driveSize, driveMaxSize);
+    if(!_store)
+    {
+        releaseOwnership();
+        return IMDISK_CLI_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // The driver issues whole sectors, the store splits them with the matching geometry
+    _store->setSectorSize(_diskGeometry.BytesPerSector);
+
+    bool restored;
+
+    if(!image.isEmpty())
+    {
+        _preloader = new CPreloader(_store, image);
+        _store->attributes()[SeedAttribute] = 1;
+        if(!_preloader->open())
+        {
+            CRamStore::removeShared(driveStoreName);
+            releaseStore();
+            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
+        }
+
+        // The seed replaces older contents in a new journal and image generation:
+        // a discard of everything ahead of the seed writes and an empty image.
+        // Both are staged, the old contents stay until the device exists.
+        if(driveDurable)
+        {
+            openJournal(false, true);
+            _store->discard(0, _store->size());
+        }
+
+        if(!driveBackingImage.isEmpty())
+            openWriteBack(false, true);
+
+        _preloader->start();
+        restored = true;
+    }
+    else
+    {
+        // A restored disk already carries its filesystem, the journal replays on top of the image
+        restored = !driveBackingImage.isEmpty() && openWriteBack(true);
+        if(driveDurable && openJournal(true))
+            restored = true;
+    }
+
+    if(restored)
+        format.clear();
+
+    // The image or journal may bring back the size of an earlier resize
+    _diskGeometry.Cylinders.QuadPart = _store->size();
+
+    _store->setHeatmap(true);
+    _proxy = new CImDiskProxy(_store, driveProxyName);
+    _proxy->setPreloader(_preloader);
+
+    if(!_proxy->listen())
+    {
+        CRamStore::removeShared(driveStoreName);
+        releaseStore();
+        return IMDISK_CLI_ERROR_CREATE_DEVICE;
+    }
+    _proxy->start();
+
+    if(!driveTracePath.isEmpty())
+        CTracer::begin(driveTracePath);
+
+    // utf16() hands out the string's own zero terminated buffer, nothing is copied
+    INT ret = this->ImDiskCliCreateDevice(&_deviceNumber, &_diskGeometry, &_imageOffset,
+                                          IMDISK_TYPE_PROXY | IMDISK_PROXY_TYPE_SHM,
+                                          (LPCWSTR)driveProxyName.utf16(), FALSE,
+                                          (LPCWSTR)driveLetter.utf16(), FALSE,
+                                          format.isEmpty() ? NULL : (LPCWSTR)format.utf16(), FALSE);
+    if(ret != IMDISK_CLI_SUCCESS && ret != IMDISK_CLI_ERROR_FORMAT)
+    {
+        CRamStore::removeShared(driveStoreName);
+        releaseStore();
+        return ret;
+    }
+
+    // Written ahead of the new generation, a crash in between refuses a restore of the old one
+    if(_preloader && persistent)
+    {
+        marker.setFileName(seedMarkerPath());
+        QDir().mkpath(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation));
+        if(marker.open(QIODevice::WriteOnly))
+        {
+            marker.write(image.toUtf8());
+            marker.close();
+        }
+    }
+    if(_preloader)
+        _seedWatch.start(seedWatchInterval);
+
+    // Staged only with a seed, a failed promotion is completed or dropped by the next open
+    if(_journal && !_journal->promote())
+        qDebug() << "Seed journal generation not promoted";
+    if(_writeBack && !_writeBack->promote())
+        qDebug() << "Seed image generation not promoted";
+
+    _store->attributes()[DeviceNumberAttribute] = _deviceNumber;
+    _store->attributes()[MountedAttribute] = 1;
+    _wasMounted = true;
+
+    startBackgroundWork();
+
+    return ret;
+}
+
+INT CRamDisk::unmount()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    // Clones share the pages of the store, they go first
+    while(!_clones.isEmpty())
+    {
+        INT ret = unmountClone(_clones.firstKey());
+        if(ret != IMDISK_CLI_SUCCESS)
+            return ret;
+    }
+
+    INT ret = this->ImDiskCliRemoveDevice(_deviceNumber, (LPCWSTR)driveLetter.utf16(), TRUE, FALSE, FALSE);
+    dumpLatency();
+
+    // The device still serves the drive, its memory has to stay
+    if(ret != IMDISK_CLI_SUCCESS)
+        return ret;
+
+    delete _snapshot;
+    _snapshot = nullptr;
+
+    if(_store)
+        _store->attributes()[MountedAttribute] = 0;
+    CRamStore::removeShared(driveStoreName);
+    releaseStore();
+    _wasMounted = false;
+    return ret;
+}
+
+void CRamDisk::releaseStore()
+{
+    delete _compactor;
+    _compactor = nullptr;
+
+    delete _pressure;
+    _pressure = nullptr;
+
+    // A disk left mounted is reattached by the next instance, compressed pages
+    // would not survive, spilled ones stay in the spill file
+    if(_store && _store->attributes() && _store->attributes()[MountedAttribute])
+    {
+        _store->restoreEvicted(~0ull);
+        _store->keepSpillFile();
+    }
+
+    delete _proxy;
+    _proxy = nullptr;
+
+    // Readers stop after their current extent, nothing is served any more
+    bool seeded = _preloader && _preloader->isComplete();
+    delete _preloader;
+    _preloader = nullptr;
+    _seedWatch.stop();
+
+    CTracer::end();
+
+    // Final commit and checkpoint before the store goes away
+    if(_journal)
+    {
+        _journal->close();
+        seeded = seeded && _journal->committedSequence() == _journal->sequence();
+        _store->setJournal(nullptr);
+        delete _journal;
+        _journal = nullptr;
+    }
+
+    // Residual dirty pages reach the image before the store goes away
+    if(_writeBack)
+        seeded = _writeBack->close() && seeded;
+    delete _writeBack;
+    _writeBack = nullptr;
+
+    if(seeded)
+        QFile::remove(seedMarkerPath());
+
+    delete _store;
+    _store = nullptr;
+
+    releaseOwnership();
+}
+
+// Held from creating or attaching the store until it is released. A crashed
+// owner leaves the mutex abandoned, which counts as free.
+bool CRamDisk::takeOwnership()
+{
+    if(_owner != NULL)
+        return true;
+
+    _owner = CreateMutex(NULL, FALSE, (LPCWSTR)QString("Global\\%1_Owner").arg(driveStoreName).utf16());
+    DWORD wait = _owner != NULL ? WaitForSingleObject(_owner, 0) : WAIT_FAILED;
+    if(wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED)
+    {
+        if(_owner != NULL)
+            CloseHandle(_owner);
+        _owner = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void CRamDisk::releaseOwnership()
+{
+    if(_owner == NULL)
+        return;
+
+    ReleaseMutex(_owner);
+    CloseHandle(_owner);
+    _owner = NULL;
+}
+
+bool CRamDisk::wasMounted()
+{
+    return _wasMounted;
+}
+
+QString CRamDisk::letter() const
+{
+    return driveLetter;
+}
+
+quint64 CRamDisk::size() const
+{
+    return _store ? _store->size() : driveSize;
+}
+
+quint64 CRamDisk::committedBytes() const
+{
+    return _store ? _store->committedPages() * CRamStore::pageSize : 0;
+}
+
+quint64 CRamDisk::residentBytes() const
+{
+    return _store ? _store->residentPages() * CRamStore::pageSize : 0;
+}
+
+CLatency::Summary CRamDisk::latency(CLatency::Operation operation) const
+{
+    return CLatency::summary(operation);
+}
+
+void CRamDisk::dumpLatency() const
+{
+    for(int i = 0; i < CLatency::OperationCount; ++i)
+    {
+        CLatency::Summary summary = latency(CLatency::Operation(i));
+        if(summary.count == 0)
+            continue;
+
+        qDebug() << "Latency" << CLatency::name(CLatency::Operation(i)) << summary.count << "ops, ns"
+                 << "p50" << summary.p50 << "p99" << summary.p99 << "p999" << summary.p999 << "max" << summary.max;
+    }
+}
+
+const CPreloader *CRamDisk::preloader() const
+{
+    return _preloader;
+}
+
+const CMemoryPressure *CRamDisk::memoryPressure() const
+{
+    return _pressure;
+}
+
+CRamStore::EvictionStats CRamDisk::evictionStats() const
+{
+    if(_store)
+        return _store->evictionStats();
+
+    CRamStore::EvictionStats none = {};
+    return none;
+}
+
+const CCompactor *CRamDisk::compactor() const
+{
+    return _compactor;
+}
+
+QString CRamDisk::lastError() const
+{
+    if(_lastError.Code == IMDISK_CLI_SUCCESS)
+        return QString();
+
+    QString text = QString::fromWCharArray(_lastError.Context);
+    if(_lastError.Subject[0])
+        text += QString(" (%1)").arg(QString::fromWCharArray(_lastError.Subject));
+
+    // Only turned into text when asked for, failing requests print nothing
+    WCHAR system[256];
+    if(_lastError.Win32Error && FormatMessageW(FORMAT_MESSAGE_MAX_WIDTH_MASK | FORMAT_MESSAGE_FROM_SYSTEM |
+                                               FORMAT_MESSAGE_IGNORE_INSERTS, NULL, _lastError.Win32Error, 0,
+                                               system, sizeof(system) / sizeof(*system), NULL))
+        text += ": " + QString::fromWCharArray(system).trimmed();
+
+    return text;
+}
+
+const CHeatmap *CRamDisk::heatmap() const
+{
+    return _store ? _store->heatmap() : nullptr;
+}
+
+quint64 CRamDisk::workingSetBytes() const
+{
+    const CHeatmap *heat = heatmap();
+    return heat ? heat->workingSetPages(workingSetSlack) * CRamStore::pageSize : 0;
+}
+
+void CRamDisk::decayHeat()
+{
+    if(_store && _store->heatmap())
+        _store->heatmap()->decay();
+}
+
+double CRamDisk::dedupRatio() const
+{
+    if(!_store || _store->residentPages() == 0)
+        return 1.0;
+
+    quint64 logical = _store->committedPages();
+    if(_snapshot)
+        logical += _snapshot->committedPages();
+    for(QMap<QString, Clone>::const_iterator it = _clones.begin(); it != _clones.end(); ++it)
+        logical += it.value().store->committedPages();
+
+    return double(logical) / double(_store->residentPages());
+}
+
+// Pushes dirty filesystem data down to the store
+void CRamDisk::flushVolume()
+{
+    WCHAR volume_path[] = L"\\\\.\\ :";
+    volume_path[4] = driveLetter[0].unicode();
+
+    HANDLE volume = ImDiskCliCachedDevice(_deviceNumber);
+    if(volume != INVALID_HANDLE_VALUE)
+        FlushFileBuffers(volume);
+    else
+    {
+        volume = CreateFile(volume_path, GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if(volume != INVALID_HANDLE_VALUE)
+        {
+            FlushFileBuffers(volume);
+            CloseHandle(volume);
+        }
+        else
+            PrintLastError(L"Error flushing volume:");
+    }
+}
+
+// Freezes the current contents of the disk, later clones start from this point
+bool CRamDisk::snapshot()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    if(!_wasMounted || !ensureSeeded())
+        return false;
+
+    flushVolume();
+
+    delete _snapshot;
+    _snapshot = _store->snapshot();
+    return true;
+}
+
+bool CRamDisk::exportImage(const QString &path)
+{
+    qDebug() << Q_FUNC_INFO << path;
+
+    if(!_wasMounted || !ensureSeeded())
+        return false;
+
+    flushVolume();
+
+    // Exported from a private snapshot, the disk stays writable meanwhile
+    CRamStore *frozen = _store->snapshot();
+    bool ok = CImageFile::exportImage(frozen, path, CImageFile::formatFor(path));
+    delete frozen;
+    return ok;
+}
+
+// Growing extends the store first, then the device and its NTFS volume.
+// ImDisk devices cannot shrink: the volume is shrunk instead, which fails while
+// files use the cut clusters, and the store releases the memory behind them.
+// The store, size() and the backing image keep the device size then, the tail
+// reads as zeros and a later resize up to that size only extends the volume.
+INT CRamDisk::resize(quint64 bytes)
+{
+    qDebug() << Q_FUNC_INFO << bytes;
+
+    if(!_wasMounted)
+        return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+
+    DWORD sector = _diskGeometry.BytesPerSector;
+    if(bytes < 2 * sector || bytes % sector || bytes > _store->capacity())
+        return IMDISK_CLI_ERROR_BAD_SYNTAX;
+
+    quint64 device = _store->size();
+
+    if(bytes > device)
+    {
+        // The driver may read the new range as soon as it knows about it
+        if(!_store->resize(bytes))
+            return IMDISK_CLI_ERROR_NOT_ENOUGH_MEMORY;
+
+        LARGE_INTEGER extended;
+        INT ret = this->ImDiskCliExtendDevice(_deviceNumber, LONGLONG(bytes - device), &extended);
+        if(ret != IMDISK_CLI_SUCCESS)
+        {
+            // Only the volume step may have failed, the driver then serves the new range already
+            if(quint64(extended.QuadPart) == device)
+                _store->resize(device);
+            else
+                _diskGeometry.Cylinders.QuadPart = bytes;
+            return ret;
+        }
+
+        _diskGeometry.Cylinders.QuadPart = bytes;
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    // The last sector keeps the backup boot sector of the volume
+    INT ret = this->ImDiskCliResizeVolume((LPCWSTR)driveLetter.utf16(), LONGLONG(bytes / sector) - 1);
+    if(ret != IMDISK_CLI_SUCCESS)
+        return ret;
+
+    if(bytes < device)
+        _store->discard(bytes, device - bytes);
+    return IMDISK_CLI_SUCCESS;
+}
+
+bool CRamDisk::mountClone(const QString &letter)
+{
+    qDebug() << Q_FUNC_INFO << letter;
+
+    CRamStore *source = _snapshot ? _snapshot : _store;
+    if(!source || _clones.contains(letter) || (source == _store && !ensureSeeded()))
+        return false;
+
+    Clone clone;
+    clone.deviceNumber = IMDISK_AUTO_DEVICE_NUMBER;
+    clone.store = source->clone();
+    clone.proxy = new CImDiskProxy(clone.store, QString("%1-%2").arg(driveProxyName).arg(letter[0]));
+
+    if(!clone.proxy->listen())
+    {
+        releaseClone(clone);
+        return false;
+    }
+    clone.proxy->start();
+
+    // Already formatted, the clone carries the filesystem of its source
+    DISK_GEOMETRY geometry = _diskGeometry;
+    LARGE_INTEGER offset = _imageOffset;
+    INT ret = this->ImDiskCliCreateDevice(&clone.deviceNumber, &geometry, &offset,
+                                          IMDISK_TYPE_PROXY | IMDISK_PROXY_TYPE_SHM,
+                                          (LPCWSTR)clone.proxy->name().utf16(), FALSE,
+                                          (LPCWSTR)letter.utf16(), FALSE, NULL, FALSE);
+    if(ret != IMDISK_CLI_SUCCESS)
+    {
+        releaseClone(clone);
+        return false;
+    }
+
+    _clones.insert(letter, clone);
+    return true;
 }
 
-void CRamDisk::mount()
+INT CRamDisk::unmountClone(const QString &letter)
 {
-    qDebug() << Q_FUNC_INFO;
+    qDebug() << Q_FUNC_INFO << letter;
 
-    QString format = QString("%1 /q /y").arg(driveFileSystem);
+    if(!_clones.contains(letter))
+        return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
 
-    this->ImDiskCliCreateDevice(&_deviceNumber, &_diskGeometry, &_imageOffset, 0, NULL, FALSE,
-                                (LPWSTR)driveLetter.toStdWString().c_str(), FALSE, (LPWSTR)format.toStdWString().c_str(), FALSE);
-    _wasMounted = true;
+    // Like the disk, a clone still served keeps its memory
+    INT ret = this->ImDiskCliRemoveDevice(_clones[letter].deviceNumber, (LPCWSTR)letter.utf16(), TRUE, FALSE, FALSE);
+    if(ret != IMDISK_CLI_SUCCESS)
+        return ret;
+
+    Clone clone = _clones.take(letter);
+    releaseClone(clone);
+    return ret;
 }
 
-void CRamDisk::unmount()
+bool CRamDisk::nativeEventFilter(const QByteArray &eventType, void *message, long *result)
 {
-    qDebug() << Q_FUNC_INFO;
+    Q_UNUSED(result);
 
-    this->ImDiskCliRemoveDevice(_deviceNumber, driveLetter.toStdWString().c_str(), TRUE, FALSE, FALSE);
-    _wasMounted = false;
+    if(eventType != "windows_generic_MSG")
+        return false;
+
+    MSG *msg = static_cast<MSG *>(message);
+    if(msg->message != WM_DEVICECHANGE || msg->wParam != DBT_DEVICEREMOVECOMPLETE)
+        return false;
+
+    DEV_BROADCAST_HDR *header = reinterpret_cast<DEV_BROADCAST_HDR *>(msg->lParam);
+    if(header && header->dbch_devicetype == DBT_DEVTYP_VOLUME)
+        ImDiskCliInvalidateDevices(reinterpret_cast<DEV_BROADCAST_VOLUME *>(header)->dbcv_unitmask);
+
+    return false;
 }
 
-bool CRamDisk::wasMounted()
+void CRamDisk::releaseClone(Clone &clone)
 {
-    return _wasMounted;
+    delete clone.proxy;
+    clone.proxy = nullptr;
+
+    delete clone.store;
+    clone.store = nullptr;
 }
 
 
 // ============================================
 // WinAPI, C-style code, (Hungarian Notation)
 // ============================================
+// Formats into stack buffers, longer messages are cut
 BOOL CRamDisk::ImDiskOemPrintF(FILE *Stream, LPCSTR Message, ...)
 {
     va_list param_list;
-    LPSTR lpBuf = NULL;
+    CHAR buf[1024];
 
     va_start(param_list, Message);
 
     if (!FormatMessageA(78 |
-                        FORMAT_MESSAGE_ALLOCATE_BUFFER |
                         FORMAT_MESSAGE_FROM_STRING, Message, 0, 0,
-                        (LPSTR) &lpBuf, 0, &param_list))
+                        buf, sizeof(buf), &param_list))
 	{
 		va_end(param_list);
         return FALSE;
 	}
 
-    CharToOemA(lpBuf, lpBuf);
-    fprintf(Stream, "%s\n", lpBuf);
-    LocalFree(lpBuf);
+    CharToOemA(buf, buf);
+    fprintf(Stream, "%s\n", buf);
 	va_end(param_list);
     return TRUE;
 }
 
 VOID CRamDisk::PrintLastError(LPCWSTR Prefix)
 {
-    LPSTR MsgBuf;
+    CHAR msg_buf[512];
 
     if (!FormatMessageA(FORMAT_MESSAGE_MAX_WIDTH_MASK |
-                        FORMAT_MESSAGE_ALLOCATE_BUFFER |
                         FORMAT_MESSAGE_FROM_SYSTEM |
                         FORMAT_MESSAGE_IGNORE_INSERTS,
-                        NULL, GetLastError(), 0, (LPSTR) &MsgBuf, 0, NULL))
-        MsgBuf = NULL;
+                        NULL, GetLastError(), 0, msg_buf, sizeof(msg_buf), NULL))
+        msg_buf[0] = 0;
 
-    ImDiskOemPrintF(stderr, "%1!ws! %2", Prefix, MsgBuf);
-
-    if (MsgBuf != NULL)
-        LocalFree(MsgBuf);
+    ImDiskOemPrintF(stderr, "%1!ws! %2", Prefix, msg_buf);
 }
 
-LPVOID CRamDisk::ImDiskCliAssertNotNull(LPVOID Ptr)
+// Records why a request failed and returns Code, lastError() turns it into text
+INT CRamDisk::ImDiskCliFail(INT Code, DWORD Win32Error, LPCWSTR Context, LPCWSTR Subject)
 {
-    if (Ptr == NULL)
-        RaiseException(STATUS_NO_MEMORY,
-                       EXCEPTION_NONCONTINUABLE,
-                       0,
-                       NULL);
+    _lastError.Code = Code;
+    _lastError.Win32Error = Win32Error;
+    _lastError.Context = Context;
+    _lastError.Subject[0] = 0;
+
+    if (Subject != NULL)
+        lstrcpynW(_lastError.Subject, Subject, MAX_PATH);
 
-    return Ptr;
+    return Code;
 }
 
 BOOL CRamDisk::ImDiskCliCheckDriverVersion(HANDLE Device)
@@ -143,32 +890,33 @@ BOOL CRamDisk::ImDiskCliCheckDriverVersion(HANDLE Device)
         {
         case ERROR_INVALID_FUNCTION:
         case ERROR_NOT_SUPPORTED:
-            fputs("Error: Not an ImDisk device.\r\n", stderr);
+            ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION, 0,
+                          L"Not an ImDisk device");
             return FALSE;
 
         default:
-            PrintLastError(L"Error opening device:");
+            ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION, GetLastError(),
+                          L"Error opening device");
             return FALSE;
         }
 
     if (BytesReturned < sizeof VersionCheck)
-    {
-        fprintf(stderr,
-                "Wrong version of ImDisk Virtual Disk Driver.\n"
-                "No current driver version information, expected: %u.%u.\n"
-                "Please reinstall ImDisk and reboot if this issue persists.\n",
-                HIBYTE(IMDISK_DRIVER_VERSION), LOBYTE(IMDISK_DRIVER_VERSION));
-        return FALSE;
-    }
+        VersionCheck = 0;
 
     if (VersionCheck != IMDISK_DRIVER_VERSION)
     {
-        fprintf(stderr,
-                "Wrong version of ImDisk Virtual Disk Driver.\n"
-                "Expected: %u.%u Installed: %u.%u\n"
-                "Please re-install ImDisk and reboot if this issue persists.\n",
-                HIBYTE(IMDISK_DRIVER_VERSION), LOBYTE(IMDISK_DRIVER_VERSION),
-                HIBYTE(VersionCheck), LOBYTE(VersionCheck));
+        WCHAR versions[64];
+
+        _snwprintf(versions, sizeof(versions) / sizeof(*versions) - 1,
+                   L"expected %u.%u, installed %u.%u",
+                   HIBYTE(IMDISK_DRIVER_VERSION), LOBYTE(IMDISK_DRIVER_VERSION),
+                   HIBYTE(VersionCheck), LOBYTE(VersionCheck));
+        versions[sizeof(versions) / sizeof(*versions) - 1] = 0;
+
+        ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION, 0,
+                      L"Wrong version of ImDisk Virtual Disk Driver, please "
+                      L"re-install ImDisk and reboot if this issue persists",
+                      versions);
         return FALSE;
     }
 
@@ -177,11 +925,14 @@ BOOL CRamDisk::ImDiskCliCheckDriverVersion(HANDLE Device)
 
 BOOL CRamDisk::ImDiskCliValidateDriveLetterTarget(LPCWSTR DriveLetter, LPCWSTR ValidTargetPath)
 {
-    DWORD len = (DWORD)wcslen(ValidTargetPath) + 2;
-    LPWSTR target = (LPWSTR)ImDiskCliAssertNotNull(_alloca(len << 1));
+    CRequestString target(_requestArena);
+
+    // Room for one more character, so a longer target does not compare equal
+    if (!target.reserve(wcslen(ValidTargetPath) + 1))
+        return FALSE;
 
-    if (QueryDosDevice(DriveLetter, target, len))
-        if (wcscmp(target, ValidTargetPath) == 0)
+    if (QueryDosDevice(DriveLetter, target.data(), (DWORD)target.capacity() + 1))
+        if (wcscmp(target.data(), ValidTargetPath) == 0)
             return TRUE;
         else
             return FALSE;
@@ -200,10 +951,7 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
 
     WCHAR temporary_mount_point[] = { 255, L':', 0 };
 
-#pragma warning(suppress: 6305)
-    LPWSTR format_cmd = (LPWSTR)
-        ImDiskCliAssertNotNull(_alloca(sizeof(format_cmd_prefix) +
-        sizeof(temporary_mount_point) + (wcslen(FormatOptions) << 1)));
+    CRequestString format_cmd(_requestArena);
 
     STARTUPINFO startup_info = { sizeof(startup_info) };
     PROCESS_INFORMATION process_info;
@@ -212,21 +960,30 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
 
     int iReturnCode;
 
+    if (!format_cmd.append(format_cmd_prefix) ||
+            !format_cmd.reserve(format_cmd.length() + 3 + wcslen(FormatOptions)))
+        return ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, ERROR_NOT_ENOUGH_MEMORY,
+                             L"Error building format command");
+
     HANDLE hMutex = CreateMutex(NULL, FALSE, format_mutex);
     if (hMutex == NULL)
-    {
-        PrintLastError(L"Error creating mutex object:");
-        return IMDISK_CLI_ERROR_FORMAT;
-    }
+        return ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, GetLastError(),
+                             L"Error creating mutex object");
 
-    switch (WaitForSingleObject(hMutex, INFINITE))
+    // Another format may hold the mutex, wait for it but stay cancellable
+    switch (CReadiness(INFINITE).waitHandle(hMutex))
     {
-    case WAIT_OBJECT_0:
-    case WAIT_ABANDONED:
+    case CReadiness::Ready:
         break;
 
+    case CReadiness::Cancelled:
+        CloseHandle(hMutex);
+        return ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, ERROR_CANCELLED,
+                             L"Format cancelled");
+
     default:
-        PrintLastError(L"Error, mutex object failed:");
+        ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, GetLastError(),
+                      L"Error, mutex object failed");
         CloseHandle(hMutex);
         return IMDISK_CLI_ERROR_FORMAT;
     }
@@ -244,9 +1001,8 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
 
     if (temporary_mount_point[0] == 0)
     {
-        fprintf
-            (stderr,
-                "Format failed. No free drive letters available.\r\n");
+        ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, 0,
+                      L"Format failed, no free drive letters available");
 
         ReleaseMutex(hMutex);
         CloseHandle(hMutex);
@@ -260,7 +1016,8 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
             temporary_mount_point,
             DevicePath))
         {
-            PrintLastError(L"Error defining drive letter:");
+            ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, GetLastError(),
+                          L"Error defining drive letter", temporary_mount_point);
             ReleaseMutex(hMutex);
             CloseHandle(hMutex);
             return IMDISK_CLI_ERROR_FORMAT;
@@ -269,6 +1026,9 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
         if (!ImDiskCliValidateDriveLetterTarget(temporary_mount_point,
             DevicePath))
         {
+            ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, 0,
+                          L"Drive letter points elsewhere", temporary_mount_point);
+
             if (!DefineDosDevice(DDD_REMOVE_DEFINITION |
                 DDD_EXACT_MATCH_ON_REMOVE |
                 DDD_RAW_TARGET_PATH,
@@ -285,12 +1045,12 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
 
     printf("Formatting disk %ws...\n", temporary_mount_point);
 
-    wcscpy(format_cmd, format_cmd_prefix);
-    wcscat(format_cmd, temporary_mount_point);
-    wcscat(format_cmd, L" ");
-    wcscat(format_cmd, FormatOptions);
+    // Reserved above, appending cannot fail
+    format_cmd.append(temporary_mount_point);
+    format_cmd.append(L" ");
+    format_cmd.append(FormatOptions);
 
-    if (CreateProcess(NULL, format_cmd, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL,
+    if (CreateProcess(NULL, format_cmd.data(), NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL,
         &startup_info, &process_info))
     {
         CloseHandle(process_info.hThread);
@@ -299,10 +1059,8 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
         iReturnCode = IMDISK_CLI_SUCCESS;
     }
     else
-    {
-        PrintLastError(L"Cannot format drive:");
-        iReturnCode = IMDISK_CLI_ERROR_FORMAT;
-    }
+        iReturnCode = ImDiskCliFail(IMDISK_CLI_ERROR_FORMAT, GetLastError(),
+                                    L"Cannot format drive", temporary_mount_point);
 
     if (temp_drive_defined)
     {
@@ -323,65 +1081,223 @@ INT CRamDisk::ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR
     return iReturnCode;
 }
 
-INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeometry, PLARGE_INTEGER ImageOffset,
-                                    DWORD Flags, LPCWSTR FileName, BOOL NativePath, LPWSTR MountPoint,
-                                    BOOL NumericPrint, LPWSTR FormatOptions, BOOL SaveSettings)
+// The control device handle is opened and version checked once, later creations reuse it
+INT CRamDisk::ImDiskCliOpenDriver(PHANDLE Driver)
 {
-    PIMDISK_CREATE_DATA create_data;
     HANDLE driver;
     UNICODE_STRING file_name;
-    DWORD dw;
-    WCHAR device_path[MAX_PATH];
-
-    RtlInitUnicodeString(&file_name, IMDISK_CTL_DEVICE_NAME);
 
-    for (;;)
+    if (_driver != INVALID_HANDLE_VALUE)
     {
-        driver = ImDiskOpenDeviceByName(&file_name,
-                                        GENERIC_READ | GENERIC_WRITE);
-
-        if (driver != INVALID_HANDLE_VALUE)
-            break;
-
-        if (GetLastError() != ERROR_FILE_NOT_FOUND)
+        if (ImDiskCliHandleAlive(_driver))
         {
-            PrintLastError(L"Error controlling the ImDisk Virtual Disk Driver:");
-            return IMDISK_CLI_ERROR_DRIVER_INACCESSIBLE;
+            *Driver = _driver;
+            return IMDISK_CLI_SUCCESS;
         }
 
+        ImDiskCliCloseDriver();
+    }
+
+    RtlInitUnicodeString(&file_name, IMDISK_CTL_DEVICE_NAME);
+
+    driver = ImDiskOpenDeviceByName(&file_name,
+                                    GENERIC_READ | GENERIC_WRITE);
+
+    if ((driver == INVALID_HANDLE_VALUE) &
+            (GetLastError() == ERROR_FILE_NOT_FOUND))
+    {
+
         if (!ImDiskStartService((LPWSTR)IMDISK_DRIVER_NAME))
             switch (GetLastError())
             {
             case ERROR_SERVICE_DOES_NOT_EXIST:
-                fputs("The ImDisk Virtual Disk Driver is not installed. "
-                      "Please re-install ImDisk.\r\n", stderr);
-                return IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED, 0,
+                                     L"The ImDisk Virtual Disk Driver is not installed, "
+                                     L"please re-install ImDisk");
 
             case ERROR_PATH_NOT_FOUND:
             case ERROR_FILE_NOT_FOUND:
-                fputs("Cannot load imdisk.sys. "
-                      "Please re-install ImDisk.\r\n", stderr);
-                return IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED, GetLastError(),
+                                     L"Cannot load imdisk.sys, please re-install ImDisk");
 
             case ERROR_SERVICE_DISABLED:
-                fputs("The ImDisk Virtual Disk Driver is disabled.\r\n", stderr);
-                return IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED, 0,
+                                     L"The ImDisk Virtual Disk Driver is disabled");
 
             default:
-                PrintLastError(L"Error loading ImDisk Virtual Disk Driver:");
-                return IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_NOT_INSTALLED, GetLastError(),
+                                     L"Error loading ImDisk Virtual Disk Driver");
             }
 
-        Sleep(0);
+        // The control device appears once the driver has initialized
+        CReadiness::Result ready = CReadiness(readyTimeout).wait([&]() {
+            driver = ImDiskOpenDeviceByName(&file_name,
+                                            GENERIC_READ | GENERIC_WRITE);
+            return (driver != INVALID_HANDLE_VALUE) |
+                    (GetLastError() != ERROR_FILE_NOT_FOUND);
+        });
+
+        if (ready != CReadiness::Ready)
+            return ready == CReadiness::Cancelled ?
+                        ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_INACCESSIBLE, ERROR_CANCELLED,
+                                      L"Loading the ImDisk Virtual Disk Driver cancelled") :
+                        ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_INACCESSIBLE, ERROR_TIMEOUT,
+                                      L"The ImDisk Virtual Disk Driver did not start in time");
+
         puts("The ImDisk Virtual Disk Driver was loaded into the kernel.");
     }
 
+    if (driver == INVALID_HANDLE_VALUE)
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DRIVER_INACCESSIBLE, GetLastError(),
+                             L"Error controlling the ImDisk Virtual Disk Driver");
+
     if (!ImDiskCliCheckDriverVersion(driver))
     {
         CloseHandle(driver);
         return IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION;
     }
 
+    _driver = driver;
+    *Driver = driver;
+    return IMDISK_CLI_SUCCESS;
+}
+
+VOID CRamDisk::ImDiskCliCloseDriver()
+{
+    if (_driver != INVALID_HANDLE_VALUE)
+        CloseHandle(_driver);
+
+    _driver = INVALID_HANDLE_VALUE;
+}
+
+VOID CRamDisk::ImDiskCliCacheDevice(PIMDISK_CREATE_DATA CreateData)
+{
+    DeviceHandle cached;
+
+    cached.Device = ImDiskOpenDeviceByNumber(CreateData->DeviceNumber,
+                                             GENERIC_READ | GENERIC_WRITE);
+
+    if (cached.Device == INVALID_HANDLE_VALUE)
+        return;
+
+    memcpy(&cached.Data, CreateData, sizeof(IMDISK_CREATE_DATA));
+    cached.Data.FileNameLength = 0;
+
+    // Device numbers are reused by the driver
+    INT index = ImDiskCliFindDevice(CreateData->DeviceNumber);
+    if (index >= 0)
+    {
+        CloseHandle(_deviceHandles[index].Device);
+        _deviceHandles[index] = cached;
+    }
+    else
+        _deviceHandles.append(cached);
+}
+
+// Index in _deviceHandles, -1 when not cached
+INT CRamDisk::ImDiskCliFindDevice(DWORD DeviceNumber)
+{
+    for (INT i = 0; i < _deviceHandles.size(); ++i)
+        if (_deviceHandles[i].Data.DeviceNumber == DeviceNumber)
+            return i;
+
+    return -1;
+}
+
+// A cached handle outlives a device removed behind our back (imdisk -D, another
+// tool), and the headless daemon never sees WM_DEVICECHANGE. One IOCTL on the
+// handle tells, still cheaper than the opens and queries it saves.
+BOOL CRamDisk::ImDiskCliHandleAlive(HANDLE Device)
+{
+    DWORD version;
+    DWORD dw;
+
+    return DeviceIoControl(Device,
+                           IOCTL_IMDISK_QUERY_VERSION,
+                           NULL, 0,
+                           &version, sizeof version,
+                           &dw, NULL) &&
+            (dw >= sizeof version) && (version == IMDISK_DRIVER_VERSION);
+}
+
+// Index of a cached device whose handle still works, a stale one is dropped, -1 when not cached
+INT CRamDisk::ImDiskCliFindLiveDevice(DWORD DeviceNumber)
+{
+    INT index = ImDiskCliFindDevice(DeviceNumber);
+    if (index < 0)
+        return -1;
+
+    if (ImDiskCliHandleAlive(_deviceHandles[index].Device))
+        return index;
+
+    CloseHandle(_deviceHandles[index].Device);
+    _deviceHandles.remove(index);
+    return -1;
+}
+
+// Hands the cached handle over to the caller, who closes it
+BOOL CRamDisk::ImDiskCliTakeDevice(DWORD DeviceNumber, LPCWSTR MountPoint, DeviceHandle *Cached)
+{
+    INT index = ImDiskCliFindLiveDevice(DeviceNumber);
+    if (index < 0)
+        return FALSE;
+
+    if ((MountPoint != NULL) && (towupper(MountPoint[0]) != towupper(_deviceHandles[index].Data.DriveLetter)))
+        return FALSE;
+
+    *Cached = _deviceHandles[index];
+    _deviceHandles.remove(index);
+    return TRUE;
+}
+
+HANDLE CRamDisk::ImDiskCliCachedDevice(DWORD DeviceNumber)
+{
+    INT index = ImDiskCliFindLiveDevice(DeviceNumber);
+    if (index < 0)
+        return INVALID_HANDLE_VALUE;
+
+    return _deviceHandles[index].Device;
+}
+
+// Bit n of UnitMask stands for drive letter 'A' + n
+VOID CRamDisk::ImDiskCliInvalidateDevices(DWORD UnitMask)
+{
+    INT i = 0;
+
+    while (i < _deviceHandles.size())
+    {
+        WCHAR letter = _deviceHandles[i].Data.DriveLetter;
+
+        if ((letter >= L'A') & (letter <= L'Z') ?
+                (UnitMask & (1u << (letter - L'A'))) != 0 : UnitMask == ~0u)
+        {
+            CloseHandle(_deviceHandles[i].Device);
+            _deviceHandles.remove(i);
+        }
+        else
+            ++i;
+    }
+}
+
+INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeometry, PLARGE_INTEGER ImageOffset,
+                                    DWORD Flags, LPCWSTR FileName, BOOL NativePath, LPCWSTR MountPoint,
+                                    BOOL NumericPrint, LPCWSTR FormatOptions, BOOL SaveSettings)
+{
+    PIMDISK_CREATE_DATA create_data;
+    HANDLE driver;
+    DWORD dw;
+    WCHAR device_path[MAX_PATH];
+    BOOL name_built;
+
+    // Blocks of the previous request are no longer referenced
+    _requestArena.reset();
+    CCreateRequest request(_requestArena);
+    _lastError.Code = IMDISK_CLI_SUCCESS;
+
+    INT ret = ImDiskCliOpenDriver(&driver);
+    if (ret != IMDISK_CLI_SUCCESS)
+        return ret;
+
     // Physical memory allocation requires the AWEAlloc driver.
     if (((IMDISK_TYPE(Flags) == IMDISK_TYPE_FILE) |
          (IMDISK_TYPE(Flags) == 0)) &
@@ -415,26 +1331,22 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
             switch (GetLastError())
             {
             case ERROR_SERVICE_DOES_NOT_EXIST:
-                fputs("The AWEAlloc driver is not installed.\r\n"
-                      "Please re-install ImDisk.\r\n", stderr);
-                break;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, 0,
+                                     L"The AWEAlloc driver is not installed, please re-install ImDisk");
 
             case ERROR_PATH_NOT_FOUND:
             case ERROR_FILE_NOT_FOUND:
-                fputs("Cannot load AWEAlloc driver.\r\n"
-                      "Please re-install ImDisk.\r\n", stderr);
-                break;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, GetLastError(),
+                                     L"Cannot load AWEAlloc driver, please re-install ImDisk");
 
             case ERROR_SERVICE_DISABLED:
-                fputs("The AWEAlloc driver is disabled.\r\n", stderr);
-                break;
+                return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, 0,
+                                     L"The AWEAlloc driver is disabled");
 
             default:
-                PrintLastError(L"Error loading AWEAlloc driver:");
+                return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, GetLastError(),
+                                     L"Error loading AWEAlloc driver");
             }
-
-            CloseHandle(driver);
-            return IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE;
         }
     }
     // Proxy reconnection types requires the user mode service.
@@ -446,11 +1358,33 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
             if (GetLastError() == ERROR_FILE_NOT_FOUND)
                 if (ImDiskStartService((LPWSTR)IMDPROXY_SVC))
                 {
-                    while (!WaitNamedPipe(IMDPROXY_SVC_PIPE_DOSDEV_NAME, 0))
-                        if (GetLastError() == ERROR_FILE_NOT_FOUND)
-                            Sleep(200);
-                        else
-                            break;
+                    // Running as told by the service control manager, then a free pipe instance
+                    CReadiness waiter(readyTimeout);
+                    CReadiness::Result ready = waiter.waitService(IMDPROXY_SVC);
+
+                    if (ready == CReadiness::Ready)
+                        ready = waiter.waitPipe(IMDPROXY_SVC_PIPE_DOSDEV_NAME);
+
+                    switch (ready)
+                    {
+                    case CReadiness::Ready:
+                        break;
+
+                    case CReadiness::Cancelled:
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, ERROR_CANCELLED,
+                                             L"Starting the ImDisk Virtual Disk Driver Helper "
+                                             L"Service cancelled");
+
+                    case CReadiness::Failed:
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, GetLastError(),
+                                             L"The ImDisk Virtual Disk Driver Helper Service "
+                                             L"stopped while starting");
+
+                    default:
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, ERROR_TIMEOUT,
+                                             L"The ImDisk Virtual Disk Driver Helper Service did "
+                                             L"not start in time");
+                    }
 
                     puts
                             ("The ImDisk Virtual Disk Driver Helper Service was started.");
@@ -460,101 +1394,75 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
                     switch (GetLastError())
                     {
                     case ERROR_SERVICE_DOES_NOT_EXIST:
-                        fputs("The ImDisk Virtual Disk Driver Helper Service is not "
-                              "installed.\r\n"
-                              "Please re-install ImDisk.\r\n", stderr);
-                        break;
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, 0,
+                                             L"The ImDisk Virtual Disk Driver Helper Service is not "
+                                             L"installed, please re-install ImDisk");
 
                     case ERROR_PATH_NOT_FOUND:
                     case ERROR_FILE_NOT_FOUND:
-                        fputs("Cannot start ImDisk Virtual Disk Driver Helper "
-                              "Service.\r\n"
-                              "Please re-install ImDisk.\r\n", stderr);
-                        break;
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, GetLastError(),
+                                             L"Cannot start ImDisk Virtual Disk Driver Helper "
+                                             L"Service, please re-install ImDisk");
 
                     case ERROR_SERVICE_DISABLED:
-                        fputs("The ImDisk Virtual Disk Driver Helper Service is "
-                              "disabled.\r\n", stderr);
-                        break;
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, 0,
+                                             L"The ImDisk Virtual Disk Driver Helper Service is "
+                                             L"disabled");
 
                     default:
-                        PrintLastError
-                                (L"Error starting ImDisk Virtual Disk Driver Helper "
-                                 L"Service:");
+                        return ImDiskCliFail(IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE, GetLastError(),
+                                             L"Error starting ImDisk Virtual Disk Driver Helper "
+                                             L"Service");
                     }
-
-                    CloseHandle(driver);
-                    return IMDISK_CLI_ERROR_SERVICE_INACCESSIBLE;
                 }
     }
 
+    // The NT name goes straight into the request, no intermediate copies
     if (FileName == NULL)
-        RtlInitUnicodeString(&file_name, NULL);
+        name_built = TRUE;
     else if (NativePath)
-    {
-        if (!RtlCreateUnicodeString(&file_name, FileName))
-        {
-            CloseHandle(driver);
-            fputs("Memory allocation error.\r\n", stderr);
-            return IMDISK_CLI_ERROR_FATAL;
-        }
-    }
+        name_built = request.appendFileName(FileName, wcslen(FileName));
     else if ((IMDISK_TYPE(Flags) == IMDISK_TYPE_PROXY) &
              (IMDISK_PROXY_TYPE(Flags) == IMDISK_PROXY_TYPE_SHM))
     {
-        LPWSTR namespace_prefix;
-        LPWSTR prefixed_name;
-        HANDLE h = CreateFile(L"\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
-                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if ((h == INVALID_HANDLE_VALUE) &
-                (GetLastError() == ERROR_FILE_NOT_FOUND))
-            namespace_prefix = (LPWSTR)L"\\BaseNamedObjects\\";
-        else
-            namespace_prefix = (LPWSTR)L"\\BaseNamedObjects\\Global\\";
-
-        if (h != INVALID_HANDLE_VALUE)
-            CloseHandle(h);
+        // Does not change while we run, looked up on the first proxy creation
+        static LPCWSTR namespace_prefix = NULL;
 
-        prefixed_name = (LPWSTR) //-V635
-                _alloca(((wcslen(namespace_prefix) + wcslen(FileName)) << 1) + 1);
-
-        if (prefixed_name == NULL)
+        if (namespace_prefix == NULL)
         {
-            CloseHandle(driver);
-            fputs("Memory allocation error.\r\n", stderr);
-            return IMDISK_CLI_ERROR_FATAL;
-        }
-
-        wcscpy(prefixed_name, namespace_prefix);
-        wcscat(prefixed_name, FileName);
+            HANDLE h = CreateFile(L"\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if ((h == INVALID_HANDLE_VALUE) &
+                    (GetLastError() == ERROR_FILE_NOT_FOUND))
+                namespace_prefix = L"\\BaseNamedObjects\\";
+            else
+                namespace_prefix = L"\\BaseNamedObjects\\Global\\";
 
-        if (!RtlCreateUnicodeString(&file_name, prefixed_name))
-        {
-            CloseHandle(driver);
-            fputs("Memory allocation error.\r\n", stderr);
-            return IMDISK_CLI_ERROR_FATAL;
+            if (h != INVALID_HANDLE_VALUE)
+                CloseHandle(h);
         }
+
+        name_built = request.appendFileName(namespace_prefix, wcslen(namespace_prefix)) &&
+                request.appendFileName(FileName, wcslen(FileName));
     }
     else
     {
+        // Only image files take this path, the conversion allocates from the process heap
+        UNICODE_STRING file_name;
+
         if (!RtlDosPathNameToNtPathName_U(FileName, &file_name, NULL, NULL))
-        {
-            CloseHandle(driver);
-            fputs("Memory allocation error.\r\n", stderr);
-            return IMDISK_CLI_ERROR_FATAL;
-        }
-    }
+            return ImDiskCliFail(IMDISK_CLI_ERROR_NOT_ENOUGH_MEMORY, ERROR_NOT_ENOUGH_MEMORY,
+                                 L"Error converting image path", FileName);
 
-    create_data = static_cast<PIMDISK_CREATE_DATA>(alloca(sizeof(IMDISK_CREATE_DATA) + file_name.Length));
-    if (create_data == NULL)
-    {
-        perror("Memory allocation error");
-        CloseHandle(driver);
+        name_built = request.appendFileName(file_name.Buffer, file_name.Length >> 1);
         RtlFreeUnicodeString(&file_name);
-        return IMDISK_CLI_ERROR_FATAL;
     }
 
-    ZeroMemory(create_data, sizeof(IMDISK_CREATE_DATA) + file_name.Length);
+    if (!name_built)
+        return ImDiskCliFail(IMDISK_CLI_ERROR_NOT_ENOUGH_MEMORY, ERROR_NOT_ENOUGH_MEMORY,
+                             L"Error building create request", FileName);
+
+    create_data = request.data();
 
     puts("Creating device...");
 
@@ -569,32 +1477,22 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
     create_data->DiskGeometry = *DiskGeometry;
     create_data->ImageOffset = *ImageOffset;
     create_data->Flags = Flags;
-    create_data->FileNameLength = file_name.Length;
-
-    if (file_name.Length != 0)
-    {
-        memcpy(&create_data->FileName, file_name.Buffer, file_name.Length);
-        RtlFreeUnicodeString(&file_name);
-    }
 
     if (!DeviceIoControl(driver,
                          IOCTL_IMDISK_CREATE_DEVICE,
                          create_data,
-                         sizeof(IMDISK_CREATE_DATA) +
-                         create_data->FileNameLength,
+                         request.size(),
                          create_data,
-                         sizeof(IMDISK_CREATE_DATA) +
-                         create_data->FileNameLength,
+                         request.size(),
                          &dw,
                          NULL))
     {
-        PrintLastError(L"Error creating virtual disk:");
-        CloseHandle(driver);
+        ImDiskCliFail(IMDISK_CLI_ERROR_CREATE_DEVICE, GetLastError(),
+                      L"Error creating virtual disk", MountPoint);
+        ImDiskCliCloseDriver();
         return IMDISK_CLI_ERROR_CREATE_DEVICE;
     }
 
-    CloseHandle(driver);
-
     *DeviceNumber = create_data->DeviceNumber;
 
     // Build device path, e.g. \Device\ImDisk2
@@ -644,7 +1542,7 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
                         ("Warning: The device is created without a mount point.\r\n",
                          stderr);
 
-                MountPoint[0] = 0;
+                MountPoint = NULL;
             }
         }
 #ifndef _WIN64
@@ -672,11 +1570,14 @@ INT CRamDisk::ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeo
     }
 
     if (FormatOptions != NULL)
-        return ImDiskCliFormatDisk(device_path,
-                                   create_data->DriveLetter,
-                                   FormatOptions);
+        ret = ImDiskCliFormatDisk(device_path,
+                                  create_data->DriveLetter,
+                                  FormatOptions);
 
-    return IMDISK_CLI_SUCCESS;
+    // Opened after format.com, which needs the volume to itself
+    ImDiskCliCacheDevice(create_data);
+
+    return ret;
 }
 
 INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL ForceDismount, BOOL EmergencyRemove, BOOL RemoveSettings)
@@ -684,29 +1585,51 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
     WCHAR drive_letter_mount_point[] = L" :";
     DWORD dw;
 
+    _requestArena.reset();
+    _lastError.Code = IMDISK_CLI_SUCCESS;
+
+    DeviceHandle cached;
+    BOOL is_cached = ImDiskCliTakeDevice(DeviceNumber, MountPoint, &cached);
+
     if (EmergencyRemove)
     {
+        if (is_cached)
+            CloseHandle(cached.Device);
+
         puts("Emergency removal...");
 
         if (!ImDiskForceRemoveDevice(NULL, DeviceNumber))
-        {
-            PrintLastError(MountPoint == NULL ? L"Error" : MountPoint);
-            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
-        }
+            return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                                 L"Emergency removal failed", MountPoint);
     }
     else
     {
-        PIMDISK_CREATE_DATA create_data = (PIMDISK_CREATE_DATA)
-                _alloca(sizeof(IMDISK_CREATE_DATA) + (MAX_PATH << 2));
+        // Inline room for the longest name a query returns
+        CCreateRequest request(_requestArena);
+        PIMDISK_CREATE_DATA create_data = request.data();
         HANDLE device;
 
-        if (create_data == NULL)
+        BOOL is_drive_letter = (MountPoint != NULL) &&
+            ((wcslen(MountPoint) == 2) ? MountPoint[1] == ':' :
+             (wcslen(MountPoint) == 3) ? wcscmp(MountPoint + 1, L":\\") == 0
+             : FALSE);
+
+        // Notify processes that this device is about to be removed,
+        // with or without a cached handle.
+        if (is_drive_letter && ((MountPoint[0] >= L'A') & (MountPoint[0] <= L'Z')))
         {
-            perror("Memory allocation error");
-            return IMDISK_CLI_ERROR_FATAL;
+            puts("Notifying applications...");
+
+            ImDiskNotifyRemovePending(NULL, MountPoint[0]);
         }
 
-        if (MountPoint == NULL)
+        // Handle and query data kept from creation, no reopen and no IOCTL round trips
+        if (is_cached)
+        {
+            device = cached.Device;
+            memcpy(create_data, &cached.Data, sizeof(IMDISK_CREATE_DATA));
+        }
+        else if (MountPoint == NULL)
         {
             device = ImDiskOpenDeviceByNumber(DeviceNumber,
                                               GENERIC_READ | GENERIC_WRITE);
@@ -719,21 +1642,11 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
                 device = ImDiskOpenDeviceByNumber(DeviceNumber,
                                                   FILE_READ_ATTRIBUTES);
         }
-        else if ((wcslen(MountPoint) == 2) ? MountPoint[1] == ':' :
-                 (wcslen(MountPoint) == 3) ? wcscmp(MountPoint + 1, L":\\") == 0
-                 : FALSE)
+        else if (is_drive_letter)
         {
             WCHAR drive_letter_path[] = L"\\\\.\\ :";
             drive_letter_path[4] = MountPoint[0];
 
-            // Notify processes that this device is about to be removed.
-            if ((MountPoint[0] >= L'A') & (MountPoint[0] <= L'Z'))
-            {
-                puts("Notifying applications...");
-
-                ImDiskNotifyRemovePending(NULL, MountPoint[0]);
-            }
-
             DbgOemPrintF((stdout, "Opening %1!ws!...\n", MountPoint));
 
             device = CreateFile(drive_letter_path,
@@ -773,70 +1686,64 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
                 switch (GetLastError())
                 {
                 case ERROR_INVALID_PARAMETER:
-                    fputs("This version of Windows only supports drive letters as "
-                          "mount points.\r\n"
-                          "Windows 2000 or higher is required to support "
-                          "subdirectory mount points.\r\n",
-                          stderr);
-                    return IMDISK_CLI_ERROR_BAD_MOUNT_POINT;
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_BAD_MOUNT_POINT, 0,
+                                         L"This version of Windows only supports drive letters "
+                                         L"as mount points", MountPoint);
 
                 case ERROR_INVALID_FUNCTION:
-                    fputs("Mount points are only supported on NTFS volumes.\r\n",
-                          stderr);
-                    return IMDISK_CLI_ERROR_BAD_MOUNT_POINT;
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_BAD_MOUNT_POINT, 0,
+                                         L"Mount points are only supported on NTFS volumes",
+                                         MountPoint);
 
                 case ERROR_NOT_A_REPARSE_POINT:
                 case ERROR_DIRECTORY:
                 case ERROR_DIR_NOT_EMPTY:
-                    ImDiskOemPrintF(stderr, "Not a mount point: '%1!ws!'\n",
-                                    MountPoint);
-                    return IMDISK_CLI_ERROR_BAD_MOUNT_POINT;
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_BAD_MOUNT_POINT, 0,
+                                         L"Not a mount point", MountPoint);
 
                 default:
-                    PrintLastError(MountPoint);
-                    return IMDISK_CLI_ERROR_BAD_MOUNT_POINT;
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_BAD_MOUNT_POINT, GetLastError(),
+                                         L"Error opening mount point", MountPoint);
                 }
         }
 
-        if (device == INVALID_HANDLE_VALUE)
-            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        if (!is_cached)
+        {
+            if (device == INVALID_HANDLE_VALUE)
+                if (GetLastError() == ERROR_FILE_NOT_FOUND)
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_NOT_FOUND, 0,
+                                         L"No such device", MountPoint);
+                else
+                    return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                                         L"Error opening device", MountPoint);
+
+            if (!ImDiskCliCheckDriverVersion(device))
             {
-                fputs("No such device.\r\n", stderr);
-                return IMDISK_CLI_ERROR_DEVICE_NOT_FOUND;
+                CloseHandle(device);
+                return IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION;
             }
-            else
+
+            if (!DeviceIoControl(device,
+                                 IOCTL_IMDISK_QUERY_DEVICE,
+                                 NULL,
+                                 0,
+                                 create_data,
+                                 request.capacity(),
+                                 &dw, NULL))
             {
-                PrintLastError(L"Error opening device:");
+                ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                              L"Is that drive really an ImDisk drive?", MountPoint);
+                CloseHandle(device);
                 return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
             }
 
-        if (!ImDiskCliCheckDriverVersion(device))
-        {
-            CloseHandle(device);
-            return IMDISK_CLI_ERROR_DRIVER_WRONG_VERSION;
-        }
-
-        if (!DeviceIoControl(device,
-                             IOCTL_IMDISK_QUERY_DEVICE,
-                             NULL,
-                             0,
-                             create_data,
-                             sizeof(IMDISK_CREATE_DATA) + (MAX_PATH << 2),
-                             &dw, NULL))
-        {
-            PrintLastError(MountPoint);
-            ImDiskOemPrintF(stderr,
-                            "%1!ws!: Is that drive really an ImDisk drive?",
-                            MountPoint);
-            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
-        }
-
-        if (dw < sizeof(IMDISK_CREATE_DATA) - sizeof(*create_data->FileName))
-        {
-            ImDiskOemPrintF(stderr,
-                            "%1!ws!: Is that drive really an ImDisk drive?",
-                            MountPoint);
-            return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
+            if (dw < sizeof(IMDISK_CREATE_DATA) - sizeof(*create_data->FileName))
+            {
+                ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, 0,
+                              L"Is that drive really an ImDisk drive?", MountPoint);
+                CloseHandle(device);
+                return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
+            }
         }
 
         if ((MountPoint == NULL) & (create_data->DriveLetter != 0))
@@ -891,7 +1798,9 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
             }
             else
             {
-                PrintLastError(MountPoint == NULL ? L"Error" : MountPoint);
+                ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                              L"Error locking volume", MountPoint);
+                CloseHandle(device);
                 return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
             }
         else
@@ -907,7 +1816,9 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
                                  &dw,
                                  NULL))
             {
-                PrintLastError(MountPoint == NULL ? L"Error" : MountPoint);
+                ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                              L"Error dismounting filesystem", MountPoint);
+                CloseHandle(device);
                 return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
             }
         }
@@ -924,7 +1835,9 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
                              NULL))
             if (ForceDismount ? !ImDiskForceRemoveDevice(device, 0) : FALSE)
             {
-                PrintLastError(MountPoint == NULL ? L"Error" : MountPoint);
+                ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                              L"Error removing device", MountPoint);
+                CloseHandle(device);
                 return IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE;
             }
 
@@ -979,3 +1892,158 @@ INT CRamDisk::ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL
 
     return 0;
 }
+
+INT CRamDisk::ImDiskCliExtendDevice(DWORD DeviceNumber, LONGLONG ExtendSize, PLARGE_INTEGER DeviceSize)
+{
+    LARGE_INTEGER extend_size;
+    extend_size.QuadPart = ExtendSize;
+
+    _lastError.Code = IMDISK_CLI_SUCCESS;
+
+    printf("Extending device %u...\n", DeviceNumber);
+
+    // Grows the NTFS volume on the device as well
+    BOOL extended = ImDiskExtendDevice(NULL, DeviceNumber, &extend_size);
+    DWORD error = GetLastError();
+
+    // The cached handle carries the old size, removal reopens the device
+    INT index = ImDiskCliFindDevice(DeviceNumber);
+    if (index >= 0)
+    {
+        CloseHandle(_deviceHandles[index].Device);
+        _deviceHandles.remove(index);
+    }
+
+    if (!extended)
+    {
+        // The device may have grown before the volume failed, taken as grown when it cannot be told
+        DeviceSize->QuadPart = -1;
+        _requestArena.reset();
+        CCreateRequest request(_requestArena);
+        if (ImDiskQueryDevice(DeviceNumber, request.data(), request.capacity()))
+            DeviceSize->QuadPart = request.data()->DiskGeometry.Cylinders.QuadPart;
+
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, error,
+                             L"Error extending device");
+    }
+
+    puts("Done.");
+
+    return IMDISK_CLI_SUCCESS;
+}
+
+INT CRamDisk::ImDiskCliResizeVolume(LPCWSTR MountPoint, LONGLONG NewSectors)
+{
+    WCHAR volume_path[] = L"\\\\.\\ :";
+    volume_path[4] = MountPoint[0];
+
+    NTFS_VOLUME_DATA_BUFFER volume_data;
+    SHRINK_VOLUME_INFORMATION shrink_info = { ShrinkPrepare, 0, NewSectors };
+    DWORD dw;
+    DWORD error = 0;
+    BOOL ok;
+
+    _lastError.Code = IMDISK_CLI_SUCCESS;
+
+    HANDLE volume = CreateFile(volume_path, GENERIC_READ | GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (volume == INVALID_HANDLE_VALUE)
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, GetLastError(),
+                             L"Error opening volume", MountPoint);
+
+    if (!DeviceIoControl(volume,
+                         FSCTL_GET_NTFS_VOLUME_DATA,
+                         NULL,
+                         0,
+                         &volume_data,
+                         sizeof(volume_data),
+                         &dw,
+                         NULL))
+    {
+        error = GetLastError();
+        CloseHandle(volume);
+        return ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, error,
+                             L"Error querying NTFS volume", MountPoint);
+    }
+
+    if (NewSectors == volume_data.NumberSectors.QuadPart)
+    {
+        CloseHandle(volume);
+        return IMDISK_CLI_SUCCESS;
+    }
+
+    if (NewSectors > volume_data.NumberSectors.QuadPart)
+    {
+        puts("Extending filesystem...");
+
+        ok = DeviceIoControl(volume,
+                             FSCTL_EXTEND_VOLUME,
+                             &NewSectors,
+                             sizeof(NewSectors),
+                             NULL,
+                             0,
+                             &dw,
+                             NULL);
+        if (!ok)
+        {
+            error = GetLastError();
+            ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, error,
+                          L"Error extending filesystem", MountPoint);
+        }
+    }
+    else
+    {
+        puts("Shrinking filesystem...");
+
+        // Prepare keeps new allocations below the new end,
+        // commit fails while clusters past it are still in use
+        ok = DeviceIoControl(volume,
+                             FSCTL_SHRINK_VOLUME,
+                             &shrink_info,
+                             sizeof(shrink_info),
+                             NULL,
+                             0,
+                             &dw,
+                             NULL);
+        if (ok)
+        {
+            shrink_info.ShrinkRequestType = ShrinkCommit;
+            ok = DeviceIoControl(volume,
+                                 FSCTL_SHRINK_VOLUME,
+                                 &shrink_info,
+                                 sizeof(shrink_info),
+                                 NULL,
+                                 0,
+                                 &dw,
+                                 NULL);
+        }
+
+        if (!ok)
+        {
+            // Taken before the abort overwrites it
+            error = GetLastError();
+            ImDiskCliFail(IMDISK_CLI_ERROR_DEVICE_INACCESSIBLE, error,
+                          L"Error shrinking filesystem, the tail is in use "
+                          L"(defrag /X moves files out of it)", MountPoint);
+
+            shrink_info.ShrinkRequestType = ShrinkAbort;
+            DeviceIoControl(volume,
+                            FSCTL_SHRINK_VOLUME,
+                            &shrink_info,
+                            sizeof(shrink_info),
+                            NULL,
+                            0,
+                            &dw,
+                            NULL);
+        }
+    }
+
+    CloseHandle(volume);
+
+    if (!ok)
+        return _lastError.Code;
+
+    puts("Done.");
+
+    return IMDISK_CLI_SUCCESS;
+}
@@ -5,6 +5,10 @@
 #include <QChar>
 #include <QDebug>
 #include <QProcess>
+#include <QMap>
+#include <QVarLengthArray>
+#include <QTimer>
+#include <QAbstractNativeEventFilter>
 
 #include <windows.h>
 #include <winioctl.h>
@@ -20,6 +24,22 @@
 #include <imdisk.h>
 #include <imdproxy.h>
 
+#include "ramstore.h"
+#include "imdiskproxy.h"
+#include "journal.h"
+#include "writeback.h"
+#include "readiness.h"
+#include "metricsserver.h"
+#include "latency.h"
+#include "tracer.h"
+#include "heatmap.h"
+#include "imagefile.h"
+#include "preloader.h"
+#include "blockkernels.h"
+#include "memorypressure.h"
+#include "compactor.h"
+#include "imdiskrequest.h"
+
 enum
 {
     IMDISK_CLI_SUCCESS = 0,
@@ -42,7 +62,7 @@ enum
 #define DbgOemPrintF(x)
 
 // Wrapper for ImDisk
-class CRamDisk : public QObject
+class CRamDisk : public QObject, public QAbstractNativeEventFilter
 {
     Q_OBJECT
 protected:
@@ -50,22 +70,121 @@ protected:
     ~CRamDisk();
 
 public slots:
-    void unmount();
+    INT unmount();
+
+private slots:
+    void decayHeat();
+    void watchSeed();
 
 public:
-    void mount();
+    // With a seed image (raw or VHD) the disk is usable at once and filled in the background
+    INT mount(const QString &image = QString());
     bool wasMounted();
+    QString letter() const;
+    quint64 size() const;
+    // Online resize to a multiple of the sector size, up to driveMaxSize.
+    // Shrinking only shrinks the volume, the device keeps its size.
+    INT resize(quint64 bytes);
+    quint64 committedBytes() const;
+    quint64 residentBytes() const;
+    // Logical pages of the disk, its clones and snapshot per pool frame in use
+    double dedupRatio() const;
+    // Latency percentiles in nanoseconds since start, over all disks of this process
+    CLatency::Summary latency(CLatency::Operation operation) const;
+    void dumpLatency() const;
+    // Access heat of the mounted disk, nullptr when not mounted
+    const CHeatmap *heatmap() const;
+    // Memory that serves nearly all repeated accesses, from the heatmap sample
+    quint64 workingSetBytes() const;
+    // Background fill of the seed image, nullptr when mounted without one
+    const CPreloader *preloader() const;
+    // Host memory pressure as seen by the relief thread, nullptr when not running
+    const CMemoryPressure *memoryPressure() const;
+    CRamStore::EvictionStats evictionStats() const;
+    // Background defragmentation of the mounted disk, nullptr when not running
+    const CCompactor *compactor() const;
+    // Why the last device create, remove or format failed, empty when it did not
+    QString lastError() const;
+    bool snapshot();
+    // Writes a consistent copy of the mounted disk, the format follows the file extension
+    bool exportImage(const QString &path);
+    // Copy-on-write device of the snapshot, or of the disk without one, at a drive letter like "S:"
+    bool mountClone(const QString &letter);
+    INT unmountClone(const QString &letter);
     static CRamDisk* getInstance();
     static void destroyInstance();
     void init();
 
+    // Drops cached device handles when Windows reports a volume removal, the
+    // window only: handles are checked before reuse for the headless daemon
+    bool nativeEventFilter(const QByteArray &eventType, void *message, long *result) override;
+
 private:
     static const QString driveLetter;
     static const quint64 driveSize;
+    static const quint64 driveMaxSize;
+    static const DWORD driveSectorSize;
     static const QString driveFileSystem;
+    static const QString driveProxyName;
+    static const QString driveStoreName;
+    static const bool driveDurable;
+    static const int journalCommitInterval;
+    static const QString driveBackingImage;
+    static const DWORD readyTimeout;
+    static const quint16 metricsPort;
+    static const QString driveTracePath;
+    static const int heatDecayInterval;
+    static const int seedWatchInterval;
+    static const double workingSetSlack;
+    static const bool relieveMemoryPressure;
+    static const bool driveCompaction;
     bool _wasMounted;
+    CRamStore *_store;
+    CImDiskProxy *_proxy;
+    CJournal *_journal;
+    CWriteBack *_writeBack;
+    CRamStore *_snapshot;
+    CMetricsServer *_metrics;
+    CPreloader *_preloader;
+    CMemoryPressure *_pressure;
+    CCompactor *_compactor;
+    QTimer _heatDecay;
+    QTimer _seedWatch;
+    quint64 _seedSequence;              // journal record that completed the seed
+    quint64 _seedPasses;                // write-back passes when the seed completed
     static CRamDisk *_instance;
 
+    // Copy-on-write device mounted next to the main disk
+    struct Clone
+    {
+        DWORD deviceNumber;
+        CRamStore *store;
+        CImDiskProxy *proxy;
+    };
+    QMap<QString, Clone> _clones;
+
+    // Slots in CRamStore::attributes() of the shared store
+    enum
+    {
+        DeviceNumberAttribute = 0,
+        MountedAttribute = 1,
+        SeedAttribute = 2               // the seed image was still loading
+    };
+
+    bool reattach();
+    bool openJournal(bool replay, bool staged = false);
+    bool openWriteBack(bool restore, bool staged = false);
+    void openMemoryPressure();
+    void startBackgroundWork();
+    void releaseStore();
+    // Only one process at a time creates, attaches, flushes or removes the store
+    bool takeOwnership();
+    void releaseOwnership();
+    void releaseClone(Clone &clone);
+    void flushVolume();
+    bool ensureSeeded();
+    QString seedMarkerPath() const;
+
 
 // ============================================
 // WinAPI, C-style code, (Hungarian Notation)
@@ -75,17 +194,53 @@ private:
     DISK_GEOMETRY _diskGeometry;
     LARGE_INTEGER _imageOffset;
 
+    // Kept from creation until removal, so removal needs no reopen or query
+    struct DeviceHandle
+    {
+        HANDLE Device;
+        IMDISK_CREATE_DATA Data;
+    };
+
+    // Failure of the last request, kept for lastError() instead of printed
+    struct CliError
+    {
+        INT Code;                       // IMDISK_CLI_*
+        DWORD Win32Error;               // 0 when there is no system error behind it
+        LPCWSTR Context;                // static text
+        WCHAR Subject[MAX_PATH];        // mount point or path involved, may be empty
+    };
+
+    HANDLE _driver;
+    HANDLE _owner;                      // named mutex held while this process owns the store
+    // Searched linearly, a handful of devices never leave the inline buffer
+    QVarLengthArray<DeviceHandle, 16> _deviceHandles;
+    CRequestArena _requestArena;
+    CliError _lastError;
+
 private:
     INT ImDiskCliRemoveDevice(DWORD DeviceNumber, LPCWSTR MountPoint, BOOL ForceDismount, BOOL EmergencyRemove, BOOL RemoveSettings);
     INT ImDiskCliCreateDevice(LPDWORD DeviceNumber, PDISK_GEOMETRY DiskGeometry, PLARGE_INTEGER ImageOffset,
-                              DWORD Flags, LPCWSTR FileName, BOOL NativePath, LPWSTR MountPoint,
-                              BOOL NumericPrint, LPWSTR FormatOptions, BOOL SaveSettings);
+                              DWORD Flags, LPCWSTR FileName, BOOL NativePath, LPCWSTR MountPoint,
+                              BOOL NumericPrint, LPCWSTR FormatOptions, BOOL SaveSettings);
 
     INT ImDiskCliFormatDisk(LPCWSTR DevicePath, WCHAR DriveLetter, LPCWSTR FormatOptions);
+    // After a failure DeviceSize is the device size, -1 when it cannot be queried
+    INT ImDiskCliExtendDevice(DWORD DeviceNumber, LONGLONG ExtendSize, PLARGE_INTEGER DeviceSize);
+    INT ImDiskCliResizeVolume(LPCWSTR MountPoint, LONGLONG NewSectors);
+
+    INT ImDiskCliOpenDriver(PHANDLE Driver);
+    VOID ImDiskCliCloseDriver();
+    VOID ImDiskCliCacheDevice(PIMDISK_CREATE_DATA CreateData);
+    INT ImDiskCliFindDevice(DWORD DeviceNumber);
+    INT ImDiskCliFindLiveDevice(DWORD DeviceNumber);
+    BOOL ImDiskCliHandleAlive(HANDLE Device);
+    BOOL ImDiskCliTakeDevice(DWORD DeviceNumber, LPCWSTR MountPoint, DeviceHandle *Cached);
+    HANDLE ImDiskCliCachedDevice(DWORD DeviceNumber);
+    VOID ImDiskCliInvalidateDevices(DWORD UnitMask);
 
     BOOL ImDiskOemPrintF(FILE *Stream, LPCSTR Message, ...);
     VOID PrintLastError(LPCWSTR Prefix);
-    LPVOID ImDiskCliAssertNotNull(LPVOID Ptr);
+    INT ImDiskCliFail(INT Code, DWORD Win32Error, LPCWSTR Context, LPCWSTR Subject = NULL);
     BOOL ImDiskCliCheckDriverVersion(HANDLE Device);
     BOOL ImDiskCliValidateDriveLetterTarget(LPCWSTR DriveLetter, LPCWSTR ValidTargetPath);
 };
@@ -0,0 +1,1187 @@
+#include "ramstore.h"
+#include "journal.h"
+#include "telemetry.h"
+#include "heatmap.h"
+#include "blockkernels.h"
+#include "spillfile.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include <QElapsedTimer>
+#include <QPair>
+#include <QDebug>
+
+const quint64 CRamStore::pageSize;
+const quint64 CRamStore::cloneReserve = 4ull*1024*1024*1024;        // pool beyond the disk for pages copied away from snapshots and clones
+const quint64 CRamStore::poolLimit = sizeof(void *) < 8 ? 1ull*1024*1024*1024 : ~0ull; // 32 bit builds map 1Gb of frames at most
+
+static const int sizeAttribute = CPagePool::attributeCount - 1;
+static const quint32 lostLocation = ~0u;                            // evicted table: held compressed, gone with the process
+static const int compressionLevel = 1;                              // zlib, speed over ratio
+static const int maxCompressedBytes = 32*1024;                     // pages that compress worse stay resident
+static const int compactBatch = 16;                                 // pages copied per hold of the read lock
+
+CRamStore::CRamStore(quint64 size, quint64 capacity) : _size(size), _committedPages(0), _readOnly(false), _sectorSize(1),
+    _readv(&CRamStore::readvWith<ByteGeometry>), _writev(&CRamStore::writevWith<ByteGeometry>), _journal(nullptr),
+    _dirty(nullptr), _dirtyPages(0), _writeLatency(0), _heatmap(nullptr), _versions(nullptr), _compactIndex(0),
+    _evictedPages(0), _evictionStats()
+{
+    _pageCount = quint32((size + pageSize - 1) / pageSize);
+    _capacityPages = quint32((qMax(size, capacity) + pageSize - 1) / pageSize);
+
+    _pool = QSharedPointer<CPagePool>(new CPagePool(pageSize, poolFrames(_capacityPages)));
+    _ownedPages.fill(0, int(_capacityPages));
+    _pages = _ownedPages.data();
+}
+
+CRamStore::CRamStore(quint64 size, quint32 capacityPages, const QSharedPointer<CPagePool> &pool, bool readOnly) :
+    _size(size), _committedPages(0), _readOnly(readOnly), _pool(pool), _pages(nullptr),
+    _pageCount(quint32((size + pageSize - 1) / pageSize)), _capacityPages(capacityPages), _sectorSize(1),
+    _readv(&CRamStore::readvWith<ByteGeometry>), _writev(&CRamStore::writevWith<ByteGeometry>), _journal(nullptr),
+    _dirty(nullptr), _dirtyPages(0), _writeLatency(0), _heatmap(nullptr), _versions(nullptr), _compactIndex(0),
+    _evictedPages(0), _evictionStats()
+{
+}
+
+CRamStore::~CRamStore()
+{
+    delete[] _dirty;
+    delete[] _versions;
+    delete _heatmap;
+
+    for(QHash<quint32, Evicted>::const_iterator it = _evicted.constBegin(); it != _evicted.constEnd(); ++it)
+        if(it.value().slot)
+            _spill->unref(it.value().slot);
+
+    // Pages of a shared store stay referenced by the region for a later attach
+    if(_pool->rootTable() == _pages)
+        return;
+
+    for(quint32 i = 0; i < _pageCount; ++i)
+        if(_pages[i])
+            _pool->unref(_pages[i]);
+}
+
+CRamStore *CRamStore::createShared(const QString &name, quint64 size, quint64 capacity)
+{
+    quint32 pages = quint32((qMax(size, capacity) + pageSize - 1) / pageSize);
+
+    CPagePool *pool = CPagePool::createShared(name, pageSize, poolFrames(pages), pages);
+    if(!pool)
+        return nullptr;
+
+    pool->attributes()[sizeAttribute] = size;
+
+    CRamStore *store = new CRamStore(size, pages, QSharedPointer<CPagePool>(pool), false);
+    store->_pages = pool->rootTable();
+    return store;
+}
+
+CRamStore *CRamStore::attachShared(const QString &name)
+{
+    CPagePool *pool = CPagePool::attachShared(name);
+    if(!pool)
+        return nullptr;
+
+    if(pool->frameSize() != pageSize)
+    {
+        delete pool;
+        return nullptr;
+    }
+
+    CRamStore *store = new CRamStore(pool->attributes()[sizeAttribute], pool->rootPages(), QSharedPointer<CPagePool>(pool), false);
+    store->_pages = pool->rootTable();
+    store->countCommittedPages();
+    store->attachEvicted();
+    return store;
+}
+
+// Room for the disk and one diverged copy of it, at most cloneReserve, a write
+// that needs a frame beyond that fails. Keeps the shared region, which is
+// reserved whole, within a small multiple of the disk, and within poolLimit
+// where the address space is too small for that: writes fail past it instead
+// of every mount.
+quint32 CRamStore::poolFrames(quint32 pages)
+{
+    quint64 frames = pages + qMin(quint64(pages), cloneReserve / pageSize);
+    return quint32(qMin(frames, poolLimit / pageSize));
+}
+
+void CRamStore::removeShared(const QString &name)
+{
+    CSharedRegion::remove(name);
+}
+
+void CRamStore::countCommittedPages()
+{
+    _committedPages = 0;
+
+    for(quint32 i = 0; i < _pageCount; ++i)
+        if(_pages[i])
+            ++_committedPages;
+}
+
+quint64 CRamStore::size() const
+{
+    return _size;
+}
+
+quint64 CRamStore::capacity() const
+{
+    return quint64(_capacityPages) * pageSize;
+}
+
+quint64 CRamStore::pageCount() const
+{
+    return _pageCount;
+}
+
+quint64 CRamStore::committedPages() const
+{
+    return _committedPages;
+}
+
+quint64 CRamStore::residentPages() const
+{
+    return _pool->usedFrames();
+}
+
+bool CRamStore::isPageCommitted(quint64 index) const
+{
+    return index < _pageCount && (_pages[index] != 0 || hasEvicted(index));
+}
+
+void CRamStore::setJournal(CJournal *journal)
+{
+    QWriteLocker locker(&_lock);
+    _journal = journal;
+}
+
+bool CRamStore::isReadOnly() const
+{
+    return _readOnly;
+}
+
+void CRamStore::setDirtyTracking(bool enabled)
+{
+    QWriteLocker locker(&_lock);
+
+    delete[] _dirty;
+    _dirty = enabled ? new QAtomicInteger<quint64>[(_capacityPages + 63) / 64] : nullptr;
+    _dirtyPages.store(0);
+}
+
+// After a reattach nothing is known about what reached the backing image
+void CRamStore::markCommittedDirty()
+{
+    QReadLocker locker(&_lock);
+
+    if(!_dirty)
+        return;
+
+    // The image keeps its older copy of a lost page, it cannot be read to flush
+    for(quint32 i = 0; i < _pageCount; ++i)
+        if(_pages[i] || (hasEvicted(i) && !_evicted.value(i).lost))
+            markDirty(quint64(i) * pageSize, pageSize);
+}
+
+quint64 CRamStore::dirtyPages() const
+{
+    return _dirtyPages.load();
+}
+
+quint64 CRamStore::takeNextDirty(quint64 index)
+{
+    if(!_dirty)
+        return _pageCount;
+
+    for(quint64 word = index / 64; word < (_pageCount + 63) / 64; ++word)
+    {
+        quint64 bits = _dirty[word].load();
+        if(word == index / 64)
+            bits &= ~0ull << (index % 64);
+
+        while(bits)
+        {
+            quint64 bit = bits & (~bits + 1);
+
+            // Another thread may have taken it meanwhile, then try the next one
+            if(_dirty[word].fetchAndAndOrdered(~bit) & bit)
+            {
+                _dirtyPages.fetchAndAddRelaxed(quint64(-1));
+
+                int shift = 0;
+                while(!(bit >> shift & 1))
+                    ++shift;
+                return word * 64 + quint64(shift);
+            }
+
+            bits &= ~bit;
+        }
+    }
+
+    return _pageCount;
+}
+
+void CRamStore::markDirtyAgain(quint64 index, quint64 pages)
+{
+    QReadLocker locker(&_lock);
+
+    // Pages a shrink cut meanwhile have nothing left to write
+    if(index >= _pageCount)
+        return;
+
+    markDirty(index * pageSize, qMin(pages, _pageCount - index) * pageSize);
+}
+
+void CRamStore::markDirty(quint64 offset, quint64 length)
+{
+    if(!_dirty || length == 0)
+        return;
+
+    for(quint64 index = offset / pageSize; index <= (offset + length - 1) / pageSize; ++index)
+    {
+        quint64 bit = 1ull << (index % 64);
+
+        if(!(_dirty[index / 64].fetchAndOrRelaxed(bit) & bit))
+            _dirtyPages.fetchAndAddRelaxed(1);
+    }
+}
+
+void CRamStore::setHeatmap(bool enabled)
+{
+    delete _heatmap;
+    _heatmap = enabled ? new CHeatmap(_pageCount, _capacityPages) : nullptr;
+}
+
+CHeatmap *CRamStore::heatmap() const
+{
+    return _heatmap;
+}
+
+bool CRamStore::setSectorSize(quint32 bytes, bool specialized)
+{
+    if(bytes == 0 || (bytes & (bytes - 1)) || bytes > pageSize)
+        return false;
+
+    _sectorSize = bytes;
+
+    if(!specialized)
+    {
+        _readv = &CRamStore::readvWith<CRuntimeGeometry>;
+        _writev = &CRamStore::writevWith<CRuntimeGeometry>;
+        return true;
+    }
+
+    switch(bytes)
+    {
+    case 512:
+        _readv = &CRamStore::readvWith<CBlockGeometry<512, pageSize> >;
+        _writev = &CRamStore::writevWith<CBlockGeometry<512, pageSize> >;
+        break;
+
+    case 4096:
+        _readv = &CRamStore::readvWith<CBlockGeometry<4096, pageSize> >;
+        _writev = &CRamStore::writevWith<CBlockGeometry<4096, pageSize> >;
+        break;
+
+    case pageSize:
+        _readv = &CRamStore::readvWith<CBlockGeometry<pageSize, pageSize> >;
+        _writev = &CRamStore::writevWith<CBlockGeometry<pageSize, pageSize> >;
+        break;
+
+    // Other sizes gain nothing over byte granular splitting
+    default:
+        _readv = &CRamStore::readvWith<ByteGeometry>;
+        _writev = &CRamStore::writevWith<ByteGeometry>;
+    }
+
+    return true;
+}
+
+quint32 CRamStore::sectorSize() const
+{
+    return _sectorSize;
+}
+
+quint64 CRamStore::writeLatency() const
+{
+    return _writeLatency.load();
+}
+
+quint64 *CRamStore::attributes() const
+{
+    return _pool->attributes();
+}
+
+CRamStore *CRamStore::clone()
+{
+    return duplicate(false, nullptr);
+}
+
+CRamStore *CRamStore::snapshot(quint64 *journalSequence)
+{
+    return duplicate(true, journalSequence);
+}
+
+// Only the page table is copied, data pages stay shared until written
+CRamStore *CRamStore::duplicate(bool readOnly, quint64 *journalSequence)
+{
+    QReadLocker locker(&_lock);
+
+    // Appends happen under the write lock, the sequence cannot move while we hold the read lock
+    if(journalSequence)
+        *journalSequence = _journal ? _journal->sequence() : 0;
+
+    CRamStore *copy = new CRamStore(_size, _capacityPages, _pool, readOnly);
+    copy->_ownedPages = QVector<quint32>(int(_capacityPages));
+    copy->_pages = copy->_ownedPages.data();
+    copy->_committedPages = _committedPages;
+
+    for(quint32 i = 0; i < _capacityPages; ++i)
+    {
+        copy->_pages[i] = _pages[i];
+        if(_pages[i])
+            _pool->ref(_pages[i]);
+    }
+
+    // Compressed copies are implicitly shared, spill slots refcounted
+    copy->_evicted = _evicted;
+    copy->_spill = _spill;
+    copy->_evictedPages = _evictedPages;
+    copy->_evictionStats = _evictionStats;
+
+    for(QHash<quint32, Evicted>::const_iterator it = _evicted.constBegin(); it != _evicted.constEnd(); ++it)
+        if(it.value().slot)
+            _spill->ref(it.value().slot);
+
+    return copy;
+}
+
+bool CRamStore::read(quint64 offset, void *buffer, quint64 length)
+{
+    Segment segment = { offset, length, buffer };
+    return readv(&segment, 1);
+}
+
+bool CRamStore::write(quint64 offset, const void *buffer, quint64 length)
+{
+    Segment segment = { offset, length, const_cast<void *>(buffer) };
+    return writev(&segment, 1);
+}
+
+bool CRamStore::discard(quint64 offset, quint64 length)
+{
+    if(_readOnly)
+        return false;
+
+    QWriteLocker locker(&_lock);
+    if(!inRange(offset, length))
+        return false;
+
+    discardSpan(offset, length);
+    markDirty(offset, length);
+
+    if(_journal)
+        _journal->appendDiscard(offset, length);
+    return true;
+}
+
+// Pages past the end are always holes with clear dirty bits, so growing only moves the end
+bool CRamStore::resize(quint64 size, bool discardTail)
+{
+    if(_readOnly || size % _sectorSize || (size + pageSize - 1) / pageSize > _capacityPages)
+        return false;
+
+    QWriteLocker locker(&_lock);
+
+    quint32 pages = quint32((size + pageSize - 1) / pageSize);
+
+    if(size < _size)
+    {
+        if(!discardTail)
+            for(quint32 i = pages; i < _pageCount; ++i)
+                if(_pages[i] || hasEvicted(i))
+                    return false;
+
+        discardSpan(size, _size - size);
+
+        for(quint32 i = pages; i < _pageCount && _dirty; ++i)
+        {
+            quint64 bit = 1ull << (i % 64);
+            if(_dirty[i / 64].fetchAndAndRelaxed(~bit) & bit)
+                _dirtyPages.fetchAndAddRelaxed(quint64(-1));
+        }
+    }
+
+    _size = size;
+    _pageCount = pages;
+
+    if(_heatmap)
+        _heatmap->resize(pages);
+
+    // Clones share the pool, only the root store owns the persisted size
+    if(_pool->rootTable() == _pages)
+        _pool->attributes()[sizeAttribute] = size;
+
+    if(_journal)
+        _journal->appendResize(size);
+    return true;
+}
+
+bool CRamStore::readv(const Segment *segments, int count)
+{
+    return (this->*_readv)(segments, count);
+}
+
+bool CRamStore::writev(const Segment *segments, int count)
+{
+    return (this->*_writev)(segments, count);
+}
+
+// A batch with any request off the sector grid is split byte granular
+template<typename Geometry>
+bool CRamStore::readvWith(const Segment *segments, int count)
+{
+    Geometry geometry(_sectorSize, pageSize);
+
+    for(int i = 0; i < count; ++i)
+        if(!geometry.isAligned(segments[i].offset, segments[i].length))
+            return readvWith<ByteGeometry>(segments, count);
+
+    QReadLocker locker(&_lock);
+
+    // Under the lock, resize() moves the end
+    for(int i = 0; i < count; ++i)
+        if(!inRange(segments[i].offset, segments[i].length))
+            return false;
+
+    Cursor cursor = { ~0ull, nullptr };
+
+    return mergeSegments(segments, count, [&](quint64 offset, quint8 *buffer, quint64 length) {
+        return readSpan(geometry, cursor, offset, buffer, length);
+    });
+}
+
+template<typename Geometry>
+bool CRamStore::writevWith(const Segment *segments, int count)
+{
+    if(_readOnly)
+        return false;
+
+    Geometry geometry(_sectorSize, pageSize);
+
+    for(int i = 0; i < count; ++i)
+        if(!geometry.isAligned(segments[i].offset, segments[i].length))
+            return writevWith<ByteGeometry>(segments, count);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QWriteLocker locker(&_lock);
+
+    for(int i = 0; i < count; ++i)
+        if(!inRange(segments[i].offset, segments[i].length))
+            return false;
+
+    Cursor cursor = { ~0ull, nullptr };
+
+    bool ok = mergeSegments(segments, count, [&](quint64 offset, quint8 *buffer, quint64 length) {
+        if(!writeSpan(geometry, cursor, offset, buffer, length))
+            return false;
+
+        markDirty(offset, length);
+        if(_journal)
+            _journal->append(offset, buffer, length);
+        return true;
+    });
+
+    // Includes the wait for the lock, which is what background readers cost us
+    quint64 latency = _writeLatency.load();
+    _writeLatency.store(latency - latency / 8 + quint64(timer.nsecsElapsed()) / 8);
+    return ok;
+}
+
+bool CRamStore::inRange(quint64 offset, quint64 length) const
+{
+    return offset <= _size && length <= _size - offset;
+}
+
+// Adjacent segments whose buffers are contiguous as well are coalesced,
+// so a run of sector-sized requests becomes one span walk.
+template<typename Span>
+bool CRamStore::mergeSegments(const Segment *segments, int count, Span span)
+{
+    int i = 0;
+
+    while(i < count)
+    {
+        quint64 offset = segments[i].offset;
+        quint64 length = segments[i].length;
+        quint8 *buffer = static_cast<quint8 *>(segments[i].buffer);
+
+        for(++i; i < count; ++i)
+        {
+            if(segments[i].offset != offset + length ||
+               static_cast<quint8 *>(segments[i].buffer) != buffer + length)
+                break;
+
+            length += segments[i].length;
+        }
+
+        if(length != 0 && !span(offset, buffer, length))
+            return false;
+    }
+
+    return true;
+}
+
+// With allocate set the returned page is private to this store, shared
+// pages are copied first. Returns nullptr for holes or when out of memory.
+quint8 *CRamStore::lookup(Cursor &cursor, quint64 index, bool allocate)
+{
+    if(cursor.index == index && (cursor.page || !allocate))
+        return cursor.page;
+
+    quint32 &frame = _pages[index];
+
+    if(allocate)
+    {
+        if(_versions)
+            ++_versions[index];
+
+        // The page is about to change, its evicted copy goes stale
+        if(hasEvicted(index))
+        {
+            if(!frame && !restorePage(index, false))
+                return nullptr;
+            forgetEvicted(index);
+        }
+
+        if(!frame)
+        {
+            frame = _pool->alloc();
+            if(frame)
+                ++_committedPages;
+        }
+        else if(_pool->isShared(frame))
+        {
+            quint32 copy = _pool->alloc();
+            if(!copy)
+                return nullptr;
+
+            CBlockKernels::copy(_pool->data(copy), _pool->data(frame), pageSize);
+            _pool->unref(frame);
+            frame = copy;
+        }
+    }
+
+    cursor.index = index;
+    cursor.page = frame ? _pool->data(frame) : nullptr;
+    return cursor.page;
+}
+
+// False when an evicted page cannot be read back, the request fails rather than read zeros
+template<typename Geometry>
+bool CRamStore::readSpan(const Geometry &geometry, Cursor &cursor, quint64 offset, quint8 *buffer, quint64 length)
+{
+    QByteArray evicted;
+
+    while(length != 0)
+    {
+        quint64 index = geometry.page(offset);
+        quint64 inPage = geometry.inPage(offset);
+        quint64 chunk = geometry.chunk(inPage, length);
+
+        const quint8 *page = lookup(cursor, index, false);
+
+        // Evicted pages are read back without coming into the pool
+        if(!page && hasEvicted(index))
+        {
+            evicted.resize(int(pageSize));
+            if(!readEvicted(index, reinterpret_cast<quint8 *>(evicted.data())))
+            {
+                CTelemetry::add(CTelemetry::EvictedReadErrors, 1);
+                return false;
+            }
+
+            page = reinterpret_cast<const quint8 *>(evicted.constData());
+        }
+
+        if(page)
+            memcpy(buffer, page + inPage, chunk);
+        else
+            memset(buffer, 0, chunk);
+
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
+
+template<typename Geometry>
+bool CRamStore::writeSpan(const Geometry &geometry, Cursor &cursor, quint64 offset, const quint8 *buffer, quint64 length)
+{
+    while(length != 0)
+    {
+        quint64 index = geometry.page(offset);
+        quint64 inPage = geometry.inPage(offset);
+        quint64 chunk = geometry.chunk(inPage, length);
+
+        // A page written full of zeros reads back the same as a hole
+        if(chunk == pageSize && CBlockKernels::isZero(buffer, chunk))
+        {
+            forgetEvicted(index);
+
+            quint32 &frame = _pages[index];
+            if(frame)
+            {
+                _pool->unref(frame);
+                frame = 0;
+                --_committedPages;
+            }
+
+            cursor.index = index;
+            cursor.page = nullptr;
+            CTelemetry::add(CTelemetry::ZeroPages, 1);
+        }
+        else
+        {
+            // Written whole, a lost page holds data again, a partial write fails
+            if(chunk == pageSize && hasEvicted(index) && _evicted.value(quint32(index)).lost)
+                forgetEvicted(index);
+
+            quint8 *page = lookup(cursor, index, true);
+            if(!page)
+                return false;
+
+            CBlockKernels::copy(page + inPage, buffer, chunk);
+        }
+
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
+
+void CRamStore::discardSpan(quint64 offset, quint64 length)
+{
+    Cursor cursor = { ~0ull, nullptr };
+
+    while(length != 0)
+    {
+        quint64 index = offset / pageSize;
+        quint64 inPage = offset % pageSize;
+        quint64 chunk = qMin(length, pageSize - inPage);
+
+        quint32 &frame = _pages[index];
+
+        if(frame || hasEvicted(index))
+        {
+            if(chunk == pageSize)
+            {
+                forgetEvicted(index);
+
+                if(frame)
+                {
+                    _pool->unref(frame);
+                    frame = 0;
+                    --_committedPages;
+                }
+                CTelemetry::add(CTelemetry::PagesReclaimed, 1);
+            }
+            else
+            {
+                quint8 *page = lookup(cursor, index, true);
+                if(page)
+                    memset(page + inPage, 0, chunk);
+            }
+        }
+
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+bool CRamStore::setSpillFile(const QString &path)
+{
+    {
+        QReadLocker locker(&_lock);
+
+        // Reopened by attachShared(), opening it again would truncate the pages spilled
+        if(_spill && _spill->path() == path)
+            return true;
+    }
+
+    // A path the region cannot hold is not recorded, its pages go with the process
+    bool persistent = _pool->rootTable() == _pages && path.size() < CPagePool::maxSpillPath;
+
+    QSharedPointer<CSpillFile> spill(new CSpillFile(pageSize));
+    if(!spill->open(path, persistent))
+        return false;
+
+    QWriteLocker locker(&_lock);
+
+    // Spilled pages live in the current file
+    if(_spill && _spill->usedSlots())
+        return false;
+
+    if(persistent)
+        _pool->setSpillPath(path);
+    _spill = spill;
+    return true;
+}
+
+void CRamStore::keepSpillFile()
+{
+    QReadLocker locker(&_lock);
+
+    if(_spill && _pool->rootTable() == _pages)
+        _spill->keep();
+}
+
+quint64 CRamStore::evictedPages() const
+{
+    return _evictedPages;
+}
+
+CRamStore::EvictionStats CRamStore::evictionStats() const
+{
+    return _evictionStats;
+}
+
+// Each page is evicted under its own hold of the write lock,
+// a foreground request waits for one compression or spill write at most
+quint64 CRamStore::evict(Eviction how, quint64 maxPages)
+{
+    if(_readOnly || (how != Compress && !_spill))
+        return 0;
+
+    QVector<quint32> pages = coldPages(how, maxPages);
+    quint64 evicted = 0;
+
+    for(int i = 0; i < pages.size(); ++i)
+    {
+        QWriteLocker locker(&_lock);
+
+        if(pages[i] < _pageCount && evictPage(how, pages[i]))
+            ++evicted;
+    }
+
+    return evicted;
+}
+
+quint64 CRamStore::restoreEvicted(quint64 maxPages)
+{
+    QVector<quint32> pages;
+
+    {
+        QReadLocker locker(&_lock);
+
+        for(QHash<quint32, Evicted>::const_iterator it = _evicted.constBegin();
+            it != _evicted.constEnd() && quint64(pages.size()) < maxPages; ++it)
+            if(!_pages[it.key()] && !it.value().lost)
+                pages.append(it.key());
+    }
+
+    quint64 restored = 0;
+
+    for(int i = 0; i < pages.size(); ++i)
+    {
+        QWriteLocker locker(&_lock);
+
+        if(_pages[pages[i]] || !hasEvicted(pages[i]))
+            continue;
+        if(!restorePage(pages[i], true))
+            break;
+
+        ++restored;
+    }
+
+    return restored;
+}
+
+// Candidates in order of the heatmap extents, coldest first, block order without a heatmap
+QVector<quint32> CRamStore::coldPages(Eviction how, quint64 maxPages)
+{
+    QReadLocker locker(&_lock);
+
+    quint32 extentPages = quint32(CHeatmap::extentPages);
+    QVector<QPair<quint32, quint32> > extents;
+
+    for(quint32 extent = 0; extent * extentPages < _pageCount; ++extent)
+        extents.append(qMakePair(_heatmap ? _heatmap->extentHeat(int(extent)) : 0u, extent));
+    std::stable_sort(extents.begin(), extents.end());
+
+    QVector<quint32> pages;
+
+    for(int i = 0; i < extents.size(); ++i)
+    {
+        quint32 first = extents[i].second * extentPages;
+
+        for(quint32 index = first; index < qMin(first + extentPages, _pageCount); ++index)
+        {
+            if(!canEvict(how, index))
+                continue;
+
+            pages.append(index);
+            if(quint64(pages.size()) >= maxPages)
+                return pages;
+        }
+    }
+
+    return pages;
+}
+
+// Frames shared with clones or snapshots stay, evicting them would free nothing
+bool CRamStore::canEvict(Eviction how, quint64 index) const
+{
+    quint32 frame = _pages[index];
+    if(frame && _pool->isShared(frame))
+        return false;
+
+    QHash<quint32, Evicted>::const_iterator it = _evicted.constFind(quint32(index));
+    bool evicted = it != _evicted.constEnd();
+
+    switch(how)
+    {
+    case Compress:
+        return frame && !evicted;
+
+    // Resident pages, clean ones cost no write, and compressed pages to free their memory
+    case Spill:
+        return frame || (evicted && !it.value().compressed.isEmpty());
+
+    case DropClean:
+        return frame && evicted && it.value().slot;
+    }
+
+    return false;
+}
+
+bool CRamStore::evictPage(Eviction how, quint64 index)
+{
+    if(!canEvict(how, index))
+        return false;
+
+    quint32 &frame = _pages[index];
+    Evicted entry = _evicted.value(quint32(index), Evicted());
+
+    if(how == Compress)
+    {
+        QByteArray compressed = qCompress(_pool->data(frame), int(pageSize), compressionLevel);
+
+        // Not tried again until the page is written
+        if(compressed.size() > maxCompressedBytes)
+        {
+            entry.incompressible = true;
+            _evicted.insert(quint32(index), entry);
+            return false;
+        }
+
+        entry.compressed = compressed;
+        ++_evictionStats.compressedPages;
+        _evictionStats.compressedBytes += quint64(compressed.size());
+        CTelemetry::add(CTelemetry::PagesCompressed, 1);
+    }
+    else if(frame && entry.slot)
+    {
+        --_evictionStats.cleanPages;
+        ++_evictionStats.spilledPages;
+        CTelemetry::add(CTelemetry::CleanPagesDropped, 1);
+    }
+    else
+    {
+        QByteArray data = frame ? QByteArray() : qUncompress(entry.compressed);
+        if(!frame && quint64(data.size()) != pageSize)
+            return false;
+
+        quint32 slot = _spill->write(frame ? static_cast<const void *>(_pool->data(frame)) : data.constData());
+        if(!slot)
+            return false;
+
+        if(!frame)
+        {
+            --_evictionStats.compressedPages;
+            _evictionStats.compressedBytes -= quint64(entry.compressed.size());
+            entry.compressed.clear();
+        }
+
+        entry.slot = slot;
+        ++_evictionStats.spilledPages;
+        CTelemetry::add(CTelemetry::PagesSpilled, 1);
+    }
+
+    _evicted.insert(quint32(index), entry);
+    publishEvicted(index, entry.slot ? entry.slot : lostLocation);
+
+    if(frame)
+    {
+        _pool->unref(frame);
+        frame = 0;
+        --_committedPages;
+        ++_evictedPages;
+    }
+
+    return true;
+}
+
+bool CRamStore::hasEvicted(quint64 index) const
+{
+    return !_evicted.isEmpty() && _evicted.contains(quint32(index));
+}
+
+bool CRamStore::readEvicted(quint64 index, quint8 *page) const
+{
+    QHash<quint32, Evicted>::const_iterator it = _evicted.constFind(quint32(index));
+    if(it == _evicted.constEnd())
+        return false;
+
+    if(!it.value().compressed.isEmpty())
+    {
+        QByteArray data = qUncompress(it.value().compressed);
+        if(quint64(data.size()) != pageSize)
+            return false;
+
+        memcpy(page, data.constData(), pageSize);
+        return true;
+    }
+
+    return it.value().slot && _spill->read(it.value().slot, page);
+}
+
+// With keepSlot a spilled page keeps its spill copy and can later be dropped without a write
+bool CRamStore::restorePage(quint64 index, bool keepSlot)
+{
+    quint32 frame = _pool->alloc();
+    if(!frame)
+        return false;
+
+    if(!readEvicted(index, _pool->data(frame)))
+    {
+        _pool->unref(frame);
+        return false;
+    }
+
+    bool keep = keepSlot && _evicted.value(quint32(index)).slot;
+
+    // In its frame before the evicted copy is forgotten, see publishEvicted()
+    _pages[index] = frame;
+    ++_committedPages;
+
+    if(keep)
+    {
+        --_evictionStats.spilledPages;
+        ++_evictionStats.cleanPages;
+        --_evictedPages;
+        publishEvicted(index, 0);
+    }
+    else
+        forgetEvicted(index, true);
+
+    CTelemetry::add(CTelemetry::PagesRestored, 1);
+    return true;
+}
+
+// restored: the page just came back into its frame and still counts as evicted
+void CRamStore::forgetEvicted(quint64 index, bool restored)
+{
+    if(_evicted.isEmpty())
+        return;
+
+    QHash<quint32, Evicted>::iterator it = _evicted.find(quint32(index));
+    if(it == _evicted.end())
+        return;
+
+    const Evicted &entry = it.value();
+    bool resident = _pages[index] != 0 && !restored;
+
+    if(!entry.compressed.isEmpty())
+    {
+        --_evictionStats.compressedPages;
+        _evictionStats.compressedBytes -= quint64(entry.compressed.size());
+    }
+    else if(entry.slot && resident)
+        --_evictionStats.cleanPages;
+    else if(entry.slot)
+        --_evictionStats.spilledPages;
+    else if(entry.lost)
+        --_evictionStats.lostPages;
+
+    if(!resident && (entry.slot || !entry.compressed.isEmpty() || entry.lost))
+        --_evictedPages;
+
+    if(entry.slot)
+        _spill->unref(entry.slot);
+
+    publishEvicted(index, 0);
+    _evicted.erase(it);
+}
+
+// The root of a shared store records where its evicted pages went, for
+// attachShared(). Written before the frame of a page is freed and cleared
+// after a page is back in its frame: a frame always wins on attach.
+void CRamStore::publishEvicted(quint64 index, quint32 location)
+{
+    if(_pool->rootTable() == _pages)
+        _pool->evictedTable()[index] = location;
+}
+
+// Pages the previous process spilled come back with its spill file, pages it
+// held compressed, or spilled to a file that is gone, are lost
+void CRamStore::attachEvicted()
+{
+    quint32 *table = _pool->evictedTable();
+    QVector<quint32> spilled;
+
+    for(quint32 i = 0; i < _capacityPages; ++i)
+    {
+        if(_pages[i])
+            table[i] = 0;
+        else if(table[i] && table[i] != lostLocation)
+            spilled.append(table[i]);
+    }
+
+    QString path = _pool->spillPath();
+    if(!spilled.isEmpty() && !path.isEmpty())
+    {
+        QSharedPointer<CSpillFile> spill(new CSpillFile(pageSize));
+        if(spill->reopen(path, spilled))
+            _spill = spill;
+        else
+            qDebug() << "Cannot reopen spill file" << path;
+    }
+
+    for(quint32 i = 0; i < _capacityPages; ++i)
+    {
+        if(!table[i])
+            continue;
+
+        Evicted entry = Evicted();
+
+        if(_spill && table[i] != lostLocation)
+        {
+            entry.slot = table[i];
+            ++_evictionStats.spilledPages;
+        }
+        else
+        {
+            entry.lost = true;
+            table[i] = lostLocation;
+            ++_evictionStats.lostPages;
+        }
+
+        _evicted.insert(i, entry);
+        ++_evictedPages;
+    }
+}
+
+quint64 CRamStore::compact(quint64 budget, bool *sweepEnded)
+{
+    struct Move
+    {
+        quint32 index;
+        quint32 frame;
+        quint32 target;
+        quint32 version;
+    };
+
+    if(sweepEnded)
+        *sweepEnded = false;
+
+    {
+        QWriteLocker locker(&_lock);
+        if(!_versions)
+            _versions = new quint32[_capacityPages]();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    quint64 moved = 0;
+    bool ended = false;
+
+    while(!ended && quint64(timer.nsecsElapsed()) < budget)
+    {
+        Move batch[compactBatch];
+        int count = 0;
+
+        {
+            QReadLocker locker(&_lock);
+
+            // Frames past the slabs the pool needs at its current use leave
+            quint32 dense = (_pool->usedFrames() + CPagePool::framesPerSlab - 1) /
+                    CPagePool::framesPerSlab * CPagePool::framesPerSlab;
+
+            while(count < compactBatch)
+            {
+                if(_compactIndex >= _pageCount)
+                {
+                    _compactIndex = 0;
+                    ended = true;
+                    break;
+                }
+
+                quint32 index = _compactIndex++;
+                quint32 frame = _pages[index];
+
+                // Shared frames are in other page tables too
+                if(frame <= dense || _pool->isShared(frame))
+                    continue;
+
+                // Clones took the free frames below, nothing more fits now
+                quint32 target = _pool->alloc(false);
+                if(!target || target > dense)
+                {
+                    if(target)
+                        _pool->unref(target);
+                    _compactIndex = 0;
+                    ended = true;
+                    break;
+                }
+
+                CBlockKernels::copy(_pool->data(target), _pool->data(frame), pageSize);
+
+                Move move = { index, frame, target, _versions[index] };
+                batch[count++] = move;
+            }
+        }
+
+        if(count == 0)
+            continue;
+
+        QWriteLocker locker(&_lock);
+
+        for(int i = 0; i < count; ++i)
+        {
+            const Move &move = batch[i];
+
+            // A snapshot taken meanwhile shares the frame, moving would unshare it
+            if(move.index < _pageCount && _pages[move.index] == move.frame &&
+               _versions[move.index] == move.version && !_pool->isShared(move.frame))
+            {
+                _pages[move.index] = move.target;
+                _pool->unref(move.frame);
+                ++moved;
+            }
+            else
+            {
+                _pool->unref(move.target);
+                CTelemetry::add(CTelemetry::CompactionConflicts, 1);
+            }
+        }
+    }
+
+    CTelemetry::add(CTelemetry::PagesCompacted, moved);
+    CTelemetry::add(CTelemetry::SlabsReleased, _pool->releaseEmptySlabs());
+
+    if(sweepEnded)
+        *sweepEnded = ended;
+
+    return moved;
+}
@@ -0,0 +1,227 @@
+#ifndef CRAMSTORE_H
+#define CRAMSTORE_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QAtomicInteger>
+#include <QHash>
+#include <QByteArray>
+
+#include "pagepool.h"
+#include "blockgeometry.h"
+
+class CJournal;
+class CHeatmap;
+class CSpillFile;
+
+// Sparse in-memory block store served to ImDisk through the proxy interface.
+// Pages are allocated on first write; unwritten ranges read back as zeros.
+// Clones and snapshots share pages by refcount and copy a page on first write.
+class CRamStore
+{
+public:
+    // One element of a readv/writev batch
+    struct Segment
+    {
+        quint64 offset;
+        quint64 length;
+        void *buffer;
+    };
+
+    // Capacity is the largest size the store can be resized to, size if 0
+    explicit CRamStore(quint64 size, quint64 capacity = 0);
+    ~CRamStore();
+
+    // Store kept in a named shared region, see CPagePool
+    static CRamStore *createShared(const QString &name, quint64 size, quint64 capacity = 0);
+    static CRamStore *attachShared(const QString &name);
+    static void removeShared(const QString &name);
+
+    quint64 size() const;
+    quint64 capacity() const;
+    quint64 pageCount() const;
+    quint64 committedPages() const;
+    // Pool frames in use by this store and all its clones and snapshots
+    quint64 residentPages() const;
+    bool isPageCommitted(quint64 index) const;
+    bool isReadOnly() const;
+
+    // Records every write and discard, nullptr to stop
+    void setJournal(CJournal *journal);
+
+    // Dirty page tracking for write-back, off until enabled
+    void setDirtyTracking(bool enabled);
+    void markCommittedDirty();
+    quint64 dirtyPages() const;
+    // Clears and returns the first dirty page at or after index, pageCount() if none
+    quint64 takeNextDirty(quint64 index);
+    // Gives back pages taken by takeNextDirty() whose write-back failed
+    void markDirtyAgain(quint64 index, quint64 pages);
+
+    // Access heatmap and working set estimate, off until enabled.
+    // Toggle only while no proxy serves the store, it records without a lock.
+    void setHeatmap(bool enabled);
+    CHeatmap *heatmap() const;
+
+    // Logical block of the disk, a power of two up to pageSize, 1 by default.
+    // Picks the geometry aligned requests are split with, set before the store is served.
+    // specialized = false selects the run time geometry, for comparison in benchmarks.
+    bool setSectorSize(quint32 bytes, bool specialized = true);
+    quint32 sectorSize() const;
+
+    // Smoothed time a foreground write spends in the store, in nanoseconds
+    quint64 writeLatency() const;
+
+    // Small caller defined values persisted with a shared store, nullptr otherwise
+    quint64 *attributes() const;
+
+    // Memory pressure relief, pages of the coldest heatmap extents first.
+    // Compress keeps qCompress'ed copies in process memory, Spill moves pages
+    // to the spill file, DropClean frees pages whose spill copy is still current.
+    // Evicted pages read back directly and are paged in when written.
+    enum Eviction
+    {
+        Compress,
+        Spill,
+        DropClean
+    };
+
+    struct EvictionStats
+    {
+        quint64 compressedPages;
+        quint64 compressedBytes;
+        quint64 spilledPages;
+        quint64 cleanPages;                 // resident with a current spill copy
+        quint64 lostPages;                  // held compressed by a previous process
+    };
+
+    // Returns the pages that left the pool, at most maxPages
+    quint64 evict(Eviction how, quint64 maxPages);
+    // Brings evicted pages back while frames are available, spill copies are kept
+    quint64 restoreEvicted(quint64 maxPages);
+    // Spill and DropClean do nothing until a spill file is set, clones share it.
+    // A shared store records where it spilled in its region: attachShared()
+    // reopens the file and serves those pages again, while pages the previous
+    // process held compressed are lost and fail to read until written whole
+    // or discarded.
+    bool setSpillFile(const QString &path);
+    // The spill file of a shared store outlives it, for the next attachShared()
+    void keepSpillFile();
+    // Pages only held compressed, in the spill file, or lost
+    quint64 evictedPages() const;
+    EvictionStats evictionStats() const;
+
+    // Incremental compaction, for one caller at a time. Walks the disk in block
+    // order and moves pages held in frames above the dense bottom of the pool
+    // into its lowest free frames, so neighbouring blocks land in neighbouring
+    // frames, then unmaps the slabs left empty. Copies run under the read lock,
+    // each batch is switched under the write lock, pages written in between
+    // are told apart by their version and left for the next sweep.
+    // Returns after about budget ns, or when the walk reaches the end of the
+    // disk, which sets sweepEnded. Returns the pages moved.
+    quint64 compact(quint64 budget, bool *sweepEnded = nullptr);
+
+    // Copy-on-write duplicates, a snapshot is a read-only clone.
+    // journalSequence receives the last journal record the snapshot contains.
+    CRamStore *clone();
+    CRamStore *snapshot(quint64 *journalSequence = nullptr);
+
+    // Online resize to a multiple of the sector size, up to capacity(). Shrinking
+    // fails while pages past the new end are committed, unless discardTail is set;
+    // the bytes past the end of a partial last page are zeroed either way.
+    bool resize(quint64 size, bool discardTail = false);
+
+    bool read(quint64 offset, void *buffer, quint64 length);
+    bool write(quint64 offset, const void *buffer, quint64 length);
+    bool discard(quint64 offset, quint64 length);
+
+    // Scatter-gather variants, segments are processed in order
+    bool readv(const Segment *segments, int count);
+    bool writev(const Segment *segments, int count);
+
+    static const quint64 pageSize = 64ull*1024;                     // 64Kb, allocation unit
+    static const quint64 cloneReserve;
+    static const quint64 poolLimit;
+
+private:
+    Q_DISABLE_COPY(CRamStore)
+
+    CRamStore(quint64 size, quint32 capacityPages, const QSharedPointer<CPagePool> &pool, bool readOnly);
+    void countCommittedPages();
+    static quint32 poolFrames(quint32 pages);
+    CRamStore *duplicate(bool readOnly, quint64 *journalSequence);
+
+    // Caches the last page looked up while walking a batch
+    struct Cursor
+    {
+        quint64 index;
+        quint8 *page;
+    };
+
+    // Byte granular, for requests that are not sector aligned
+    typedef CBlockGeometry<1, pageSize> ByteGeometry;
+
+    bool inRange(quint64 offset, quint64 length) const;
+    quint8 *lookup(Cursor &cursor, quint64 index, bool allocate);
+
+    template<typename Geometry>
+    bool readvWith(const Segment *segments, int count);
+    template<typename Geometry>
+    bool writevWith(const Segment *segments, int count);
+    template<typename Geometry>
+    bool readSpan(const Geometry &geometry, Cursor &cursor, quint64 offset, quint8 *buffer, quint64 length);
+    template<typename Geometry>
+    bool writeSpan(const Geometry &geometry, Cursor &cursor, quint64 offset, const quint8 *buffer, quint64 length);
+    void discardSpan(quint64 offset, quint64 length);
+    void markDirty(quint64 offset, quint64 length);
+
+    // A page outside the pool, or a resident one with a spill copy
+    struct Evicted
+    {
+        QByteArray compressed;
+        quint32 slot;                       // spill file slot, 0 = none
+        bool incompressible;
+        bool lost;                          // compressed copy gone with a previous process
+    };
+
+    bool hasEvicted(quint64 index) const;
+    bool readEvicted(quint64 index, quint8 *page) const;
+    bool restorePage(quint64 index, bool keepSlot);
+    void forgetEvicted(quint64 index, bool restored = false);
+    bool canEvict(Eviction how, quint64 index) const;
+    bool evictPage(Eviction how, quint64 index);
+    QVector<quint32> coldPages(Eviction how, quint64 maxPages);
+    void publishEvicted(quint64 index, quint32 location);
+    void attachEvicted();
+
+    template<typename Span>
+    static bool mergeSegments(const Segment *segments, int count, Span span);
+
+    quint64 _size;
+    quint64 _committedPages;
+    bool _readOnly;
+    QSharedPointer<CPagePool> _pool;
+    QVector<quint32> _ownedPages;
+    quint32 *_pages;
+    quint32 _pageCount;
+    quint32 _capacityPages;
+    quint32 _sectorSize;
+    bool (CRamStore::*_readv)(const Segment *segments, int count);
+    bool (CRamStore::*_writev)(const Segment *segments, int count);
+    CJournal *_journal;
+    QAtomicInteger<quint64> *_dirty;
+    QAtomicInteger<quint64> _dirtyPages;
+    QAtomicInteger<quint64> _writeLatency;
+    CHeatmap *_heatmap;
+    quint32 *_versions;                     // bumped by every write, while compaction runs
+    quint32 _compactIndex;
+    QHash<quint32, Evicted> _evicted;
+    QSharedPointer<CSpillFile> _spill;
+    quint64 _evictedPages;
+    EvictionStats _evictionStats;
+    QReadWriteLock _lock;
+};
+
+#endif // CRAMSTORE_H
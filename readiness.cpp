@@ -0,0 +1,167 @@
+#include "readiness.h"
+
+const DWORD CReadiness::minBackoff = 1;                              // ms, first retry
+const DWORD CReadiness::maxBackoff = 64;                             // ms, polling never gets coarser
+
+CReadiness::CReadiness(DWORD timeout) : _timeout(timeout), _start(GetTickCount()), _backoff(minBackoff)
+{
+}
+
+// Manual reset, stays set until resetCancel()
+HANDLE CReadiness::cancelEvent()
+{
+    static HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    return event;
+}
+
+void CReadiness::cancelAll()
+{
+    SetEvent(cancelEvent());
+}
+
+void CReadiness::resetCancel()
+{
+    ResetEvent(cancelEvent());
+}
+
+CReadiness::Result CReadiness::pause()
+{
+    DWORD elapsed = GetTickCount() - _start;
+    if (elapsed >= _timeout)
+        return TimedOut;
+
+    DWORD delay = _backoff < _timeout - elapsed ? _backoff : _timeout - elapsed;
+    _backoff = _backoff * 2 < maxBackoff ? _backoff * 2 : maxBackoff;
+
+    return WaitForSingleObject(cancelEvent(), delay) == WAIT_OBJECT_0 ? Cancelled : Ready;
+}
+
+DWORD CReadiness::remaining() const
+{
+    if (_timeout == INFINITE)
+        return INFINITE;
+
+    DWORD elapsed = GetTickCount() - _start;
+    return elapsed < _timeout ? _timeout - elapsed : 0;
+}
+
+CReadiness::Result CReadiness::waitHandle(HANDLE object)
+{
+    HANDLE objects[] = { cancelEvent(), object };
+
+    switch (WaitForMultipleObjects(2, objects, FALSE, _timeout))
+    {
+    case WAIT_OBJECT_0:
+        return Cancelled;
+
+    case WAIT_OBJECT_0 + 1:
+    case WAIT_ABANDONED_0 + 1:
+        return Ready;
+
+    default:
+        return TimedOut;
+    }
+}
+
+// Queued to the thread that registered, which waits alertable; the status is in the SERVICE_NOTIFY
+static VOID CALLBACK onServiceNotify(PVOID Parameter)
+{
+    UNREFERENCED_PARAMETER(Parameter);
+}
+
+CReadiness::Result CReadiness::waitService(LPCWSTR name)
+{
+    SC_HANDLE manager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
+    if (manager == NULL)
+        return Failed;
+
+    SC_HANDLE service = OpenService(manager, name, SERVICE_QUERY_STATUS);
+    if (service == NULL)
+    {
+        CloseServiceHandle(manager);
+        return Failed;
+    }
+
+    SERVICE_NOTIFY notify = {};
+    notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+    notify.pfnNotifyCallback = onServiceNotify;
+
+    Result result = Failed;
+
+    // Reported at once when the service is in the state already
+    DWORD error = NotifyServiceStatusChange(service, SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_STOPPED,
+                                            &notify);
+    if (error == ERROR_SUCCESS)
+    {
+        DWORD wait;
+
+        // Another APC of this thread ends the wait too, notify is untouched then
+        do
+        {
+            DWORD timeout = remaining();
+            wait = timeout ? WaitForSingleObjectEx(cancelEvent(), timeout, TRUE) : WAIT_TIMEOUT;
+        }
+        while ((wait == WAIT_IO_COMPLETION) & (notify.dwNotificationStatus == ERROR_SUCCESS) &
+               (notify.ServiceStatus.dwCurrentState == 0));
+
+        switch (wait)
+        {
+        case WAIT_OBJECT_0:
+            result = Cancelled;
+            break;
+
+        case WAIT_IO_COMPLETION:
+            error = notify.dwNotificationStatus != ERROR_SUCCESS ? notify.dwNotificationStatus :
+                                                                   notify.ServiceStatus.dwWin32ExitCode;
+            if ((notify.dwNotificationStatus == ERROR_SUCCESS) &
+                (notify.ServiceStatus.dwCurrentState == SERVICE_RUNNING))
+                result = Ready;
+            break;
+
+        default:
+            result = TimedOut;
+            break;
+        }
+    }
+
+    // No callback is queued after the close, one queued before runs now,
+    // while notify is still in scope
+    CloseServiceHandle(service);
+    CloseServiceHandle(manager);
+    SleepEx(0, TRUE);
+
+    SetLastError(error);
+    return result;
+}
+
+CReadiness::Result CReadiness::waitPipe(LPCWSTR name)
+{
+    for (;;)
+    {
+        DWORD timeout = remaining();
+
+        // 0 would be NMPWAIT_USE_DEFAULT_WAIT
+        if (timeout == 0)
+            return TimedOut;
+
+        if (WaitNamedPipe(name, timeout))
+            return Ready;
+
+        switch (GetLastError())
+        {
+        case ERROR_FILE_NOT_FOUND:
+            break;
+
+        case ERROR_SEM_TIMEOUT:
+            return TimedOut;
+
+        // Exists, the connect reports what is wrong with it
+        default:
+            return Ready;
+        }
+
+        Result result = pause();
+        if (result != Ready)
+            return result;
+    }
+}
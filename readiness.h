@@ -0,0 +1,69 @@
+#ifndef CREADINESS_H
+#define CREADINESS_H
+
+#include <windows.h>
+
+// Waits until a driver, service or pipe becomes available.
+// A service start is told by the service control manager, a pipe that exists
+// is waited for by the pipe file system. Objects without a change
+// notification, like the driver control device, are polled with exponential
+// backoff, starting at once and capped at maxBackoff, so the wait ends close
+// to the moment the object is ready. Every wait has a timeout and ends early
+// when cancelAll() is called from any thread, a blocking pipe wait excepted.
+class CReadiness
+{
+public:
+    enum Result
+    {
+        Ready,
+        TimedOut,
+        Cancelled,
+        Failed                              // the service stopped or cannot be watched
+    };
+
+    explicit CReadiness(DWORD timeout);
+
+    // Check is called until it returns true
+    template<typename Check>
+    Result wait(Check ready);
+
+    // Waits for a kernel object to become signaled
+    Result waitHandle(HANDLE object);
+
+    // Waits for a started service to report SERVICE_RUNNING, Failed sets the last error
+    Result waitService(LPCWSTR name);
+    // Waits for a free instance of a pipe, polls until the server creates it
+    Result waitPipe(LPCWSTR name);
+
+    static void cancelAll();
+    static void resetCancel();
+
+    static const DWORD minBackoff;
+    static const DWORD maxBackoff;
+
+private:
+    // Sleeps for the next backoff step, or reports why the wait is over
+    Result pause();
+    DWORD remaining() const;
+    static HANDLE cancelEvent();
+
+    DWORD _timeout;
+    DWORD _start;
+    DWORD _backoff;
+};
+
+template<typename Check>
+CReadiness::Result CReadiness::wait(Check ready)
+{
+    for (;;)
+    {
+        if (ready())
+            return Ready;
+
+        Result result = pause();
+        if (result != Ready)
+            return result;
+    }
+}
+
+#endif // CREADINESS_H
@@ -0,0 +1,419 @@
+#include "tracer.h"
+#include "ramstore.h"
+#include "latency.h"
+#include "telemetry.h"
+#include "heatmap.h"
+#include "compactor.h"
+#include "journal.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <QDebug>
+
+#include <stdio.h>
+#include <algorithm>
+
+// Replays a block trace recorded by CTracer, one request at a time in
+// timestamp order, so two runs issue exactly the same sequence.
+// Backends: a CRamStore sized to the trace (default) or a file or device.
+// With --compact the store is defragmented in the background during the
+// replay and to the end afterwards, the RSS is printed before and after.
+// With --journal the trace is replayed once per commit interval into a fresh
+// store that journals to <path>-<ms>ms, showing what each interval costs in
+// write latency and throughput and how many records it leaves uncommitted.
+
+static const char defaultCommitIntervals[] = "1,10,100,1000";       // ms, CRamDisk::journalCommitInterval is 100
+
+static void usage()
+{
+    fprintf(stderr, "Usage: qt-imdisk-replay <trace> [--max-speed] [--file <image>] [--compact]\n"
+                    "                        [--journal <path> [--commit-ms <ms>[,<ms>...]]]\n");
+}
+
+class CReplayBackend
+{
+public:
+    virtual ~CReplayBackend() {}
+    virtual bool read(quint64 offset, char *buffer, quint64 length) = 0;
+    virtual bool write(quint64 offset, const char *buffer, quint64 length) = 0;
+    virtual bool discard(quint64 offset, quint64 length) = 0;
+    virtual const CHeatmap *heatmap() const { return nullptr; }
+    virtual CRamStore *store() { return nullptr; }
+};
+
+class CStoreBackend : public CReplayBackend
+{
+public:
+    // Fed like the proxy feeds it, so a replay also shows the working set and its sampling cost
+    explicit CStoreBackend(quint64 size) : _store(size)
+    {
+        _store.setHeatmap(true);
+    }
+
+    bool read(quint64 offset, char *buffer, quint64 length) override
+    {
+        if(!_store.read(offset, buffer, length))
+            return false;
+        _store.heatmap()->record(offset, length);
+        return true;
+    }
+
+    bool write(quint64 offset, const char *buffer, quint64 length) override
+    {
+        if(!_store.write(offset, buffer, length))
+            return false;
+        _store.heatmap()->record(offset, length);
+        return true;
+    }
+
+    bool discard(quint64 offset, quint64 length) override
+    {
+        return _store.discard(offset, length);
+    }
+
+    const CHeatmap *heatmap() const override
+    {
+        return _store.heatmap();
+    }
+
+    CRamStore *store() override
+    {
+        return &_store;
+    }
+
+private:
+    CRamStore _store;
+};
+
+// Discards are not passed on, a plain file has no portable way to punch them
+class CFileBackend : public CReplayBackend
+{
+public:
+    explicit CFileBackend(const QString &path) : _file(path) {}
+
+    bool open()
+    {
+        return _file.open(QIODevice::ReadWrite);
+    }
+
+    bool read(quint64 offset, char *buffer, quint64 length) override
+    {
+        return _file.seek(qint64(offset)) && _file.read(buffer, qint64(length)) >= 0;
+    }
+
+    bool write(quint64 offset, const char *buffer, quint64 length) override
+    {
+        return _file.seek(qint64(offset)) && _file.write(buffer, qint64(length)) == qint64(length);
+    }
+
+    bool discard(quint64 offset, quint64 length) override
+    {
+        Q_UNUSED(offset);
+        Q_UNUSED(length);
+        return true;
+    }
+
+private:
+    QFile _file;
+};
+
+struct ReplayResult
+{
+    quint64 bytes;
+    double seconds;
+    int failed;
+    QVector<quint64> writeLatencies;    // only with a journal
+    quint64 maxUncommitted;             // journal records appended but not yet on disk
+};
+
+static ReplayResult replayRecords(const QVector<CTracer::Record> &records, CReplayBackend *backend,
+                                  QByteArray &buffer, bool maxSpeed, const CJournal *journal = nullptr)
+{
+    ReplayResult result = { 0, 0.0, 0, QVector<quint64>(), 0 };
+
+    quint64 start = CLatency::now();
+    quint64 first = records.isEmpty() ? 0 : records.first().timestamp;
+
+    for(int i = 0; i < records.size(); ++i)
+    {
+        const CTracer::Record &record = records[i];
+
+        if(!maxSpeed)
+        {
+            quint64 due = record.timestamp - first;
+            quint64 elapsed = CLatency::now() - start;
+            if(due > elapsed)
+                QThread::usleep(ulong((due - elapsed) / 1000));
+        }
+
+        quint64 issued = CLatency::now();
+        quint64 latency;
+        bool ok;
+
+        switch(record.op)
+        {
+        case CTracer::ReadOp:
+            ok = backend->read(record.offset, buffer.data(), record.length);
+            CLatency::record(CLatency::Read, CLatency::now() - issued);
+            break;
+
+        case CTracer::WriteOp:
+            ok = backend->write(record.offset, buffer.constData(), record.length);
+            latency = CLatency::now() - issued;
+            CLatency::record(CLatency::Write, latency);
+            if(journal)
+                result.writeLatencies.append(latency);
+            break;
+
+        case CTracer::DiscardOp:
+            ok = backend->discard(record.offset, record.length);
+            CLatency::record(CLatency::Discard, CLatency::now() - issued);
+            break;
+
+        default:
+            ok = false;
+        }
+
+        if(!ok)
+            ++result.failed;
+        if(record.op != CTracer::DiscardOp)
+            result.bytes += record.length;
+        if(journal)
+            result.maxUncommitted = qMax(result.maxUncommitted, journal->sequence() - journal->committedSequence());
+    }
+
+    result.seconds = (CLatency::now() - start) / 1e9;
+    return result;
+}
+
+// Segments and checkpoint of a journal at path
+static void removeJournal(const QString &path)
+{
+    QFileInfo info(path);
+    QDir dir = info.dir();
+    QStringList names = dir.entryList(QStringList() << info.fileName() + ".*", QDir::Files);
+
+    for(int i = 0; i < names.size(); ++i)
+        QFile::remove(dir.filePath(names[i]));
+}
+
+static quint64 percentile(const QVector<quint64> &sorted, int permille)
+{
+    if(sorted.isEmpty())
+        return 0;
+
+    // Rank rounded up, like CLatency::summary
+    quint64 rank = (quint64(sorted.size()) * quint64(permille) + 999) / 1000;
+    return sorted[int(qMax<quint64>(rank, 1) - 1)];
+}
+
+static int benchJournal(const QVector<CTracer::Record> &records, quint64 extent, QByteArray &buffer,
+                        bool maxSpeed, const QString &path, const QList<int> &intervals)
+{
+    int failed = 0;
+
+    printf("%-9s %9s %12s %12s %12s %12s %12s %10s\n", "commit", "MB/s", "write p50", "p99", "p999", "max",
+           "uncommitted", "drain");
+
+    for(int i = 0; i < intervals.size(); ++i)
+    {
+        QString runPath = QString("%1-%2ms").arg(path).arg(intervals[i]);
+        removeJournal(runPath);
+
+        CStoreBackend *backend = new CStoreBackend(extent);
+        CJournal *journal = new CJournal(runPath, intervals[i]);
+
+        if(!journal->open(backend->store()))
+        {
+            fprintf(stderr, "Cannot open journal %s\n", runPath.toLocal8Bit().constData());
+            delete journal;
+            delete backend;
+            return 1;
+        }
+        backend->store()->setJournal(journal);
+
+        ReplayResult result = replayRecords(records, backend, buffer, maxSpeed, journal);
+
+        // Until the last record is on disk, at most one interval and a commit
+        quint64 drainStart = CLatency::now();
+        while(journal->committedSequence() < journal->sequence())
+            QThread::usleep(100);
+        double drained = (CLatency::now() - drainStart) / 1e6;
+
+        backend->store()->setJournal(nullptr);
+        delete journal;
+        delete backend;
+        removeJournal(runPath);
+
+        std::sort(result.writeLatencies.begin(), result.writeLatencies.end());
+        const QVector<quint64> &sorted = result.writeLatencies;
+
+        printf("%6d ms %9.1f %9.1f us %9.1f us %9.1f us %9.1f us %12llu %7.1f ms\n", intervals[i],
+               result.seconds > 0 ? result.bytes / 1048576.0 / result.seconds : 0.0,
+               percentile(sorted, 500) / 1e3, percentile(sorted, 990) / 1e3, percentile(sorted, 999) / 1e3,
+               (sorted.isEmpty() ? 0 : sorted.last()) / 1e3, result.maxUncommitted, drained);
+
+        failed += result.failed;
+    }
+
+    return failed ? 2 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    QString tracePath;
+    QString imagePath;
+    QString journalPath;
+    QString commitIntervals = defaultCommitIntervals;
+    bool maxSpeed = false;
+    bool compact = false;
+
+    for(int i = 1; i < args.size(); ++i)
+    {
+        if(args[i] == "--max-speed")
+            maxSpeed = true;
+        else if(args[i] == "--compact")
+            compact = true;
+        else if(args[i] == "--file" && i + 1 < args.size())
+            imagePath = args[++i];
+        else if(args[i] == "--journal" && i + 1 < args.size())
+            journalPath = args[++i];
+        else if(args[i] == "--commit-ms" && i + 1 < args.size())
+            commitIntervals = args[++i];
+        else if(tracePath.isEmpty())
+            tracePath = args[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    QList<int> intervals;
+    QStringList parts = commitIntervals.split(',');
+
+    for(int i = 0; i < parts.size(); ++i)
+    {
+        bool ok;
+        int interval = parts[i].toInt(&ok);
+        if(!ok || interval <= 0)
+            tracePath.clear();
+        intervals.append(interval);
+    }
+
+    // The journal records store writes, a file backend has none
+    if(tracePath.isEmpty() || (!journalPath.isEmpty() && (!imagePath.isEmpty() || compact)))
+    {
+        usage();
+        return 1;
+    }
+
+    QVector<CTracer::Record> records;
+    quint64 dropped = 0;
+
+    if(!CTracer::load(tracePath, records, &dropped))
+    {
+        fprintf(stderr, "Cannot read trace %s\n", tracePath.toLocal8Bit().constData());
+        return 1;
+    }
+
+    quint64 extent = 0;
+    quint64 largest = 0;
+
+    for(int i = 0; i < records.size(); ++i)
+    {
+        if(records[i].op != CTracer::DiscardOp)
+            largest = qMax(largest, records[i].length);
+        extent = qMax(extent, records[i].offset + records[i].length);
+    }
+
+    // Written data is a fixed pattern, only sizes and positions come from the trace
+    QByteArray buffer(int(largest), char(0x5a));
+
+    if(!journalPath.isEmpty())
+        return benchJournal(records, extent, buffer, maxSpeed, journalPath, intervals);
+
+    CReplayBackend *backend;
+
+    if(imagePath.isEmpty())
+        backend = new CStoreBackend(extent);
+    else
+    {
+        CFileBackend *file = new CFileBackend(imagePath);
+        if(!file->open())
+        {
+            fprintf(stderr, "Cannot open %s\n", imagePath.toLocal8Bit().constData());
+            delete file;
+            return 1;
+        }
+        backend = file;
+    }
+
+    // Runs next to the replay, so the latencies below include what it costs
+    CCompactor *compactor = nullptr;
+    if(compact && backend->store())
+    {
+        compactor = new CCompactor(backend->store());
+        compactor->start(QThread::LowPriority);
+    }
+
+    ReplayResult result = replayRecords(records, backend, buffer, maxSpeed);
+    int failed = result.failed;
+
+    printf("%d requests (%d failed, %llu dropped at record time), %.3f s, %.1f MB/s\n",
+           records.size(), failed, dropped, result.seconds,
+           result.seconds > 0 ? result.bytes / 1048576.0 / result.seconds : 0.0);
+
+    if(const CHeatmap *heatmap = backend->heatmap())
+        printf("working set %.1f MB, %llu sampled accesses, %llu ns per sampled access\n",
+               heatmap->workingSetPages(0.05) * CRamStore::pageSize / 1048576.0,
+               heatmap->sampledAccesses(), heatmap->samplingCost());
+
+    if(compactor)
+    {
+        delete compactor;
+
+        // Whatever the background slices left, until a sweep moves nothing
+        quint64 rss = CCompactor::residentBytes();
+        quint64 moved = 0;
+        quint64 sweepMoved = 1;
+        bool sweepEnded;
+
+        while(sweepMoved)
+        {
+            sweepMoved = 0;
+            do
+                sweepMoved += backend->store()->compact(~0ull, &sweepEnded);
+            while(!sweepEnded);
+            moved += sweepMoved;
+        }
+
+        printf("compaction %llu pages during the replay, %llu after it, RSS %.1f MB -> %.1f MB\n",
+               CTelemetry::total(CTelemetry::PagesCompacted) - moved, moved,
+               rss / 1048576.0, CCompactor::residentBytes() / 1048576.0);
+    }
+
+    delete backend;
+
+    const CLatency::Operation operations[] = { CLatency::Read, CLatency::Write, CLatency::Discard };
+
+    for(int i = 0; i < 3; ++i)
+    {
+        CLatency::Summary summary = CLatency::summary(operations[i]);
+        if(summary.count == 0)
+            continue;
+
+        printf("%-8s %10llu ops  p50 %8llu ns  p99 %8llu ns  p999 %8llu ns  max %8llu ns\n",
+               CLatency::name(operations[i]), summary.count, summary.p50, summary.p99, summary.p999, summary.max);
+    }
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,201 @@
+#include "sharedregion.h"
+
+#include <QDir>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef Q_OS_WIN
+static QString regionPath(const QString &name)
+{
+    return QDir::toNativeSeparators(QDir::temp().filePath(name + ".store"));
+}
+#else
+static QByteArray regionPath(const QString &name)
+{
+    return "/" + name.toLocal8Bit();
+}
+#endif
+
+CSharedRegion::CSharedRegion() : _data(nullptr), _size(0)
+#ifdef Q_OS_WIN
+  , _file(INVALID_HANDLE_VALUE), _section(NULL)
+#else
+  , _fd(-1)
+#endif
+{
+}
+
+CSharedRegion::~CSharedRegion()
+{
+    close();
+}
+
+bool CSharedRegion::create(const QString &name, quint64 size)
+{
+    qDebug() << Q_FUNC_INFO << name << size;
+
+#ifdef Q_OS_WIN
+    // A file, not a pagefile section: the section would die with the last handle,
+    // the file outlives a crashed owner. Temporary attribute keeps the lazy
+    // writer off the file while memory is available
+    _file = CreateFile((LPCWSTR)regionPath(name).utf16(), GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, NULL);
+    if(_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD dw;
+    DeviceIoControl(_file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dw, NULL);
+
+    LARGE_INTEGER end;
+    end.QuadPart = LONGLONG(size);
+    if(!SetFilePointerEx(_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(_file))
+    {
+        close();
+        return false;
+    }
+#else
+    _fd = shm_open(regionPath(name).constData(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(_fd < 0)
+        return false;
+
+    if(ftruncate(_fd, off_t(size)) != 0)
+    {
+        close();
+        return false;
+    }
+#endif
+
+    return map(size);
+}
+
+bool CSharedRegion::open(const QString &name)
+{
+    qDebug() << Q_FUNC_INFO << name;
+
+#ifdef Q_OS_WIN
+    _file = CreateFile((LPCWSTR)regionPath(name).utf16(), GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_TEMPORARY, NULL);
+    if(_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(_file, &size))
+    {
+        close();
+        return false;
+    }
+
+    return map(quint64(size.QuadPart));
+#else
+    _fd = shm_open(regionPath(name).constData(), O_RDWR, 0600);
+    if(_fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(_fd, &st) != 0)
+    {
+        close();
+        return false;
+    }
+
+    return map(quint64(st.st_size));
+#endif
+}
+
+bool CSharedRegion::map(quint64 size)
+{
+#ifdef Q_OS_WIN
+    _section = CreateFileMapping(_file, NULL, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), NULL);
+    if(_section == NULL)
+    {
+        close();
+        return false;
+    }
+
+    _data = static_cast<quint8 *>(MapViewOfFile(_section, FILE_MAP_WRITE, 0, 0, 0));
+    if(_data == NULL)
+    {
+        close();
+        return false;
+    }
+#else
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, _fd, 0);
+    if(data == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    _data = static_cast<quint8 *>(data);
+#endif
+
+    _size = size;
+    return true;
+}
+
+void CSharedRegion::close()
+{
+#ifdef Q_OS_WIN
+    if(_data)
+        UnmapViewOfFile(_data);
+    if(_section != NULL)
+        CloseHandle(_section);
+    if(_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+
+    _section = NULL;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if(_data)
+        munmap(_data, _size);
+    if(_fd >= 0)
+        ::close(_fd);
+
+    _fd = -1;
+#endif
+
+    _data = nullptr;
+    _size = 0;
+}
+
+bool CSharedRegion::remove(const QString &name)
+{
+#ifdef Q_OS_WIN
+    return DeleteFile((LPCWSTR)regionPath(name).utf16()) != FALSE;
+#else
+    return shm_unlink(regionPath(name).constData()) == 0;
+#endif
+}
+
+quint8 *CSharedRegion::data() const
+{
+    return _data;
+}
+
+quint64 CSharedRegion::size() const
+{
+    return _size;
+}
+
+void CSharedRegion::release(quint64 offset, quint64 length)
+{
+#ifdef Q_OS_WIN
+    FILE_ZERO_DATA_INFORMATION zero;
+    zero.FileOffset.QuadPart = LONGLONG(offset);
+    zero.BeyondFinalZero.QuadPart = LONGLONG(offset + length);
+
+    DWORD dw;
+    DeviceIoControl(_file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &dw, NULL);
+#else
+    fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(offset), off_t(length));
+#endif
+}
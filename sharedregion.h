@@ -0,0 +1,49 @@
+#ifndef CSHAREDREGION_H
+#define CSHAREDREGION_H
+
+#include <QtGlobal>
+#include <QString>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+// Named memory region that outlives the process which created it.
+// Linux: POSIX shm object in /dev/shm. Windows: section over a sparse
+// temporary file, so it survives even when no process holds a handle.
+// The mapping is sparse, untouched ranges cost no memory.
+class CSharedRegion
+{
+public:
+    CSharedRegion();
+    ~CSharedRegion();
+
+    bool create(const QString &name, quint64 size);
+    bool open(const QString &name);
+    void close();
+
+    // Destroys the named object, the current mapping stays valid until close()
+    static bool remove(const QString &name);
+
+    quint8 *data() const;
+    quint64 size() const;
+
+    // Returns frame memory to the OS, the range reads back as zeros
+    void release(quint64 offset, quint64 length);
+
+private:
+    Q_DISABLE_COPY(CSharedRegion)
+
+    bool map(quint64 size);
+
+    quint8 *_data;
+    quint64 _size;
+#ifdef Q_OS_WIN
+    HANDLE _file;
+    HANDLE _section;
+#else
+    int _fd;
+#endif
+};
+
+#endif // CSHAREDREGION_H
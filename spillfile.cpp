@@ -0,0 +1,220 @@
+#include "spillfile.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+
+#ifndef Q_OS_WIN
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+CSpillFile::CSpillFile(quint64 slotSize) : _slotSize(slotSize), _usedSlots(0), _persistent(false), _keep(false)
+#ifdef Q_OS_WIN
+  , _file(INVALID_HANDLE_VALUE)
+#else
+  , _fd(-1)
+#endif
+{
+}
+
+CSpillFile::~CSpillFile()
+{
+    close();
+}
+
+bool CSpillFile::open(const QString &path, bool persistent)
+{
+    qDebug() << Q_FUNC_INFO << path << persistent;
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    _path = path;
+    _persistent = persistent;
+    _keep = false;
+
+#ifdef Q_OS_WIN
+    _file = CreateFile((LPCWSTR)QDir::toNativeSeparators(path).utf16(), GENERIC_READ | GENERIC_WRITE,
+                       0, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED |
+                       (persistent ? 0 : FILE_FLAG_DELETE_ON_CLOSE), NULL);
+    return _file != INVALID_HANDLE_VALUE;
+#else
+    _fd = ::open(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(_fd < 0)
+        return false;
+
+    // Nameless from now on, a crash leaves nothing behind
+    if(!persistent)
+        unlink(QFile::encodeName(path).constData());
+    return true;
+#endif
+}
+
+bool CSpillFile::reopen(const QString &path, const QVector<quint32> &occupied)
+{
+    qDebug() << Q_FUNC_INFO << path << occupied.size();
+
+    quint32 last = 0;
+    for(int i = 0; i < occupied.size(); ++i)
+        last = qMax(last, occupied[i]);
+
+#ifdef Q_OS_WIN
+    _file = CreateFile((LPCWSTR)QDir::toNativeSeparators(path).utf16(), GENERIC_READ | GENERIC_WRITE,
+                       0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, NULL);
+    if(_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(_file, &size) && quint64(size.QuadPart) >= quint64(last) * _slotSize;
+#else
+    _fd = ::open(QFile::encodeName(path).constData(), O_RDWR);
+    if(_fd < 0)
+        return false;
+
+    off_t size = lseek(_fd, 0, SEEK_END);
+    bool ok = size >= 0 && quint64(size) >= quint64(last) * _slotSize;
+#endif
+
+    _path = path;
+    _persistent = true;
+    _keep = false;
+
+    // A file cut short is not ours, or lost its tail; it goes on close
+    if(!ok)
+    {
+        close();
+        return false;
+    }
+
+    QMutexLocker locker(&_mutex);
+
+    _refs.fill(0, int(last));
+    for(int i = 0; i < occupied.size(); ++i)
+        if(occupied[i] && !_refs[int(occupied[i] - 1)]++)
+            ++_usedSlots;
+
+    for(quint32 slot = last; slot > 0; --slot)
+        if(!_refs[int(slot - 1)])
+            _freeSlots.append(slot);
+
+    return true;
+}
+
+// Once the pages spilled are recorded elsewhere, for a later reopen()
+void CSpillFile::keep()
+{
+    _keep = _persistent;
+}
+
+void CSpillFile::close()
+{
+#ifdef Q_OS_WIN
+    if(_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+    _file = INVALID_HANDLE_VALUE;
+
+    if(_persistent && !_keep)
+        DeleteFile((LPCWSTR)QDir::toNativeSeparators(_path).utf16());
+#else
+    if(_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+
+    if(_persistent && !_keep)
+        unlink(QFile::encodeName(_path).constData());
+#endif
+
+    _persistent = false;
+
+    QMutexLocker locker(&_mutex);
+    _refs.clear();
+    _freeSlots.clear();
+    _usedSlots = 0;
+}
+
+QString CSpillFile::path() const
+{
+    return _path;
+}
+
+quint32 CSpillFile::write(const void *data)
+{
+    quint32 slot;
+
+    {
+        QMutexLocker locker(&_mutex);
+
+        if(!_freeSlots.isEmpty())
+            slot = _freeSlots.takeLast();
+        else
+        {
+            _refs.append(0);
+            slot = quint32(_refs.size());
+        }
+
+        _refs[int(slot - 1)] = 1;
+        ++_usedSlots;
+    }
+
+    quint64 offset = quint64(slot - 1) * _slotSize;
+
+#ifdef Q_OS_WIN
+    OVERLAPPED position = {};
+    position.Offset = DWORD(offset);
+    position.OffsetHigh = DWORD(offset >> 32);
+
+    DWORD written = 0;
+    bool ok = WriteFile(_file, data, DWORD(_slotSize), &written, &position) && written == _slotSize;
+#else
+    bool ok = pwrite(_fd, data, _slotSize, off_t(offset)) == ssize_t(_slotSize);
+#endif
+
+    if(!ok)
+    {
+        unref(slot);
+        return 0;
+    }
+
+    return slot;
+}
+
+bool CSpillFile::read(quint32 slot, void *data) const
+{
+    quint64 offset = quint64(slot - 1) * _slotSize;
+
+#ifdef Q_OS_WIN
+    OVERLAPPED position = {};
+    position.Offset = DWORD(offset);
+    position.OffsetHigh = DWORD(offset >> 32);
+
+    DWORD read = 0;
+    return ReadFile(_file, data, DWORD(_slotSize), &read, &position) && read == _slotSize;
+#else
+    return pread(_fd, data, _slotSize, off_t(offset)) == ssize_t(_slotSize);
+#endif
+}
+
+void CSpillFile::ref(quint32 slot)
+{
+    QMutexLocker locker(&_mutex);
+    ++_refs[int(slot - 1)];
+}
+
+void CSpillFile::unref(quint32 slot)
+{
+    QMutexLocker locker(&_mutex);
+
+    if(--_refs[int(slot - 1)] != 0)
+        return;
+
+    _freeSlots.append(slot);
+    --_usedSlots;
+}
+
+quint32 CSpillFile::usedSlots() const
+{
+    QMutexLocker locker(&_mutex);
+    return _usedSlots;
+}
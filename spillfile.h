@@ -0,0 +1,59 @@
+#ifndef CSPILLFILE_H
+#define CSPILLFILE_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QVector>
+#include <QMutex>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+// Temporary file of page sized slots for pages the store moves out of memory.
+// Slots are refcounted, so clones and snapshots can share the slots of the
+// pages they share. Reads and writes are positional and may run concurrently.
+// The file is deleted when closed, its contents never outlive the process.
+// A persistent file keeps its name until closed instead, so what a crashed
+// process spilled can be reopened, and keep() leaves it behind on close too.
+class CSpillFile
+{
+public:
+    explicit CSpillFile(quint64 slotSize);
+    ~CSpillFile();
+
+    bool open(const QString &path, bool persistent = false);
+    // A persistent file left behind, the slots listed in occupied hold one reference each
+    bool reopen(const QString &path, const QVector<quint32> &occupied);
+    void keep();
+    void close();
+
+    QString path() const;
+
+    // Returns a slot holding one reference, 0 when the write failed
+    quint32 write(const void *data);
+    bool read(quint32 slot, void *data) const;
+    void ref(quint32 slot);
+    void unref(quint32 slot);
+
+    quint32 usedSlots() const;
+
+private:
+    Q_DISABLE_COPY(CSpillFile)
+
+    quint64 _slotSize;
+    QVector<quint32> _refs;
+    QVector<quint32> _freeSlots;
+    quint32 _usedSlots;
+    QString _path;
+    bool _persistent;
+    bool _keep;
+    mutable QMutex _mutex;
+#ifdef Q_OS_WIN
+    HANDLE _file;
+#else
+    int _fd;
+#endif
+};
+
+#endif // CSPILLFILE_H
@@ -0,0 +1,78 @@
+#include "telemetry.h"
+
+QMutex CTelemetry::_lock;
+QVector<CTelemetry::Slot *> CTelemetry::_slots;
+QVector<CTelemetry::Slot *> CTelemetry::_free;
+quint64 CTelemetry::_retired[CTelemetry::CounterCount];
+thread_local CTelemetry::Slot *CTelemetry::_local = nullptr;
+
+CTelemetry::LocalSlot::LocalSlot()
+{
+    QMutexLocker locker(&_lock);
+
+    if(!_free.isEmpty())
+    {
+        slot = _free.takeLast();
+        return;
+    }
+
+    slot = new Slot;
+    for(int i = 0; i < CounterCount; ++i)
+        slot->values[i].store(0);
+    _slots.append(slot);
+}
+
+// Folded into the retired totals so the sums never go backwards
+CTelemetry::LocalSlot::~LocalSlot()
+{
+    QMutexLocker locker(&_lock);
+
+    for(int i = 0; i < CounterCount; ++i)
+        _retired[i] += slot->values[i].fetchAndStoreRelaxed(0);
+
+    _free.append(slot);
+}
+
+// First counter update of a thread
+CTelemetry::Slot *CTelemetry::attach()
+{
+    static thread_local LocalSlot local;
+    _local = local.slot;
+    return local.slot;
+}
+
+quint64 CTelemetry::total(Counter counter)
+{
+    QMutexLocker locker(&_lock);
+
+    quint64 sum = _retired[counter];
+    for(int i = 0; i < _slots.size(); ++i)
+        sum += _slots[i]->values[counter].load();
+
+    return sum;
+}
+
+const char *CTelemetry::name(Counter counter)
+{
+    static const char *names[CounterCount] =
+    {
+        "reads_total",
+        "writes_total",
+        "discards_total",
+        "read_bytes_total",
+        "written_bytes_total",
+        "discarded_bytes_total",
+        "reclaimed_pages_total",
+        "zero_pages_total",
+        "compressed_pages_total",
+        "spilled_pages_total",
+        "dropped_clean_pages_total",
+        "restored_pages_total",
+        "evicted_read_errors_total",
+        "compacted_pages_total",
+        "compaction_conflicts_total",
+        "released_slabs_total"
+    };
+
+    return names[counter];
+}
@@ -0,0 +1,77 @@
+#ifndef CTELEMETRY_H
+#define CTELEMETRY_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QVector>
+
+// Process wide I/O counters.
+// Every thread adds to its own cache line, so the I/O path never contends
+// with other threads or with readers. total() sums all slots plus what
+// exited threads left behind.
+class CTelemetry
+{
+public:
+    enum Counter
+    {
+        Reads,
+        Writes,
+        Discards,
+        BytesRead,
+        BytesWritten,
+        BytesDiscarded,
+        PagesReclaimed,
+        ZeroPages,
+        PagesCompressed,
+        PagesSpilled,
+        CleanPagesDropped,
+        PagesRestored,
+        EvictedReadErrors,
+        PagesCompacted,
+        CompactionConflicts,
+        SlabsReleased,
+        CounterCount
+    };
+
+    // Only the owning thread writes a slot, a plain load and store is enough
+    static inline void add(Counter counter, quint64 value)
+    {
+        QAtomicInteger<quint64> &slot = local()->values[counter];
+        slot.store(slot.load() + value);
+    }
+
+    static quint64 total(Counter counter);
+    static const char *name(Counter counter);
+
+private:
+    struct alignas(64) Slot
+    {
+        QAtomicInteger<quint64> values[CounterCount];
+    };
+
+    // Returns the slot to the free list when its thread exits
+    struct LocalSlot
+    {
+        Slot *slot;
+        LocalSlot();
+        ~LocalSlot();
+    };
+
+    static inline Slot *local()
+    {
+        Slot *slot = _local;
+        return slot ? slot : attach();
+    }
+
+    static Slot *attach();
+
+    static thread_local Slot *_local;
+
+    static QMutex _lock;
+    static QVector<Slot *> _slots;
+    static QVector<Slot *> _free;
+    static quint64 _retired[CounterCount];
+};
+
+#endif // CTELEMETRY_H
@@ -0,0 +1,239 @@
+#include "tracer.h"
+#include "latency.h"
+
+#include <algorithm>
+
+#include <QtAlgorithms>
+#include <QDebug>
+
+const int CTracer::ringSize = 65536;                                // records per thread, power of two
+const int CTracer::drainInterval = 50;                              // ms
+
+static const quint32 traceMagic = 0x43525451;                       // "QTRC"
+
+QAtomicPointer<CTracer> CTracer::_active;
+QAtomicInt CTracer::_writers;
+QAtomicInteger<quint32> CTracer::_generations;
+
+CTracer::CTracer(const QString &path) : _file(path), _start(CLatency::now()),
+    _generation(_generations.fetchAndAddOrdered(1) + 1), _stopping(false), _dropped(0)
+{
+    qDebug() << Q_FUNC_INFO << path;
+}
+
+CTracer::~CTracer()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    qDeleteAll(_rings);
+}
+
+bool CTracer::begin(const QString &path)
+{
+    if(_active.load())
+        return false;
+
+    CTracer *tracer = new CTracer(path);
+    if(!tracer->open())
+    {
+        delete tracer;
+        return false;
+    }
+
+    tracer->start(QThread::LowPriority);
+    _active.storeRelease(tracer);
+    return true;
+}
+
+void CTracer::end()
+{
+    CTracer *tracer = _active.fetchAndStoreOrdered(nullptr);
+    if(!tracer)
+        return;
+
+    // Nobody can pick the tracer up anymore, wait for those who already did
+    while(_writers.loadAcquire())
+        QThread::yieldCurrentThread();
+
+    {
+        QMutexLocker locker(&tracer->_mutex);
+        tracer->_stopping = true;
+    }
+    tracer->wait();
+
+    qDebug() << "Trace written to" << tracer->_file.fileName() << "," << tracer->_dropped.load() << "records dropped";
+    delete tracer;
+}
+
+bool CTracer::open()
+{
+    if(!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Cannot open trace file" << _file.fileName();
+        return false;
+    }
+
+    Header header = { traceMagic, sizeof(Record), 0 };
+    return _file.write(reinterpret_cast<const char *>(&header), sizeof(header)) == sizeof(header);
+}
+
+void CTracer::recordActive(Op op, quint64 offset, quint64 length)
+{
+    _writers.ref();
+
+    if(CTracer *tracer = _active.loadAcquire())
+        tracer->append(op, offset, length);
+
+    _writers.deref();
+}
+
+void CTracer::append(Op op, quint64 offset, quint64 length)
+{
+    Ring *ring = localRing();
+    if(!ring)
+        return;
+
+    quint32 head = ring->head.load();
+
+    if(head - ring->tail.loadAcquire() >= quint32(ringSize))
+    {
+        _dropped.fetchAndAddRelaxed(1);
+        return;
+    }
+
+    Record &record = ring->records[int(head & quint32(ringSize - 1))];
+    record.timestamp = CLatency::now() - _start;
+    record.offset = offset;
+    record.length = length;
+    record.op = quint16(op);
+    record.thread = ring->thread;
+    record.reserved = 0;
+
+    ring->head.storeRelease(head + 1);
+}
+
+// A thread keeps its ring for the lifetime of one trace
+CTracer::Ring *CTracer::localRing()
+{
+    static thread_local quint32 generation = 0;
+    static thread_local Ring *ring = nullptr;
+
+    if(generation == _generation)
+        return ring;
+
+    QMutexLocker locker(&_mutex);
+
+    ring = new Ring;
+    ring->records.resize(ringSize);
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->thread = quint16(_rings.size());
+    _rings.append(ring);
+
+    generation = _generation;
+    return ring;
+}
+
+void CTracer::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    for(;;)
+    {
+        bool stopping;
+
+        {
+            QMutexLocker locker(&_mutex);
+            stopping = _stopping;
+        }
+
+        drain();
+
+        if(stopping)
+            break;
+
+        QThread::msleep(drainInterval);
+    }
+
+    Header header = { traceMagic, sizeof(Record), _dropped.load() };
+    _file.seek(0);
+    _file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    _file.close();
+}
+
+void CTracer::drain()
+{
+    QVector<Ring *> rings;
+
+    {
+        QMutexLocker locker(&_mutex);
+        rings = _rings;
+    }
+
+    for(int i = 0; i < rings.size(); ++i)
+    {
+        Ring *ring = rings[i];
+        quint32 tail = ring->tail.load();
+        quint32 head = ring->head.loadAcquire();
+
+        // At most two contiguous pieces, before and after the wrap
+        while(tail != head)
+        {
+            int first = int(tail & quint32(ringSize - 1));
+            int count = int(qMin(head - tail, quint32(ringSize - first)));
+
+            _file.write(reinterpret_cast<const char *>(ring->records.constData() + first),
+                        qint64(count) * qint64(sizeof(Record)));
+            tail += quint32(count);
+        }
+
+        ring->tail.storeRelease(tail);
+    }
+}
+
+bool CTracer::load(const QString &path, QVector<Record> &records, quint64 *dropped)
+{
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+
+    Header header;
+    if(file.read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header) ||
+       header.magic != traceMagic ||
+       (header.recordSize != sizeof(Record) && header.recordSize != sizeof(LegacyRecord)))
+        return false;
+
+    qint64 count = (file.size() - qint64(sizeof(header))) / qint64(header.recordSize);
+    records.resize(int(count));
+
+    if(header.recordSize == sizeof(Record))
+    {
+        if(file.read(reinterpret_cast<char *>(records.data()), count * qint64(sizeof(Record))) !=
+           count * qint64(sizeof(Record)))
+            return false;
+    }
+    else
+    {
+        QVector<LegacyRecord> legacy;
+        legacy.resize(int(count));
+        if(file.read(reinterpret_cast<char *>(legacy.data()), count * qint64(sizeof(LegacyRecord))) !=
+           count * qint64(sizeof(LegacyRecord)))
+            return false;
+
+        for(int i = 0; i < legacy.size(); ++i)
+        {
+            Record record = { legacy[i].timestamp, legacy[i].offset, legacy[i].length,
+                              legacy[i].op, legacy[i].thread, 0 };
+            records[i] = record;
+        }
+    }
+
+    // Stable, so records of one thread keep their order on equal timestamps
+    std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    if(dropped)
+        *dropped = header.dropped;
+    return true;
+}
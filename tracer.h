@@ -0,0 +1,106 @@
+#ifndef CTRACER_H
+#define CTRACER_H
+
+#include <QThread>
+#include <QString>
+#include <QVector>
+#include <QFile>
+#include <QMutex>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+
+// Block I/O trace recorder.
+// Each I/O thread appends fixed size records to its own ring buffer; the
+// tracer thread drains all rings into the trace file. A full ring drops
+// records rather than stalling I/O, drops are counted in the file header.
+// With no trace running record() costs one pointer load.
+class CTracer : public QThread
+{
+    Q_OBJECT
+public:
+    enum Op
+    {
+        ReadOp = 1,
+        WriteOp = 2,
+        DiscardOp = 3
+    };
+
+    struct Record
+    {
+        quint64 timestamp;                  // ns since the trace started
+        quint64 offset;
+        quint64 length;                     // a discard may cover the whole disk
+        quint16 op;
+        quint16 thread;                     // small per-thread number, not an OS thread id
+        quint32 reserved;
+    };
+
+    // One trace per process
+    static bool begin(const QString &path);
+    static void end();
+
+    static inline void record(Op op, quint64 offset, quint64 length)
+    {
+        if(_active.load())
+            recordActive(op, offset, length);
+    }
+
+    // Reads a trace written by the recorder, sorted by timestamp
+    static bool load(const QString &path, QVector<Record> &records, quint64 *dropped = nullptr);
+
+    static const int ringSize;
+    static const int drainInterval;
+
+protected:
+    void run() override;
+
+private:
+    struct Ring
+    {
+        QVector<Record> records;
+        QAtomicInteger<quint32> head;       // written by the I/O thread
+        QAtomicInteger<quint32> tail;       // written by the tracer thread
+        quint16 thread;
+    };
+
+    // Records of traces written before lengths took 64 bits, still loaded
+    struct LegacyRecord
+    {
+        quint64 timestamp;
+        quint64 offset;
+        quint32 length;
+        quint16 op;
+        quint16 thread;
+    };
+
+    struct Header
+    {
+        quint32 magic;
+        quint32 recordSize;
+        quint64 dropped;                    // filled in when the trace ends
+    };
+
+    explicit CTracer(const QString &path);
+    ~CTracer();
+
+    bool open();
+    static void recordActive(Op op, quint64 offset, quint64 length);
+    void append(Op op, quint64 offset, quint64 length);
+    Ring *localRing();
+    void drain();
+
+    QFile _file;
+    quint64 _start;
+    quint32 _generation;
+    bool _stopping;
+
+    QMutex _mutex;
+    QVector<Ring *> _rings;
+    QAtomicInteger<quint64> _dropped;
+
+    static QAtomicPointer<CTracer> _active;
+    static QAtomicInt _writers;             // threads inside recordActive(), end() waits for them
+    static QAtomicInteger<quint32> _generations;
+};
+
+#endif // CTRACER_H
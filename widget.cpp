@@ -1,14 +1,24 @@
 #include "widget.h"
 #include "ui_widget.h"
 
+#include "telemetry.h"
+#include "heatmap.h"
+
+static const int statsInterval = 1000;                          // ms between label updates
+
 Widget::Widget(QWidget *parent) :
     QWidget(parent),
-    ui(new Ui::Widget)
+    ui(new Ui::Widget),
+    _lastBytesRead(0), _lastBytesWritten(0), _lastRequests(0)
 {
     ui->setupUi(this);
 
     qDebug() << Q_FUNC_INFO;
     CRamDisk::getInstance()->init();
+
+    connect(&_statsTimer, &QTimer::timeout, this, &Widget::updateStats);
+    _statsTimer.start(statsInterval);
+    _statsInterval.start();
 }
 
 void Widget::on_btn_mountDisk_clicked()
@@ -28,6 +38,40 @@ void Widget::on_btn_unmountDisk_clicked()
     CRamDisk::getInstance()->unmount();
 }
 
+void Widget::updateStats()
+{
+    CRamDisk *disk = CRamDisk::getInstance();
+    const double mb = 1024.0 * 1024.0;
+
+    ui->lbl_memory->setText(QString("RAM: %1 MB used, %2 MB committed, dedup %3x")
+                            .arg(disk->residentBytes() / mb, 0, 'f', 1)
+                            .arg(disk->committedBytes() / mb, 0, 'f', 1)
+                            .arg(disk->dedupRatio(), 0, 'f', 2));
+
+    quint64 bytesRead = CTelemetry::total(CTelemetry::BytesRead);
+    quint64 bytesWritten = CTelemetry::total(CTelemetry::BytesWritten);
+    quint64 requests = CTelemetry::total(CTelemetry::Reads) + CTelemetry::total(CTelemetry::Writes) +
+            CTelemetry::total(CTelemetry::Discards);
+
+    double seconds = qMax<qint64>(_statsInterval.restart(), 1) / 1000.0;
+
+    ui->lbl_io->setText(QString("I/O: read %1 MB/s, write %2 MB/s, %3 IOPS")
+                        .arg((bytesRead - _lastBytesRead) / mb / seconds, 0, 'f', 1)
+                        .arg((bytesWritten - _lastBytesWritten) / mb / seconds, 0, 'f', 1)
+                        .arg(qRound((requests - _lastRequests) / seconds)));
+
+    const CHeatmap *heatmap = disk->heatmap();
+
+    ui->lbl_heat->setText(QString("Working set: %1 MB, sampling %2 ns per sampled access")
+                          .arg(disk->workingSetBytes() / mb, 0, 'f', 1)
+                          .arg(heatmap ? heatmap->samplingCost() : 0));
+    ui->heatmap->setHeatmap(heatmap);
+
+    _lastBytesRead = bytesRead;
+    _lastBytesWritten = bytesWritten;
+    _lastRequests = requests;
+}
+
 Widget::~Widget()
 {
     qDebug() << Q_FUNC_INFO;
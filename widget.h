@@ -2,6 +2,8 @@
 #define WIDGET_H
 
 #include <QWidget>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QDebug>
 
 #include "ramdisk.h"
@@ -23,8 +25,16 @@ private slots:
 
     void on_btn_unmountDisk_clicked();
 
+    void updateStats();
+
 private:
     Ui::Widget *ui;
+
+    QTimer _statsTimer;
+    QElapsedTimer _statsInterval;
+    quint64 _lastBytesRead;
+    quint64 _lastBytesWritten;
+    quint64 _lastRequests;
 };
 
 #endif // WIDGET_H
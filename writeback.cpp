@@ -0,0 +1,382 @@
+#include "writeback.h"
+#include "ramstore.h"
+#include "latency.h"
+#include "imagefile.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+const quint64 CWriteBack::maxRate = 256ull*1024*1024;              // 256Mb/s
+const quint64 CWriteBack::minRate = 4ull*1024*1024;                // 4Mb/s, never stalls completely
+const quint64 CWriteBack::burst = 8ull*1024*1024;                  // bucket depth
+const int CWriteBack::passInterval = 500;                          // ms between dirty scans
+const int CWriteBack::maxRunPages = 16;                            // 1Mb per write
+
+static const char stagedSuffix[] = ".new";
+static const char promoteSuffix[] = ".promote";                    // present while a staged image replaces the image
+
+static qint64 monotonicNs()
+{
+    static QElapsedTimer clock;
+    if(!clock.isValid())
+        clock.start();
+    return clock.nsecsElapsed();
+}
+
+CWriteBack::CWriteBack(CRamStore *store, const QString &imagePath, QObject *parent) :
+    QThread(parent), _store(store), _path(imagePath), _image(imagePath),
+    _rate(maxRate), _tokens(0), _lastRefill(0), _baseLatency(0), _bytesWritten(0), _passes(0), _stopping(false), _restored(false),
+    _staged(false), _promote(false), _promoted(false)
+{
+    qDebug() << Q_FUNC_INFO << imagePath;
+}
+
+CWriteBack::~CWriteBack()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    close();
+}
+
+quint64 CWriteBack::rate() const
+{
+    return _rate;
+}
+
+quint64 CWriteBack::bytesWritten() const
+{
+    return _bytesWritten.load();
+}
+
+quint64 CWriteBack::passes() const
+{
+    return _passes.load();
+}
+
+bool CWriteBack::isRestored() const
+{
+    return _restored;
+}
+
+bool CWriteBack::open(bool restore, bool staged)
+{
+    qDebug() << Q_FUNC_INFO << restore << staged;
+
+    recover();
+
+    // A new generation starts empty, the image stays untouched until promoted
+    _staged = staged;
+    if(staged)
+    {
+        restore = false;
+        _image.setFileName(_path + stagedSuffix);
+        QFile::remove(_image.fileName());
+    }
+
+    bool existed = _image.exists();
+
+    // Unbuffered, a failed write shows up at the write that owns the pages
+    if(!_image.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot open backing image" << _image.fileName();
+        return false;
+    }
+
+    if(restore && existed && !load())
+    {
+        _image.close();
+        return false;
+    }
+
+    if(!_image.resize(qint64(_store->size())))
+    {
+        _image.close();
+        return false;
+    }
+
+    _store->setDirtyTracking(true);
+    if(!restore)
+        _store->markCommittedDirty();
+
+    _stopping = false;
+    _lastRefill = monotonicNs();
+    start(QThread::LowPriority);
+    return true;
+}
+
+// Holes and zero pages of the image stay unallocated in the store.
+// The image follows online resizes, so its size is the size the disk last had.
+bool CWriteBack::load()
+{
+    quint64 loaded = 0;
+    quint64 size = quint64(_image.size());
+
+    if(size != 0 && size != _store->size() && !_store->resize(size, true))
+        qDebug() << "Backing image size" << size << "does not fit the disk";
+
+    if(!CImageFile::importImage(_store, _image.fileName(), &loaded))
+        return false;
+
+    _restored = loaded != 0;
+    return true;
+}
+
+bool CWriteBack::promote()
+{
+    QMutexLocker locker(&_mutex);
+    _promote = true;
+    _wake.wakeAll();
+
+    while(_promote)
+        _wake.wait(&_mutex);
+
+    return _promoted;
+}
+
+// A staged image without the marker belongs to a mount that never got its device
+void CWriteBack::recover()
+{
+    QString staged = _path + stagedSuffix;
+    QString marker = _path + promoteSuffix;
+
+    if(QFile::exists(marker) && QFile::exists(staged))
+    {
+        QFile::remove(_path);
+        if(!QFile::rename(staged, _path))
+            return;
+    }
+
+    QFile::remove(staged);
+    QFile::remove(marker);
+}
+
+// Flusher thread, or close() once it stopped. The image is reopened under its
+// own name, a failed rename leaves the marker for the next recover().
+bool CWriteBack::promoteImage()
+{
+    if(!_staged)
+        return true;
+
+    QFile marker(_path + promoteSuffix);
+    if(!sync() || !marker.open(QIODevice::WriteOnly))
+        return false;
+    marker.close();
+
+    _image.close();
+    QFile::remove(_path);
+
+    bool ok = QFile::rename(_path + stagedSuffix, _path);
+    if(ok)
+    {
+        _image.setFileName(_path);
+        QFile::remove(marker.fileName());
+        _staged = false;
+    }
+
+    if(!_image.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot reopen backing image" << _image.fileName();
+        return false;
+    }
+
+    return ok;
+}
+
+bool CWriteBack::close()
+{
+    if(!_image.isOpen())
+        return true;
+
+    {
+        QMutexLocker locker(&_mutex);
+        _stopping = true;
+        _wake.wakeAll();
+    }
+    wait();
+
+    // Only the residual dirty set is left at this point
+    QElapsedTimer timer;
+    timer.start();
+    quint64 residual = _store->dirtyPages();
+
+    bool ok = flushPass(false) && sync();
+    _store->setDirtyTracking(false);
+    _image.close();
+
+    qDebug() << "Write-back flushed" << residual << "residual pages in" << timer.elapsed() << "ms";
+    return ok;
+}
+
+void CWriteBack::run()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    for(;;)
+    {
+        bool promote;
+        {
+            QMutexLocker locker(&_mutex);
+
+            if(!_stopping && !_promote)
+                _wake.wait(&_mutex, ulong(passInterval));
+            if(_stopping)
+                return;
+            promote = _promote;
+        }
+
+        // A failed promotion keeps the marker if it got that far, the next open() decides
+        if(promote)
+        {
+            bool promoted = promoteImage();
+            if(!promoted)
+                qDebug() << "Backing image promotion failed";
+
+            QMutexLocker locker(&_mutex);
+            _promoted = promoted;
+            _promote = false;
+            _wake.wakeAll();
+        }
+
+        if(_store->dirtyPages() == 0 && quint64(_image.size()) == _store->size())
+        {
+            _passes.fetchAndAddRelaxed(1);
+            continue;
+        }
+
+        if(flushPass(true) && sync())
+            _passes.fetchAndAddRelaxed(1);
+        else
+            qDebug() << "Write-back pass failed";
+    }
+}
+
+// One sweep over the dirty bitmap in block order, runs of adjacent pages go out as one write
+bool CWriteBack::flushPass(bool throttled)
+{
+    QByteArray run(int(CRamStore::pageSize) * maxRunPages, Qt::Uninitialized);
+
+    // The image takes the size of the last resize, a shrink cleared the dirty
+    // bits of the cut pages and a grow added holes only
+    quint64 size = _store->size();
+    if(quint64(_image.size()) != size && !_image.resize(qint64(size)))
+        return false;
+
+    quint64 index = _store->takeNextDirty(0);
+
+    while(index < _store->pageCount())
+    {
+        quint64 first = index;
+        int pages = 0;
+
+        do
+        {
+            // A page cut by a shrink after it was taken goes out as zeros, the next pass truncates it
+            quint64 offset = index * CRamStore::pageSize;
+            char *page = run.data() + pages * CRamStore::pageSize;
+            size = _store->size();
+
+            if(offset >= size)
+                memset(page, 0, CRamStore::pageSize);
+            else if(!_store->read(offset, page, qMin(CRamStore::pageSize, size - offset)))
+            {
+                // Nothing of the run goes out, the unreadable page included
+                _store->markDirtyAgain(first, quint64(pages) + 1);
+                return false;
+            }
+            ++pages;
+            index = _store->takeNextDirty(index + 1);
+        }
+        while(pages < maxRunPages && index == first + quint64(pages));
+
+        quint64 offset = first * CRamStore::pageSize;
+        quint64 bytes = quint64(pages) * CRamStore::pageSize;
+        if(size > offset)
+            bytes = qMin(bytes, size - offset);
+
+        // Once stopping, the rest of the pass goes out at full speed
+        if(throttled && !isStopping())
+            throttle(bytes);
+
+        // The run and the page already taken for the next one stay dirty
+        if(!_image.seek(qint64(offset)) || _image.write(run.constData(), qint64(bytes)) != qint64(bytes))
+        {
+            _store->markDirtyAgain(first, quint64(pages));
+            if(index < _store->pageCount())
+                _store->markDirtyAgain(index, 1);
+            return false;
+        }
+
+        _bytesWritten.fetchAndAddRelaxed(bytes);
+    }
+
+    return _image.flush();
+}
+
+bool CWriteBack::isStopping()
+{
+    QMutexLocker locker(&_mutex);
+    return _stopping;
+}
+
+void CWriteBack::throttle(quint64 bytes)
+{
+    adaptRate();
+
+    qint64 now = monotonicNs();
+    _tokens = qMin(double(burst), _tokens + double(now - _lastRefill) * double(_rate) / 1e9);
+    _lastRefill = now;
+
+    if(_tokens < double(bytes))
+    {
+        double waitNs = (double(bytes) - _tokens) * 1e9 / double(_rate);
+        QThread::usleep(ulong(waitNs / 1000));
+
+        now = monotonicNs();
+        _tokens = qMin(double(burst), _tokens + double(now - _lastRefill) * double(_rate) / 1e9);
+        _lastRefill = now;
+    }
+
+    _tokens -= double(bytes);
+}
+
+// AIMD on the token rate, driven by the foreground write latency of the store
+void CWriteBack::adaptRate()
+{
+    quint64 latency = _store->writeLatency();
+    if(latency == 0)
+        return;
+
+    // Baseline follows the lowest latency seen, drifting up slowly so it can recover
+    if(_baseLatency == 0 || latency < _baseLatency)
+        _baseLatency = latency;
+    else
+        _baseLatency += (latency - _baseLatency) / 1024;
+
+    if(latency > _baseLatency * 2)
+        _rate = qMax(minRate, _rate / 2);
+    else
+        _rate = qMin(maxRate, _rate + minRate);
+}
+
+bool CWriteBack::sync()
+{
+    quint64 start = CLatency::now();
+
+#ifdef Q_OS_WIN
+    bool ok = FlushFileBuffers(HANDLE(_get_osfhandle(_image.handle()))) != FALSE;
+#else
+    bool ok = fdatasync(_image.handle()) == 0;
+#endif
+
+    CLatency::record(CLatency::Flush, CLatency::now() - start);
+    return ok;
+}
@@ -0,0 +1,80 @@
+#ifndef CWRITEBACK_H
+#define CWRITEBACK_H
+
+#include <QThread>
+#include <QString>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInteger>
+
+class CRamStore;
+
+// Background flusher keeping a backing image a few seconds behind the store.
+// Dirty pages are written in ascending order, coalesced into runs, under a
+// token bucket rate limit that is halved whenever foreground write latency
+// climbs and recovers additively while it stays low.
+// A staged image is written next to the image, as <image>.new, and replaces
+// it on promote(). A crash before that leaves the image as it was, a crash
+// during the swap is completed by the next open().
+class CWriteBack : public QThread
+{
+    Q_OBJECT
+public:
+    CWriteBack(CRamStore *store, const QString &imagePath, QObject *parent = 0);
+    ~CWriteBack();
+
+    // With restore set an existing image is loaded into the store first,
+    // otherwise every committed page of the store counts as dirty
+    bool open(bool restore, bool staged = false);
+    // The staged image takes the place of the image, done by the flusher thread
+    bool promote();
+    bool isRestored() const;
+    // Stops the thread and writes whatever is still dirty, unthrottled
+    bool close();
+
+    quint64 rate() const;
+    quint64 bytesWritten() const;
+    // Passes that left the image matching the store as of their start
+    quint64 passes() const;
+
+    static const quint64 maxRate;
+    static const quint64 minRate;
+    static const quint64 burst;
+    static const int passInterval;
+    static const int maxRunPages;
+
+protected:
+    void run() override;
+
+private:
+    bool load();
+    bool flushPass(bool throttled);
+    bool isStopping();
+    void throttle(quint64 bytes);
+    void adaptRate();
+    bool sync();
+    void recover();
+    bool promoteImage();
+
+    CRamStore *_store;
+    QString _path;
+    QFile _image;
+
+    quint64 _rate;
+    double _tokens;
+    qint64 _lastRefill;
+    quint64 _baseLatency;
+    QAtomicInteger<quint64> _bytesWritten;
+    QAtomicInteger<quint64> _passes;
+
+    QMutex _mutex;
+    QWaitCondition _wake;
+    bool _stopping;
+    bool _restored;
+    bool _staged;
+    bool _promote;
+    bool _promoted;
+};
+
+#endif // CWRITEBACK_H